@@ -0,0 +1,447 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** \file coalescer.h */
+
+#include <string.h>
+#include "kfxmpp.h"
+#include "coalescer.h"
+#include "iobackend.h"
+
+struct _KfxmppPresenceCoalescer {
+	GHashTable *pending;	/**< Held presences, indexed by sender JID */
+	GQueue *order;		/**< Sender JIDs in order of first held presence */
+
+	/* Callback */
+	KfxmppPresenceCoalescerCallback callback;	/**< Function that delivers presences */
+	gpointer callback_data;				/**< Callback user data */
+
+	/* Window */
+	guint window;		/**< Time presences are held, in milliseconds. 0 means until flush */
+	GMainContext *context;	/**< Main context of window timeout */
+	GSource *timeout;	/**< Pending window timeout */
+	KfxmppIoBackend *backend;	/**< Backend running window timer instead of \b context, may be NULL */
+	KfxmppIoTimer *timer;	/**< Pending window timer of \b backend */
+
+	/* Statistics */
+	guint collapsed;	/**< Number of presences replaced by newer ones */
+	guint delivered;	/**< Number of presences delivered */
+};
+
+
+/**
+ * \brief Held presence
+ **/
+typedef struct {
+	gchar *jid;		/**< Sender JID */
+	xmlNodePtr node;	/**< Newest presence of that JID */
+} KfxmppPresenceEntry;
+
+
+static gboolean kfxmpp_presence_coalescer_is_availability (xmlNodePtr node);
+static void kfxmpp_presence_coalescer_deliver (KfxmppPresenceCoalescer *self, const gchar *jid);
+static gboolean kfxmpp_presence_coalescer_timeout (gpointer data);
+static gboolean kfxmpp_presence_coalescer_timer (gpointer data);
+static void kfxmpp_presence_coalescer_start_window (KfxmppPresenceCoalescer *self);
+static void kfxmpp_presence_coalescer_stop_window (KfxmppPresenceCoalescer *self);
+static gboolean kfxmpp_presence_coalescer_remove_entry (gpointer key, gpointer value, gpointer data);
+static void kfxmpp_presence_entry_free (KfxmppPresenceEntry *entry);
+
+
+/**
+ * \brief Create a new presence coalescer
+ * \param callback Function called to deliver presences
+ * \param data User data passed to callback
+ **/
+KfxmppPresenceCoalescer *kfxmpp_presence_coalescer_new (KfxmppPresenceCoalescerCallback callback, gpointer data)
+{
+	KfxmppPresenceCoalescer *self;
+
+	self = g_new0 (KfxmppPresenceCoalescer, 1);
+
+	self->pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+			NULL, (GDestroyNotify) kfxmpp_presence_entry_free);
+	self->order = g_queue_new ();
+	self->callback = callback;
+	self->callback_data = data;
+
+	return self;
+}
+
+
+/**
+ * \brief Free a coalescer
+ * \param self A coalescer
+ *
+ * Presences still held are dropped.
+ **/
+void kfxmpp_presence_coalescer_free (KfxmppPresenceCoalescer *self)
+{
+	g_return_if_fail (self);
+
+	kfxmpp_presence_coalescer_clear (self);
+	if (self->backend)
+		kfxmpp_io_backend_unref (self->backend);
+	g_hash_table_destroy (self->pending);
+	g_queue_free (self->order);
+	g_free (self);
+}
+
+
+/**
+ * \brief Set how long presences are held
+ * \param self A coalescer
+ * \param window Time in milliseconds. When 0, presences are held until
+ * 	kfxmpp_presence_coalescer_flush is called, e.g. at the end of a batch
+ * 	of parsed data.
+ * \param context Main context used for window timeout (NULL for default)
+ *
+ * Presences already held get a new window of \b window in \b context.
+ * Backend set with kfxmpp_presence_coalescer_set_io_backend takes
+ * precedence over \b context.
+ **/
+void kfxmpp_presence_coalescer_set_window (KfxmppPresenceCoalescer *self, guint window, GMainContext *context)
+{
+	g_return_if_fail (self);
+
+	kfxmpp_presence_coalescer_stop_window (self);
+
+	self->window = window;
+	self->context = context;
+
+	/* Held presences must not wait for a timeout that is gone */
+	if (! g_queue_is_empty (self->order))
+		kfxmpp_presence_coalescer_start_window (self);
+}
+
+
+/**
+ * \brief Set backend running window timer
+ * \param self A coalescer
+ * \param backend A backend, NULL to use main context set with
+ * 	kfxmpp_presence_coalescer_set_window
+ *
+ * A session driven by epoll, io_uring or external backend has nothing
+ * iterating its main context, so its window has to expire in backend's
+ * dispatch.
+ **/
+void kfxmpp_presence_coalescer_set_io_backend (KfxmppPresenceCoalescer *self, KfxmppIoBackend *backend)
+{
+	g_return_if_fail (self);
+
+	if (backend == self->backend)
+		return;
+
+	kfxmpp_presence_coalescer_stop_window (self);
+	if (backend)
+		kfxmpp_io_backend_ref (backend);
+	if (self->backend)
+		kfxmpp_io_backend_unref (self->backend);
+	self->backend = backend;
+
+	if (! g_queue_is_empty (self->order))
+		kfxmpp_presence_coalescer_start_window (self);
+}
+
+
+/**
+ * \brief Get time window of held presences ends at
+ * \param self A coalescer
+ * \return Time on clock of kfxmpp_io_get_time, -1 if no window timer of a
+ * 	backend is running
+ **/
+gint64 kfxmpp_presence_coalescer_get_deadline (KfxmppPresenceCoalescer *self)
+{
+	g_return_val_if_fail (self, -1);
+
+	if (self->timer == NULL)
+		return -1;
+	return kfxmpp_io_timer_get_deadline (self->timer);
+}
+
+
+/**
+ * \brief Get how long presences are held
+ * \param self A coalescer
+ * \return Time in milliseconds
+ **/
+guint kfxmpp_presence_coalescer_get_window (KfxmppPresenceCoalescer *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->window;
+}
+
+
+/**
+ * \brief Pass a stanza through coalescer
+ * \param self A coalescer
+ * \param node A stanza
+ * \return TRUE if coalescer has taken a copy of stanza and will deliver it
+ * 	later, FALSE if caller should deliver it immediately
+ *
+ * A stanza that is not held causes presence held for its sender to be
+ * delivered first, so stanzas from a single JID are never reordered.
+ **/
+gboolean kfxmpp_presence_coalescer_push (KfxmppPresenceCoalescer *self, xmlNodePtr node)
+{
+	KfxmppPresenceEntry *entry;
+	xmlChar *from;
+
+	g_return_val_if_fail (self, FALSE);
+	g_return_val_if_fail (node, FALSE);
+
+	from = xmlGetProp (node, BAD_CAST "from");
+	if (from == NULL)
+		return FALSE;
+
+	if (! kfxmpp_presence_coalescer_is_availability (node)) {
+		/* Keep order of stanzas from that JID */
+		if (g_hash_table_lookup (self->pending, from))
+			kfxmpp_presence_coalescer_deliver (self, (const gchar *) from);
+		xmlFree (from);
+		return FALSE;
+	}
+
+	entry = g_hash_table_lookup (self->pending, from);
+	if (entry) {
+		/* Newer presence replaces held one */
+		xmlFreeNode (entry->node);
+		entry->node = xmlCopyNode (node, 1);
+		self->collapsed++;
+	} else {
+		entry = g_new (KfxmppPresenceEntry, 1);
+		entry->jid = g_strdup ((const gchar *) from);
+		entry->node = xmlCopyNode (node, 1);
+		g_hash_table_insert (self->pending, entry->jid, entry);
+		g_queue_push_tail (self->order, entry->jid);
+	}
+	xmlFree (from);
+
+	kfxmpp_presence_coalescer_start_window (self);
+
+	return TRUE;
+}
+
+
+/**
+ * \brief Start window timeout, unless it is running or there is no window
+ * \param self A coalescer
+ **/
+static void kfxmpp_presence_coalescer_start_window (KfxmppPresenceCoalescer *self)
+{
+	if (self->window == 0 || self->timeout || self->timer)
+		return;
+
+	if (self->backend) {
+		self->timer = kfxmpp_io_backend_add_timer (self->backend, self->window,
+				kfxmpp_presence_coalescer_timer, self);
+	} else {
+		self->timeout = g_timeout_source_new (self->window);
+		g_source_set_callback (self->timeout, kfxmpp_presence_coalescer_timeout, self, NULL);
+		g_source_attach (self->timeout, self->context);
+	}
+}
+
+
+/**
+ * \brief Stop window timeout or timer, if one is running
+ * \param self A coalescer
+ **/
+static void kfxmpp_presence_coalescer_stop_window (KfxmppPresenceCoalescer *self)
+{
+	if (self->timeout) {
+		g_source_destroy (self->timeout);
+		g_source_unref (self->timeout);
+		self->timeout = NULL;
+	}
+	if (self->timer) {
+		kfxmpp_io_timer_remove (self->timer);
+		self->timer = NULL;
+	}
+}
+
+
+/**
+ * \brief Deliver all held presences
+ * \param self A coalescer
+ *
+ * Presences are delivered in order their senders were first seen.
+ **/
+void kfxmpp_presence_coalescer_flush (KfxmppPresenceCoalescer *self)
+{
+	g_return_if_fail (self);
+
+	kfxmpp_presence_coalescer_stop_window (self);
+
+	while (! g_queue_is_empty (self->order)) {
+		kfxmpp_presence_coalescer_deliver (self, g_queue_peek_head (self->order));
+	}
+}
+
+
+/**
+ * \brief Drop all held presences without delivering them
+ * \param self A coalescer
+ **/
+void kfxmpp_presence_coalescer_clear (KfxmppPresenceCoalescer *self)
+{
+	g_return_if_fail (self);
+
+	kfxmpp_presence_coalescer_stop_window (self);
+
+	while (! g_queue_is_empty (self->order))
+		g_queue_pop_head (self->order);
+	g_hash_table_foreach_remove (self->pending, kfxmpp_presence_coalescer_remove_entry, NULL);
+}
+
+
+/**
+ * \brief Get number of presences currently held
+ * \param self A coalescer
+ **/
+guint kfxmpp_presence_coalescer_get_pending (KfxmppPresenceCoalescer *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return g_queue_get_length (self->order);
+}
+
+
+/**
+ * \brief Get number of presences dropped because newer ones arrived
+ * \param self A coalescer
+ **/
+guint kfxmpp_presence_coalescer_get_collapsed (KfxmppPresenceCoalescer *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->collapsed;
+}
+
+
+/**
+ * \brief Get number of delivered presences
+ * \param self A coalescer
+ **/
+guint kfxmpp_presence_coalescer_get_delivered (KfxmppPresenceCoalescer *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->delivered;
+}
+
+
+/**
+ * \brief Check whether presence only carries availability state
+ *
+ * Subscription requests, probes and errors must not be collapsed.
+ **/
+static gboolean kfxmpp_presence_coalescer_is_availability (xmlNodePtr node)
+{
+	xmlChar *type;
+	gboolean ret;
+
+	if (xmlStrcmp (node->name, BAD_CAST "presence") != 0)
+		return FALSE;
+
+	type = xmlGetProp (node, BAD_CAST "type");
+	ret = type == NULL || xmlStrcmp (type, BAD_CAST "unavailable") == 0;
+	xmlFree (type);
+
+	return ret;
+}
+
+
+/**
+ * \brief Deliver presence held for a JID
+ **/
+static void kfxmpp_presence_coalescer_deliver (KfxmppPresenceCoalescer *self, const gchar *jid)
+{
+	KfxmppPresenceEntry *entry;
+	xmlNodePtr node;
+
+	entry = g_hash_table_lookup (self->pending, jid);
+	g_return_if_fail (entry);
+
+	/* Detach entry before calling back, callback may push more stanzas */
+	g_queue_remove (self->order, entry->jid);
+	node = entry->node;
+	entry->node = NULL;
+	g_hash_table_remove (self->pending, jid);
+
+	self->delivered++;
+	if (self->callback)
+		self->callback (self, node, self->callback_data);
+
+	xmlFreeNode (node);
+}
+
+
+/**
+ * \brief Callback called when coalescing window expires
+ **/
+static gboolean kfxmpp_presence_coalescer_timeout (gpointer data)
+{
+	KfxmppPresenceCoalescer *self = data;
+
+	kfxmpp_presence_coalescer_flush (self);
+
+	return FALSE;
+}
+
+
+/**
+ * \brief Callback called when window timer of backend expires
+ **/
+static gboolean kfxmpp_presence_coalescer_timer (gpointer data)
+{
+	KfxmppPresenceCoalescer *self = data;
+
+	/* Timer is removed when this returns */
+	self->timer = NULL;
+
+	kfxmpp_presence_coalescer_flush (self);
+
+	return FALSE;
+}
+
+
+/**
+ * \brief Tell hash table to remove every entry it has
+ **/
+static gboolean kfxmpp_presence_coalescer_remove_entry (gpointer key, gpointer value, gpointer data)
+{
+	return TRUE;
+}
+
+
+/**
+ * \brief Free a held presence
+ **/
+static void kfxmpp_presence_entry_free (KfxmppPresenceEntry *entry)
+{
+	if (entry->node)
+		xmlFreeNode (entry->node);
+	g_free (entry->jid);
+	g_free (entry);
+}
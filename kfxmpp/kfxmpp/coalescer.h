@@ -0,0 +1,71 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** \file coalescer.h */
+
+#ifndef __COALESCER_H__
+#define __COALESCER_H__
+
+#include <glib.h>
+#include <libxml/tree.h>
+#include <kfxmpp/iobackend.h>
+
+G_BEGIN_DECLS
+
+/**
+ * \brief Object that collapses bursts of presence updates
+ *
+ * Availability presences (with no type or with type 'unavailable') are
+ * held per full JID of sender, and only the newest one from each JID is
+ * delivered when coalescer is flushed. Other stanzas are never held.
+ **/
+typedef struct _KfxmppPresenceCoalescer KfxmppPresenceCoalescer;
+
+
+/**
+ * \brief Callback called when coalescer delivers a presence
+ * \param coalescer A coalescer
+ * \param node Presence stanza. It is freed by coalescer after callback returns.
+ * \param data User data
+ **/
+typedef void (*KfxmppPresenceCoalescerCallback) (KfxmppPresenceCoalescer *coalescer, xmlNodePtr node, gpointer data);
+
+
+KfxmppPresenceCoalescer *kfxmpp_presence_coalescer_new (KfxmppPresenceCoalescerCallback callback, gpointer data);
+void kfxmpp_presence_coalescer_free (KfxmppPresenceCoalescer *self);
+
+void kfxmpp_presence_coalescer_set_window (KfxmppPresenceCoalescer *self, guint window, GMainContext *context);
+guint kfxmpp_presence_coalescer_get_window (KfxmppPresenceCoalescer *self);
+void kfxmpp_presence_coalescer_set_io_backend (KfxmppPresenceCoalescer *self, KfxmppIoBackend *backend);
+gint64 kfxmpp_presence_coalescer_get_deadline (KfxmppPresenceCoalescer *self);
+
+gboolean kfxmpp_presence_coalescer_push (KfxmppPresenceCoalescer *self, xmlNodePtr node);
+void kfxmpp_presence_coalescer_flush (KfxmppPresenceCoalescer *self);
+void kfxmpp_presence_coalescer_clear (KfxmppPresenceCoalescer *self);
+
+guint kfxmpp_presence_coalescer_get_pending (KfxmppPresenceCoalescer *self);
+guint kfxmpp_presence_coalescer_get_collapsed (KfxmppPresenceCoalescer *self);
+guint kfxmpp_presence_coalescer_get_delivered (KfxmppPresenceCoalescer *self);
+
+G_END_DECLS
+
+#endif /* __COALESCER_H__ */
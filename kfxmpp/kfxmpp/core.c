@@ -46,6 +46,10 @@ static void foo (const gchar *log_domain,
  **/
 void kfxmpp_init (void)
 {
+	/* Sessions may be used from many threads */
+	if (! g_thread_supported ())
+		g_thread_init (NULL);
+
 	gnet_init ();
 #ifdef HAVE_GNUTLS
 	gnutls_global_init ();
@@ -78,6 +82,7 @@ void kfxmpp_init (void)
  **/
 void kfxmpp_deinit (void)
 {
+	kfxmpp_tls_cache_deinit ();
 #ifdef HAVE_GNUTLS
 	gnutls_global_deinit ();
 #endif
@@ -45,6 +45,9 @@ typedef enum {
 /** Default XMPP/Jabber port */
 #define KFXMPP_DEFAULT_PORT 5222
 
+/** Usual port of direct TLS endpoints */
+#define KFXMPP_DEFAULT_DIRECT_TLS_PORT 5223
+
 //#include "session.h"
 //#include "streamparser.h"
 
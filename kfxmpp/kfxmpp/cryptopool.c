@@ -0,0 +1,220 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/** \file cryptopool.h */
+
+#include "kfxmpp.h"
+#include "cryptopool.h"
+
+#include <unistd.h>
+
+/**
+ * \brief Work pushed to a crypto pool
+ **/
+typedef struct {
+	KfxmppCryptoFunc func;		/**< Function run by worker */
+	GSourceFunc done;		/**< Function run in \b context afterwards */
+	gpointer data;			/**< Data passed to both */
+	GMainContext *context;		/**< Context to report back to, holding a reference */
+} KfxmppCryptoJob;
+
+struct _KfxmppCryptoPool {
+	gint ref_count;			/**< Number of references to this object */
+	GThreadPool *threads;		/**< Worker threads */
+	guint max_threads;		/**< Maximum number of workers */
+	gint pending;			/**< Jobs pushed and not run yet (atomic) */
+	gint completed;			/**< Jobs run (atomic) */
+};
+
+
+/***********************************************************************
+ *
+ * Static function prototypes
+ *
+ */
+
+static void kfxmpp_crypto_pool_run (gpointer data, gpointer user_data);
+
+
+/**
+ * \brief Create a new KfxmppCryptoPool
+ * \param max_threads Maximum number of worker threads, 0 for one per
+ * 	online processor
+ * \return A new crypto pool
+ *
+ * Threads are started as jobs come, up to \b max_threads. Jobs beyond
+ * that wait in a queue, so a storm occupies at most that many cores.
+ **/
+KfxmppCryptoPool *kfxmpp_crypto_pool_new (guint max_threads)
+{
+	KfxmppCryptoPool *self;
+
+	if (max_threads == 0)
+		max_threads = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+
+	self = g_new0 (KfxmppCryptoPool, 1);
+	self->ref_count = 1;
+	self->max_threads = max_threads;
+	self->threads = g_thread_pool_new (kfxmpp_crypto_pool_run, self, max_threads, FALSE, NULL);
+
+	return self;
+}
+
+
+/**
+ * \brief Free a crypto pool
+ * \param self A crypto pool
+ *
+ * Jobs already pushed are run first, and report back as usual. Must not
+ * be called from a worker thread.
+ **/
+void kfxmpp_crypto_pool_free (KfxmppCryptoPool *self)
+{
+	g_return_if_fail (self);
+
+	g_thread_pool_free (self->threads, FALSE, TRUE);
+	g_free (self);
+}
+
+
+/**
+ * \brief Add a reference to KfxmppCryptoPool
+ *
+ * This function is thread-safe.
+ **/
+KfxmppCryptoPool *kfxmpp_crypto_pool_ref (KfxmppCryptoPool *self)
+{
+	g_return_val_if_fail (self, NULL);
+	g_atomic_int_inc (&self->ref_count);
+	return self;
+}
+
+
+/**
+ * \brief Remove a reference from KfxmppCryptoPool
+ *
+ * Object will be deleted when reference count reaches 0. This function is
+ * thread-safe.
+ **/
+void kfxmpp_crypto_pool_unref (KfxmppCryptoPool *self)
+{
+	g_return_if_fail (self);
+	if (g_atomic_int_dec_and_test (&self->ref_count))
+		kfxmpp_crypto_pool_free (self);
+}
+
+
+/**
+ * \brief Run a function on a worker thread
+ * \param self A crypto pool
+ * \param func Function run by a worker
+ * \param done Function run in \b context when \b func returns, its return
+ * 	value is ignored
+ * \param data Data passed to \b func and \b done
+ * \param context Main context to run \b done in, NULL for default one
+ **/
+void kfxmpp_crypto_pool_push (KfxmppCryptoPool *self, KfxmppCryptoFunc func, GSourceFunc done,
+				gpointer data, GMainContext *context)
+{
+	KfxmppCryptoJob *job;
+
+	g_return_if_fail (self);
+	g_return_if_fail (func);
+	g_return_if_fail (done);
+
+	job = g_new (KfxmppCryptoJob, 1);
+	job->func = func;
+	job->done = done;
+	job->data = data;
+	job->context = g_main_context_ref (context ? context : g_main_context_default ());
+
+	g_atomic_int_inc (&self->pending);
+	g_thread_pool_push (self->threads, job, NULL);
+}
+
+
+/**
+ * \brief Get maximum number of worker threads
+ * \param self A crypto pool
+ * \return Number of threads
+ **/
+guint kfxmpp_crypto_pool_get_max_threads (KfxmppCryptoPool *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->max_threads;
+}
+
+
+/**
+ * \brief Get number of jobs waiting for a worker or being run
+ * \param self A crypto pool
+ * \return Number of jobs
+ **/
+guint kfxmpp_crypto_pool_get_pending (KfxmppCryptoPool *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return g_atomic_int_get (&self->pending);
+}
+
+
+/**
+ * \brief Get number of jobs run so far
+ * \param self A crypto pool
+ * \return Number of jobs
+ **/
+guint kfxmpp_crypto_pool_get_completed (KfxmppCryptoPool *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return g_atomic_int_get (&self->completed);
+}
+
+
+/**
+ * \brief Run a job and report it back to its context
+ * \param data A KfxmppCryptoJob
+ * \param user_data A KfxmppCryptoPool
+ **/
+static void kfxmpp_crypto_pool_run (gpointer data, gpointer user_data)
+{
+	KfxmppCryptoPool *self = user_data;
+	KfxmppCryptoJob *job = data;
+	GSource *source;
+
+	job->func (job->data);
+
+	g_atomic_int_add (&self->pending, -1);
+	g_atomic_int_inc (&self->completed);
+
+	source = g_idle_source_new ();
+	g_source_set_priority (source, G_PRIORITY_DEFAULT);
+	g_source_set_callback (source, job->done, job->data, NULL);
+	g_source_attach (source, job->context);
+	g_source_unref (source);
+
+	g_main_context_unref (job->context);
+	g_free (job);
+}
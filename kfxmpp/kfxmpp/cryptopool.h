@@ -0,0 +1,72 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+
+/** \file cryptopool.h */
+
+#ifndef __CRYPTOPOOL_H__
+#define __CRYPTOPOOL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * \brief Bounded set of threads running CPU-heavy TLS work
+ *
+ * During a reconnect storm, key exchange and certificate checks of new
+ * sessions would keep I/O thread busy while established sessions wait.
+ * Sessions given a crypto pool with kfxmpp_session_set_crypto_pool run
+ * their handshake steps on its threads instead, and only move handshake
+ * records between socket and gnutls on I/O thread. Records of
+ * established sessions are still encrypted and decrypted on I/O thread.
+ *
+ * One pool may be shared by sessions of any number of threads. Each job
+ * reports back to main context it was pushed for.
+ *
+ * Thread safety: all functions may be called from any thread.
+ **/
+typedef struct _KfxmppCryptoPool KfxmppCryptoPool;
+
+/**
+ * \callback function run by a worker thread
+ * \param data User data
+ **/
+typedef void (*KfxmppCryptoFunc) (gpointer data);
+
+
+KfxmppCryptoPool *kfxmpp_crypto_pool_new (guint max_threads);
+void kfxmpp_crypto_pool_free (KfxmppCryptoPool *self);
+KfxmppCryptoPool *kfxmpp_crypto_pool_ref (KfxmppCryptoPool *self);
+void kfxmpp_crypto_pool_unref (KfxmppCryptoPool *self);
+
+void kfxmpp_crypto_pool_push (KfxmppCryptoPool *self, KfxmppCryptoFunc func, GSourceFunc done,
+				gpointer data, GMainContext *context);
+guint kfxmpp_crypto_pool_get_max_threads (KfxmppCryptoPool *self);
+guint kfxmpp_crypto_pool_get_pending (KfxmppCryptoPool *self);
+guint kfxmpp_crypto_pool_get_completed (KfxmppCryptoPool *self);
+
+G_END_DECLS
+
+#endif /* __CRYPTOPOOL_H__ */
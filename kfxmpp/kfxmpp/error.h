@@ -40,7 +40,9 @@ typedef enum {
 	KFXMPP_ERROR_AUTH_FAILED,		/**< Authorization failed */
 	KFXMPP_ERROR_SESSION_ALREADY_OPEN,	/**< Trying to open already opened session */
 	KFXMPP_ERROR_SESSION_NOT_OPEN,		/**< Session is not open */
-	KFXMPP_ERROR_TIMEOUT			/**< Timeout expired */
+	KFXMPP_ERROR_TIMEOUT,			/**< Timeout expired */
+	KFXMPP_ERROR_FILTER_SYNTAX,		/**< Syntax error in filter expression */
+	KFXMPP_ERROR_WOULD_BLOCK		/**< Send queue is above its high watermark */
 } KfxmppError;
 
 #define KFXMPP_ERROR kfxmpp_error_quark ()
@@ -24,6 +24,7 @@
 
 #include "kfxmpp.h"
 #include "event.h"
+#include "iobackend.h"
 
 /**
  * \brief Container for stanza handling callback
@@ -40,6 +41,32 @@ struct _KfxmppEvent {
 	gpointer obj;		/**< Event source */
 	GList *handlers;	/**< List of handlers listening for this event */
 	gint ref_count;		/**< Number of references to this object */
+
+	GList *pending;		/**< Deferred dispatches, oldest first */
+	gulong max_pending_age;	/**< Longest time a dispatch stayed pending, in ms */
+};
+
+
+/**
+ * \brief State of a deferred dispatch
+ *
+ * Fields other than \b resolved, \b handled and \b armed are only
+ * touched from the thread triggering the event.
+ **/
+struct _KfxmppEventToken {
+	KfxmppEvent *event;		/**< Event being dispatched */
+	gpointer data;			/**< Pinned event data */
+	KfxmppEventUnpinFunc unpin;	/**< Function releasing \b data */
+	GMainContext *context;		/**< Context to resume dispatch in */
+	KfxmppIoBackend *backend;	/**< Backend to resume dispatch through instead, may be NULL */
+	GSList *remaining;		/**< Handlers not called yet */
+	GTimeVal started;		/**< Time when handler deferred */
+
+	GMutex *mutex;			/**< Lock protecting fields below */
+	GCond *arming;			/**< Signalled when token is armed */
+	gboolean armed;			/**< Whether trigger has finished setting up token */
+	gboolean resolved;		/**< Whether kfxmpp_event_token_resolve was called */
+	gboolean handled;		/**< Result passed to kfxmpp_event_token_resolve */
 };
 
 
@@ -50,6 +77,17 @@ typedef struct {
 
 
 static gint kfxmpp_event_entry_compare (gconstpointer a, gconstpointer b);
+static void kfxmpp_event_arm (KfxmppEvent *self, KfxmppEventToken *token);
+static gboolean kfxmpp_event_dispatch (KfxmppEvent *event, gpointer data, KfxmppEventPinFunc pin,
+					KfxmppEventUnpinFunc unpin, GMainContext *context,
+					KfxmppIoBackend *backend);
+static void kfxmpp_event_schedule (KfxmppEventToken *token);
+static gboolean kfxmpp_event_resume (gpointer data);
+static void kfxmpp_event_token_free (KfxmppEventToken *token);
+static gulong kfxmpp_event_elapsed (const GTimeVal *since);
+
+/** Slot for a token created by handler currently running in this thread */
+static GStaticPrivate current_slot = G_STATIC_PRIVATE_INIT;
 
 /**
  * \brief Create a new event
@@ -90,11 +128,13 @@ void kfxmpp_event_free (KfxmppEvent *self)
 
 /**
  * \brief Add a reference to KfxmppEvent
+ *
+ * This function is thread-safe.
  **/
 KfxmppEvent* kfxmpp_event_ref (KfxmppEvent *self)
 {
         g_return_val_if_fail (self, NULL);
-        self->ref_count++;
+        g_atomic_int_inc (&self->ref_count);
         return self;
 }
 
@@ -102,13 +142,13 @@ KfxmppEvent* kfxmpp_event_ref (KfxmppEvent *self)
 /**
  * \brief Remove a reference from KfxmppEvent
  *
- * Object will be deleted when reference count reaches 0
+ * Object will be deleted when reference count reaches 0.
+ * This function is thread-safe.
  **/
 void kfxmpp_event_unref (KfxmppEvent *self)
 {
         g_return_if_fail (self);
-        self->ref_count--;
-        if (self->ref_count == 0)
+        if (g_atomic_int_dec_and_test (&self->ref_count))
                 kfxmpp_event_free (self);
 }
 
@@ -168,25 +208,377 @@ void kfxmpp_event_remove_handler (KfxmppEvent *event, KfxmppEventHandler *handle
  * \brief Thigger an event
  * \param event The event to be triggered
  * \param data Event-specific data
+ *
+ * If a handler defers, \b data must stay valid until its token is
+ * resolved, and remaining handlers are called from default main context.
  **/
 gboolean kfxmpp_event_trigger (KfxmppEvent *event, gpointer data)
+{
+	return kfxmpp_event_trigger_full (event, data, NULL, NULL, NULL);
+}
+
+
+/**
+ * \brief Thigger an event, allowing handlers to defer
+ * \param event The event to be triggered
+ * \param data Event-specific data
+ * \param pin Function called to keep \b data alive when a handler defers (may be NULL)
+ * \param unpin Function releasing data returned by \b pin (may be NULL)
+ * \param context Main context to resume dispatch in, NULL for default one
+ * \return TRUE if event was handled or is pending, FALSE otherwise
+ **/
+gboolean kfxmpp_event_trigger_full (KfxmppEvent *event, gpointer data, KfxmppEventPinFunc pin,
+					KfxmppEventUnpinFunc unpin, GMainContext *context)
 {
 	g_return_val_if_fail (event, FALSE);
 
+	return kfxmpp_event_dispatch (event, data, pin, unpin, context, NULL);
+}
+
+
+/**
+ * \brief Thigger an event, resuming deferred handlers through an I/O backend
+ * \param event The event to be triggered
+ * \param data Event-specific data
+ * \param pin Function called to keep \b data alive when a handler defers (may be NULL)
+ * \param unpin Function releasing data returned by \b pin (may be NULL)
+ * \param context Main context to resume dispatch in, NULL for default one
+ * \param backend Backend whose dispatching thread resumes dispatch (may be NULL)
+ * \return TRUE if event was handled or is pending, FALSE otherwise
+ *
+ * Epoll, io_uring and external backends run remaining handlers from their
+ * own dispatch, see kfxmpp_io_backend_invoke, so nothing has to iterate
+ * \b context. With other backends, this is kfxmpp_event_trigger_full.
+ **/
+gboolean kfxmpp_event_trigger_with_backend (KfxmppEvent *event, gpointer data, KfxmppEventPinFunc pin,
+					KfxmppEventUnpinFunc unpin, GMainContext *context,
+					KfxmppIoBackend *backend)
+{
+	g_return_val_if_fail (event, FALSE);
+
+	return kfxmpp_event_dispatch (event, data, pin, unpin, context, backend);
+}
+
+
+/**
+ * \brief Call handlers of an event, remembering where to resume if one defers
+ **/
+static gboolean kfxmpp_event_dispatch (KfxmppEvent *event, gpointer data, KfxmppEventPinFunc pin,
+					KfxmppEventUnpinFunc unpin, GMainContext *context,
+					KfxmppIoBackend *backend)
+{
 	GList *tmp;
+	KfxmppEventToken *slot;
+	gpointer saved;
+	gboolean handled = FALSE;
+
+	saved = g_static_private_get (&current_slot);
+	g_static_private_set (&current_slot, &slot, NULL);
 
 	for (tmp = event->handlers; tmp; tmp = tmp->next) {
 		KfxmppEventEntry *entry = tmp->data;
 		KfxmppEventHandler *handler = entry->handler;
 
+		slot = NULL;
 //		if (handler->callback (handler, event->obj, data, handler->data) == TRUE)
-		if (kfxmpp_event_handler_call (handler, event->obj, data) == TRUE)
-			return TRUE;
+		handled = kfxmpp_event_handler_call (handler, event->obj, data);
+
+		if (slot) {
+			/* Handler deferred, remember where to continue */
+			GList *rest;
+
+			for (rest = tmp->next; rest; rest = rest->next) {
+				entry = rest->data;
+				slot->remaining = g_slist_prepend (slot->remaining,
+						kfxmpp_event_handler_ref (entry->handler));
+			}
+			slot->remaining = g_slist_reverse (slot->remaining);
+			slot->data = pin ? pin (event->obj, data) : data;
+			slot->unpin = unpin;
+			slot->context = context ? g_main_context_ref (context) : NULL;
+			slot->backend = backend ? kfxmpp_io_backend_ref (backend) : NULL;
+
+			kfxmpp_event_arm (event, slot);
+			handled = TRUE;
+			break;
+		} else if (handled == KFXMPP_EVENT_PENDING) {
+			g_warning ("Handler returned KFXMPP_EVENT_PENDING without calling kfxmpp_event_defer");
+		}
+
+		if (handled)
+			break;
+	}
+
+	g_static_private_set (&current_slot, saved, NULL);
+	return handled ? TRUE : FALSE;
+}
+
+
+/**
+ * \brief Get number of pending dispatches
+ * \param self An event
+ * \return Number of times this event was deferred and not yet resumed
+ **/
+guint kfxmpp_event_get_pending (KfxmppEvent *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return g_list_length (self->pending);
+}
+
+
+/**
+ * \brief Get age of oldest pending dispatch
+ * \param self An event
+ * \return Time in milliseconds since oldest pending handler deferred, 0 if none
+ **/
+gulong kfxmpp_event_get_pending_age (KfxmppEvent *self)
+{
+	KfxmppEventToken *token;
+
+	g_return_val_if_fail (self, 0);
+
+	if (self->pending == NULL)
+		return 0;
+
+	token = self->pending->data;
+	return kfxmpp_event_elapsed (&token->started);
+}
+
+
+/**
+ * \brief Get longest time a dispatch stayed pending
+ * \param self An event
+ * \return Time in milliseconds between deferring and resuming, for the slowest dispatch so far
+ **/
+gulong kfxmpp_event_get_max_pending_age (KfxmppEvent *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->max_pending_age;
+}
+
+
+/**
+ * \brief Defer decision of currently running handler
+ * \return A continuation token, or NULL if not called from a handler
+ *
+ * This must be called from within handler callback, which should then
+ * return KFXMPP_EVENT_PENDING. Later, kfxmpp_event_token_resolve must be
+ * called with the token exactly once.
+ **/
+KfxmppEventToken *kfxmpp_event_defer (void)
+{
+	KfxmppEventToken **slot;
+
+	slot = g_static_private_get (&current_slot);
+	g_return_val_if_fail (slot, NULL);
+	g_return_val_if_fail (*slot == NULL, NULL);
+
+	*slot = g_new0 (KfxmppEventToken, 1);
+	(*slot)->mutex = g_mutex_new ();
+	(*slot)->arming = g_cond_new ();
+	g_get_current_time (&(*slot)->started);
+
+	return *slot;
+}
+
+
+/**
+ * \brief Finish a deferred dispatch
+ * \param token A token returned by kfxmpp_event_defer
+ * \param handled TRUE if event was handled, FALSE to call remaining handlers
+ *
+ * This function is thread-safe. Remaining handlers are called and event
+ * data is released in the thread running event's main context, some time
+ * after this function returns. Token is no longer valid after this call.
+ **/
+void kfxmpp_event_token_resolve (KfxmppEventToken *token, gboolean handled)
+{
+	gboolean armed;
+
+	g_return_if_fail (token);
+
+	g_mutex_lock (token->mutex);
+	if (token->resolved) {
+		g_mutex_unlock (token->mutex);
+		g_warning ("Event token resolved twice");
+		return;
 	}
+	token->resolved = TRUE;
+	token->handled = handled;
+	armed = token->armed;
+	g_mutex_unlock (token->mutex);
+
+	if (armed)
+		kfxmpp_event_schedule (token);
+}
+
+
+/**
+ * \brief Get event data a deferred dispatch has pinned
+ * \param token A token returned by kfxmpp_event_defer
+ * \return Data returned by pin function passed to kfxmpp_event_trigger_full,
+ * 	or event data itself if there was none
+ *
+ * This function is thread-safe. Event data passed to handler may be gone
+ * once handler returns; this copy stays valid until token is resolved.
+ * Called from another thread before handler has returned, it waits until
+ * data is pinned. It can not be called from handler itself.
+ **/
+gpointer kfxmpp_event_token_get_data (KfxmppEventToken *token)
+{
+	KfxmppEventToken **slot;
+
+	g_return_val_if_fail (token, NULL);
+
+	/* Handler's own thread would wait for itself */
+	slot = g_static_private_get (&current_slot);
+	g_return_val_if_fail (slot == NULL || *slot != token, NULL);
+
+	g_mutex_lock (token->mutex);
+	while (! token->armed)
+		g_cond_wait (token->arming, token->mutex);
+	g_mutex_unlock (token->mutex);
+
+	return token->data;
+}
+
+
+/**
+ * \brief Mark token as ready to be resumed
+ *
+ * Token might have been resolved already by another thread before its
+ * handler returned, in which case continuation is scheduled here.
+ **/
+static void kfxmpp_event_arm (KfxmppEvent *self, KfxmppEventToken *token)
+{
+	gboolean resolved;
+
+	token->event = kfxmpp_event_ref (self);
+	self->pending = g_list_append (self->pending, token);
+
+	g_mutex_lock (token->mutex);
+	token->armed = TRUE;
+	resolved = token->resolved;
+	g_cond_broadcast (token->arming);
+	g_mutex_unlock (token->mutex);
+
+	if (resolved)
+		kfxmpp_event_schedule (token);
+}
+
+
+/**
+ * \brief Schedule continuation of a resolved dispatch
+ *
+ * This may run in any thread.
+ **/
+static void kfxmpp_event_schedule (KfxmppEventToken *token)
+{
+	GSource *source;
+
+	if (token->backend && kfxmpp_io_backend_invoke (token->backend, kfxmpp_event_resume, token, NULL))
+		return;
+
+	source = g_idle_source_new ();
+	g_source_set_callback (source, kfxmpp_event_resume, token, NULL);
+	g_source_attach (source, token->context);
+	g_source_unref (source);
+}
+
+
+/**
+ * \brief Continue dispatch after token was resolved
+ **/
+static gboolean kfxmpp_event_resume (gpointer data)
+{
+	KfxmppEventToken *token = data;
+	KfxmppEvent *event = token->event;
+	KfxmppEventToken *slot = NULL;
+	gpointer saved;
+	gboolean handled;
+	gulong age;
+
+	event->pending = g_list_remove (event->pending, token);
+	age = kfxmpp_event_elapsed (&token->started);
+	if (age > event->max_pending_age)
+		event->max_pending_age = age;
+
+	saved = g_static_private_get (&current_slot);
+	g_static_private_set (&current_slot, &slot, NULL);
+
+	handled = token->handled;
+	while (!handled && token->remaining) {
+		KfxmppEventHandler *handler = token->remaining->data;
+
+		token->remaining = g_slist_delete_link (token->remaining, token->remaining);
+		slot = NULL;
+		handled = kfxmpp_event_handler_call (handler, event->obj, token->data);
+		kfxmpp_event_handler_unref (handler);
+
+		if (slot) {
+			/* Deferred again, hand pinned data over to new token */
+			slot->remaining = token->remaining;
+			slot->data = token->data;
+			slot->unpin = token->unpin;
+			slot->context = token->context;
+			slot->backend = token->backend;
+			token->remaining = NULL;
+			token->unpin = NULL;
+			token->context = NULL;
+			token->backend = NULL;
+
+			kfxmpp_event_arm (event, slot);
+			break;
+		}
+	}
+
+	g_static_private_set (&current_slot, saved, NULL);
+
+	if (token->unpin)
+		token->unpin (event->obj, token->data);
+	kfxmpp_event_token_free (token);
+
 	return FALSE;
 }
 
 
+/**
+ * \brief Release a token after its dispatch is finished
+ **/
+static void kfxmpp_event_token_free (KfxmppEventToken *token)
+{
+	g_slist_foreach (token->remaining, (GFunc) kfxmpp_event_handler_unref, NULL);
+	g_slist_free (token->remaining);
+	if (token->context)
+		g_main_context_unref (token->context);
+	if (token->backend)
+		kfxmpp_io_backend_unref (token->backend);
+	if (token->mutex)
+		g_mutex_free (token->mutex);
+	if (token->arming)
+		g_cond_free (token->arming);
+	kfxmpp_event_unref (token->event);
+	g_free (token);
+}
+
+
+/**
+ * \brief Get number of milliseconds since given time
+ **/
+static gulong kfxmpp_event_elapsed (const GTimeVal *since)
+{
+	GTimeVal now;
+	glong ms;
+
+	g_get_current_time (&now);
+	ms = (now.tv_sec - since->tv_sec) * 1000 + (now.tv_usec - since->tv_usec) / 1000;
+
+	return ms > 0 ? (gulong) ms : 0;
+}
+
+
 /**
  * \brief compare two KfxmppEventEntries
  *
@@ -232,11 +624,13 @@ void kfxmpp_event_handler_free (KfxmppEventHandler *self)
 
 /**
  * \brief Add a reference to KfxmppEventHandler
+ *
+ * This function is thread-safe.
  **/
 KfxmppEventHandler* kfxmpp_event_handler_ref (KfxmppEventHandler *self)
 {
         g_return_val_if_fail (self, NULL);
-        self->ref_count++;
+        g_atomic_int_inc (&self->ref_count);
         return self;
 }
 
@@ -244,13 +638,13 @@ KfxmppEventHandler* kfxmpp_event_handler_ref (KfxmppEventHandler *self)
 /**
  * \brief Remove a reference from KfxmppEventHandler
  *
- * Object will be deleted when reference count reaches 0
+ * Object will be deleted when reference count reaches 0.
+ * This function is thread-safe.
  **/
 void kfxmpp_event_handler_unref (KfxmppEventHandler *self)
 {
         g_return_if_fail (self);
-        self->ref_count--;
-        if (self->ref_count == 0)
+        if (g_atomic_int_dec_and_test (&self->ref_count))
                 kfxmpp_event_handler_free (self);
 }
 
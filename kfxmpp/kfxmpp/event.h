@@ -26,6 +26,7 @@
 #define __EVENT_H__
 
 #include <glib.h>
+#include <kfxmpp/iobackend.h>
 
 
 /**
@@ -50,14 +51,42 @@ typedef enum {
 
 /**
  * \brief An event
+ *
+ * Thread safety: kfxmpp_event_ref and kfxmpp_event_unref are atomic and may
+ * be called from any thread. Adding, removing and triggering handlers is
+ * not synchronized, so an event must be triggered and modified from one
+ * thread at a time.
  **/
 typedef struct _KfxmppEvent KfxmppEvent;
 
 /**
  * \brief An object that listens for certain events
+ *
+ * Thread safety: kfxmpp_event_handler_ref and kfxmpp_event_handler_unref are
+ * atomic, so one handler may be shared by events living in different
+ * threads. Its callback is run in the thread that triggers the event, and
+ * its destroy notify in the thread that drops the last reference.
  **/
 typedef struct _KfxmppEventHandler KfxmppEventHandler;
 
+/**
+ * \brief Continuation token of a deferred handler
+ *
+ * A handler that cannot decide synchronously calls kfxmpp_event_defer,
+ * keeps the token and returns KFXMPP_EVENT_PENDING. Event data stays
+ * pinned until kfxmpp_event_token_resolve is called, which may happen from
+ * any thread. Remaining handlers are then called (or not) in the thread
+ * running main context the event was triggered for, or dispatching the
+ * backend, see kfxmpp_event_trigger_with_backend. Every token must be
+ * resolved exactly once.
+ **/
+typedef struct _KfxmppEventToken KfxmppEventToken;
+
+/**
+ * \brief Value returned by a handler that has deferred its decision
+ **/
+#define KFXMPP_EVENT_PENDING	2
+
 
 /**
  * \callback function called by a handler
@@ -67,10 +96,26 @@ typedef struct _KfxmppEventHandler KfxmppEventHandler;
  * \param data User supplied data
  * \return TRUE if event was handled succesfully
  * 	FALSE to call more handlers
+ * 	KFXMPP_EVENT_PENDING after calling kfxmpp_event_defer
  **/
 typedef gboolean (*KfxmppEventHandlerFunc) (KfxmppEventHandler *handler, gpointer source,
 					gpointer event, gpointer data);
 
+/**
+ * \callback function keeping event data alive while dispatch is pending
+ * \param source Object that triggered this event
+ * \param data Event data
+ * \return Data passed to handlers called after resolution
+ **/
+typedef gpointer (*KfxmppEventPinFunc) (gpointer source, gpointer data);
+
+/**
+ * \callback function releasing data returned by KfxmppEventPinFunc
+ * \param source Object that triggered this event
+ * \param data Pinned data
+ **/
+typedef void (*KfxmppEventUnpinFunc) (gpointer source, gpointer data);
+
 
 KfxmppEvent *kfxmpp_event_new (gpointer source);
 void kfxmpp_event_free (KfxmppEvent *self);
@@ -79,6 +124,18 @@ void kfxmpp_event_unref (KfxmppEvent *self);
 void kfxmpp_event_add_handler (KfxmppEvent *self, KfxmppEventHandler *handler, gint priority);
 void kfxmpp_event_remove_handler (KfxmppEvent *event, KfxmppEventHandler *handler);
 gboolean kfxmpp_event_trigger (KfxmppEvent *event, gpointer data);
+gboolean kfxmpp_event_trigger_full (KfxmppEvent *event, gpointer data, KfxmppEventPinFunc pin,
+					KfxmppEventUnpinFunc unpin, GMainContext *context);
+gboolean kfxmpp_event_trigger_with_backend (KfxmppEvent *event, gpointer data, KfxmppEventPinFunc pin,
+					KfxmppEventUnpinFunc unpin, GMainContext *context,
+					KfxmppIoBackend *backend);
+guint kfxmpp_event_get_pending (KfxmppEvent *self);
+gulong kfxmpp_event_get_pending_age (KfxmppEvent *self);
+gulong kfxmpp_event_get_max_pending_age (KfxmppEvent *self);
+
+KfxmppEventToken *kfxmpp_event_defer (void);
+gpointer kfxmpp_event_token_get_data (KfxmppEventToken *token);
+void kfxmpp_event_token_resolve (KfxmppEventToken *token, gboolean handled);
 
 KfxmppEventHandler *kfxmpp_event_handler_new (KfxmppEventHandlerFunc callback, gpointer data, GDestroyNotify notify);
 void kfxmpp_event_handler_free (KfxmppEventHandler *self);
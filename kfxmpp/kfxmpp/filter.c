@@ -0,0 +1,552 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** \file filter.h */
+
+#include <string.h>
+#include "kfxmpp.h"
+#include "filter.h"
+
+/**
+ * \brief Attribute predicate
+ **/
+typedef struct {
+	gchar *name;		/**< Attribute name */
+	gchar *value;		/**< Expected value */
+	gboolean suffix;	/**< Whether value should only end with \b value */
+	gboolean domain;	/**< Whether only domain part of JID in attribute is compared */
+} KfxmppFilterAttr;
+
+
+/**
+ * \brief Single step of filter expression, matches one element
+ **/
+typedef struct {
+	gchar *ns;		/**< Namespace, NULL matches any namespace */
+	gchar *name;		/**< Element name, NULL matches any element */
+	GSList *attrs;		/**< Attribute predicates */
+} KfxmppFilterStep;
+
+
+struct _KfxmppFilter {
+	gchar *expression;		/**< Source expression */
+	KfxmppFilterStep *stanza;	/**< Step matching stanza element */
+	KfxmppFilterStep *children[KFXMPP_FILTER_MAX_CHILDREN];	/**< Required children */
+	guint n_children;		/**< Number of required children */
+
+	/* Statistics */
+	guint matches;			/**< Number of rejected stanzas */
+	guint skipped;			/**< Number of elements skipped without building nodes */
+
+	gint ref_count;			/**< Reference count */
+};
+
+
+static KfxmppFilterStep *kfxmpp_filter_parse_step (KfxmppFilter *self, const gchar **p, gboolean allow_children, GError **error);
+static gchar *kfxmpp_filter_parse_name (const gchar **p);
+static gchar *kfxmpp_filter_parse_quoted (const gchar **p);
+static void kfxmpp_filter_skip_spaces (const gchar **p);
+static gboolean kfxmpp_filter_step_match (KfxmppFilterStep *step, const gchar *ns, const gchar *name, const gchar **attrs);
+static void kfxmpp_filter_step_free (KfxmppFilterStep *step);
+
+
+/**
+ * \brief Compile a filter
+ * \param expression Filter expression, see KfxmppFilter
+ * \param error Location to store error information (may be NULL)
+ * \return A new filter, or NULL if expression is not valid
+ **/
+KfxmppFilter *kfxmpp_filter_new (const gchar *expression, GError **error)
+{
+	KfxmppFilter *self;
+	const gchar *p = expression;
+
+	g_return_val_if_fail (expression, NULL);
+
+	self = g_new0 (KfxmppFilter, 1);
+	self->expression = g_strdup (expression);
+	self->ref_count = 1;
+
+	self->stanza = kfxmpp_filter_parse_step (self, &p, TRUE, error);
+	if (self->stanza == NULL) {
+		kfxmpp_filter_free (self);
+		return NULL;
+	}
+
+	kfxmpp_filter_skip_spaces (&p);
+	if (*p == '/') {
+		/* 'a/b' is a shorthand for 'a[b]' */
+		KfxmppFilterStep *child;
+
+		p++;
+		child = kfxmpp_filter_parse_step (self, &p, FALSE, error);
+		if (child == NULL) {
+			kfxmpp_filter_free (self);
+			return NULL;
+		}
+		if (self->n_children == KFXMPP_FILTER_MAX_CHILDREN) {
+			kfxmpp_filter_step_free (child);
+			g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+					"Too many child predicates in '%s'", expression);
+			kfxmpp_filter_free (self);
+			return NULL;
+		}
+		self->children[self->n_children++] = child;
+		kfxmpp_filter_skip_spaces (&p);
+	}
+
+	if (*p != '\0') {
+		g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+				"Unexpected '%c' at offset %d in '%s'",
+				*p, (gint) (p - expression), expression);
+		kfxmpp_filter_free (self);
+		return NULL;
+	}
+
+	return self;
+}
+
+
+/**
+ * \brief Free a filter
+ * \param self A filter
+ **/
+void kfxmpp_filter_free (KfxmppFilter *self)
+{
+	guint i;
+
+	g_return_if_fail (self);
+
+	if (self->stanza)
+		kfxmpp_filter_step_free (self->stanza);
+	for (i = 0; i < self->n_children; i++)
+		kfxmpp_filter_step_free (self->children[i]);
+	g_free (self->expression);
+	g_free (self);
+}
+
+
+/**
+ * \brief Add a reference to KfxmppFilter
+ *
+ * This function is thread-safe.
+ **/
+KfxmppFilter *kfxmpp_filter_ref (KfxmppFilter *self)
+{
+        g_return_val_if_fail (self, NULL);
+        g_atomic_int_inc (&self->ref_count);
+        return self;
+}
+
+
+/**
+ * \brief Remove a reference from KfxmppFilter
+ *
+ * Object will be deleted when reference count reaches 0.
+ * This function is thread-safe.
+ **/
+void kfxmpp_filter_unref (KfxmppFilter *self)
+{
+        g_return_if_fail (self);
+        if (g_atomic_int_dec_and_test (&self->ref_count))
+                kfxmpp_filter_free (self);
+}
+
+
+/**
+ * \brief Get expression filter was compiled from
+ * \param self A filter
+ **/
+const gchar *kfxmpp_filter_get_expression (KfxmppFilter *self)
+{
+	g_return_val_if_fail (self, NULL);
+
+	return self->expression;
+}
+
+
+/**
+ * \brief Get number of stanzas rejected by this filter
+ * \param self A filter
+ **/
+guint kfxmpp_filter_get_matches (KfxmppFilter *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->matches;
+}
+
+
+/**
+ * \brief Get number of elements that were skipped without building nodes
+ * \param self A filter
+ **/
+guint kfxmpp_filter_get_skipped (KfxmppFilter *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->skipped;
+}
+
+
+/**
+ * \brief Check whether stanza element matches the filter
+ * \param self A filter
+ * \param ns Namespace of stanza
+ * \param name Local name of stanza element
+ * \param attrs NULL-terminated array of attribute names and values
+ * \return TRUE if stanza element matches. If filter has child predicates,
+ * 	stanza is rejected only when all of them are satisfied as well.
+ **/
+gboolean kfxmpp_filter_match_stanza (KfxmppFilter *self, const gchar *ns, const gchar *name, const gchar **attrs)
+{
+	g_return_val_if_fail (self, FALSE);
+
+	return kfxmpp_filter_step_match (self->stanza, ns, name, attrs);
+}
+
+
+/**
+ * \brief Check which child predicates are satisfied by a child element
+ * \param self A filter
+ * \param ns Namespace of child element
+ * \param name Local name of child element
+ * \param attrs NULL-terminated array of attribute names and values
+ * \return Bit mask of satisfied child predicates
+ **/
+guint kfxmpp_filter_match_child (KfxmppFilter *self, const gchar *ns, const gchar *name, const gchar **attrs)
+{
+	guint mask = 0;
+	guint i;
+
+	g_return_val_if_fail (self, 0);
+
+	for (i = 0; i < self->n_children; i++) {
+		if (kfxmpp_filter_step_match (self->children[i], ns, name, attrs))
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+
+/**
+ * \brief Get bit mask with all child predicates of filter set
+ * \param self A filter
+ * \return Bit mask, 0 if filter has no child predicates
+ **/
+guint kfxmpp_filter_get_children_mask (KfxmppFilter *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return (1 << self->n_children) - 1;
+}
+
+
+/**
+ * \brief Record that filter has rejected a stanza
+ * \param self A filter
+ **/
+void kfxmpp_filter_count_match (KfxmppFilter *self)
+{
+	g_return_if_fail (self);
+
+	self->matches++;
+}
+
+
+/**
+ * \brief Record elements skipped because of this filter
+ * \param self A filter
+ * \param elements Number of elements
+ **/
+void kfxmpp_filter_count_skipped (KfxmppFilter *self, guint elements)
+{
+	g_return_if_fail (self);
+
+	self->skipped += elements;
+}
+
+
+/***********************************************************************
+ *
+ * Expression compiler
+ *
+ */
+
+/**
+ * \brief Parse single step with its predicates
+ **/
+static KfxmppFilterStep *kfxmpp_filter_parse_step (KfxmppFilter *self, const gchar **p, gboolean allow_children, GError **error)
+{
+	KfxmppFilterStep *step;
+	const gchar *expr = self->expression;
+
+	step = g_new0 (KfxmppFilterStep, 1);
+
+	kfxmpp_filter_skip_spaces (p);
+
+	/* Namespace */
+	if (**p == '{') {
+		const gchar *end = strchr (*p, '}');
+		if (end == NULL) {
+			g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+					"Unterminated namespace in '%s'", expr);
+			goto fail;
+		}
+		step->ns = g_strndup (*p + 1, end - *p - 1);
+		*p = end + 1;
+	}
+
+	/* Element name */
+	if (**p == '*') {
+		(*p)++;
+	} else {
+		step->name = kfxmpp_filter_parse_name (p);
+		if (step->name == NULL) {
+			g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+					"Element name expected at offset %d in '%s'",
+					(gint) (*p - expr), expr);
+			goto fail;
+		}
+	}
+
+	/* Predicates */
+	for (kfxmpp_filter_skip_spaces (p); **p == '['; kfxmpp_filter_skip_spaces (p)) {
+		(*p)++;
+		kfxmpp_filter_skip_spaces (p);
+
+		if (**p == '@' || strncmp (*p, "domain(", 7) == 0) {
+			/* Attribute predicate */
+			KfxmppFilterAttr *attr;
+
+			attr = g_new0 (KfxmppFilterAttr, 1);
+			step->attrs = g_slist_append (step->attrs, attr);
+
+			if (**p == 'd') {
+				/* domain(@attr) */
+				attr->domain = TRUE;
+				*p += 7;
+				kfxmpp_filter_skip_spaces (p);
+				if (**p != '@') {
+					g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+							"Expected '@' at offset %d in '%s'",
+							(gint) (*p - expr), expr);
+					goto fail;
+				}
+			}
+			(*p)++;
+
+			attr->name = kfxmpp_filter_parse_name (p);
+			kfxmpp_filter_skip_spaces (p);
+			if (attr->domain) {
+				if (**p != ')') {
+					g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+							"Expected ')' at offset %d in '%s'",
+							(gint) (*p - expr), expr);
+					goto fail;
+				}
+				(*p)++;
+				kfxmpp_filter_skip_spaces (p);
+			}
+			if (**p == '$') {
+				attr->suffix = TRUE;
+				(*p)++;
+			}
+			if (attr->name == NULL || **p != '=') {
+				g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+						"Malformed attribute predicate at offset %d in '%s'",
+						(gint) (*p - expr), expr);
+				goto fail;
+			}
+			(*p)++;
+			kfxmpp_filter_skip_spaces (p);
+			attr->value = kfxmpp_filter_parse_quoted (p);
+			if (attr->value == NULL) {
+				g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+						"Quoted value expected at offset %d in '%s'",
+						(gint) (*p - expr), expr);
+				goto fail;
+			}
+		} else {
+			/* Child presence predicate */
+			KfxmppFilterStep *child;
+
+			if (! allow_children) {
+				g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+						"Only direct children of stanza may be tested in '%s'", expr);
+				goto fail;
+			}
+			if (self->n_children == KFXMPP_FILTER_MAX_CHILDREN) {
+				g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+						"Too many child predicates in '%s'", expr);
+				goto fail;
+			}
+			child = kfxmpp_filter_parse_step (self, p, FALSE, error);
+			if (child == NULL)
+				goto fail;
+			self->children[self->n_children++] = child;
+		}
+
+		kfxmpp_filter_skip_spaces (p);
+		if (**p != ']') {
+			g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_FILTER_SYNTAX,
+					"Expected ']' at offset %d in '%s'",
+					(gint) (*p - expr), expr);
+			goto fail;
+		}
+		(*p)++;
+	}
+
+	return step;
+
+fail:
+	kfxmpp_filter_step_free (step);
+	return NULL;
+}
+
+
+/**
+ * \brief Parse an element or attribute name
+ * \return A newly allocated name, or NULL if there is no name at \b p
+ **/
+static gchar *kfxmpp_filter_parse_name (const gchar **p)
+{
+	const gchar *start = *p;
+
+	while (g_ascii_isalnum (**p) || **p == '_' || **p == '-' || **p == '.' || **p == ':'
+			|| (guchar) **p >= 0x80)
+		(*p)++;
+
+	if (*p == start)
+		return NULL;
+	return g_strndup (start, *p - start);
+}
+
+
+/**
+ * \brief Parse a string in single or double quotes
+ * \return A newly allocated string without quotes, or NULL on error
+ **/
+static gchar *kfxmpp_filter_parse_quoted (const gchar **p)
+{
+	const gchar *end;
+	gchar quote = **p;
+	gchar *ret;
+
+	if (quote != '\'' && quote != '"')
+		return NULL;
+
+	end = strchr (*p + 1, quote);
+	if (end == NULL)
+		return NULL;
+
+	ret = g_strndup (*p + 1, end - *p - 1);
+	*p = end + 1;
+	return ret;
+}
+
+
+/**
+ * \brief Skip white space
+ **/
+static void kfxmpp_filter_skip_spaces (const gchar **p)
+{
+	while (g_ascii_isspace (**p))
+		(*p)++;
+}
+
+
+/**
+ * \brief Check whether an element matches a step
+ **/
+static gboolean kfxmpp_filter_step_match (KfxmppFilterStep *step, const gchar *ns, const gchar *name, const gchar **attrs)
+{
+	GSList *tmp;
+
+	if (step->ns && (ns == NULL || strcmp (step->ns, ns) != 0))
+		return FALSE;
+	if (step->name && strcmp (step->name, name) != 0)
+		return FALSE;
+
+	for (tmp = step->attrs; tmp; tmp = tmp->next) {
+		KfxmppFilterAttr *attr = tmp->data;
+		const gchar *value = NULL;
+		gint i;
+
+		for (i = 0; attrs && attrs[i]; i += 2) {
+			if (strcmp (attrs[i], attr->name) == 0) {
+				value = attrs[i+1];
+				break;
+			}
+		}
+
+		if (value == NULL)
+			return FALSE;
+		if (attr->domain) {
+			/* Compare domain part of JID: [node@]domain[/resource] */
+			const gchar *at = strchr (value, '@');
+			const gchar *slash;
+			gsize len;
+
+			if (at && (strchr (value, '/') == NULL || at < strchr (value, '/')))
+				value = at + 1;
+			slash = strchr (value, '/');
+			len = slash ? (gsize) (slash - value) : strlen (value);
+
+			if (attr->suffix) {
+				gsize vlen = strlen (attr->value);
+				if (len < vlen || strncmp (value + len - vlen, attr->value, vlen) != 0)
+					return FALSE;
+			} else if (strlen (attr->value) != len || strncmp (value, attr->value, len) != 0) {
+				return FALSE;
+			}
+		} else if (attr->suffix) {
+			if (! g_str_has_suffix (value, attr->value))
+				return FALSE;
+		} else if (strcmp (value, attr->value) != 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+
+/**
+ * \brief Free a step
+ **/
+static void kfxmpp_filter_step_free (KfxmppFilterStep *step)
+{
+	GSList *tmp;
+
+	for (tmp = step->attrs; tmp; tmp = tmp->next) {
+		KfxmppFilterAttr *attr = tmp->data;
+
+		g_free (attr->name);
+		g_free (attr->value);
+		g_free (attr);
+	}
+	g_slist_free (step->attrs);
+	g_free (step->ns);
+	g_free (step->name);
+	g_free (step);
+}
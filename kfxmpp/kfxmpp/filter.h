@@ -0,0 +1,81 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** \file filter.h */
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/** Maximum number of child predicates in a single filter */
+#define KFXMPP_FILTER_MAX_CHILDREN 16
+
+/**
+ * \brief Compiled stanza filter
+ *
+ * A filter is written in a small subset of XPath and rejects stanzas
+ * before they are turned into a tree:
+ *
+ * \code
+ * filter    := step ('/' step)?
+ * step      := ('{' namespace '}')? (name | '*') predicate*
+ * predicate := '[' attribute ('=' | '$=') quoted ']'	value equals / ends with
+ *            | '[' step ']'				child element is present
+ * attribute := '@' name
+ *            | 'domain(' '@' name ')'			domain part of JID in attribute
+ * \endcode
+ *
+ * Expression 'a/b' is the same as 'a[b]'. Examples:
+ *
+ * \code
+ * message[{http://jabber.org/protocol/chatstates}*][@type='chat']
+ * presence[domain(@from)$='spam.example.com']
+ * message/{http://jabber.org/protocol/pubsub#event}event
+ * \endcode
+ *
+ * Thread safety: kfxmpp_filter_ref and kfxmpp_filter_unref are atomic.
+ * Counters are updated by the thread that parses the stream.
+ **/
+typedef struct _KfxmppFilter KfxmppFilter;
+
+KfxmppFilter *kfxmpp_filter_new (const gchar *expression, GError **error);
+void kfxmpp_filter_free (KfxmppFilter *self);
+KfxmppFilter *kfxmpp_filter_ref (KfxmppFilter *self);
+void kfxmpp_filter_unref (KfxmppFilter *self);
+
+const gchar *kfxmpp_filter_get_expression (KfxmppFilter *self);
+guint kfxmpp_filter_get_matches (KfxmppFilter *self);
+guint kfxmpp_filter_get_skipped (KfxmppFilter *self);
+
+/* Used by stream parser */
+gboolean kfxmpp_filter_match_stanza (KfxmppFilter *self, const gchar *ns, const gchar *name, const gchar **attrs);
+guint kfxmpp_filter_match_child (KfxmppFilter *self, const gchar *ns, const gchar *name, const gchar **attrs);
+guint kfxmpp_filter_get_children_mask (KfxmppFilter *self);
+void kfxmpp_filter_count_match (KfxmppFilter *self);
+void kfxmpp_filter_count_skipped (KfxmppFilter *self, guint elements);
+
+G_END_DECLS
+
+#endif /* __FILTER_H__ */
@@ -0,0 +1,2883 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** \file iobackend.h */
+
+#include "kfxmpp.h"
+#include "iobackend.h"
+#include "mpscqueue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EPOLL_H
+#  include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif
+#ifdef HAVE_IO_URING
+#  include <linux/io_uring.h>
+#  include <poll.h>
+#  include <sys/mman.h>
+#  include <sys/socket.h>
+#  include <sys/syscall.h>
+#endif
+
+/** Maximum number of events taken by epoll backend at once */
+#define EPOLL_MAX_EVENTS 256
+
+/** Resolution of epoll and io_uring backend timers, in milliseconds */
+#define TIMER_TICK 10
+
+/** Number of slots in timer wheel, a turn of it is about 10 s */
+#define TIMER_SLOTS 1024
+
+/** Number of submission queue entries of io_uring backend */
+#define URING_ENTRIES 256
+
+/** Number of completion queue entries, every multishot receive can post many */
+#define URING_CQ_ENTRIES 8192
+
+/** Number of receive buffers shared by io_uring watches, a power of 2 */
+#define URING_BUFFERS 512
+
+/** Size of a receive buffer */
+#define URING_BUFFER_SIZE 16384
+
+/** Group of receive buffers */
+#define URING_BUFFER_GROUP 0
+
+/** Maximum number of linked sends submitted for a watch at once */
+#define URING_MAX_CHAIN 16
+
+/** Conditions reported whether asked for or not */
+#define ALWAYS_REPORTED (G_IO_ERR | G_IO_HUP | G_IO_NVAL)
+
+struct _KfxmppIoBackend {
+	const KfxmppIoBackendFuncs *funcs;	/**< Backend implementation */
+	gpointer data;			/**< Backend-specific data */
+	GDestroyNotify notify;		/**< Function freeing \b data */
+	gint ref_count;			/**< Number of references to this object */
+	guint n_watches;		/**< Number of registered watches */
+	gpointer owner;			/**< GThread that dispatched backend last, NULL if none did */
+};
+
+struct _KfxmppIoWatch {
+	KfxmppIoBackend *backend;	/**< Backend this watch belongs to */
+	gpointer handle;		/**< Backend-specific handle */
+	gint fd;			/**< Watched file descriptor */
+	GIOCondition interest;		/**< Conditions callback is interested in */
+	KfxmppIoFunc func;		/**< Callback */
+	gpointer data;			/**< User data passed to \b func */
+	KfxmppIoRecvFunc recv_func;	/**< Callback receiving data, NULL unless backend does I/O */
+	gsize unsent;			/**< Bytes passed to kfxmpp_io_watch_send and not written yet */
+	gint dispatching;		/**< Nesting level of callback invocations */
+	gboolean removed;		/**< Whether watch was removed */
+};
+
+struct _KfxmppIoTimer {
+	KfxmppIoBackend *backend;	/**< Backend this timer belongs to */
+	gpointer handle;		/**< Backend-specific handle */
+	guint interval;			/**< Interval, in milliseconds */
+	GSourceFunc func;		/**< Callback */
+	gpointer data;			/**< User data passed to \b func */
+	gint dispatching;		/**< Nesting level of callback invocations */
+	gboolean removed;		/**< Whether timer was removed */
+};
+
+
+/***********************************************************************
+ *
+ * Static function prototypes
+ *
+ */
+
+static void kfxmpp_io_watch_free (KfxmppIoWatch *watch);
+static void kfxmpp_io_timer_free (KfxmppIoTimer *timer);
+static gboolean kfxmpp_io_backend_has_loop (KfxmppIoBackend *self);
+
+/* GLib backend */
+static gpointer kfxmpp_io_glib_add (gpointer backend_data, KfxmppIoWatch *watch, gint fd, GIOCondition interest);
+static void kfxmpp_io_glib_modify (gpointer backend_data, gpointer handle, GIOCondition interest);
+static void kfxmpp_io_glib_remove (gpointer backend_data, gpointer handle);
+static gpointer kfxmpp_io_glib_add_timer (gpointer backend_data, KfxmppIoTimer *timer, guint interval);
+static gboolean kfxmpp_io_glib_prepare (GSource *source, gint *timeout);
+static gboolean kfxmpp_io_glib_check (GSource *source);
+static gboolean kfxmpp_io_glib_dispatch (GSource *source, GSourceFunc callback, gpointer data);
+static gboolean kfxmpp_io_glib_timeout (gpointer data);
+
+/* Loop shared by epoll, io_uring and external backends */
+static void kfxmpp_io_loop_defer (gpointer backend_data, gpointer handle, GIOCondition condition);
+static gpointer kfxmpp_io_loop_add_timer (gpointer backend_data, KfxmppIoTimer *timer, guint interval);
+static void kfxmpp_io_loop_remove_timer (gpointer backend_data, gpointer handle);
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Epoll backend */
+static gpointer kfxmpp_io_epoll_add (gpointer backend_data, KfxmppIoWatch *watch, gint fd, GIOCondition interest);
+static void kfxmpp_io_epoll_modify (gpointer backend_data, gpointer handle, GIOCondition interest);
+static void kfxmpp_io_epoll_remove (gpointer backend_data, gpointer handle);
+static void kfxmpp_io_epoll_defer (gpointer backend_data, gpointer handle, GIOCondition condition);
+static void kfxmpp_io_epoll_free (gpointer backend_data);
+#endif
+
+#ifdef HAVE_IO_URING
+/* io_uring backend */
+static gpointer kfxmpp_io_uring_add (gpointer backend_data, KfxmppIoWatch *watch, gint fd, GIOCondition interest);
+static void kfxmpp_io_uring_modify (gpointer backend_data, gpointer handle, GIOCondition interest);
+static void kfxmpp_io_uring_remove (gpointer backend_data, gpointer handle);
+static gboolean kfxmpp_io_uring_set_recv (gpointer backend_data, gpointer handle, gboolean enable);
+static void kfxmpp_io_uring_send (gpointer backend_data, gpointer handle, GString *data);
+static void kfxmpp_io_uring_free (gpointer backend_data);
+#endif
+
+/* External backend */
+static gpointer kfxmpp_io_external_add (gpointer backend_data, KfxmppIoWatch *watch, gint fd, GIOCondition interest);
+static void kfxmpp_io_external_modify (gpointer backend_data, gpointer handle, GIOCondition interest);
+static void kfxmpp_io_external_remove (gpointer backend_data, gpointer handle);
+static void kfxmpp_io_external_defer (gpointer backend_data, gpointer handle, GIOCondition condition);
+static gpointer kfxmpp_io_external_add_timer (gpointer backend_data, KfxmppIoTimer *timer, guint interval);
+static void kfxmpp_io_external_free (gpointer backend_data);
+
+
+/**
+ * \brief Create a backend with custom implementation
+ * \param funcs Functions implementing backend. They must stay valid as long as backend exists.
+ * \param data Data passed to \b funcs
+ * \param notify Function called to free \b data when backend is freed (may be NULL)
+ * \return A new backend
+ **/
+KfxmppIoBackend *kfxmpp_io_backend_new (const KfxmppIoBackendFuncs *funcs, gpointer data, GDestroyNotify notify)
+{
+	KfxmppIoBackend *self;
+
+	g_return_val_if_fail (funcs, NULL);
+
+	self = g_new0 (KfxmppIoBackend, 1);
+	self->funcs = funcs;
+	self->data = data;
+	self->notify = notify;
+	self->ref_count = 1;
+
+	return self;
+}
+
+
+/**
+ * \brief Free a backend
+ * \param self A backend
+ **/
+void kfxmpp_io_backend_free (KfxmppIoBackend *self)
+{
+	g_return_if_fail (self);
+
+	if (self->notify)
+		self->notify (self->data);
+	g_free (self);
+}
+
+
+/**
+ * \brief Add a reference to KfxmppIoBackend
+ *
+ * This function is thread-safe.
+ **/
+KfxmppIoBackend *kfxmpp_io_backend_ref (KfxmppIoBackend *self)
+{
+	g_return_val_if_fail (self, NULL);
+	g_atomic_int_inc (&self->ref_count);
+	return self;
+}
+
+
+/**
+ * \brief Remove a reference from KfxmppIoBackend
+ *
+ * Object will be deleted when reference count reaches 0. Every watch
+ * and timer holds a reference to its backend. This function is thread-safe.
+ **/
+void kfxmpp_io_backend_unref (KfxmppIoBackend *self)
+{
+	g_return_if_fail (self);
+	if (g_atomic_int_dec_and_test (&self->ref_count))
+		kfxmpp_io_backend_free (self);
+}
+
+
+/**
+ * \brief Get number of file descriptors watched by a backend
+ * \param self A backend
+ * \return Number of watches
+ **/
+guint kfxmpp_io_backend_get_n_watches (KfxmppIoBackend *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->n_watches;
+}
+
+
+/**
+ * \brief Start watching a file descriptor
+ * \param self A backend
+ * \param fd File descriptor
+ * \param interest Conditions to watch for, usually G_IO_IN and/or G_IO_OUT
+ * \param func Function called when \b fd is ready
+ * \param data Data passed to \b func
+ * \return A new watch
+ **/
+KfxmppIoWatch *kfxmpp_io_backend_add_watch (KfxmppIoBackend *self, gint fd, GIOCondition interest,
+					KfxmppIoFunc func, gpointer data)
+{
+	KfxmppIoWatch *watch;
+
+	g_return_val_if_fail (self, NULL);
+	g_return_val_if_fail (fd >= 0, NULL);
+	g_return_val_if_fail (func, NULL);
+
+	watch = g_new0 (KfxmppIoWatch, 1);
+	watch->backend = kfxmpp_io_backend_ref (self);
+	watch->fd = fd;
+	watch->interest = interest;
+	watch->func = func;
+	watch->data = data;
+	watch->handle = self->funcs->add (self->data, watch, fd, interest);
+	self->n_watches++;
+
+	return watch;
+}
+
+
+/**
+ * \brief Change conditions a watch is interested in
+ * \param watch A watch
+ * \param interest New set of conditions
+ *
+ * Backend is not touched if interest does not change, so this is cheap
+ * to call after every change of session's output queue.
+ *
+ * Conditions that were not interesting so far may hold already, and an
+ * edge-triggered backend would never report them. They are deferred, so
+ * callback gets to check them in next dispatch.
+ **/
+void kfxmpp_io_watch_set_interest (KfxmppIoWatch *watch, GIOCondition interest)
+{
+	GIOCondition added;
+
+	g_return_if_fail (watch);
+
+	if (watch->removed || watch->interest == interest)
+		return;
+
+	added = interest & ~watch->interest;
+	watch->interest = interest;
+	watch->backend->funcs->modify (watch->backend->data, watch->handle, interest);
+	if (added)
+		kfxmpp_io_watch_defer (watch, added);
+}
+
+
+/**
+ * \brief Get conditions a watch is interested in
+ * \param watch A watch
+ * \return A set of conditions
+ **/
+GIOCondition kfxmpp_io_watch_get_interest (KfxmppIoWatch *watch)
+{
+	g_return_val_if_fail (watch, 0);
+
+	return watch->interest;
+}
+
+
+/**
+ * \brief Get file descriptor of a watch
+ * \param watch A watch
+ * \return A file descriptor
+ **/
+gint kfxmpp_io_watch_get_fd (KfxmppIoWatch *watch)
+{
+	g_return_val_if_fail (watch, -1);
+
+	return watch->fd;
+}
+
+
+/**
+ * \brief Report a condition again in next dispatch
+ * \param watch A watch
+ * \param condition Conditions that may still hold
+ *
+ * Callback calls this when it stops consuming readiness before reaching
+ * EAGAIN, like a session that has used up its read budget. Backend will
+ * call it again in next dispatch, without waiting for the descriptor,
+ * and will not block waiting for events until then. This does nothing
+ * on level-triggered backends, which report the condition anyway.
+ **/
+void kfxmpp_io_watch_defer (KfxmppIoWatch *watch, GIOCondition condition)
+{
+	g_return_if_fail (watch);
+
+	condition &= watch->interest;
+	if (watch->removed || condition == 0 || watch->backend->funcs->defer == NULL)
+		return;
+
+	watch->backend->funcs->defer (watch->backend->data, watch->handle, condition);
+}
+
+
+/**
+ * \brief Stop watching a file descriptor
+ * \param watch A watch
+ *
+ * Watch is freed, though this may be postponed if its callback is
+ * running. It may be called from within any callback of the same backend.
+ **/
+void kfxmpp_io_watch_remove (KfxmppIoWatch *watch)
+{
+	g_return_if_fail (watch);
+
+	if (watch->removed)
+		return;
+
+	watch->removed = TRUE;
+	watch->backend->funcs->remove (watch->backend->data, watch->handle);
+	watch->backend->n_watches--;
+
+	if (watch->dispatching == 0)
+		kfxmpp_io_watch_free (watch);
+}
+
+
+/**
+ * \brief Call watch's callback
+ * \param watch A watch
+ * \param condition Conditions that hold
+ * \return FALSE if watch was removed
+ *
+ * This is called by backends when file descriptor is ready.
+ **/
+gboolean kfxmpp_io_watch_dispatch (KfxmppIoWatch *watch, GIOCondition condition)
+{
+	gboolean alive;
+
+	g_return_val_if_fail (watch, FALSE);
+
+	condition &= watch->interest | ALWAYS_REPORTED;
+	if (watch->removed || condition == 0)
+		return ! watch->removed;
+
+	watch->dispatching++;
+	if (! watch->func (watch, condition, watch->data))
+		kfxmpp_io_watch_remove (watch);
+	alive = ! watch->removed;
+
+	if (--watch->dispatching == 0 && watch->removed)
+		kfxmpp_io_watch_free (watch);
+
+	return alive;
+}
+
+
+/**
+ * \brief Let backend receive and send data for a watch
+ * \param watch A watch
+ * \param func Function called with received data, NULL to go back to
+ * 	readiness notifications
+ * \return TRUE if backend does I/O for watch now, FALSE if it can only
+ * 	report readiness
+ *
+ * In completion mode callback no longer gets G_IO_IN, it gets data
+ * backend has read already. Data to write is passed to
+ * kfxmpp_io_watch_send, and G_IO_OUT is reported when all of it is
+ * written. Only io_uring backend supports it.
+ *
+ * Switching back is needed before anything else reads the descriptor.
+ * Data backend receives after that, though there should be none by then,
+ * is dropped with a warning.
+ **/
+gboolean kfxmpp_io_watch_set_recv_func (KfxmppIoWatch *watch, KfxmppIoRecvFunc func)
+{
+	const KfxmppIoBackendFuncs *funcs;
+
+	g_return_val_if_fail (watch, FALSE);
+
+	funcs = watch->backend->funcs;
+	if (watch->removed || funcs->set_recv == NULL)
+		return FALSE;
+
+	if (! funcs->set_recv (watch->backend->data, watch->handle, func != NULL))
+		return FALSE;
+	watch->recv_func = func;
+
+	return TRUE;
+}
+
+
+/**
+ * \brief Stop or restart receiving in completion mode
+ * \param watch A watch whose backend does I/O, see kfxmpp_io_watch_set_recv_func
+ * \param receiving FALSE to stop reading descriptor, TRUE to start again
+ *
+ * Watch stays in completion mode. Data backend had received already
+ * is still passed to receive callback, nothing more is read until
+ * receiving restarts.
+ **/
+void kfxmpp_io_watch_set_receiving (KfxmppIoWatch *watch, gboolean receiving)
+{
+	g_return_if_fail (watch);
+
+	if (watch->removed || watch->recv_func == NULL)
+		return;
+
+	watch->backend->funcs->set_recv (watch->backend->data, watch->handle, receiving);
+}
+
+
+/**
+ * \brief Write a segment in completion mode
+ * \param watch A watch whose backend does I/O, see kfxmpp_io_watch_set_recv_func
+ * \param data Data to write. Watch takes ownership of it.
+ *
+ * Segments are written in order. If writing fails, G_IO_ERR is reported.
+ * Segments still unwritten when watch is removed are written anyway, so
+ * descriptor may be closed right after removing watch.
+ **/
+void kfxmpp_io_watch_send (KfxmppIoWatch *watch, GString *data)
+{
+	g_return_if_fail (watch);
+	g_return_if_fail (data);
+
+	if (watch->removed || watch->recv_func == NULL || data->len == 0) {
+		g_string_free (data, TRUE);
+		return;
+	}
+
+	watch->unsent += data->len;
+	watch->backend->funcs->send (watch->backend->data, watch->handle, data);
+}
+
+
+/**
+ * \brief Get number of bytes passed to kfxmpp_io_watch_send and not written yet
+ * \param watch A watch
+ * \return Number of bytes
+ **/
+gsize kfxmpp_io_watch_get_unsent (KfxmppIoWatch *watch)
+{
+	g_return_val_if_fail (watch, 0);
+
+	return watch->unsent;
+}
+
+
+/**
+ * \brief Call watch's receive callback
+ * \param watch A watch
+ * \param data Received data
+ * \param size Size of \b data, 0 at end of stream, negated errno on error
+ * \return FALSE if watch was removed
+ *
+ * This is called by backends doing I/O.
+ **/
+gboolean kfxmpp_io_watch_received (KfxmppIoWatch *watch, const gchar *data, gssize size)
+{
+	gboolean alive;
+
+	g_return_val_if_fail (watch, FALSE);
+
+	if (watch->removed)
+		return FALSE;
+	if (watch->recv_func == NULL) {
+		if (size > 0)
+			g_warning ("Dropping %ld bytes received on descriptor %d", (glong) size, watch->fd);
+		return TRUE;
+	}
+
+	watch->dispatching++;
+	watch->recv_func (watch, data, size, watch->data);
+	alive = ! watch->removed;
+
+	if (--watch->dispatching == 0 && watch->removed)
+		kfxmpp_io_watch_free (watch);
+
+	return alive;
+}
+
+
+/**
+ * \brief Account a segment backend has written
+ * \param watch A watch
+ * \param size Size of segment
+ * \param failed Whether it was not written in whole
+ *
+ * This is called by backends doing I/O. It reports G_IO_ERR on failure,
+ * G_IO_OUT when the last segment is written.
+ **/
+void kfxmpp_io_watch_sent (KfxmppIoWatch *watch, gsize size, gboolean failed)
+{
+	g_return_if_fail (watch);
+
+	if (watch->removed)
+		return;
+
+	watch->unsent -= MIN (size, watch->unsent);
+	if (failed)
+		kfxmpp_io_watch_dispatch (watch, G_IO_ERR);
+	else if (watch->unsent == 0)
+		kfxmpp_io_watch_dispatch (watch, G_IO_OUT);
+}
+
+
+/**
+ * \brief Free a removed watch
+ **/
+static void kfxmpp_io_watch_free (KfxmppIoWatch *watch)
+{
+	kfxmpp_io_backend_unref (watch->backend);
+	g_free (watch);
+}
+
+
+/**
+ * \brief Start a timer
+ * \param self A backend
+ * \param interval Time between calls to \b func, in milliseconds. 0 calls
+ * 	it once per dispatch, after socket events.
+ * \param func Function called when timer expires, returns FALSE to remove timer
+ * \param data Data passed to \b func
+ * \return A new timer
+ *
+ * Unlike GLib timeouts, these do not have IDs. Timer is removed with
+ * kfxmpp_io_timer_remove, or by returning FALSE from \b func.
+ **/
+KfxmppIoTimer *kfxmpp_io_backend_add_timer (KfxmppIoBackend *self, guint interval,
+					GSourceFunc func, gpointer data)
+{
+	KfxmppIoTimer *timer;
+
+	g_return_val_if_fail (self, NULL);
+	g_return_val_if_fail (func, NULL);
+
+	timer = g_new0 (KfxmppIoTimer, 1);
+	timer->backend = kfxmpp_io_backend_ref (self);
+	timer->interval = interval;
+	timer->func = func;
+	timer->data = data;
+	timer->handle = self->funcs->add_timer (self->data, timer, interval);
+
+	return timer;
+}
+
+
+/**
+ * \brief Get interval of a timer
+ * \param timer A timer
+ * \return Interval, in milliseconds
+ **/
+guint kfxmpp_io_timer_get_interval (KfxmppIoTimer *timer)
+{
+	g_return_val_if_fail (timer, 0);
+
+	return timer->interval;
+}
+
+
+/**
+ * \brief Stop a timer
+ * \param timer A timer
+ *
+ * Timer is freed, though this may be postponed if its callback is
+ * running. It may be called from within any callback of the same backend.
+ **/
+void kfxmpp_io_timer_remove (KfxmppIoTimer *timer)
+{
+	g_return_if_fail (timer);
+
+	if (timer->removed)
+		return;
+
+	timer->removed = TRUE;
+	timer->backend->funcs->remove_timer (timer->backend->data, timer->handle);
+
+	if (timer->dispatching == 0)
+		kfxmpp_io_timer_free (timer);
+}
+
+
+/**
+ * \brief Call timer's callback
+ * \param timer A timer
+ * \return TRUE if timer should be re-armed
+ *
+ * This is called by backends when timer expires.
+ **/
+gboolean kfxmpp_io_timer_dispatch (KfxmppIoTimer *timer)
+{
+	gboolean alive;
+
+	g_return_val_if_fail (timer, FALSE);
+
+	if (timer->removed)
+		return FALSE;
+
+	timer->dispatching++;
+	if (! timer->func (timer->data))
+		kfxmpp_io_timer_remove (timer);
+	alive = ! timer->removed;
+
+	if (--timer->dispatching == 0 && timer->removed)
+		kfxmpp_io_timer_free (timer);
+
+	return alive;
+}
+
+
+/**
+ * \brief Free a removed timer
+ **/
+static void kfxmpp_io_timer_free (KfxmppIoTimer *timer)
+{
+	kfxmpp_io_backend_unref (timer->backend);
+	g_free (timer);
+}
+
+
+
+/***********************************************************************
+ *
+ * GLib backend
+ *
+ */
+
+/**
+ * \brief Single GSource polling a watched file descriptor
+ **/
+typedef struct {
+	GSource source;		/**< Parent */
+	GPollFD pollfd;		/**< Polled descriptor */
+	KfxmppIoWatch *watch;	/**< Watch */
+} KfxmppIoGlibSource;
+
+static const KfxmppIoBackendFuncs glib_funcs = {
+	kfxmpp_io_glib_add,
+	kfxmpp_io_glib_modify,
+	kfxmpp_io_glib_remove,
+	NULL,
+	kfxmpp_io_glib_add_timer,
+	kfxmpp_io_glib_remove,
+	NULL,
+	NULL
+};
+
+static GSourceFuncs glib_source_funcs = {
+	kfxmpp_io_glib_prepare,
+	kfxmpp_io_glib_check,
+	kfxmpp_io_glib_dispatch,
+	NULL
+};
+
+
+/**
+ * \brief Create a backend using GLib main loop
+ * \param context Main context watches are attached to, NULL for default one
+ * \return A new backend
+ *
+ * Each watch is a single GSource with one GPollFD, whose events are
+ * changed in place when interest changes. Each timer is a GLib timeout.
+ **/
+KfxmppIoBackend *kfxmpp_io_backend_new_glib (GMainContext *context)
+{
+	if (context == NULL)
+		context = g_main_context_default ();
+
+	return kfxmpp_io_backend_new (&glib_funcs, g_main_context_ref (context),
+			(GDestroyNotify) g_main_context_unref);
+}
+
+
+static gpointer kfxmpp_io_glib_add (gpointer backend_data, KfxmppIoWatch *watch, gint fd, GIOCondition interest)
+{
+	KfxmppIoGlibSource *src;
+
+	src = (KfxmppIoGlibSource *) g_source_new (&glib_source_funcs, sizeof (KfxmppIoGlibSource));
+	src->watch = watch;
+	src->pollfd.fd = fd;
+	src->pollfd.events = interest | ALWAYS_REPORTED;
+	g_source_add_poll ((GSource *) src, &src->pollfd);
+	g_source_attach ((GSource *) src, backend_data);
+
+	return src;
+}
+
+
+static void kfxmpp_io_glib_modify (gpointer backend_data, gpointer handle, GIOCondition interest)
+{
+	KfxmppIoGlibSource *src = handle;
+
+	src->pollfd.events = interest | ALWAYS_REPORTED;
+}
+
+
+static void kfxmpp_io_glib_remove (gpointer backend_data, gpointer handle)
+{
+	g_source_destroy (handle);
+	g_source_unref (handle);
+}
+
+
+static gpointer kfxmpp_io_glib_add_timer (gpointer backend_data, KfxmppIoTimer *timer, guint interval)
+{
+	GSource *src;
+
+	src = g_timeout_source_new (interval);
+	g_source_set_callback (src, kfxmpp_io_glib_timeout, timer, NULL);
+	g_source_attach (src, backend_data);
+
+	return src;
+}
+
+
+static gboolean kfxmpp_io_glib_prepare (GSource *source, gint *timeout)
+{
+	*timeout = -1;
+	return FALSE;
+}
+
+
+static gboolean kfxmpp_io_glib_check (GSource *source)
+{
+	KfxmppIoGlibSource *src = (KfxmppIoGlibSource *) source;
+
+	return (src->pollfd.revents & src->pollfd.events) != 0;
+}
+
+
+static gboolean kfxmpp_io_glib_dispatch (GSource *source, GSourceFunc callback, gpointer data)
+{
+	KfxmppIoGlibSource *src = (KfxmppIoGlibSource *) source;
+
+	kfxmpp_io_watch_dispatch (src->watch, src->pollfd.revents);
+	/* Removed watch has already destroyed this source */
+	return TRUE;
+}
+
+
+static gboolean kfxmpp_io_glib_timeout (gpointer data)
+{
+	kfxmpp_io_timer_dispatch (data);
+	/* Removed timer has already destroyed this source */
+	return TRUE;
+}
+
+
+
+/***********************************************************************
+ *
+ * Loop shared by epoll, io_uring and external backends
+ *
+ */
+
+/**
+ * \brief State of a backend running its own loop
+ *
+ * It is the first member of backend data, so functions taking backend
+ * data can treat it as a loop.
+ **/
+typedef struct {
+	gint dispatching;	/**< Nesting level of kfxmpp_io_backend_dispatch */
+	GSList *dead;		/**< Handles removed during dispatch */
+	GQueue *ready;		/**< Watch handles with deferred conditions */
+	GQueue *immediate;	/**< Timer handles with zero interval */
+	GList *wheel[TIMER_SLOTS];	/**< Timer handles, by tick they expire at modulo TIMER_SLOTS */
+	guint n_timers;		/**< Number of timers in \b wheel */
+	gint64 base;		/**< Time of tick 0, in milliseconds */
+	gint64 tick;		/**< Last tick whose timers were run */
+	guint syscalls;		/**< Number of system calls made */
+	KfxmppMpscQueue *calls;	/**< Calls queued by kfxmpp_io_backend_invoke */
+	gint woken;		/**< Whether \b wake_read may be readable (atomic) */
+	gint wake_read;		/**< Descriptor readable when \b calls got items, -1 if there is none */
+	gint wake_write;	/**< Descriptor written to wake loop up, same as \b wake_read for eventfd */
+} KfxmppIoLoop;
+
+/**
+ * \brief Part of a watch handle the loop knows about
+ *
+ * It is the first member of backend's own handle.
+ **/
+typedef struct {
+	KfxmppIoWatch *watch;	/**< Watch, NULL if removed */
+	GIOCondition pending;	/**< Deferred conditions */
+	GList *ready;		/**< Link in ready queue, if deferred */
+} KfxmppIoLoopWatch;
+
+/**
+ * \brief Handle of a timer
+ **/
+typedef struct {
+	KfxmppIoTimer *timer;	/**< Timer, NULL if removed */
+	gint64 ticks;		/**< Interval in ticks, 0 for immediate timers */
+	gint64 target;		/**< Tick timer expires at */
+	GList *link;		/**< Link in wheel slot or immediate queue, NULL while not armed */
+} KfxmppIoLoopTimer;
+
+/**
+ * \brief Call queued by kfxmpp_io_backend_invoke
+ **/
+typedef struct {
+	GSourceFunc func;	/**< Function to call */
+	gpointer data;		/**< Data passed to \b func */
+	GDestroyNotify notify;	/**< Function releasing \b data after call (may be NULL) */
+} KfxmppIoLoopCall;
+
+
+/**
+ * \brief Get monotonic time, in milliseconds
+ **/
+static gint64 kfxmpp_io_loop_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void kfxmpp_io_loop_init (KfxmppIoLoop *loop)
+{
+	loop->ready = g_queue_new ();
+	loop->immediate = g_queue_new ();
+	loop->base = kfxmpp_io_loop_now ();
+	loop->calls = kfxmpp_mpsc_queue_new ();
+
+#ifdef HAVE_SYS_EVENTFD_H
+	loop->wake_read = loop->wake_write = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+	{
+		gint fds[2];
+
+		loop->wake_read = loop->wake_write = -1;
+		if (pipe (fds) == 0) {
+			fcntl (fds[0], F_SETFL, O_NONBLOCK);
+			fcntl (fds[1], F_SETFL, O_NONBLOCK);
+			loop->wake_read = fds[0];
+			loop->wake_write = fds[1];
+		}
+	}
+#endif
+	if (loop->wake_read < 0)
+		g_warning ("Cannot create wakeup descriptor: %s", g_strerror (errno));
+}
+
+
+/**
+ * \brief Release a call that was never made
+ **/
+static void kfxmpp_io_loop_call_free (gpointer data)
+{
+	KfxmppIoLoopCall *call = data;
+
+	if (call->notify)
+		call->notify (call->data);
+	g_free (call);
+}
+
+
+static void kfxmpp_io_loop_clear (KfxmppIoLoop *loop)
+{
+	/* Watches and timers hold references, so there are none left */
+	g_slist_foreach (loop->dead, (GFunc) g_free, NULL);
+	g_slist_free (loop->dead);
+	g_queue_free (loop->ready);
+	g_queue_free (loop->immediate);
+	kfxmpp_mpsc_queue_free (loop->calls, kfxmpp_io_loop_call_free);
+	if (loop->wake_write != loop->wake_read)
+		close (loop->wake_write);
+	if (loop->wake_read >= 0)
+		close (loop->wake_read);
+}
+
+
+/**
+ * \brief Make wakeup descriptor readable
+ *
+ * This is the only loop function other threads call.
+ **/
+static void kfxmpp_io_loop_wake (KfxmppIoLoop *loop)
+{
+	guint64 one = 1;
+
+	g_atomic_int_set (&loop->woken, TRUE);
+	if (loop->wake_write >= 0 && write (loop->wake_write, &one, sizeof (one)) < 0 && errno != EAGAIN)
+		g_warning ("Cannot wake loop up: %s", g_strerror (errno));
+}
+
+
+/**
+ * \brief Make calls queued by other threads
+ * \return Number of calls made
+ **/
+static gint kfxmpp_io_loop_run_calls (KfxmppIoLoop *loop)
+{
+	GSList *calls, *tmp;
+	gint n = 0;
+
+	/* Calls pushed after this are followed by a new wakeup */
+	if (g_atomic_int_compare_and_exchange (&loop->woken, TRUE, FALSE) && loop->wake_read >= 0) {
+		gchar buffer[64];
+
+		while (read (loop->wake_read, buffer, sizeof (buffer)) > 0)
+			;
+		loop->syscalls++;
+	}
+
+	calls = kfxmpp_mpsc_queue_pop_all (loop->calls);
+	for (tmp = calls; tmp; tmp = tmp->next) {
+		KfxmppIoLoopCall *call = tmp->data;
+
+		call->func (call->data);
+		kfxmpp_io_loop_call_free (call);
+		n++;
+	}
+	g_slist_free (calls);
+
+	return n;
+}
+
+
+static void kfxmpp_io_loop_enter (KfxmppIoLoop *loop)
+{
+	loop->dispatching++;
+}
+
+
+static void kfxmpp_io_loop_leave (KfxmppIoLoop *loop)
+{
+	if (--loop->dispatching == 0) {
+		g_slist_foreach (loop->dead, (GFunc) g_free, NULL);
+		g_slist_free (loop->dead);
+		loop->dead = NULL;
+	}
+}
+
+
+/**
+ * \brief Free a removed handle, or keep it until dispatch ends
+ **/
+static void kfxmpp_io_loop_bury (KfxmppIoLoop *loop, gpointer handle)
+{
+	if (loop->dispatching)
+		loop->dead = g_slist_prepend (loop->dead, handle);
+	else
+		g_free (handle);
+}
+
+
+/**
+ * \brief Forget deferred conditions of a watch
+ **/
+static void kfxmpp_io_loop_unready (KfxmppIoLoop *loop, KfxmppIoLoopWatch *lw)
+{
+	if (lw->ready) {
+		g_queue_delete_link (loop->ready, lw->ready);
+		lw->ready = NULL;
+	}
+	lw->pending = 0;
+}
+
+
+/**
+ * \brief Report conditions kernel has reported for a watch
+ **/
+static void kfxmpp_io_loop_report (KfxmppIoLoop *loop, KfxmppIoLoopWatch *lw, GIOCondition condition)
+{
+	if (lw->watch == NULL)
+		return;
+
+	if (lw->ready) {
+		/* Reported anyway, no need to do it twice */
+		lw->pending &= ~condition;
+		if (lw->pending == 0)
+			kfxmpp_io_loop_unready (loop, lw);
+	}
+	kfxmpp_io_watch_dispatch (lw->watch, condition);
+}
+
+
+static void kfxmpp_io_loop_defer (gpointer backend_data, gpointer handle, GIOCondition condition)
+{
+	KfxmppIoLoop *loop = backend_data;
+	KfxmppIoLoopWatch *lw = handle;
+
+	lw->pending |= condition;
+	if (lw->ready == NULL) {
+		g_queue_push_tail (loop->ready, lw);
+		lw->ready = loop->ready->tail;
+	}
+}
+
+
+/**
+ * \brief Get time until loop has to be dispatched
+ **/
+static gint kfxmpp_io_loop_timeout (KfxmppIoLoop *loop, gint64 now)
+{
+	gint64 tick, deadline;
+	GList *tmp;
+	gint i;
+
+	if (loop->ready->length > 0 || loop->immediate->length > 0 ||
+			! kfxmpp_mpsc_queue_is_empty (loop->calls))
+		return 0;
+	if (loop->n_timers == 0)
+		return -1;
+
+	/* First slot holding a timer due on this turn */
+	for (i = 1; i <= TIMER_SLOTS; i++) {
+		tick = loop->tick + i;
+		for (tmp = loop->wheel[tick % TIMER_SLOTS]; tmp; tmp = tmp->next) {
+			if (((KfxmppIoLoopTimer *) tmp->data)->target <= tick)
+				goto found;
+		}
+	}
+	/* Everything expires on later turns, wake up after this one */
+	tick = loop->tick + TIMER_SLOTS;
+
+found:
+	deadline = loop->base + tick * TIMER_TICK;
+	if (deadline <= now)
+		return 0;
+	return MIN (deadline - now, G_MAXINT);
+}
+
+
+/**
+ * \brief Put a timer on the wheel, or in immediate queue
+ **/
+static void kfxmpp_io_loop_arm (KfxmppIoLoop *loop, KfxmppIoLoopTimer *h, gint64 now)
+{
+	gint slot;
+
+	if (h->ticks == 0) {
+		g_queue_push_tail (loop->immediate, h);
+		h->link = loop->immediate->tail;
+		return;
+	}
+
+	h->target = (now - loop->base) / TIMER_TICK + h->ticks;
+	if (h->target <= loop->tick)
+		h->target = loop->tick + 1;
+	slot = h->target % TIMER_SLOTS;
+	loop->wheel[slot] = g_list_prepend (loop->wheel[slot], h);
+	h->link = loop->wheel[slot];
+	loop->n_timers++;
+}
+
+
+/**
+ * \brief Take a timer off the wheel or immediate queue
+ **/
+static void kfxmpp_io_loop_disarm (KfxmppIoLoop *loop, KfxmppIoLoopTimer *h)
+{
+	gint slot;
+
+	if (h->link == NULL)
+		return;
+
+	if (h->ticks == 0) {
+		g_queue_delete_link (loop->immediate, h->link);
+	} else {
+		slot = h->target % TIMER_SLOTS;
+		loop->wheel[slot] = g_list_delete_link (loop->wheel[slot], h->link);
+		loop->n_timers--;
+	}
+	h->link = NULL;
+}
+
+
+/**
+ * \brief Call timers that have expired
+ * \return Number of timers called
+ *
+ * Timers re-armed by their callbacks are not called again in the same
+ * dispatch, even if their interval is 0.
+ **/
+static gint kfxmpp_io_loop_run_timers (KfxmppIoLoop *loop, gint64 now)
+{
+	GSList *expired = NULL;
+	GSList *tmp;
+	gint64 now_tick;
+	guint rounds;
+	gint n = 0;
+
+	rounds = loop->immediate->length;
+	while (rounds-- > 0) {
+		KfxmppIoLoopTimer *h = g_queue_pop_head (loop->immediate);
+
+		if (h == NULL)
+			break;
+		h->link = NULL;
+		n++;
+		if (kfxmpp_io_timer_dispatch (h->timer) && h->link == NULL)
+			kfxmpp_io_loop_arm (loop, h, now);
+	}
+
+	now_tick = (now - loop->base) / TIMER_TICK;
+	while (loop->tick < now_tick && loop->n_timers > 0) {
+		GList *link, *next;
+		gint slot;
+
+		slot = ++loop->tick % TIMER_SLOTS;
+		for (link = loop->wheel[slot]; link; link = next) {
+			KfxmppIoLoopTimer *h = link->data;
+
+			next = link->next;
+			if (h->target <= loop->tick) {
+				loop->wheel[slot] = g_list_delete_link (loop->wheel[slot], link);
+				h->link = NULL;
+				loop->n_timers--;
+				expired = g_slist_prepend (expired, h);
+			}
+		}
+	}
+	/* Nothing to do on skipped ticks */
+	loop->tick = MAX (loop->tick, now_tick);
+
+	expired = g_slist_reverse (expired);
+	for (tmp = expired; tmp; tmp = tmp->next) {
+		KfxmppIoLoopTimer *h = tmp->data;
+
+		/* Handles of removed timers stay in dead list until dispatch ends */
+		if (h->timer == NULL)
+			continue;
+		n++;
+		if (kfxmpp_io_timer_dispatch (h->timer) && h->link == NULL)
+			kfxmpp_io_loop_arm (loop, h, now);
+	}
+	g_slist_free (expired);
+
+	return n;
+}
+
+
+/**
+ * \brief Report conditions deferred by callbacks
+ * \return Number of watches dispatched
+ **/
+static gint kfxmpp_io_loop_run_ready (KfxmppIoLoop *loop)
+{
+	guint rounds;
+	gint n = 0;
+
+	/* Watches deferring again wait for next dispatch */
+	rounds = loop->ready->length;
+	while (rounds-- > 0) {
+		KfxmppIoLoopWatch *lw = g_queue_pop_head (loop->ready);
+		GIOCondition condition;
+
+		if (lw == NULL)
+			break;
+		condition = lw->pending;
+		lw->pending = 0;
+		lw->ready = NULL;
+		kfxmpp_io_watch_dispatch (lw->watch, condition);
+		n++;
+	}
+
+	return n;
+}
+
+
+static gpointer kfxmpp_io_loop_add_timer (gpointer backend_data, KfxmppIoTimer *timer, guint interval)
+{
+	KfxmppIoLoop *loop = backend_data;
+	KfxmppIoLoopTimer *h;
+
+	h = g_new0 (KfxmppIoLoopTimer, 1);
+	h->timer = timer;
+	h->ticks = (interval + TIMER_TICK - 1) / TIMER_TICK;
+	kfxmpp_io_loop_arm (loop, h, kfxmpp_io_loop_now ());
+
+	return h;
+}
+
+
+static void kfxmpp_io_loop_remove_timer (gpointer backend_data, gpointer handle)
+{
+	KfxmppIoLoop *loop = backend_data;
+	KfxmppIoLoopTimer *h = handle;
+
+	kfxmpp_io_loop_disarm (loop, h);
+	h->timer = NULL;
+	kfxmpp_io_loop_bury (loop, h);
+}
+
+
+/**
+ * \brief Get time of clock backends run their timers by
+ * \return Milliseconds of monotonic clock
+ *
+ * This is the clock of deadlines and of time passed to
+ * kfxmpp_io_backend_process. libuv's uv_now uses the same one.
+ **/
+gint64 kfxmpp_io_get_time (void)
+{
+	return kfxmpp_io_loop_now ();
+}
+
+
+
+/***********************************************************************
+ *
+ * Epoll backend
+ *
+ */
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/**
+ * \brief State of epoll backend
+ **/
+typedef struct {
+	KfxmppIoLoop loop;	/**< Shared loop state */
+	gint fd;		/**< Epoll instance */
+	gboolean edge;		/**< Whether descriptors are registered edge-triggered */
+} KfxmppIoEpoll;
+
+/**
+ * \brief Handle of a watch registered with epoll
+ *
+ * Handles are referenced by events returned from epoll_wait, so removed
+ * ones are kept until dispatch finishes.
+ **/
+typedef struct {
+	KfxmppIoLoopWatch base;	/**< Loop part */
+	gint fd;		/**< Watched descriptor */
+} KfxmppIoEpollHandle;
+
+static const KfxmppIoBackendFuncs epoll_funcs = {
+	kfxmpp_io_epoll_add,
+	kfxmpp_io_epoll_modify,
+	kfxmpp_io_epoll_remove,
+	kfxmpp_io_epoll_defer,
+	kfxmpp_io_loop_add_timer,
+	kfxmpp_io_loop_remove_timer,
+	NULL,
+	NULL
+};
+
+
+/**
+ * \brief Convert GIOCondition to epoll events
+ **/
+static guint32 kfxmpp_io_epoll_events (GIOCondition interest)
+{
+	guint32 events = 0;
+
+	if (interest & G_IO_IN)
+		events |= EPOLLIN;
+	if (interest & G_IO_PRI)
+		events |= EPOLLPRI;
+	if (interest & G_IO_OUT)
+		events |= EPOLLOUT;
+	return events;
+}
+
+
+/**
+ * \brief Convert epoll events to GIOCondition
+ **/
+static GIOCondition kfxmpp_io_epoll_condition (guint32 events)
+{
+	GIOCondition condition = 0;
+
+	if (events & EPOLLIN)
+		condition |= G_IO_IN;
+	if (events & EPOLLPRI)
+		condition |= G_IO_PRI;
+	if (events & EPOLLOUT)
+		condition |= G_IO_OUT;
+	if (events & EPOLLERR)
+		condition |= G_IO_ERR;
+	if (events & EPOLLHUP)
+		condition |= G_IO_HUP;
+	return condition;
+}
+#endif
+
+
+/**
+ * \brief Create a backend using epoll
+ * \return A new backend, or NULL if epoll is not available
+ *
+ * Backend is driven by calling kfxmpp_io_backend_dispatch, or by polling
+ * descriptor returned by kfxmpp_io_backend_get_fd for readability and
+ * dispatching with zero timeout then. Descriptors are level-triggered.
+ **/
+KfxmppIoBackend *kfxmpp_io_backend_new_epoll (void)
+{
+	return kfxmpp_io_backend_new_epoll_full (FALSE);
+}
+
+
+/**
+ * \brief Create a backend using epoll
+ * \param edge_triggered Whether to register descriptors edge-triggered
+ * \return A new backend, or NULL if epoll is not available
+ *
+ * Edge-triggered backend registers every descriptor once for both reading
+ * and writing, so changing interest costs no system call, and a wakeup
+ * reports only descriptors that got new data or buffer space. This is
+ * what makes thousands of mostly idle sessions cheap, see
+ * KfxmppSessionPool.
+ *
+ * Timers are kept in a hashed wheel with TIMER_TICK resolution, so adding
+ * and removing one costs the same no matter how many there are.
+ **/
+KfxmppIoBackend *kfxmpp_io_backend_new_epoll_full (gboolean edge_triggered)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	KfxmppIoEpoll *ep;
+	gint fd;
+
+	fd = epoll_create (EPOLL_MAX_EVENTS);
+	if (fd < 0)
+		return NULL;
+
+	ep = g_new0 (KfxmppIoEpoll, 1);
+	ep->fd = fd;
+	ep->edge = edge_triggered;
+	kfxmpp_io_loop_init (&ep->loop);
+
+	/* Loop itself stands for wakeup descriptor in events */
+	if (ep->loop.wake_read >= 0) {
+		struct epoll_event event;
+
+		event.events = EPOLLIN;
+		event.data.ptr = &ep->loop;
+		epoll_ctl (fd, EPOLL_CTL_ADD, ep->loop.wake_read, &event);
+	}
+
+	return kfxmpp_io_backend_new (&epoll_funcs, ep, kfxmpp_io_epoll_free);
+#else
+	return NULL;
+#endif
+}
+
+
+#ifdef HAVE_SYS_EPOLL_H
+static gint kfxmpp_io_epoll_dispatch (KfxmppIoBackend *self, gint timeout)
+{
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	KfxmppIoEpoll *ep = self->data;
+	gint wait, n, i;
+
+	wait = kfxmpp_io_loop_timeout (&ep->loop, kfxmpp_io_loop_now ());
+	if (wait >= 0 && (timeout < 0 || wait < timeout))
+		timeout = wait;
+
+	n = epoll_wait (ep->fd, events, EPOLL_MAX_EVENTS, timeout);
+	ep->loop.syscalls++;
+	if (n < 0) {
+		if (errno != EINTR)
+			return -1;
+		n = 0;
+	}
+
+	kfxmpp_io_backend_ref (self);
+	kfxmpp_io_loop_enter (&ep->loop);
+	for (i = 0; i < n; i++) {
+		KfxmppIoEpollHandle *h = events[i].data.ptr;
+
+		/* Wakeup is taken care of by kfxmpp_io_loop_run_calls */
+		if (events[i].data.ptr == &ep->loop)
+			continue;
+		kfxmpp_io_loop_report (&ep->loop, &h->base, kfxmpp_io_epoll_condition (events[i].events));
+	}
+	n += kfxmpp_io_loop_run_calls (&ep->loop);
+	n += kfxmpp_io_loop_run_ready (&ep->loop);
+	n += kfxmpp_io_loop_run_timers (&ep->loop, kfxmpp_io_loop_now ());
+	kfxmpp_io_loop_leave (&ep->loop);
+	kfxmpp_io_backend_unref (self);
+
+	return n;
+}
+
+
+static gpointer kfxmpp_io_epoll_add (gpointer backend_data, KfxmppIoWatch *watch, gint fd, GIOCondition interest)
+{
+	KfxmppIoEpoll *ep = backend_data;
+	KfxmppIoEpollHandle *h;
+	struct epoll_event event;
+
+	h = g_new0 (KfxmppIoEpollHandle, 1);
+	h->base.watch = watch;
+	h->fd = fd;
+
+	if (ep->edge)
+		event.events = EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLET;
+	else
+		event.events = kfxmpp_io_epoll_events (interest);
+	event.data.ptr = h;
+	ep->loop.syscalls++;
+	if (epoll_ctl (ep->fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		g_warning ("Cannot add descriptor %d to epoll: %s", fd, g_strerror (errno));
+
+	return h;
+}
+
+
+static void kfxmpp_io_epoll_modify (gpointer backend_data, gpointer handle, GIOCondition interest)
+{
+	KfxmppIoEpoll *ep = backend_data;
+	KfxmppIoEpollHandle *h = handle;
+	struct epoll_event event;
+
+	/* Edge-triggered descriptors are registered for everything,
+	 * kfxmpp_io_watch_dispatch filters out what is not interesting */
+	if (ep->edge)
+		return;
+
+	event.events = kfxmpp_io_epoll_events (interest);
+	event.data.ptr = h;
+	ep->loop.syscalls++;
+	epoll_ctl (ep->fd, EPOLL_CTL_MOD, h->fd, &event);
+}
+
+
+static void kfxmpp_io_epoll_remove (gpointer backend_data, gpointer handle)
+{
+	KfxmppIoEpoll *ep = backend_data;
+	KfxmppIoEpollHandle *h = handle;
+	struct epoll_event event;
+
+	/* Descriptor may be closed already, then kernel has forgotten it */
+	ep->loop.syscalls++;
+	epoll_ctl (ep->fd, EPOLL_CTL_DEL, h->fd, &event);
+	h->base.watch = NULL;
+	kfxmpp_io_loop_unready (&ep->loop, &h->base);
+	kfxmpp_io_loop_bury (&ep->loop, h);
+}
+
+
+static void kfxmpp_io_epoll_defer (gpointer backend_data, gpointer handle, GIOCondition condition)
+{
+	KfxmppIoEpoll *ep = backend_data;
+
+	/* Level-triggered epoll reports it again anyway */
+	if (ep->edge)
+		kfxmpp_io_loop_defer (&ep->loop, handle, condition);
+}
+
+
+static void kfxmpp_io_epoll_free (gpointer backend_data)
+{
+	KfxmppIoEpoll *ep = backend_data;
+
+	close (ep->fd);
+	kfxmpp_io_loop_clear (&ep->loop);
+	g_free (ep);
+}
+#endif
+
+
+
+/***********************************************************************
+ *
+ * io_uring backend
+ *
+ */
+
+#ifdef HAVE_IO_URING
+
+/**
+ * \brief Kinds of operations submitted to io_uring
+ **/
+enum {
+	URING_OP_POLL,		/**< Multishot readiness poll */
+	URING_OP_RECV,		/**< Multishot receive into provided buffers */
+	URING_OP_SEND		/**< Send of a single segment */
+};
+
+typedef struct _KfxmppIoUringHandle KfxmppIoUringHandle;
+
+/**
+ * \brief An operation submitted to io_uring
+ *
+ * Its address is user data of the submission, so that completions find
+ * it. It is freed with its last completion.
+ **/
+typedef struct {
+	gint kind;			/**< One of URING_OP_* */
+	KfxmppIoUringHandle *handle;	/**< Handle it was submitted for */
+	guint32 events;			/**< Polled events */
+	GString *data;			/**< Segment being sent */
+	gboolean cancelled;		/**< Whether its cancellation was submitted */
+} KfxmppIoUringOp;
+
+/**
+ * \brief Handle of a watch registered with io_uring
+ *
+ * Operations in flight point to it, so removed handles are kept until
+ * the last of them completes. Segments queued before removal are still
+ * written, on a duplicate of descriptor owner may close meanwhile.
+ **/
+struct _KfxmppIoUringHandle {
+	KfxmppIoLoopWatch base;	/**< Loop part */
+	gint fd;		/**< Watched descriptor */
+	gboolean owns_fd;	/**< Whether \b fd is a duplicate closed with handle */
+	GIOCondition interest;	/**< Conditions watch is interested in */
+	gboolean receiving;	/**< Whether backend receives data for watch */
+	KfxmppIoUringOp *poll;	/**< Armed poll, NULL if none */
+	KfxmppIoUringOp *recv;	/**< Armed receive, NULL if none */
+	GQueue *outgoing;	/**< Segments not submitted yet */
+	gboolean queued;	/**< Whether handle is in backend's send queue */
+	guint sending;		/**< Number of sends in flight */
+	guint ops;		/**< Number of operations in flight */
+	gboolean removed;	/**< Whether watch was removed */
+};
+
+/**
+ * \brief State of io_uring backend
+ **/
+typedef struct {
+	KfxmppIoLoop loop;		/**< Shared loop state */
+	gint fd;			/**< Ring */
+	gchar *ring;			/**< Mapped submission and completion rings */
+	gsize ring_size;		/**< Size of \b ring */
+	struct io_uring_sqe *sqes;	/**< Mapped submission entries */
+	gsize sqes_size;		/**< Size of \b sqes */
+	guint *sq_head;			/**< Head of submission ring, moved by kernel */
+	guint *sq_tail;			/**< Tail of submission ring, as kernel sees it */
+	guint *sq_array;		/**< Submission ring */
+	guint sq_mask;			/**< Mask of submission ring index */
+	guint sq_entries;		/**< Size of submission ring */
+	guint sq_filled;		/**< Tail of submission ring, including entries not submitted yet */
+	guint *cq_head;			/**< Head of completion ring, moved by us */
+	guint *cq_tail;			/**< Tail of completion ring, moved by kernel */
+	guint cq_mask;			/**< Mask of completion ring index */
+	struct io_uring_cqe *cqes;	/**< Completion ring */
+	struct io_uring_buf_ring *buf_ring;	/**< Ring of receive buffers kernel picks from */
+	gsize buf_ring_size;		/**< Size of \b buf_ring */
+	guint16 buf_tail;		/**< Tail of \b buf_ring */
+	gchar *buffers;			/**< Receive buffers */
+	GQueue *sending;		/**< Handles with segments to submit */
+	guint n_ops;			/**< Number of operations in flight */
+} KfxmppIoUring;
+
+static const KfxmppIoBackendFuncs uring_funcs = {
+	kfxmpp_io_uring_add,
+	kfxmpp_io_uring_modify,
+	kfxmpp_io_uring_remove,
+	kfxmpp_io_loop_defer,
+	kfxmpp_io_loop_add_timer,
+	kfxmpp_io_loop_remove_timer,
+	kfxmpp_io_uring_set_recv,
+	kfxmpp_io_uring_send
+};
+
+
+/**
+ * \brief Submit entries filled so far, and wait for completions
+ * \param wait Number of completions to wait for
+ * \param timeout Maximum time to wait, in milliseconds, -1 waits forever
+ * \return -1 on error
+ **/
+static gint kfxmpp_io_uring_enter (KfxmppIoUring *u, guint wait, gint timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	guint submit, flags = 0;
+	gint ret;
+
+	/* Entries left by a failed call are submitted again */
+	submit = u->sq_filled - __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE);
+	if (submit == 0 && wait == 0)
+		return 0;
+	__atomic_store_n (u->sq_tail, u->sq_filled, __ATOMIC_RELEASE);
+
+	memset (&arg, 0, sizeof (arg));
+	if (wait > 0) {
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+			arg.ts = (guint64) (gsize) &ts;
+		}
+	}
+
+	ret = syscall (__NR_io_uring_enter, u->fd, submit, wait, flags,
+			wait > 0 ? &arg : NULL, wait > 0 ? sizeof (arg) : 0);
+	u->loop.syscalls++;
+	if (ret < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		return -1;
+	return 0;
+}
+
+
+/**
+ * \brief Take next completion off the ring
+ * \return FALSE if there is none
+ **/
+static gboolean kfxmpp_io_uring_next (KfxmppIoUring *u, struct io_uring_cqe *cqe)
+{
+	guint head = *u->cq_head;
+
+	if (head == __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE))
+		return FALSE;
+
+	*cqe = u->cqes[head & u->cq_mask];
+	__atomic_store_n (u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return TRUE;
+}
+
+
+/**
+ * \brief Get next submission entry, submitting the ring first if it has
+ * 	less than \b room of them free
+ **/
+static struct io_uring_sqe *kfxmpp_io_uring_get_sqe (KfxmppIoUring *u, guint room)
+{
+	struct io_uring_sqe *sqe;
+	guint index;
+
+	if (u->sq_filled + room - __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE) > u->sq_entries)
+		kfxmpp_io_uring_enter (u, 0, 0);
+
+	index = u->sq_filled++ & u->sq_mask;
+	sqe = &u->sqes[index];
+	memset (sqe, 0, sizeof (*sqe));
+	u->sq_array[index] = index;
+
+	return sqe;
+}
+
+
+/**
+ * \brief Poll wakeup descriptor, completions carry address of the loop
+ **/
+static void kfxmpp_io_uring_arm_wakeup (KfxmppIoUring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	if (u->loop.wake_read < 0)
+		return;
+
+	sqe = kfxmpp_io_uring_get_sqe (u, 1);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = u->loop.wake_read;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (guint64) (gsize) &u->loop;
+}
+
+
+/**
+ * \brief Give a receive buffer back to kernel
+ **/
+static void kfxmpp_io_uring_recycle (KfxmppIoUring *u, guint16 bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &u->buf_ring->bufs[u->buf_tail & (URING_BUFFERS - 1)];
+	buf->addr = (guint64) (gsize) (u->buffers + (gsize) bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	__atomic_store_n (&u->buf_ring->tail, ++u->buf_tail, __ATOMIC_RELEASE);
+}
+
+
+static void kfxmpp_io_uring_prep_recv (struct io_uring_sqe *sqe, gint fd, gpointer user_data)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = (guint64) (gsize) user_data;
+}
+
+
+static void kfxmpp_io_uring_prep_cancel (struct io_uring_sqe *sqe, gpointer target, gpointer user_data)
+{
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (guint64) (gsize) target;
+	sqe->user_data = (guint64) (gsize) user_data;
+}
+
+
+/**
+ * \brief Check that kernel receives into provided buffers repeatedly
+ *
+ * Older kernels set up the ring and register buffers fine, but reject
+ * multishot receive or finish it after the first buffer.
+ **/
+static gboolean kfxmpp_io_uring_probe (KfxmppIoUring *u)
+{
+	struct io_uring_cqe cqe;
+	gboolean multishot = FALSE;
+	gboolean recv_done = FALSE;
+	gboolean cancel_done = FALSE;
+	gboolean sent;
+	gint fds[2];
+	gint tries;
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return FALSE;
+
+	kfxmpp_io_uring_prep_recv (kfxmpp_io_uring_get_sqe (u, 1), fds[0], GINT_TO_POINTER (1));
+	kfxmpp_io_uring_enter (u, 0, 0);
+	/* Receive is cancelled below either way */
+	sent = write (fds[1], "x", 1) == 1;
+	kfxmpp_io_uring_enter (u, 1, sent ? 1000 : 0);
+
+	for (tries = 0; tries < 10 && ! (recv_done && cancel_done); tries++) {
+		while (kfxmpp_io_uring_next (u, &cqe)) {
+			if (cqe.flags & IORING_CQE_F_BUFFER)
+				kfxmpp_io_uring_recycle (u, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			if (cqe.user_data == 2) {
+				cancel_done = TRUE;
+			} else if (cqe.user_data == 1) {
+				if (cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE))
+					multishot = TRUE;
+				if (! (cqe.flags & IORING_CQE_F_MORE))
+					recv_done = TRUE;
+			}
+		}
+		if (tries == 0)
+			kfxmpp_io_uring_prep_cancel (kfxmpp_io_uring_get_sqe (u, 1),
+					GINT_TO_POINTER (1), GINT_TO_POINTER (2));
+		kfxmpp_io_uring_enter (u, 1, 100);
+	}
+
+	close (fds[0]);
+	close (fds[1]);
+
+	return sent && multishot && recv_done && cancel_done;
+}
+
+
+/**
+ * \brief Free backend state, with operations in flight finished
+ **/
+static void kfxmpp_io_uring_close (KfxmppIoUring *u)
+{
+	if (u->buf_ring)
+		munmap (u->buf_ring, u->buf_ring_size);
+	if (u->sqes)
+		munmap (u->sqes, u->sqes_size);
+	if (u->ring)
+		munmap (u->ring, u->ring_size);
+	close (u->fd);
+	g_free (u->buffers);
+	g_queue_free (u->sending);
+	kfxmpp_io_loop_clear (&u->loop);
+	g_free (u);
+}
+
+
+/**
+ * \brief Set up a ring with receive buffers
+ * \return Backend state, or NULL if kernel lacks anything needed
+ **/
+static KfxmppIoUring *kfxmpp_io_uring_open (void)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	KfxmppIoUring *u;
+	gsize sq_size, cq_size;
+	guint needed;
+	gint fd;
+	guint i;
+
+	memset (&params, 0, sizeof (params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+
+	/* Fails with ENOSYS on old kernels, with EPERM where it is disabled */
+	fd = syscall (__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (fd < 0)
+		return NULL;
+
+	u = g_new0 (KfxmppIoUring, 1);
+	u->fd = fd;
+	u->sending = g_queue_new ();
+	kfxmpp_io_loop_init (&u->loop);
+
+	/* Waiting with timeout, and completions not lost when ring overflows */
+	needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if ((params.features & needed) != needed)
+		goto fail;
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof (guint);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+	u->ring_size = MAX (sq_size, cq_size);
+	u->ring = mmap (NULL, u->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED) {
+		u->ring = NULL;
+		goto fail;
+	}
+	u->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+	u->sqes = mmap (NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto fail;
+	}
+
+	u->sq_head = (guint *) (u->ring + params.sq_off.head);
+	u->sq_tail = (guint *) (u->ring + params.sq_off.tail);
+	u->sq_array = (guint *) (u->ring + params.sq_off.array);
+	u->sq_mask = *(guint *) (u->ring + params.sq_off.ring_mask);
+	u->sq_entries = params.sq_entries;
+	u->sq_filled = *u->sq_tail;
+	u->cq_head = (guint *) (u->ring + params.cq_off.head);
+	u->cq_tail = (guint *) (u->ring + params.cq_off.tail);
+	u->cq_mask = *(guint *) (u->ring + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (u->ring + params.cq_off.cqes);
+
+	/* Receive buffers, shared by every watch */
+	u->buf_ring_size = URING_BUFFERS * sizeof (struct io_uring_buf);
+	u->buf_ring = mmap (NULL, u->buf_ring_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->buf_ring == MAP_FAILED) {
+		u->buf_ring = NULL;
+		goto fail;
+	}
+	memset (&reg, 0, sizeof (reg));
+	reg.ring_addr = (guint64) (gsize) u->buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (syscall (__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+
+	u->buffers = g_malloc ((gsize) URING_BUFFERS * URING_BUFFER_SIZE);
+	for (i = 0; i < URING_BUFFERS; i++)
+		kfxmpp_io_uring_recycle (u, i);
+
+	if (! kfxmpp_io_uring_probe (u))
+		goto fail;
+	kfxmpp_io_uring_arm_wakeup (u);
+
+	return u;
+
+fail:
+	kfxmpp_io_uring_close (u);
+	return NULL;
+}
+
+
+/**
+ * \brief Convert GIOCondition to poll events
+ **/
+static guint32 kfxmpp_io_uring_events (GIOCondition interest)
+{
+	guint32 events = 0;
+
+	if (interest & G_IO_IN)
+		events |= POLLIN;
+	if (interest & G_IO_PRI)
+		events |= POLLPRI;
+	if (interest & G_IO_OUT)
+		events |= POLLOUT;
+	return events;
+}
+
+
+/**
+ * \brief Convert poll events to GIOCondition
+ **/
+static GIOCondition kfxmpp_io_uring_condition (guint32 events)
+{
+	GIOCondition condition = 0;
+
+	if (events & POLLIN)
+		condition |= G_IO_IN;
+	if (events & POLLPRI)
+		condition |= G_IO_PRI;
+	if (events & POLLOUT)
+		condition |= G_IO_OUT;
+	if (events & POLLERR)
+		condition |= G_IO_ERR;
+	if (events & POLLHUP)
+		condition |= G_IO_HUP;
+	if (events & POLLNVAL)
+		condition |= G_IO_NVAL;
+	return condition;
+}
+
+
+static KfxmppIoUringOp *kfxmpp_io_uring_op_new (KfxmppIoUring *u, KfxmppIoUringHandle *h, gint kind)
+{
+	KfxmppIoUringOp *op;
+
+	op = g_new0 (KfxmppIoUringOp, 1);
+	op->kind = kind;
+	op->handle = h;
+	h->ops++;
+	u->n_ops++;
+
+	return op;
+}
+
+
+static void kfxmpp_io_uring_handle_free (KfxmppIoUringHandle *h)
+{
+	GString *segment;
+
+	while ((segment = g_queue_pop_head (h->outgoing)) != NULL)
+		g_string_free (segment, TRUE);
+	g_queue_free (h->outgoing);
+	if (h->owns_fd)
+		close (h->fd);
+	g_free (h);
+}
+
+
+/**
+ * \brief Free a finished operation, and its handle if it was the last one
+ **/
+static void kfxmpp_io_uring_op_free (KfxmppIoUring *u, KfxmppIoUringOp *op)
+{
+	KfxmppIoUringHandle *h = op->handle;
+
+	if (op->data)
+		g_string_free (op->data, TRUE);
+	g_free (op);
+	u->n_ops--;
+
+	/* Handle waiting to submit more segments is still needed */
+	if (--h->ops == 0 && h->removed && ! h->queued)
+		kfxmpp_io_uring_handle_free (h);
+}
+
+
+/**
+ * \brief Ask kernel to finish an operation early
+ *
+ * Its completions are ignored from now on, except for the last one.
+ **/
+static void kfxmpp_io_uring_cancel (KfxmppIoUring *u, KfxmppIoUringOp *op)
+{
+	kfxmpp_io_uring_prep_cancel (kfxmpp_io_uring_get_sqe (u, 1), op, NULL);
+	op->cancelled = TRUE;
+}
+
+
+/**
+ * \brief Poll descriptor for conditions watch is interested in
+ *
+ * Poll is multishot, so it keeps reporting every wakeup of the descriptor
+ * until cancelled, much like edge-triggered epoll.
+ **/
+static void kfxmpp_io_uring_arm_poll (KfxmppIoUring *u, KfxmppIoUringHandle *h)
+{
+	struct io_uring_sqe *sqe;
+	KfxmppIoUringOp *op;
+	guint32 events;
+
+	events = kfxmpp_io_uring_events (h->interest);
+	if (h->poll) {
+		if (h->poll->events == events)
+			return;
+		kfxmpp_io_uring_cancel (u, h->poll);
+		h->poll = NULL;
+	}
+
+	op = kfxmpp_io_uring_op_new (u, h, URING_OP_POLL);
+	op->events = events;
+
+	sqe = kfxmpp_io_uring_get_sqe (u, 1);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = h->fd;
+	sqe->poll32_events = events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (guint64) (gsize) op;
+	h->poll = op;
+}
+
+
+/**
+ * \brief Receive data for watch, into buffers kernel picks as it arrives
+ **/
+static void kfxmpp_io_uring_arm_recv (KfxmppIoUring *u, KfxmppIoUringHandle *h)
+{
+	KfxmppIoUringOp *op;
+
+	op = kfxmpp_io_uring_op_new (u, h, URING_OP_RECV);
+	kfxmpp_io_uring_prep_recv (kfxmpp_io_uring_get_sqe (u, 1), h->fd, op);
+	h->recv = op;
+}
+
+
+/**
+ * \brief Submit next chain of queued segments of a watch
+ **/
+static void kfxmpp_io_uring_submit_chain (KfxmppIoUring *u, KfxmppIoUringHandle *h)
+{
+	guint n, i;
+
+	n = MIN (h->outgoing->length, URING_MAX_CHAIN);
+	for (i = 0; i < n; i++) {
+		struct io_uring_sqe *sqe;
+		KfxmppIoUringOp *op;
+
+		/* Whole chain has to go in one submission */
+		sqe = kfxmpp_io_uring_get_sqe (u, i == 0 ? n : 1);
+		op = kfxmpp_io_uring_op_new (u, h, URING_OP_SEND);
+		op->data = g_queue_pop_head (h->outgoing);
+
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = h->fd;
+		sqe->addr = (guint64) (gsize) op->data->str;
+		sqe->len = op->data->len;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		if (i + 1 < n)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = (guint64) (gsize) op;
+		h->sending++;
+	}
+}
+
+
+/**
+ * \brief Submit queued segments of every watch
+ *
+ * Segments of a watch are linked, so that kernel writes them in order,
+ * and a watch has one chain in flight at most, so that a failed write
+ * cannot let a later one overtake it.
+ **/
+static void kfxmpp_io_uring_submit_sends (KfxmppIoUring *u)
+{
+	KfxmppIoUringHandle *h;
+
+	while ((h = g_queue_pop_head (u->sending)) != NULL) {
+		h->queued = FALSE;
+		kfxmpp_io_uring_submit_chain (u, h);
+	}
+}
+
+
+/**
+ * \brief Handle a completion
+ * \return Number of callbacks called
+ **/
+static gint kfxmpp_io_uring_complete (KfxmppIoUring *u, struct io_uring_cqe *cqe)
+{
+	KfxmppIoUringOp *op = (KfxmppIoUringOp *) (gsize) cqe->user_data;
+	KfxmppIoUringHandle *h;
+	gboolean more;
+	gsize size;
+	gint n = 0;
+
+	/* Cancellations themselves report nothing worth knowing */
+	if (op == NULL)
+		return 0;
+
+	/* Wakeup is taken care of by kfxmpp_io_loop_run_calls */
+	if ((gpointer) op == (gpointer) &u->loop) {
+		if (! (cqe->flags & IORING_CQE_F_MORE) && cqe->res >= 0)
+			kfxmpp_io_uring_arm_wakeup (u);
+		return 0;
+	}
+
+	h = op->handle;
+	more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+	switch (op->kind) {
+	case URING_OP_POLL:
+		if (! op->cancelled && h->base.watch) {
+			kfxmpp_io_loop_report (&u->loop, &h->base, cqe->res >= 0 ?
+					kfxmpp_io_uring_condition (cqe->res) : G_IO_ERR);
+			n++;
+		}
+		if (! more && h->poll == op) {
+			/* Kernel stopped polling on its own, start again unless it failed */
+			h->poll = NULL;
+			if (! h->removed && ! h->receiving && cqe->res >= 0)
+				kfxmpp_io_uring_arm_poll (u, h);
+		}
+		break;
+
+	case URING_OP_RECV:
+		if (h->base.watch == NULL || (op->cancelled && cqe->res <= 0)) {
+			if (cqe->res > 0 && ! h->removed)
+				g_warning ("Dropping %d bytes received on descriptor %d", cqe->res, h->fd);
+		} else if (cqe->res != -ENOBUFS) {
+			/* Data is off the socket even if receiving was cancelled meanwhile */
+			kfxmpp_io_watch_received (h->base.watch, (cqe->flags & IORING_CQE_F_BUFFER) ?
+					u->buffers + (gsize) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFFER_SIZE :
+					NULL, cqe->res);
+			n++;
+		}
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+			kfxmpp_io_uring_recycle (u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		if (! more && h->recv == op) {
+			/* Buffers ran out, or kernel stopped on its own. End of
+			 * stream and errors are final. */
+			h->recv = NULL;
+			if (! h->removed && h->receiving && (cqe->res > 0 || cqe->res == -ENOBUFS))
+				kfxmpp_io_uring_arm_recv (u, h);
+		}
+		break;
+
+	case URING_OP_SEND:
+		size = op->data->len;
+		h->sending--;
+		if (h->base.watch) {
+			kfxmpp_io_watch_sent (h->base.watch, size, cqe->res != (gint) size);
+			n++;
+		} else if (cqe->res != (gint) size) {
+			/* Nobody learns about it, rest of stream is pointless */
+			while (h->outgoing->length > 0)
+				g_string_free (g_queue_pop_head (h->outgoing), TRUE);
+		}
+		/* Removed watch still writes what it had queued */
+		if (h->sending == 0 && ! h->queued && h->outgoing->length > 0) {
+			g_queue_push_tail (u->sending, h);
+			h->queued = TRUE;
+		}
+		break;
+	}
+
+	if (! more)
+		kfxmpp_io_uring_op_free (u, op);
+
+	return n;
+}
+
+
+/**
+ * \brief Handle every completion on the ring
+ * \return Number of callbacks called
+ **/
+static gint kfxmpp_io_uring_reap (KfxmppIoUring *u)
+{
+	struct io_uring_cqe cqe;
+	gint n = 0;
+
+	while (kfxmpp_io_uring_next (u, &cqe))
+		n += kfxmpp_io_uring_complete (u, &cqe);
+
+	return n;
+}
+
+
+/**
+ * \brief Check whether there is anything to submit
+ **/
+static gboolean kfxmpp_io_uring_has_work (KfxmppIoUring *u)
+{
+	return u->sending->length > 0 ||
+		u->sq_filled != __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE) ||
+		*u->cq_head != __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE);
+}
+#endif
+
+
+/**
+ * \brief Create a backend using io_uring
+ * \return A new backend, or NULL if kernel does not support what it needs
+ *
+ * It is driven like epoll backend, and reports readiness through
+ * multishot polls with the same edge-triggered rules. Its watches can
+ * also be switched to completion I/O with kfxmpp_io_watch_set_recv_func:
+ * kernel then receives into a ring of buffers shared by every watch and
+ * hands them to callback without any system call per read, and segments
+ * passed to kfxmpp_io_watch_send are written by linked submissions.
+ * Everything callbacks ask for during a dispatch is submitted by a
+ * single system call, which also waits for next completions.
+ *
+ * Support is checked at run time, by a multishot receive on a socket
+ * pair. Kernels older than 6.0, or ones where io_uring is disabled, get
+ * NULL, and callers fall back to epoll.
+ **/
+KfxmppIoBackend *kfxmpp_io_backend_new_uring (void)
+{
+#ifdef HAVE_IO_URING
+	KfxmppIoUring *u;
+
+	u = kfxmpp_io_uring_open ();
+	if (u == NULL)
+		return NULL;
+
+	return kfxmpp_io_backend_new (&uring_funcs, u, kfxmpp_io_uring_free);
+#else
+	return NULL;
+#endif
+}
+
+
+#ifdef HAVE_IO_URING
+static gint kfxmpp_io_uring_dispatch (KfxmppIoBackend *self, gint timeout)
+{
+	KfxmppIoUring *u = self->data;
+	gint wait, n;
+
+	kfxmpp_io_uring_submit_sends (u);
+
+	wait = kfxmpp_io_loop_timeout (&u->loop, kfxmpp_io_loop_now ());
+	if (wait >= 0 && (timeout < 0 || wait < timeout))
+		timeout = wait;
+	if (*u->cq_head != __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE))
+		timeout = 0;
+
+	/* What last dispatch asked for is submitted by the call that waits */
+	if (kfxmpp_io_uring_enter (u, timeout != 0 ? 1 : 0, timeout) < 0)
+		return -1;
+
+	kfxmpp_io_backend_ref (self);
+	kfxmpp_io_loop_enter (&u->loop);
+	n = kfxmpp_io_uring_reap (u);
+	n += kfxmpp_io_loop_run_calls (&u->loop);
+	n += kfxmpp_io_loop_run_ready (&u->loop);
+	n += kfxmpp_io_loop_run_timers (&u->loop, kfxmpp_io_loop_now ());
+	kfxmpp_io_loop_leave (&u->loop);
+	kfxmpp_io_backend_unref (self);
+
+	return n;
+}
+
+
+static gpointer kfxmpp_io_uring_add (gpointer backend_data, KfxmppIoWatch *watch, gint fd, GIOCondition interest)
+{
+	KfxmppIoUringHandle *h;
+
+	h = g_new0 (KfxmppIoUringHandle, 1);
+	h->base.watch = watch;
+	h->fd = fd;
+	h->interest = interest;
+	h->outgoing = g_queue_new ();
+	kfxmpp_io_uring_arm_poll (backend_data, h);
+
+	return h;
+}
+
+
+static void kfxmpp_io_uring_modify (gpointer backend_data, gpointer handle, GIOCondition interest)
+{
+	KfxmppIoUringHandle *h = handle;
+
+	h->interest = interest;
+	/* Receiving watches learn about finished writes from completions */
+	if (! h->receiving)
+		kfxmpp_io_uring_arm_poll (backend_data, h);
+}
+
+
+static void kfxmpp_io_uring_remove (gpointer backend_data, gpointer handle)
+{
+	KfxmppIoUring *u = backend_data;
+	KfxmppIoUringHandle *h = handle;
+
+	h->base.watch = NULL;
+	h->removed = TRUE;
+	kfxmpp_io_loop_unready (&u->loop, &h->base);
+	if (h->queued) {
+		g_queue_remove (u->sending, h);
+		h->queued = FALSE;
+	}
+
+	/* Queued segments may carry the end of stream. They are written
+	 * after sends in flight, on a descriptor that stays open even if
+	 * owner closes its own right after this */
+	if (h->outgoing->length > 0) {
+		h->fd = dup (h->fd);
+		h->owns_fd = h->fd >= 0;
+		if (! h->owns_fd) {
+			g_warning ("Dropping output of removed watch: %s", g_strerror (errno));
+			while (h->outgoing->length > 0)
+				g_string_free (g_queue_pop_head (h->outgoing), TRUE);
+		} else if (h->sending == 0) {
+			kfxmpp_io_uring_submit_chain (u, h);
+		}
+	}
+
+	/* Sends in flight are left alone, kernel holds their descriptor */
+	if (h->poll) {
+		kfxmpp_io_uring_cancel (u, h->poll);
+		h->poll = NULL;
+	}
+	if (h->recv) {
+		kfxmpp_io_uring_cancel (u, h->recv);
+		h->recv = NULL;
+	}
+
+	if (h->ops == 0)
+		kfxmpp_io_uring_handle_free (h);
+	else if (u->loop.dispatching == 0)
+		/* Operations keep socket open until they are cancelled */
+		kfxmpp_io_uring_enter (u, 0, 0);
+}
+
+
+static gboolean kfxmpp_io_uring_set_recv (gpointer backend_data, gpointer handle, gboolean enable)
+{
+	KfxmppIoUring *u = backend_data;
+	KfxmppIoUringHandle *h = handle;
+
+	if (h->receiving == enable)
+		return TRUE;
+
+	h->receiving = enable;
+	if (enable) {
+		if (h->poll) {
+			kfxmpp_io_uring_cancel (u, h->poll);
+			h->poll = NULL;
+		}
+		kfxmpp_io_uring_arm_recv (u, h);
+	} else {
+		if (h->recv) {
+			kfxmpp_io_uring_cancel (u, h->recv);
+			h->recv = NULL;
+		}
+		kfxmpp_io_uring_arm_poll (u, h);
+	}
+
+	return TRUE;
+}
+
+
+static void kfxmpp_io_uring_send (gpointer backend_data, gpointer handle, GString *data)
+{
+	KfxmppIoUring *u = backend_data;
+	KfxmppIoUringHandle *h = handle;
+
+	g_queue_push_tail (h->outgoing, data);
+	if (! h->queued && h->sending == 0) {
+		g_queue_push_tail (u->sending, h);
+		h->queued = TRUE;
+	}
+}
+
+
+static void kfxmpp_io_uring_free (gpointer backend_data)
+{
+	KfxmppIoUring *u = backend_data;
+	gint tries;
+
+	/* Watches hold references, so what is left are operations being
+	 * cancelled and sends of removed watches */
+	kfxmpp_io_uring_enter (u, 0, 0);
+	for (tries = 0; (u->n_ops > 0 || u->sending->length > 0) && tries < 10; tries++) {
+		kfxmpp_io_uring_submit_sends (u);
+		kfxmpp_io_uring_enter (u, 1, 100);
+		kfxmpp_io_uring_reap (u);
+	}
+	if (u->n_ops > 0)
+		g_warning ("%u io_uring operations did not finish", u->n_ops);
+
+	kfxmpp_io_uring_close (u);
+}
+#endif
+
+
+
+/***********************************************************************
+ *
+ * External backend
+ *
+ */
+
+/**
+ * \brief State of a backend driven by application's own loop
+ **/
+typedef struct {
+	KfxmppIoLoop loop;		/**< Shared loop state */
+	KfxmppIoBackend *backend;	/**< Backend this is data of, not referenced */
+	KfxmppIoUpdateFunc update;	/**< Called when descriptors, interest or deadline change */
+	gpointer update_data;		/**< Data passed to \b update */
+} KfxmppIoExternal;
+
+static const KfxmppIoBackendFuncs external_funcs = {
+	kfxmpp_io_external_add,
+	kfxmpp_io_external_modify,
+	kfxmpp_io_external_remove,
+	kfxmpp_io_external_defer,
+	kfxmpp_io_external_add_timer,
+	kfxmpp_io_loop_remove_timer,
+	NULL,
+	NULL
+};
+
+
+/**
+ * \brief Create a backend driven by application's own event loop
+ * \param update Function called when a watch is added, changed or
+ * 	removed, or when a timer may expire earlier than before (may be NULL)
+ * \param data Data passed to \b update
+ * \return A new backend
+ *
+ * Backend polls nothing itself. Application registers descriptors of
+ * watches with its epoll or libuv loop, interested in what
+ * kfxmpp_io_watch_get_interest says, and wakes up no later than
+ * kfxmpp_io_backend_get_deadline, or when descriptor returned by
+ * kfxmpp_io_backend_get_wakeup_fd becomes readable. Whatever it finds is
+ * passed to kfxmpp_io_backend_process, which runs callbacks right away.
+ * No GLib main loop is involved.
+ *
+ * \b update is not called while kfxmpp_io_backend_process runs, as
+ * application reads everything again after it returns anyway.
+ **/
+KfxmppIoBackend *kfxmpp_io_backend_new_external (KfxmppIoUpdateFunc update, gpointer data)
+{
+	KfxmppIoExternal *ext;
+
+	ext = g_new0 (KfxmppIoExternal, 1);
+	ext->update = update;
+	ext->update_data = data;
+	kfxmpp_io_loop_init (&ext->loop);
+	ext->backend = kfxmpp_io_backend_new (&external_funcs, ext, kfxmpp_io_external_free);
+
+	return ext->backend;
+}
+
+
+/**
+ * \brief Tell application its registrations may be stale
+ **/
+static void kfxmpp_io_external_changed (KfxmppIoExternal *ext)
+{
+	if (ext->update && ext->loop.dispatching == 0)
+		ext->update (ext->backend, ext->update_data);
+}
+
+
+static gpointer kfxmpp_io_external_add (gpointer backend_data, KfxmppIoWatch *watch, gint fd, GIOCondition interest)
+{
+	KfxmppIoLoopWatch *lw;
+
+	lw = g_new0 (KfxmppIoLoopWatch, 1);
+	lw->watch = watch;
+	kfxmpp_io_external_changed (backend_data);
+
+	return lw;
+}
+
+
+static void kfxmpp_io_external_modify (gpointer backend_data, gpointer handle, GIOCondition interest)
+{
+	kfxmpp_io_external_changed (backend_data);
+}
+
+
+static void kfxmpp_io_external_remove (gpointer backend_data, gpointer handle)
+{
+	KfxmppIoExternal *ext = backend_data;
+	KfxmppIoLoopWatch *lw = handle;
+
+	lw->watch = NULL;
+	kfxmpp_io_loop_unready (&ext->loop, lw);
+	kfxmpp_io_loop_bury (&ext->loop, lw);
+	kfxmpp_io_external_changed (ext);
+}
+
+
+static void kfxmpp_io_external_defer (gpointer backend_data, gpointer handle, GIOCondition condition)
+{
+	KfxmppIoExternal *ext = backend_data;
+
+	kfxmpp_io_loop_defer (&ext->loop, handle, condition);
+	kfxmpp_io_external_changed (ext);
+}
+
+
+static gpointer kfxmpp_io_external_add_timer (gpointer backend_data, KfxmppIoTimer *timer, guint interval)
+{
+	gpointer handle;
+
+	handle = kfxmpp_io_loop_add_timer (backend_data, timer, interval);
+	kfxmpp_io_external_changed (backend_data);
+
+	return handle;
+}
+
+
+static void kfxmpp_io_external_free (gpointer backend_data)
+{
+	KfxmppIoExternal *ext = backend_data;
+
+	kfxmpp_io_loop_clear (&ext->loop);
+	g_free (ext);
+}
+
+
+/**
+ * \brief Handle readiness found by application and expired timers
+ * \param self An external backend
+ * \param watch A watch whose descriptor is ready (may be NULL)
+ * \param revents Conditions that hold for \b watch
+ * \param now Current time, see kfxmpp_io_get_time
+ * \return Number of callbacks called
+ *
+ * Deferred conditions are reported after \b revents, timers are run last.
+ * Calling this with no watch just runs what is due.
+ **/
+gint kfxmpp_io_backend_process (KfxmppIoBackend *self, KfxmppIoWatch *watch, GIOCondition revents, gint64 now)
+{
+	KfxmppIoExternal *ext;
+	gint n = 0;
+
+	g_return_val_if_fail (self, -1);
+	g_return_val_if_fail (self->funcs == &external_funcs, -1);
+	g_return_val_if_fail (watch == NULL || watch->backend == self, -1);
+
+	ext = self->data;
+	kfxmpp_io_backend_claim (self);
+	kfxmpp_io_backend_ref (self);
+	kfxmpp_io_loop_enter (&ext->loop);
+	if (watch && revents && ! watch->removed) {
+		kfxmpp_io_loop_report (&ext->loop, watch->handle, revents);
+		n++;
+	}
+	n += kfxmpp_io_loop_run_calls (&ext->loop);
+	n += kfxmpp_io_loop_run_ready (&ext->loop);
+	n += kfxmpp_io_loop_run_timers (&ext->loop, now);
+	kfxmpp_io_loop_leave (&ext->loop);
+	kfxmpp_io_backend_unref (self);
+
+	return n;
+}
+
+
+
+/***********************************************************************
+ *
+ * Driving epoll, io_uring and external backends
+ *
+ */
+
+/**
+ * \brief Get file descriptor that becomes readable when backend has events
+ * \param self An epoll or io_uring backend
+ * \return A file descriptor, -1 for other backends
+ *
+ * Expired timers, deferred conditions and io_uring submissions waiting
+ * for next dispatch do not make it readable, see
+ * kfxmpp_io_backend_get_timeout.
+ **/
+gint kfxmpp_io_backend_get_fd (KfxmppIoBackend *self)
+{
+	g_return_val_if_fail (self, -1);
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (self->funcs == &epoll_funcs)
+		return ((KfxmppIoEpoll *) self->data)->fd;
+#endif
+#ifdef HAVE_IO_URING
+	if (self->funcs == &uring_funcs)
+		return ((KfxmppIoUring *) self->data)->fd;
+#endif
+	return -1;
+}
+
+
+/**
+ * \brief Get time until backend has to be dispatched
+ * \param self A backend
+ * \return Time in milliseconds, 0 if backend should be dispatched right
+ * 	away, -1 if only descriptor readiness matters. Always -1 for
+ * 	GLib and custom backends.
+ *
+ * This is the timeout to use when polling kfxmpp_io_backend_get_fd.
+ **/
+gint kfxmpp_io_backend_get_timeout (KfxmppIoBackend *self)
+{
+	g_return_val_if_fail (self, -1);
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (self->funcs == &epoll_funcs)
+		return kfxmpp_io_loop_timeout (self->data, kfxmpp_io_loop_now ());
+#endif
+#ifdef HAVE_IO_URING
+	if (self->funcs == &uring_funcs) {
+		if (kfxmpp_io_uring_has_work (self->data))
+			return 0;
+		return kfxmpp_io_loop_timeout (self->data, kfxmpp_io_loop_now ());
+	}
+#endif
+	if (self->funcs == &external_funcs)
+		return kfxmpp_io_loop_timeout (self->data, kfxmpp_io_loop_now ());
+	return -1;
+}
+
+
+/**
+ * \brief Get time backend has to be dispatched or processed at
+ * \param self A backend
+ * \return Time on clock of kfxmpp_io_get_time, -1 if only descriptor
+ * 	readiness matters. Always -1 for GLib and custom backends.
+ *
+ * A deadline that has passed already means there is work to do right
+ * away.
+ **/
+gint64 kfxmpp_io_backend_get_deadline (KfxmppIoBackend *self)
+{
+	gint timeout;
+
+	g_return_val_if_fail (self, -1);
+
+	timeout = kfxmpp_io_backend_get_timeout (self);
+	if (timeout < 0)
+		return -1;
+	return kfxmpp_io_loop_now () + timeout;
+}
+
+
+/**
+ * \brief Make calling thread the one dispatching a backend
+ * \param self A backend
+ *
+ * kfxmpp_io_backend_dispatch and kfxmpp_io_backend_process do this
+ * themselves. It is needed only to take a backend over from a thread that
+ * has stopped dispatching it for good, so that data sessions send is no
+ * longer left for that thread to write.
+ *
+ * This function is thread-safe.
+ **/
+void kfxmpp_io_backend_claim (KfxmppIoBackend *self)
+{
+	gpointer thread = g_thread_self ();
+	gpointer owner;
+
+	g_return_if_fail (self);
+
+	do {
+		owner = g_atomic_pointer_get (&self->owner);
+	} while (owner != thread && ! g_atomic_pointer_compare_and_exchange (&self->owner, owner, thread));
+}
+
+
+/**
+ * \brief Check whether calling thread may use a backend now
+ * \param self A backend
+ * \return TRUE if watches and timers of backend may be added, changed and
+ * 	removed by calling thread. kfxmpp_io_backend_release must be called
+ * 	then, once thread is done with them.
+ *
+ * GLib backend belongs to thread running its main context, or to calling
+ * thread if none does, see g_main_context_acquire. Other backends belong
+ * to thread that last called kfxmpp_io_backend_dispatch or
+ * kfxmpp_io_backend_process. Until one of them is called, the first
+ * thread to acquire backend gets it.
+ *
+ * This function is thread-safe.
+ **/
+gboolean kfxmpp_io_backend_acquire (KfxmppIoBackend *self)
+{
+	gpointer thread = g_thread_self ();
+
+	g_return_val_if_fail (self, FALSE);
+
+	if (self->funcs == &glib_funcs)
+		return g_main_context_acquire (self->data);
+
+	return g_atomic_pointer_get (&self->owner) == thread ||
+		g_atomic_pointer_compare_and_exchange (&self->owner, NULL, thread);
+}
+
+
+/**
+ * \brief Release a backend acquired with kfxmpp_io_backend_acquire
+ * \param self A backend
+ **/
+void kfxmpp_io_backend_release (KfxmppIoBackend *self)
+{
+	g_return_if_fail (self);
+
+	if (self->funcs == &glib_funcs)
+		g_main_context_release (self->data);
+}
+
+
+/**
+ * \brief Have a function called by thread dispatching a backend
+ * \param self An epoll, io_uring or external backend
+ * \param func Function to call, its return value is ignored
+ * \param data Data passed to \b func
+ * \param notify Function releasing \b data after call, or when backend is
+ * 	freed first (may be NULL)
+ * \return TRUE if call was queued, FALSE for GLib and custom backends.
+ * 	Callers use an idle source of their main context for those.
+ *
+ * This function is thread-safe. \b func is called once, by next
+ * kfxmpp_io_backend_dispatch or kfxmpp_io_backend_process. A thread
+ * blocked in dispatch is woken up, external loops see
+ * kfxmpp_io_backend_get_wakeup_fd become readable.
+ **/
+gboolean kfxmpp_io_backend_invoke (KfxmppIoBackend *self, GSourceFunc func, gpointer data,
+					GDestroyNotify notify)
+{
+	KfxmppIoLoop *loop;
+	KfxmppIoLoopCall *call;
+
+	g_return_val_if_fail (self, FALSE);
+	g_return_val_if_fail (func, FALSE);
+
+	if (! kfxmpp_io_backend_has_loop (self))
+		return FALSE;
+
+	call = g_new (KfxmppIoLoopCall, 1);
+	call->func = func;
+	call->data = data;
+	call->notify = notify;
+
+	/* First call of a batch wakes loop up, the rest rides along */
+	loop = self->data;
+	if (kfxmpp_mpsc_queue_push (loop->calls, call))
+		kfxmpp_io_loop_wake (loop);
+
+	return TRUE;
+}
+
+
+/**
+ * \brief Get file descriptor that becomes readable when other threads need external backend
+ * \param self An external backend
+ * \return A file descriptor, -1 for other backends
+ *
+ * Application polls it for G_IO_IN together with descriptors of
+ * watches, and calls kfxmpp_io_backend_process when it is readable. That
+ * makes calls queued by kfxmpp_io_backend_invoke, e.g. data sessions were
+ * sent from other threads, and clears the descriptor.
+ **/
+gint kfxmpp_io_backend_get_wakeup_fd (KfxmppIoBackend *self)
+{
+	g_return_val_if_fail (self, -1);
+
+	if (self->funcs != &external_funcs)
+		return -1;
+	return ((KfxmppIoLoop *) self->data)->wake_read;
+}
+
+
+/**
+ * \brief Check whether a backend runs on KfxmppIoLoop
+ **/
+static gboolean kfxmpp_io_backend_has_loop (KfxmppIoBackend *self)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	if (self->funcs == &epoll_funcs)
+		return TRUE;
+#endif
+#ifdef HAVE_IO_URING
+	if (self->funcs == &uring_funcs)
+		return TRUE;
+#endif
+	return self->funcs == &external_funcs;
+}
+
+
+/**
+ * \brief Get time a timer expires at
+ * \param timer A timer
+ * \return Time on clock of kfxmpp_io_get_time, -1 while timer is not
+ * 	armed. Always -1 for GLib and custom backends.
+ **/
+gint64 kfxmpp_io_timer_get_deadline (KfxmppIoTimer *timer)
+{
+	KfxmppIoLoop *loop;
+	KfxmppIoLoopTimer *h;
+
+	g_return_val_if_fail (timer, -1);
+
+	if (timer->removed || ! kfxmpp_io_backend_has_loop (timer->backend))
+		return -1;
+
+	loop = timer->backend->data;
+	h = timer->handle;
+	if (h->link == NULL)
+		return -1;
+	if (h->ticks == 0)
+		return kfxmpp_io_loop_now ();
+	return loop->base + h->target * TIMER_TICK;
+}
+
+
+/**
+ * \brief Get conditions deferred with kfxmpp_io_watch_defer and not reported yet
+ * \param watch A watch
+ * \return Deferred conditions. Always 0 for GLib and custom backends.
+ **/
+GIOCondition kfxmpp_io_watch_get_deferred (KfxmppIoWatch *watch)
+{
+	g_return_val_if_fail (watch, 0);
+
+	if (watch->removed || ! kfxmpp_io_backend_has_loop (watch->backend))
+		return 0;
+
+	return ((KfxmppIoLoopWatch *) watch->handle)->pending;
+}
+
+
+/**
+ * \brief Wait for events and call callbacks of ready watches and expired timers
+ * \param self An epoll or io_uring backend
+ * \param timeout Maximum time to wait, in milliseconds. -1 waits forever.
+ * 	Backend waits less if a timer expires earlier.
+ * \return Number of callbacks called, -1 on error
+ *
+ * Deferred conditions are reported after socket events, timers are run
+ * last.
+ **/
+gint kfxmpp_io_backend_dispatch (KfxmppIoBackend *self, gint timeout)
+{
+	g_return_val_if_fail (self, -1);
+
+	kfxmpp_io_backend_claim (self);
+#ifdef HAVE_SYS_EPOLL_H
+	if (self->funcs == &epoll_funcs)
+		return kfxmpp_io_epoll_dispatch (self, timeout);
+#endif
+#ifdef HAVE_IO_URING
+	if (self->funcs == &uring_funcs)
+		return kfxmpp_io_uring_dispatch (self, timeout);
+#endif
+	g_return_val_if_reached (-1);
+}
+
+
+/**
+ * \brief Get number of system calls made by a backend
+ * \param self A backend
+ * \return Number of calls waiting for events, registering descriptors
+ * 	and submitting operations. Reads and writes made by callbacks are
+ * 	not counted. Always 0 for backends other than epoll and io_uring.
+ **/
+guint kfxmpp_io_backend_get_syscalls (KfxmppIoBackend *self)
+{
+	g_return_val_if_fail (self, 0);
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (self->funcs == &epoll_funcs)
+		return ((KfxmppIoLoop *) self->data)->syscalls;
+#endif
+#ifdef HAVE_IO_URING
+	if (self->funcs == &uring_funcs)
+		return ((KfxmppIoLoop *) self->data)->syscalls;
+#endif
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** \file iobackend.h */
+
+#ifndef __IOBACKEND_H__
+#define __IOBACKEND_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * \brief Source of socket readiness notifications
+ *
+ * Sessions do not poll their sockets themselves, they register a single
+ * watch with a backend and change its interest as their output queue
+ * fills and drains. Backends are available for GLib main loop, for a
+ * plain epoll or io_uring loop, and for any loop of an embedding
+ * application. That one either polls what external backend asks for, or
+ * provides its own KfxmppIoBackendFuncs.
+ *
+ * Readiness is reported level-triggered, a callback is called again as
+ * long as the condition it is interested in holds, except by edge-triggered
+ * epoll backend. That one reports a condition only when it starts to hold,
+ * so callbacks have to consume it until EAGAIN, or call
+ * kfxmpp_io_watch_defer when they stop early.
+ *
+ * Backends also run timers, so that sessions driven by the same backend
+ * need nothing else from the loop that dispatches it.
+ *
+ * io_uring backend can do the I/O itself as well. A watch switched to
+ * completion mode gets data kernel has already received instead of
+ * G_IO_IN, and hands data to write to the backend, see
+ * kfxmpp_io_watch_set_recv_func.
+ *
+ * Thread safety: kfxmpp_io_backend_ref, kfxmpp_io_backend_unref,
+ * kfxmpp_io_backend_acquire, kfxmpp_io_backend_claim and
+ * kfxmpp_io_backend_invoke are atomic. Watches must be added, changed
+ * and removed from the thread dispatching the backend, which other
+ * threads can tell with kfxmpp_io_backend_acquire, or hand work over to
+ * with kfxmpp_io_backend_invoke.
+ **/
+typedef struct _KfxmppIoBackend KfxmppIoBackend;
+
+/**
+ * \brief A file descriptor registered with a backend
+ **/
+typedef struct _KfxmppIoWatch KfxmppIoWatch;
+
+/**
+ * \brief A timer run by a backend
+ **/
+typedef struct _KfxmppIoTimer KfxmppIoTimer;
+
+/**
+ * \callback function called when file descriptor is ready
+ * \param watch A watch
+ * \param condition Conditions that hold. G_IO_ERR and G_IO_HUP are
+ * 	reported even if not asked for.
+ * \param data User data
+ * \return FALSE if watch should be removed
+ **/
+typedef gboolean (*KfxmppIoFunc) (KfxmppIoWatch *watch, GIOCondition condition, gpointer data);
+
+/**
+ * \callback function called with data backend has received
+ * \param watch A watch
+ * \param buffer Received data, valid only until callback returns
+ * \param size Size of data, 0 at end of stream, negated errno on error
+ * \param data User data
+ *
+ * Backend stops receiving after end of stream or an error. Callback
+ * removes the watch with kfxmpp_io_watch_remove if it is done with it.
+ **/
+typedef void (*KfxmppIoRecvFunc) (KfxmppIoWatch *watch, const gchar *buffer, gssize size, gpointer data);
+
+/**
+ * \callback function called when application loop has to look at external backend again
+ * \param backend An external backend
+ * \param data User data
+ *
+ * Descriptors, their interest or backend's deadline may have changed.
+ **/
+typedef void (*KfxmppIoUpdateFunc) (KfxmppIoBackend *backend, gpointer data);
+
+/**
+ * \brief Functions implementing a backend
+ *
+ * \b add returns a backend-specific handle of new watch, which is passed
+ * to other functions. When file descriptor becomes ready, backend calls
+ * kfxmpp_io_watch_dispatch. \b defer asks for a condition to be reported
+ * again without waiting for the descriptor, it may be NULL for
+ * level-triggered backends.
+ *
+ * \b add_timer works the same way for timers. Backend calls
+ * kfxmpp_io_timer_dispatch after \b interval milliseconds, and again
+ * after each next interval as long as it returns TRUE.
+ *
+ * Backends doing I/O themselves implement \b set_recv, which switches a
+ * watch between readiness and completion mode, and \b send, which takes
+ * ownership of a segment to write. They call kfxmpp_io_watch_received and
+ * kfxmpp_io_watch_sent as I/O completes. Both are NULL for others.
+ **/
+typedef struct {
+	gpointer (*add) (gpointer backend_data, KfxmppIoWatch *watch, gint fd, GIOCondition interest);
+	void (*modify) (gpointer backend_data, gpointer handle, GIOCondition interest);
+	void (*remove) (gpointer backend_data, gpointer handle);
+	void (*defer) (gpointer backend_data, gpointer handle, GIOCondition condition);
+	gpointer (*add_timer) (gpointer backend_data, KfxmppIoTimer *timer, guint interval);
+	void (*remove_timer) (gpointer backend_data, gpointer handle);
+	gboolean (*set_recv) (gpointer backend_data, gpointer handle, gboolean enable);
+	void (*send) (gpointer backend_data, gpointer handle, GString *data);
+} KfxmppIoBackendFuncs;
+
+
+KfxmppIoBackend *kfxmpp_io_backend_new (const KfxmppIoBackendFuncs *funcs, gpointer data, GDestroyNotify notify);
+KfxmppIoBackend *kfxmpp_io_backend_new_glib (GMainContext *context);
+KfxmppIoBackend *kfxmpp_io_backend_new_epoll (void);
+KfxmppIoBackend *kfxmpp_io_backend_new_epoll_full (gboolean edge_triggered);
+KfxmppIoBackend *kfxmpp_io_backend_new_uring (void);
+KfxmppIoBackend *kfxmpp_io_backend_new_external (KfxmppIoUpdateFunc update, gpointer data);
+void kfxmpp_io_backend_free (KfxmppIoBackend *self);
+KfxmppIoBackend *kfxmpp_io_backend_ref (KfxmppIoBackend *self);
+void kfxmpp_io_backend_unref (KfxmppIoBackend *self);
+
+gint kfxmpp_io_backend_get_fd (KfxmppIoBackend *self);
+gint kfxmpp_io_backend_get_wakeup_fd (KfxmppIoBackend *self);
+gint kfxmpp_io_backend_get_timeout (KfxmppIoBackend *self);
+gint64 kfxmpp_io_backend_get_deadline (KfxmppIoBackend *self);
+gint kfxmpp_io_backend_dispatch (KfxmppIoBackend *self, gint timeout);
+gint kfxmpp_io_backend_process (KfxmppIoBackend *self, KfxmppIoWatch *watch, GIOCondition revents, gint64 now);
+gboolean kfxmpp_io_backend_acquire (KfxmppIoBackend *self);
+void kfxmpp_io_backend_release (KfxmppIoBackend *self);
+void kfxmpp_io_backend_claim (KfxmppIoBackend *self);
+gboolean kfxmpp_io_backend_invoke (KfxmppIoBackend *self, GSourceFunc func, gpointer data,
+					GDestroyNotify notify);
+gint64 kfxmpp_io_get_time (void);
+guint kfxmpp_io_backend_get_n_watches (KfxmppIoBackend *self);
+guint kfxmpp_io_backend_get_syscalls (KfxmppIoBackend *self);
+
+KfxmppIoWatch *kfxmpp_io_backend_add_watch (KfxmppIoBackend *self, gint fd, GIOCondition interest,
+					KfxmppIoFunc func, gpointer data);
+void kfxmpp_io_watch_set_interest (KfxmppIoWatch *watch, GIOCondition interest);
+GIOCondition kfxmpp_io_watch_get_interest (KfxmppIoWatch *watch);
+gint kfxmpp_io_watch_get_fd (KfxmppIoWatch *watch);
+void kfxmpp_io_watch_defer (KfxmppIoWatch *watch, GIOCondition condition);
+GIOCondition kfxmpp_io_watch_get_deferred (KfxmppIoWatch *watch);
+void kfxmpp_io_watch_remove (KfxmppIoWatch *watch);
+gboolean kfxmpp_io_watch_dispatch (KfxmppIoWatch *watch, GIOCondition condition);
+
+gboolean kfxmpp_io_watch_set_recv_func (KfxmppIoWatch *watch, KfxmppIoRecvFunc func);
+void kfxmpp_io_watch_set_receiving (KfxmppIoWatch *watch, gboolean receiving);
+void kfxmpp_io_watch_send (KfxmppIoWatch *watch, GString *data);
+gsize kfxmpp_io_watch_get_unsent (KfxmppIoWatch *watch);
+gboolean kfxmpp_io_watch_received (KfxmppIoWatch *watch, const gchar *data, gssize size);
+void kfxmpp_io_watch_sent (KfxmppIoWatch *watch, gsize size, gboolean failed);
+
+KfxmppIoTimer *kfxmpp_io_backend_add_timer (KfxmppIoBackend *self, guint interval,
+					GSourceFunc func, gpointer data);
+guint kfxmpp_io_timer_get_interval (KfxmppIoTimer *timer);
+gint64 kfxmpp_io_timer_get_deadline (KfxmppIoTimer *timer);
+void kfxmpp_io_timer_remove (KfxmppIoTimer *timer);
+gboolean kfxmpp_io_timer_dispatch (KfxmppIoTimer *timer);
+
+G_END_DECLS
+
+#endif /* __IOBACKEND_H__ */
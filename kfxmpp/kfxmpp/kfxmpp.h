@@ -27,12 +27,18 @@
 
 
 #include <kfxmpp/core.h>
+#include <kfxmpp/cryptopool.h>
 #include <kfxmpp/error.h>
 #include <kfxmpp/event.h>
+#include <kfxmpp/filter.h>
+#include <kfxmpp/iobackend.h>
 #include <kfxmpp/sasl.h>
 #include <kfxmpp/session.h>
+#include <kfxmpp/sessionpool.h>
+#include <kfxmpp/shardmanager.h>
 #include <kfxmpp/stanza.h>
 #include <kfxmpp/streamparser.h>
+#include <kfxmpp/tlscache.h>
 
 
 
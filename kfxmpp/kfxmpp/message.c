@@ -65,11 +65,13 @@ void kfxmpp_message_free (KfxmppMessage *self)
 
 /**
  * \brief Add a reference to KfxmppMessage
+ *
+ * This function is thread-safe.
  **/
 KfxmppMessage* kfxmpp_message_ref (KfxmppMessage *self)
 {
         g_return_val_if_fail (self, NULL);
-        self->ref_count++;
+        g_atomic_int_inc (&self->ref_count);
         return self;
 }
 
@@ -77,13 +79,13 @@ KfxmppMessage* kfxmpp_message_ref (KfxmppMessage *self)
 /**
  * \brief Remove a reference from KfxmppMessage
  *
- * Object will be deleted when reference count reaches 0
+ * Object will be deleted when reference count reaches 0.
+ * This function is thread-safe.
  **/
 void kfxmpp_message_unref (KfxmppMessage *self)
 {
         g_return_if_fail (self);
-        self->ref_count--;
-        if (self->ref_count == 0)
+        if (g_atomic_int_dec_and_test (&self->ref_count))
                 kfxmpp_message_free (self);
 }
 
@@ -257,14 +259,20 @@ static KfxmppStanza *kfxmpp_message_create_stanza (KfxmppMessage *self)
  * \brief Send a message
  * \param self A message
  * \param session A session
+ * \param error Location to store error information (may be NULL)
+ * \return Number of bytes sent. Negative value means message was not
+ * 	sent, e.g. with KFXMPP_ERROR_WOULD_BLOCK, see kfxmpp_session_send
  **/
-void kfxmpp_message_send (KfxmppMessage *self, KfxmppSession *session)
+gssize kfxmpp_message_send (KfxmppMessage *self, KfxmppSession *session, GError **error)
 {
 	KfxmppStanza *stanza;
+	gssize ret;
 
 	stanza = kfxmpp_message_create_stanza (self);
-	kfxmpp_session_send (session, stanza, NULL);
+	ret = kfxmpp_session_send (session, stanza, error);
 	kfxmpp_stanza_free (stanza);
+
+	return ret;
 }
 
 
@@ -308,14 +316,19 @@ void kfxmpp_message_parse_stanza (KfxmppMessage *self, KfxmppStanza *stanza)
  * \param session A KfxmppSession
  * \param to Recipient JID
  * \param body Message body
+ * \param error Location to store error information (may be NULL)
+ * \return Number of bytes sent. Negative value means message was not sent
  **/
-void kfxmpp_message_send_simple (KfxmppSession *session, const gchar *to, const gchar *body)
+gssize kfxmpp_message_send_simple (KfxmppSession *session, const gchar *to, const gchar *body, GError **error)
 {
 	KfxmppStanza *msg;
+	gssize ret;
 
 	msg = kfxmpp_stanza_new (to, KFXMPP_STANZA_KLASS_MESSAGE);
 	xmlNewTextChild (msg->node, NULL, "body", body);
 	
-	kfxmpp_session_send (session, msg, NULL);
+	ret = kfxmpp_session_send (session, msg, error);
 	kfxmpp_stanza_free (msg);
+
+	return ret;
 }
@@ -41,6 +41,10 @@ typedef enum {
 
 /**
  * \brief A message
+ *
+ * Thread safety: kfxmpp_message_ref and kfxmpp_message_unref are atomic and
+ * may be called from any thread. Fields and setters are not synchronized;
+ * a message shared between threads should be treated as read-only.
  */
 typedef struct {
 	gchar *from;	/**< Message sender	*/
@@ -68,10 +72,10 @@ const gchar *kfxmpp_session_get_subject (KfxmppMessage *self);
 void kfxmpp_message_set_body (KfxmppMessage *self, const gchar *body);
 const gchar *kfxmpp_session_get_body (KfxmppMessage *self);
 	
-void kfxmpp_message_send (KfxmppMessage *self, KfxmppSession *session);
+gssize kfxmpp_message_send (KfxmppMessage *self, KfxmppSession *session, GError **error);
 
 void kfxmpp_message_parse_stanza (KfxmppMessage *self, KfxmppStanza *stanza);
 
-void kfxmpp_message_send_simple (KfxmppSession *session, const gchar *to, const gchar *body);
+gssize kfxmpp_message_send_simple (KfxmppSession *session, const gchar *to, const gchar *body, GError **error);
 	
 #endif /* __MESSAGE_H__ */
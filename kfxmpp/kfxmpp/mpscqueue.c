@@ -0,0 +1,133 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** \file mpscqueue.h */
+
+#include "kfxmpp.h"
+#include "mpscqueue.h"
+
+/*
+ * Producers push list nodes onto a lock-free stack with compare-and-swap.
+ * The consumer detaches the whole stack at once and reverses it, which
+ * gives items back in FIFO order. As single nodes are never popped, the
+ * stack is not prone to ABA problem.
+ */
+struct _KfxmppMpscQueue {
+	gpointer head;		/**< Top of the stack (most recently pushed GSList node) */
+};
+
+
+/**
+ * \brief Create a new queue
+ * \return A new, empty queue
+ **/
+KfxmppMpscQueue *kfxmpp_mpsc_queue_new (void)
+{
+	return g_new0 (KfxmppMpscQueue, 1);
+}
+
+
+/**
+ * \brief Free a queue
+ * \param self A queue
+ * \param notify Function called for each item still left in queue (may be NULL)
+ *
+ * No other thread may push to the queue while it is being freed.
+ **/
+void kfxmpp_mpsc_queue_free (KfxmppMpscQueue *self, GDestroyNotify notify)
+{
+	GSList *items, *tmp;
+
+	g_return_if_fail (self);
+
+	items = kfxmpp_mpsc_queue_pop_all (self);
+	if (notify) {
+		for (tmp = items; tmp; tmp = tmp->next)
+			notify (tmp->data);
+	}
+	g_slist_free (items);
+	g_free (self);
+}
+
+
+/**
+ * \brief Push an item to the queue
+ * \param self A queue
+ * \param data An item
+ * \return TRUE if queue was empty before this push
+ *
+ * This function may be called from any thread. Return value tells the
+ * producer that it is the first one in a new batch, so it should wake up
+ * the consumer; later producers need not do that.
+ **/
+gboolean kfxmpp_mpsc_queue_push (KfxmppMpscQueue *self, gpointer data)
+{
+	GSList *node;
+	gpointer head;
+
+	g_return_val_if_fail (self, FALSE);
+
+	node = g_slist_alloc ();
+	node->data = data;
+
+	do {
+		head = g_atomic_pointer_get (&self->head);
+		node->next = head;
+	} while (! g_atomic_pointer_compare_and_exchange (&self->head, head, node));
+
+	return head == NULL;
+}
+
+
+/**
+ * \brief Take all items from the queue
+ * \param self A queue
+ * \return List of items in order they were pushed. It should be freed
+ * 	with g_slist_free by the caller.
+ *
+ * This function must be called only by the consumer thread.
+ **/
+GSList *kfxmpp_mpsc_queue_pop_all (KfxmppMpscQueue *self)
+{
+	gpointer head;
+
+	g_return_val_if_fail (self, NULL);
+
+	do {
+		head = g_atomic_pointer_get (&self->head);
+	} while (head && ! g_atomic_pointer_compare_and_exchange (&self->head, head, NULL));
+
+	return g_slist_reverse (head);
+}
+
+
+/**
+ * \brief Check whether queue is empty
+ * \param self A queue
+ * \return TRUE if there are no items in queue
+ **/
+gboolean kfxmpp_mpsc_queue_is_empty (KfxmppMpscQueue *self)
+{
+	g_return_val_if_fail (self, TRUE);
+
+	return g_atomic_pointer_get (&self->head) == NULL;
+}
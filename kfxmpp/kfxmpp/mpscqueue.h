@@ -0,0 +1,50 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** \file mpscqueue.h */
+
+#ifndef __MPSCQUEUE_H__
+#define __MPSCQUEUE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * \brief Lock-free multi-producer, single-consumer queue
+ *
+ * Any number of threads may push items concurrently, without taking a lock.
+ * A single consumer takes all queued items at once, in the order they were
+ * pushed.
+ **/
+typedef struct _KfxmppMpscQueue KfxmppMpscQueue;
+
+KfxmppMpscQueue *kfxmpp_mpsc_queue_new (void);
+void kfxmpp_mpsc_queue_free (KfxmppMpscQueue *self, GDestroyNotify notify);
+
+gboolean kfxmpp_mpsc_queue_push (KfxmppMpscQueue *self, gpointer data);
+GSList *kfxmpp_mpsc_queue_pop_all (KfxmppMpscQueue *self);
+gboolean kfxmpp_mpsc_queue_is_empty (KfxmppMpscQueue *self);
+
+G_END_DECLS
+
+#endif /* __MPSCQUEUE_H__ */
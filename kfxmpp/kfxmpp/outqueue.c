@@ -0,0 +1,331 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** \file outqueue.h */
+
+#include "kfxmpp.h"
+#include "outqueue.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+struct _KfxmppOutQueue {
+	GQueue *segments;	/**< GStrings waiting to be written, oldest first */
+	gsize offset;		/**< Number of bytes of first segment already written */
+	gsize bytes;		/**< Number of bytes waiting to be written */
+	GString *spare;		/**< Empty segment kept for reuse */
+	guint syscalls;		/**< Number of write system calls made so far */
+};
+
+
+/***********************************************************************
+ *
+ * Static function prototypes
+ *
+ */
+
+static void kfxmpp_out_queue_consume (KfxmppOutQueue *self, gsize size);
+static void kfxmpp_out_queue_cork (gint fd, gboolean cork);
+
+
+/**
+ * \brief Create a new output queue
+ * \return A new, empty queue
+ **/
+KfxmppOutQueue *kfxmpp_out_queue_new (void)
+{
+	KfxmppOutQueue *self;
+
+	self = g_new0 (KfxmppOutQueue, 1);
+	self->segments = g_queue_new ();
+
+	return self;
+}
+
+
+/**
+ * \brief Free an output queue and all data left in it
+ * \param self A queue
+ **/
+void kfxmpp_out_queue_free (KfxmppOutQueue *self)
+{
+	g_return_if_fail (self);
+
+	kfxmpp_out_queue_clear (self);
+	g_queue_free (self->segments);
+	if (self->spare)
+		g_string_free (self->spare, TRUE);
+	g_free (self);
+}
+
+
+/**
+ * \brief Append data to the queue
+ * \param self A queue
+ * \param data Data to be written
+ * \param size Size of data
+ *
+ * Data is copied, so \b data may be freed right after this call.
+ **/
+void kfxmpp_out_queue_append (KfxmppOutQueue *self, const gchar *data, gsize size)
+{
+	GString *tail;
+
+	g_return_if_fail (self);
+
+	if (size == 0)
+		return;
+
+	tail = g_queue_peek_tail (self->segments);
+	if (tail == NULL || tail->len + size > KFXMPP_OUT_QUEUE_SEGMENT_SIZE) {
+		/* Start a new segment */
+		if (self->spare) {
+			tail = self->spare;
+			self->spare = NULL;
+		} else {
+			tail = g_string_sized_new (MAX (size, KFXMPP_OUT_QUEUE_SEGMENT_SIZE));
+		}
+		g_queue_push_tail (self->segments, tail);
+	}
+
+	g_string_append_len (tail, data, size);
+	self->bytes += size;
+}
+
+
+/**
+ * \brief Write as much queued data as possible without blocking
+ * \param self A queue
+ * \param fd Socket to write data to
+ * \return Number of bytes written, or -1 on error (errno is set then)
+ *
+ * Up to KFXMPP_OUT_QUEUE_MAX_IOV segments are written with one system
+ * call. When more calls are needed, the socket is corked meanwhile, so
+ * that no partial frames are sent out between them. Flush stops when
+ * the socket cannot accept more data, leaving the rest queued.
+ **/
+gssize kfxmpp_out_queue_flush (KfxmppOutQueue *self, gint fd)
+{
+	struct iovec iov[KFXMPP_OUT_QUEUE_MAX_IOV];
+	struct msghdr msg;
+	gsize total = 0;
+	gboolean corked = FALSE;
+
+	g_return_val_if_fail (self, -1);
+
+	while (self->bytes > 0) {
+		GList *tmp;
+		gsize requested = 0;
+		gssize written;
+		gint n = 0;
+
+		for (tmp = self->segments->head; tmp && n < KFXMPP_OUT_QUEUE_MAX_IOV; tmp = tmp->next, n++) {
+			GString *segment = tmp->data;
+			gsize offset = n == 0 ? self->offset : 0;
+
+			iov[n].iov_base = segment->str + offset;
+			iov[n].iov_len = segment->len - offset;
+			requested += iov[n].iov_len;
+		}
+
+		if (tmp && !corked) {
+			/* More than one call is needed */
+			kfxmpp_out_queue_cork (fd, TRUE);
+			corked = TRUE;
+		}
+
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		do {
+			written = sendmsg (fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+			self->syscalls++;
+		} while (written < 0 && errno == EINTR);
+
+		if (written < 0) {
+			gint saved_errno = errno;
+
+			if (saved_errno == EAGAIN || saved_errno == EWOULDBLOCK)
+				break;
+
+			if (corked)
+				kfxmpp_out_queue_cork (fd, FALSE);
+			errno = saved_errno;
+			return -1;
+		}
+
+		total += written;
+		kfxmpp_out_queue_consume (self, written);
+
+		if ((gsize) written < requested) {
+			/* Socket buffer is full, next call would fail anyway */
+			break;
+		}
+	}
+
+	if (corked)
+		kfxmpp_out_queue_cork (fd, FALSE);
+
+	return total;
+}
+
+
+/**
+ * \brief Take oldest segment off a queue
+ * \param self A queue
+ * \return Segment with data not written yet, NULL if queue is empty.
+ * 	Caller owns it.
+ *
+ * This is for backends writing data themselves, see
+ * kfxmpp_io_watch_send.
+ **/
+GString *kfxmpp_out_queue_pop (KfxmppOutQueue *self)
+{
+	GString *segment;
+
+	g_return_val_if_fail (self, NULL);
+
+	segment = g_queue_pop_head (self->segments);
+	if (segment == NULL)
+		return NULL;
+
+	if (self->offset > 0) {
+		g_string_erase (segment, 0, self->offset);
+		self->offset = 0;
+	}
+	self->bytes -= segment->len;
+
+	return segment;
+}
+
+
+/**
+ * \brief Drop all queued data
+ * \param self A queue
+ **/
+void kfxmpp_out_queue_clear (KfxmppOutQueue *self)
+{
+	GString *segment;
+
+	g_return_if_fail (self);
+
+	while ((segment = g_queue_pop_head (self->segments)) != NULL)
+		g_string_free (segment, TRUE);
+	self->offset = 0;
+	self->bytes = 0;
+}
+
+
+/**
+ * \brief Get number of bytes waiting to be written
+ * \param self A queue
+ * \return Number of bytes
+ **/
+gsize kfxmpp_out_queue_get_bytes (KfxmppOutQueue *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->bytes;
+}
+
+
+/**
+ * \brief Get number of segments in the queue
+ * \param self A queue
+ * \return Number of segments
+ **/
+guint kfxmpp_out_queue_get_length (KfxmppOutQueue *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->segments->length;
+}
+
+
+/**
+ * \brief Get number of write system calls made by the queue
+ * \param self A queue
+ * \return Number of calls, including ones that failed
+ **/
+guint kfxmpp_out_queue_get_syscalls (KfxmppOutQueue *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->syscalls;
+}
+
+
+/**
+ * \brief Remove written data from the front of queue
+ **/
+static void kfxmpp_out_queue_consume (KfxmppOutQueue *self, gsize size)
+{
+	self->bytes -= size;
+
+	while (size > 0) {
+		GString *segment = g_queue_peek_head (self->segments);
+		gsize left = segment->len - self->offset;
+
+		if (size < left) {
+			self->offset += size;
+			return;
+		}
+
+		/* Whole segment was written */
+		size -= left;
+		self->offset = 0;
+		g_queue_pop_head (self->segments);
+
+		if (self->spare == NULL && segment->allocated_len <= 2 * KFXMPP_OUT_QUEUE_SEGMENT_SIZE) {
+			g_string_truncate (segment, 0);
+			self->spare = segment;
+		} else {
+			g_string_free (segment, TRUE);
+		}
+	}
+}
+
+
+/**
+ * \brief Set or clear TCP_CORK option on a socket
+ *
+ * Errors are ignored, as the option only affects performance and is not
+ * available for all kinds of sockets.
+ **/
+static void kfxmpp_out_queue_cork (gint fd, gboolean cork)
+{
+#ifdef TCP_CORK
+	gint value = cork ? 1 : 0;
+
+	setsockopt (fd, IPPROTO_TCP, TCP_CORK, &value, sizeof (value));
+#endif
+}
@@ -0,0 +1,64 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** \file outqueue.h */
+
+#ifndef __OUTQUEUE_H__
+#define __OUTQUEUE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/** Small writes are copied into segments of this size */
+#define KFXMPP_OUT_QUEUE_SEGMENT_SIZE	16384
+
+/** Maximum number of segments passed to a single system call */
+#define KFXMPP_OUT_QUEUE_MAX_IOV	64
+
+/**
+ * \brief Queue of data waiting to be written to a socket
+ *
+ * Data appended to the queue is coalesced into a list of segments, which
+ * are later written with a single gather write per flush. Short writes
+ * are handled by remembering how much of the first segment was already
+ * sent.
+ *
+ * A queue is not thread-safe.
+ **/
+typedef struct _KfxmppOutQueue KfxmppOutQueue;
+
+KfxmppOutQueue *kfxmpp_out_queue_new (void);
+void kfxmpp_out_queue_free (KfxmppOutQueue *self);
+
+void kfxmpp_out_queue_append (KfxmppOutQueue *self, const gchar *data, gsize size);
+gssize kfxmpp_out_queue_flush (KfxmppOutQueue *self, gint fd);
+GString *kfxmpp_out_queue_pop (KfxmppOutQueue *self);
+void kfxmpp_out_queue_clear (KfxmppOutQueue *self);
+
+gsize kfxmpp_out_queue_get_bytes (KfxmppOutQueue *self);
+guint kfxmpp_out_queue_get_length (KfxmppOutQueue *self);
+guint kfxmpp_out_queue_get_syscalls (KfxmppOutQueue *self);
+
+G_END_DECLS
+
+#endif /* __OUTQUEUE_H__ */
@@ -58,9 +58,13 @@ void kfxmpp_sasl_plain (KfxmppSession *session)
 	xmlSetProp (auth, "mechanism", "PLAIN");
 	xmlNodeSetContent (auth, base);
 
+	/* Authentication is never refused by send queue's high watermark */
 	KfxmppStanza *stanza;
+	gchar *xml;
 	stanza = kfxmpp_stanza_new_from_xml (auth);
-	kfxmpp_session_send (session, stanza, NULL);
+	xml = kfxmpp_stanza_to_string (stanza);
+	kfxmpp_session_send_raw (session, xml, -1, NULL);
+	g_free (xml);
 	kfxmpp_stanza_free (stanza);
 
 	g_free (msg);
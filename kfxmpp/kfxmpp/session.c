@@ -29,20 +29,76 @@
 #include "event.h"
 #include "sasl.h"
 #include "message.h"
+#include "mpscqueue.h"
+#include "coalescer.h"
+#include "outqueue.h"
+#include "iobackend.h"
 
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <gnet.h>
 
 #ifdef HAVE_GNUTLS
 #  include <gnutls/gnutls.h>
 #endif
+#ifdef HAVE_LINUX_TLS_H
+#  include <linux/tls.h>
+#endif
+#ifdef HAVE_LIBZ
+#  include <zlib.h>
+#endif
 
 /* Starttls command */
 #define KFXMPP_SESSION_TLS "<starttls xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>"
 
+/* Stream compression request (XEP-0138) */
+#define KFXMPP_SESSION_COMPRESS "<compress xmlns='http://jabber.org/protocol/compress'><method>zlib</method></compress>"
+
 /* Buffer size */
 #define BUFFER_SIZE 1024
 
+/* Largest receive buffer, grown from BUFFER_SIZE when reads keep filling it */
+#define MAX_BUFFER_SIZE (64 * 1024)
+
+/* Number of wakeups using less than a quarter of receive buffer before it shrinks */
+#define BUFFER_SHRINK_WAKEUPS 16
+
+/* Bytes and stanzas processed per wakeup before yielding to other sessions, by profile */
+#define LATENCY_READ_BUDGET (16 * 1024)
+#define LATENCY_STANZA_BUDGET 16
+#define THROUGHPUT_READ_BUDGET (256 * 1024)
+#define THROUGHPUT_STANZA_BUDGET 512
+
+/* Amount of queued output that is written without waiting for end of main loop iteration */
+#define FLUSH_THRESHOLD (64 * 1024)
+
+/* Largest amount of data one TLS record carries */
+#define TLS_RECORD_SIZE (16 * 1024)
+
+/* Milliseconds a partially filled TLS record waits for more data, by profile;
+ * sessions that never chose a profile do not wait */
+#define LATENCY_TLS_DELAY 0
+#define THROUGHPUT_TLS_DELAY 1
+
+/* Size of chunks compressed and decompressed data is produced in */
+#define COMPRESS_CHUNK (16 * 1024)
+
+/* Default compression window, as zlib's window bits */
+#define DEFAULT_COMPRESS_WINDOW 15
+
+/* Default send queue watermarks */
+#define DEFAULT_HIGH_WATERMARK (1024 * 1024)
+#define DEFAULT_LOW_WATERMARK (256 * 1024)
+
+/* ALPN protocol of direct TLS endpoints (XEP-0368) */
+#define KFXMPP_SESSION_ALPN "xmpp-client"
+
 /* Id scheme */
 #define RESPONSE_STRING "msg%d"
 
@@ -50,10 +106,41 @@
 #define DEFAULT_TIMEOUT 60
 
 
+#ifdef HAVE_GNUTLS
+/**
+ * \brief TLS handshake run on a crypto pool
+ *
+ * gnutls reads and writes memory buffers on a worker, session moves data
+ * between them and its socket in between steps. While a step runs,
+ * worker owns everything here; data received meanwhile waits in session's
+ * tls_in.
+ **/
+typedef struct {
+	KfxmppSession	*session;		/**< Session, holding a reference while a step runs */
+	gnutls_session_t gnutls;		/**< gnutls session object */
+	GString		*in;			/**< Records not taken by gnutls yet */
+	GString		*out;			/**< Records written by last step */
+	gint		result;			/**< Return value of last step */
+	gboolean	started;		/**< Whether any step was run */
+	gboolean	busy;			/**< Whether a step is running */
+	gboolean	cancelled;		/**< Whether session gave up on this handshake */
+} KfxmppSessionHandshake;
+#endif
+
+
 /**
  * \brief Object representing connection to a XMPP server
  *
  *    This is central object in \b kfxmpp library
+ *
+ * Thread safety: kfxmpp_session_ref and kfxmpp_session_unref are atomic and
+ * may be called from any thread, and so may kfxmpp_session_send,
+ * kfxmpp_session_send_raw, kfxmpp_session_get_pending_bytes and
+ * kfxmpp_session_get_send_queue_depth. All other functions must be called
+ * from the thread that drives the session: the one running its main
+ * context, which must also be the one dispatching its I/O backend when
+ * session is in a pool or on an epoll, io_uring or external backend.
+ * Data sent from other threads is written by that thread.
  **/
 struct _KfxmppSession {
 	/* General information */
@@ -74,11 +161,36 @@ struct _KfxmppSession {
 	/* Network stuff */
 	GTcpSocket	*socket;		/**< Connection socket	*/
 	GTcpSocketConnectAsyncID connect_id;	/**< ID of connection attempt */
+	gboolean	fast_open;		/**< Whether known servers are connected to with TCP Fast Open */
+	gboolean	fast_opened;		/**< Whether session opened socket itself, \b socket is NULL then */
+	struct sockaddr_storage peer;		/**< Address last connection went to */
+	socklen_t	peer_len;		/**< Size of \b peer, 0 if unknown */
+	gchar		*peer_host;		/**< Host name \b peer was resolved from */
+	gint		peer_port;		/**< Port \b peer was connected to */
+	gboolean	bind_pipelining;	/**< Whether binding is requested along with restarted stream */
+	gboolean	bind_pipelined;		/**< Whether binding was requested before stream features came */
 	GIOChannel	*io;			/**< I/O stream from socket	*/
+	KfxmppMpscQueue	*send_queue;		/**< Data sent from other threads, waiting for I/O thread */
+	KfxmppOutQueue	*out_queue;		/**< Data waiting to be written to socket */
+	KfxmppIoTimer	*flush_timer;		/**< Timer flushing \b out_queue at end of iteration, if scheduled */
+
+	/* Send backpressure */
+	gint		pending_bytes;		/**< Bytes sent by any thread and not written yet (atomic) */
+	gint		pending_chunks;		/**< Queue segments and chunks from other threads (atomic) */
+	gsize		out_bytes;		/**< Size of \b out_queue last accounted for */
+	guint		out_segments;		/**< Length of \b out_queue last accounted for */
+	gsize		high_watermark;		/**< kfxmpp_session_send fails above this, 0 for no limit */
+	gsize		low_watermark;		/**< Writable callback fires below this */
+	gint		blocked;		/**< Whether a send was refused and writable callback is due (atomic) */
+	KfxmppSessionWritableCallback writable_callback;	/**< Called when queue drains */
+	gpointer	writable_data;		/**< Data passed to above callback */
 
 	/* Event watching stuff */
 	GMainContext *context;	/**< Main loop context */
-	GSource	*sources[4];	/**< Source condition */
+	KfxmppIoBackend	*backend;	/**< Readiness and timer backend, GLib one on \b context by default */
+	gboolean	default_backend;	/**< Whether \b backend is GLib one created by session */
+	KfxmppIoWatch	*watch;		/**< Single watch on socket, interested in writing only while output is queued */
+	gboolean	completion;	/**< Whether backend receives and writes for \b watch */
 	
 
 	/* Connect callback */
@@ -90,12 +202,69 @@ struct _KfxmppSession {
 	gpointer disconnect_data;
 	
 	KfxmppStreamParser *parser;	/**< XML parser */
+	KfxmppStreamParserPool *parser_pool;	/**< Pool of parser contexts, NULL if none */
+	gchar		*recv_buffer;		/**< Receive buffer, allocated on first read */
+	gsize		recv_size;		/**< Size of \b recv_buffer */
+	guint		recv_idle;		/**< Consecutive wakeups that used little of \b recv_buffer */
+	KfxmppPresenceCoalescer *coalescer;	/**< Presence coalescing stage, NULL if disabled */
+	GList *filters;			/**< Stanza filters installed on every parser */
+
+	/* Input scheduling */
+	KfxmppSchedulingProfile profile;	/**< Profile budgets were last set from */
+	gsize		read_budget;		/**< Bytes read per wakeup before yielding */
+	guint		stanza_budget;		/**< Stanzas parsed per wakeup before yielding */
+	guint		burst_stanzas;		/**< Stanzas parsed during current wakeup */
+	gint64		yielded_at;		/**< When session yielded with input left, in microseconds, 0 if it did not */
+	guint		delays[KFXMPP_SESSION_DELAY_BUCKETS];	/**< Histogram of scheduling delays */
+
+	/* Inbound backpressure */
+	GHashTable	*pinned;		/**< Sizes of stanzas and messages pinned by deferred handlers */
+	xmlNodePtr	dispatching;		/**< Stanza a message event is being triggered for */
+	guint		inbound_stanzas;	/**< Number of entries in \b pinned */
+	gsize		inbound_bytes;		/**< Sum of sizes in \b pinned */
+	guint		inbound_max_stanzas;	/**< Reading pauses at this many stanzas, 0 for no limit */
+	gsize		inbound_max_bytes;	/**< Reading pauses at this many bytes, 0 for no limit */
+	KfxmppInboundDropPolicy inbound_drop;	/**< Stanzas dropped while reading is paused */
+	gboolean	reading_paused;		/**< Whether session stopped reading its socket */
+	GString		*held_in;		/**< Data backend received while reading was paused */
+	KfxmppIoTimer	*resume_timer;		/**< Timer resuming reading, if scheduled */
+	guint		n_pauses;		/**< Times reading was paused */
+	guint		n_resumes;		/**< Times reading was resumed */
+	guint		n_dropped;		/**< Stanzas dropped by \b inbound_drop */
 
 	/* TLS stuff */
 	gboolean	secure;			/**< Whether link is secured	*/
+	gboolean	handshaking;		/**< Whether TLS handshake is in progress */
+	gboolean	verify;			/**< Whether server certificate is verified */
+	gboolean	ktls;			/**< Whether kernel should take over records after handshake */
+	gboolean	ktls_ulp;		/**< Whether TLS ULP is attached to socket */
+	gboolean	ktls_failed;		/**< Whether kernel could not take over records */
+	KfxmppKtlsDirection ktls_active;	/**< Directions kernel took over */
+	GString		*tls_in;		/**< Records received by backend and not taken by gnutls yet */
+	GString		*tls_out;		/**< Data waiting to fill a TLS record */
+	gsize		tls_record_size;	/**< Data put in one record, 0 for a record per send */
+	guint		tls_delay;		/**< Milliseconds a partial record waits for more data, 0 for end of iteration */
+	KfxmppIoTimer	*tls_timer;		/**< Timer sealing a partial record, if scheduled */
+	guint		tls_records;		/**< Records sealed so far */
+	KfxmppCryptoPool *crypto_pool;		/**< Pool running handshake steps, NULL to run them here */
 #ifdef HAVE_GNUTLS
 	gnutls_session_t gnutls;		/**< gnutls session object	*/
-	gnutls_certificate_credentials_t cred;	/**< certificate info	*/
+	KfxmppSessionHandshake *offload;	/**< Handshake run on \b crypto_pool, NULL if none */
+#endif
+
+	/* Stream compression */
+	gint		compress_level;		/**< zlib compression level, negative if compression is not wanted */
+	gint		compress_window;	/**< zlib window bits of outgoing stream */
+	gboolean	compress_requested;	/**< Whether compression was requested and server did not answer yet */
+	gboolean	deflate_pending;	/**< Whether data was compressed since last flush point */
+	gboolean	deflating;		/**< Whether compressor is producing output */
+	gsize		raw_sent;		/**< Bytes compressed */
+	gsize		compressed_sent;	/**< Bytes compressor produced */
+	gsize		raw_received;		/**< Bytes decompressed */
+	gsize		compressed_received;	/**< Bytes decompressor consumed */
+#ifdef HAVE_LIBZ
+	z_stream	*deflater;		/**< Compressor of outgoing stream, NULL if not compressed */
+	z_stream	*inflater;		/**< Decompressor of incoming stream, NULL if not compressed */
 #endif
 
 	/* Event handling stuff */
@@ -104,8 +273,8 @@ struct _KfxmppSession {
 
 	/* Timeouts */
 	gint timeout;					/**< Timeout length, in seconds */
-	gint connect_timeout_id;			/**< ID of connect callback */
-	gint ping_pong_id;				/**< ID of ping-pong timeout */
+	KfxmppIoTimer *connect_timer;			/**< Connect timeout */
+	KfxmppIoTimer *ping_pong_timer;			/**< Ping-pong timer */
 };
 
 
@@ -115,18 +284,77 @@ struct _KfxmppSession {
  *
  */
 
-static gboolean kfxmpp_session_io_event (GIOChannel *source, GIOCondition condition, gpointer data);
+static gboolean kfxmpp_session_io_event (KfxmppIoWatch *watch, GIOCondition condition, gpointer data);
+static void kfxmpp_session_io_recv (KfxmppIoWatch *watch, const gchar *buffer, gssize size, gpointer data);
+static void kfxmpp_session_set_completion (KfxmppSession *self, gboolean enable);
 static void kfxmpp_session_connect_ok (KfxmppSession *self);
 static void kfxmpp_session_connect_failed (KfxmppSession *self, KfxmppError error);
 static void kfxmpp_session_connected (GTcpSocket *socket, GTcpSocketConnectAsyncStatus status, gpointer data);
+static gboolean kfxmpp_session_fast_open (KfxmppSession *self, const gchar *addr);
+static void kfxmpp_session_start_stream (KfxmppSession *self);
+static void kfxmpp_session_delete_socket (KfxmppSession *self);
 static void kfxmpp_session_close (KfxmppSession *self);
+static void kfxmpp_session_disconnected (KfxmppSession *self, GIOCondition condition);
 static void kfxmpp_session_open_stream (KfxmppSession *self);
+static gboolean kfxmpp_session_acquire (KfxmppSession *self);
+static void kfxmpp_session_release (KfxmppSession *self);
+static gssize kfxmpp_session_write (KfxmppSession *self, const gchar *buffer, gssize size);
+static gssize kfxmpp_session_transmit (KfxmppSession *self, const gchar *buffer, gssize size);
+static void kfxmpp_session_feed (KfxmppSession *self, const gchar *buffer, gsize size);
+static void kfxmpp_session_queue_data (KfxmppSession *self, const gchar *buffer, gssize size);
+static gboolean kfxmpp_session_drain_send_queue (gpointer data);
+static void kfxmpp_session_schedule_flush (KfxmppSession *self);
+static gboolean kfxmpp_session_flush_idle (gpointer data);
+static gboolean kfxmpp_session_flush (KfxmppSession *self);
+static void kfxmpp_session_stop_flushing (KfxmppSession *self);
+static void kfxmpp_session_free_chunk (gpointer data);
+static gboolean kfxmpp_session_read_burst (KfxmppSession *self);
+static gint64 kfxmpp_session_now (void);
+static void kfxmpp_session_record_delay (KfxmppSession *self, gint64 delay);
+static void kfxmpp_session_update_interest (KfxmppSession *self, gboolean writing);
+static void kfxmpp_session_inbound_grew (KfxmppSession *self, gsize bytes);
+static void kfxmpp_session_inbound_shrank (KfxmppSession *self, gsize bytes);
+static void kfxmpp_session_check_inbound (KfxmppSession *self);
+static gboolean kfxmpp_session_resume_reading (gpointer data);
+static gboolean kfxmpp_session_should_drop (KfxmppSession *self, xmlNodePtr node);
+static gsize kfxmpp_session_node_size (xmlNodePtr node);
+static void kfxmpp_session_account_output (KfxmppSession *self);
+static gboolean kfxmpp_session_check_writable (gpointer data);
+static gint kfxmpp_session_request (KfxmppSession *self, KfxmppStanza *stanza, KfxmppEventHandler *handler,
+					gboolean limited, GError **error);
+#ifdef HAVE_LIBZ
+static gboolean kfxmpp_session_start_compression (KfxmppSession *self);
+static void kfxmpp_session_deflate (KfxmppSession *self, const gchar *buffer, gsize size, gint flush);
+#endif
+static void kfxmpp_session_sync_compression (KfxmppSession *self);
+static void kfxmpp_session_end_compression (KfxmppSession *self);
 #ifdef HAVE_GNUTLS
+static void kfxmpp_session_continue_handshake (KfxmppSession *self);
+static void kfxmpp_session_offload_handshake (KfxmppSession *self);
+static void kfxmpp_session_handshake_step (gpointer data);
+static gboolean kfxmpp_session_handshake_done (gpointer data);
+static void kfxmpp_session_finish_handshake (KfxmppSession *self, gint ret);
+static void kfxmpp_session_free_handshake (KfxmppSessionHandshake *hs);
+static void kfxmpp_session_end_tls (KfxmppSession *self);
+static int kfxmpp_session_verify_peer (gnutls_session_t session);
+static void kfxmpp_session_start_ktls (KfxmppSession *self, KfxmppKtlsDirection direction);
+static gboolean kfxmpp_session_ktls_skip_record (KfxmppSession *self);
+static void kfxmpp_session_seal_records (KfxmppSession *self, gboolean partial);
+static gboolean kfxmpp_session_seal_timeout (gpointer data);
+static gssize kfxmpp_session_hs_send (gnutls_transport_ptr_t p, const void*data, gsize size);
+static gssize kfxmpp_session_hs_recv (gnutls_transport_ptr_t p, void* data, gsize size);
 static gssize kfxmpp_session_tls_send (gnutls_transport_ptr_t p, const void*data, gsize size);
 static gssize kfxmpp_session_tls_recv (gnutls_transport_ptr_t p, void* data, gsize size);
 #endif
 static void kfxmpp_session_got_stream (KfxmppStreamParser *parser, gint version, const gchar *id, gpointer data);
 static void kfxmpp_session_got_xml (KfxmppStreamParser *parser, xmlNodePtr node, gpointer data);
+static void kfxmpp_session_got_presence (KfxmppPresenceCoalescer *coalescer, xmlNodePtr node, gpointer data);
+static void kfxmpp_session_reset_parser (KfxmppSession *self);
+static void kfxmpp_session_dispatch_xml (KfxmppSession *self, xmlNodePtr node);
+static gpointer kfxmpp_session_pin_stanza (gpointer source, gpointer data);
+static void kfxmpp_session_unpin_stanza (gpointer source, gpointer data);
+static gpointer kfxmpp_session_pin_message (gpointer source, gpointer data);
+static void kfxmpp_session_unpin_message (gpointer source, gpointer data);
 static gboolean kfxmpp_session_xml_event (KfxmppEventHandler *handler, KfxmppSession *self, KfxmppStanza *stazna, gpointer data);
 static void kfxmpp_session_bind_resource (KfxmppSession *self);
 static gboolean kfxmpp_session_bind_resource_response (KfxmppEventHandler *handler, gpointer source,
@@ -159,11 +387,23 @@ KfxmppSession *kfxmpp_session_new (const gchar *server)
 	
 	self->port = KFXMPP_DEFAULT_PORT;
 	self->use_tls = KFXMPP_TLS_POLICY_IF_AVAILABLE;
+	self->verify = TRUE;
 
 	self->context = g_main_context_default ();
+	g_main_context_ref (self->context);
+	self->send_queue = kfxmpp_mpsc_queue_new ();
+	self->out_queue = kfxmpp_out_queue_new ();
+	self->recv_size = BUFFER_SIZE;
+	kfxmpp_session_set_scheduling_profile (self, KFXMPP_SCHEDULING_THROUGHPUT);
+	self->tls_delay = 0;
+	self->pinned = g_hash_table_new (NULL, NULL);
+	self->high_watermark = DEFAULT_HIGH_WATERMARK;
+	self->low_watermark = DEFAULT_LOW_WATERMARK;
+	self->compress_level = -1;
+	self->compress_window = DEFAULT_COMPRESS_WINDOW;
 
 	/* Setup parser */
-	self->parser = kfxmpp_stream_parser_new (kfxmpp_session_got_xml, self);	
+	kfxmpp_session_reset_parser (self);
 	kfxmpp_stream_parser_set_stream_callback (self->parser, kfxmpp_session_got_stream);
 
 	/* Setup events */
@@ -179,8 +419,8 @@ KfxmppSession *kfxmpp_session_new (const gchar *server)
 
 	/* Timeouts */
 	self->timeout = DEFAULT_TIMEOUT;
-	self->connect_timeout_id = 0;
-	self->ping_pong_id = 0;
+	self->connect_timer = NULL;
+	self->ping_pong_timer = NULL;
 	
 	return self;
 }
@@ -195,26 +435,51 @@ void kfxmpp_session_free (KfxmppSession *self)
 	gint i;
 
 	g_return_if_fail (self);
+
+	/* Watch and timers of a shared backend would outlive session */
+	kfxmpp_session_delete_socket (self);
+	kfxmpp_session_close (self);
 	
 	g_free (self->username);
 	g_free (self->server);
 	g_free (self->password);
 	g_free (self->resource);
 	g_free (self->host_address);
+	g_free (self->peer_host);
 
-	gnet_tcp_socket_unref (self->socket);
 	kfxmpp_stream_parser_unref (self->parser);
+	if (self->parser_pool)
+		kfxmpp_stream_parser_pool_unref (self->parser_pool);
+	if (self->crypto_pool)
+		kfxmpp_crypto_pool_unref (self->crypto_pool);
+	kfxmpp_mpsc_queue_free (self->send_queue, kfxmpp_session_free_chunk);
+	kfxmpp_out_queue_free (self->out_queue);
+	g_free (self->recv_buffer);
+	if (self->tls_in)
+		g_string_free (self->tls_in, TRUE);
+	if (self->tls_out)
+		g_string_free (self->tls_out, TRUE);
+	if (self->held_in)
+		g_string_free (self->held_in, TRUE);
+	g_hash_table_destroy (self->pinned);
+	if (self->backend)
+		kfxmpp_io_backend_unref (self->backend);
+	if (self->coalescer)
+		kfxmpp_presence_coalescer_free (self->coalescer);
+	g_list_foreach (self->filters, (GFunc) kfxmpp_filter_unref, NULL);
+	g_list_free (self->filters);
 
 #ifdef HAVE_GNUTLS	
-	gnutls_deinit (self->gnutls);
-	gnutls_certificate_free_credentials (self->cred);
+	kfxmpp_session_end_tls (self);
 #endif
+	kfxmpp_session_end_compression (self);
 
 	/* Free events */
 	for (i = 0; i < KFXMPP_N_EVENT_TYPES; i++) {
 		kfxmpp_event_unref (self->events[i]);
 	}
 	g_hash_table_destroy (self->response_ids);
+	g_main_context_unref (self->context);
 	
 	g_free (self);
 }
@@ -222,11 +487,13 @@ void kfxmpp_session_free (KfxmppSession *self)
 
 /**
  * \brief Add a reference to KfxmppSession
+ *
+ * This function is thread-safe.
  **/
 KfxmppSession* kfxmpp_session_ref (KfxmppSession *self)
 {
         g_return_val_if_fail (self, NULL);
-        self->ref_count++;
+        g_atomic_int_inc (&self->ref_count);
         return self;
 }
 
@@ -234,13 +501,15 @@ KfxmppSession* kfxmpp_session_ref (KfxmppSession *self)
 /**
  * \brief Remove a reference from KfxmppSession
  *
- * Object will be deleted when reference count reaches 0
+ * Object will be deleted when reference count reaches 0. This function is
+ * thread-safe, but the last reference should be dropped in the thread that
+ * runs the session's main context, as freeing a session tears down its
+ * event sources.
  **/
 void kfxmpp_session_unref (KfxmppSession *self)
 {
         g_return_if_fail (self);
-        self->ref_count--;
-        if (self->ref_count == 0)
+        if (g_atomic_int_dec_and_test (&self->ref_count))
                 kfxmpp_session_free (self);
 }
 
@@ -444,6 +713,19 @@ int kfxmpp_session_get_priority (KfxmppSession *self)
 }
 
 
+/**
+ * \brief Set whether session secures its connection with TLS
+ * \param self A session
+ * \param use_tls A TLS usage policy
+ *
+ * KFXMPP_TLS_POLICY_DIRECT is for endpoints expecting TLS straight away,
+ * usually on KFXMPP_DEFAULT_DIRECT_TLS_PORT, which has to be set as well.
+ * Handshake then starts right after connecting, offering ALPN protocol
+ * "xmpp-client", and saves plaintext stream header, features, STARTTLS
+ * request and its answer. ALPN is advisory: a server that does not
+ * negotiate it is accepted, one that selects another protocol fails
+ * handshake with KFXMPP_ERROR_TLS_HANDSHAKE_FAILED.
+ **/
 void kfxmpp_session_set_use_tls (KfxmppSession *self, KfxmppTlsUsagePolicy use_tls)
 {
 	g_return_if_fail (self);
@@ -461,718 +743,3394 @@ KfxmppTlsUsagePolicy kfxmpp_session_get_use_tls (KfxmppSession *self)
 
 
 /**
- * \brief Set protocol version to use
+ * \brief Set whether server certificate is verified
  * \param self A session
- * \param proto A protocol version
+ * \param verify TRUE to verify certificate against system trust store
+ * 	and server name (default), FALSE to accept any certificate
  *
- * There are some minor differences between XMPP 1.0 and legacy Jabber protocol.
- * KFXMPP_PROTOCOL_AUTO, the default setting, should be suitable for most needs.
+ * Handshake fails with KFXMPP_ERROR_TLS_HANDSHAKE_FAILED if certificate
+ * does not verify.
  **/
-void kfxmpp_session_set_protocol (KfxmppSession *self, KfxmppProtocol proto)
+void kfxmpp_session_set_verify_certificate (KfxmppSession *self, gboolean verify)
 {
 	g_return_if_fail (self);
 
-	self->protocol = proto;
+	self->verify = verify;
 }
 
 
 /**
- * \brief Get protocol version used it this session
+ * \brief Get whether server certificate is verified
  * \param self A session
- * \return Protocol version
+ * \return TRUE if certificate is verified
  **/
-KfxmppProtocol kfxmpp_session_get_protocol (KfxmppSession *self)
+gboolean kfxmpp_session_get_verify_certificate (KfxmppSession *self)
 {
-	g_return_val_if_fail (self, -1);
+	g_return_val_if_fail (self, FALSE);
 
-	return self->protocol;
+	return self->verify;
 }
 
 
 /**
- * \brief Set timeout length
+ * \brief Set whether kernel should encrypt and decrypt TLS records
  * \param self A session
- * \param timeout Timeout length (in seconds)
+ * \param enable TRUE to hand keys to kernel TLS after handshake
+ *
+ * Sessions then write and read plain data on their socket, and kernel
+ * does the rest. Sending switches over once records gnutls encrypted
+ * have been written, receiving once gnutls holds no partial record, after
+ * first data record; control records kernel receives later, such as
+ * late TLS 1.3 tickets, are skipped. When kernel lacks TLS support or
+ * negotiated cipher, gnutls goes on as before. Only AES-GCM and
+ * ChaCha20-Poly1305 are offloaded. Receiving is not offloaded in
+ * io_uring completion mode. Disabled by default.
  **/
-void kfxmpp_session_set_timeout (KfxmppSession *self, gint timeout)
+void kfxmpp_session_set_ktls (KfxmppSession *self, gboolean enable)
 {
 	g_return_if_fail (self);
 
-	self->timeout = timeout;
+	self->ktls = enable;
 }
 
 
 /**
- * \brief Get timeout length version used it this session
+ * \brief Get whether kernel should encrypt and decrypt TLS records
  * \param self A session
- * \return Timeout (in seconds)
+ * \return TRUE if kernel TLS is enabled
  **/
-KfxmppProtocol kfxmpp_session_get_timeout (KfxmppSession *self)
+gboolean kfxmpp_session_get_ktls (KfxmppSession *self)
 {
-	g_return_val_if_fail (self, -1);
+	g_return_val_if_fail (self, FALSE);
 
-	return self->timeout;
+	return self->ktls;
 }
 
 
-
-/***********************************************************************
- * 
- * Network Input/Output
- *
- */
-
 /**
- * \brief Read data from remote host
+ * \brief Get directions kernel TLS has taken over
  * \param self A session
- * \param buffer Location of buffer to store read data
- * \param size Size of buffer
- * \param error Locatiopn to store error information (may be NULL)
- * \return Number of bytes read. Negative value means error.
+ * \return Directions, KFXMPP_KTLS_NONE if gnutls does everything
  **/
-gssize kfxmpp_session_read (KfxmppSession *self, gchar *buffer, gssize size, GError **error)
+KfxmppKtlsDirection kfxmpp_session_get_ktls_active (KfxmppSession *self)
 {
-	gssize bytes_read;
-
-	g_return_val_if_fail (self, -999);
-	
-#ifdef HAVE_GNUTLS
-	if (self->secure) {
-		/* Write through gnutls */
-		bytes_read = gnutls_record_recv (self->gnutls, buffer, size);
-	} else
-#endif
-	{
-		GIOStatus status;
-		status = g_io_channel_read_chars
-				(self->io, buffer, size, &bytes_read, NULL);
-		
-		if (status != G_IO_STATUS_NORMAL) {
-			/* Some error */
-			/* TODO: check these errors */
-			return -1;
-		}
-	}
-
-#ifdef DEBUG
-	extern gboolean debug_net;
-	if (debug_net) {
-		g_printerr ("\nrecv\n----\n");
-		fwrite (buffer, 1, bytes_read, stderr);
-		g_printerr ("\n");
-	}
-#endif
+	g_return_val_if_fail (self, KFXMPP_KTLS_NONE);
 
-	return bytes_read;
+	return self->ktls_active;
 }
 
 
 /**
- * \brief Send an XML stanza to remote host
+ * \brief Set whether session saves round trips when connecting
  * \param self A session
- * \param stanza A xml stanza
- * \param error Location to store error information (may be NULL)
- * \return Number of bytes written. Negative value means an error.
+ * \param enable TRUE to connect with TCP Fast Open
+ *
+ * Connecting again to host and port of last connection then skips name
+ * lookup and uses TCP Fast Open, so stream header is sent with SYN once
+ * kernel has a server cookie, from the connection after next one on.
+ * Connection errors show up as disconnects then, and make session look
+ * host up again next time. Disabled by default.
+ *
+ * See also kfxmpp_session_set_bind_pipelining, which saves one more
+ * round trip.
  **/
-gssize kfxmpp_session_send (KfxmppSession *self, KfxmppStanza *stanza, GError **error)
+void kfxmpp_session_set_fast_open (KfxmppSession *self, gboolean enable)
 {
-	gchar *xml;
-	gssize ret;
-	
-	g_return_val_if_fail (self, -1);
-	g_return_val_if_fail (stanza, -1);
+	g_return_if_fail (self);
 
-	xml = kfxmpp_stanza_to_string (stanza);
-	ret = kfxmpp_session_send_raw (self, xml, strlen (xml), NULL);
-//	kfxmpp_log ("send\n----\n%s\n", xml);
-	g_free (xml);
-	return ret;
+	self->fast_open = enable;
 }
 
 
 /**
- * \brief Send an XML stanza to remote host and call a handler when a response is received
+ * \brief Get whether session saves round trips when connecting
  * \param self A session
- * \param stanza A xml stanza
- * \param handler An event handler to be called when response is received
- * \param error Locatiopn to store error information (may be NULL)
- * \return an ID. Response handler can be canceled with kfxmpp_session_cancel_response
+ * \return TRUE if fast open is enabled
  **/
-gint kfxmpp_session_send_await_response (KfxmppSession *self, KfxmppStanza *stanza, KfxmppEventHandler *handler, GError **error)
+gboolean kfxmpp_session_get_fast_open (KfxmppSession *self)
 {
-	static gint id = 0;
-	gchar idstr[10];	/* Should be enough */
+	g_return_val_if_fail (self, FALSE);
 
-	g_return_val_if_fail (self, -1);
-	g_return_val_if_fail (stanza, -1);
-	g_return_val_if_fail (handler, -1);
+	return self->fast_open;
+}
 
-	snprintf (idstr, 10, RESPONSE_STRING, ++id);
 
-	/* Set the id property */
-	xmlSetProp (stanza->node, BAD_CAST "id", BAD_CAST idstr);
+/**
+ * \brief Set whether resource binding is requested without waiting for stream features
+ * \param self A session
+ * \param enable TRUE to request binding right after SASL authentication
+ *
+ * Binding is then sent together with stream header restarted after
+ * authentication, one round trip earlier. Stream features server sends
+ * after that are not inspected: session assumes binding is offered, as
+ * RFC 6120 requires, and negotiates nothing else on restarted stream.
+ * Binding waits for features anyway when compression is enabled.
+ * Disabled by default.
+ **/
+void kfxmpp_session_set_bind_pipelining (KfxmppSession *self, gboolean enable)
+{
+	g_return_if_fail (self);
 
-	/* Send stanza */
-	kfxmpp_session_send (self, stanza, NULL);
+	self->bind_pipelining = enable;
+}
 
-	/* Register handler */
-	kfxmpp_session_await_response (self, idstr, handler);
 
-	return id;
+/**
+ * \brief Get whether resource binding is requested without waiting for stream features
+ * \param self A session
+ * \return TRUE if binding is pipelined
+ **/
+gboolean kfxmpp_session_get_bind_pipelining (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, FALSE);
+
+	return self->bind_pipelining;
 }
 
 
 /**
- * \brief Send raw character data to server
+ * \brief Set whether session compresses its stream
  * \param self A session
- * \param buffer Character data to be sent
- * \param size Size of data to be transmitted, or -1 if data is null-terminated
- * \param error Locatiopn to store error information (may be NULL)
- * \return Number of bytes sent. Negative value means an error
+ * \param level zlib compression level, 0 (fastest) to 9 (smallest).
+ * 	Negative value disables compression (default).
+ * \param window zlib window bits of outgoing stream, 9 to 15
+ *
+ * Compression (XEP-0138) is requested after authentication, if server
+ * offers zlib. Compressor takes about 2^(window + 3) bytes, 256 KB with
+ * default window of 15 and 4 KB with 9; decompressor takes about 40 KB,
+ * as server chooses its own window. Output is
+ * flushed to a byte boundary whenever output queue is flushed, so
+ * compression gets better the more is sent in one main loop iteration.
+ * Takes effect on next connection.
  **/
-gssize kfxmpp_session_send_raw (KfxmppSession *self, const gchar *buffer, gssize size, GError **error)
+void kfxmpp_session_set_compression (KfxmppSession *self, gint level, gint window)
 {
-	gssize bytes_written;
-	
-	g_return_val_if_fail (self, -9);	/* Magic numbers... FIXME */
+	g_return_if_fail (self);
 
-	if (size == -1)
-		size = strlen (buffer);
-	
-#ifdef DEBUG
-	extern gboolean debug_net;
-	if (debug_net) {
-		g_printerr ("\nsend\n----\n");
-		fwrite (buffer, 1, size, stderr);
-		g_printerr ("\n");
-	}
-#endif
-	
-#ifdef HAVE_GNUTLS
-	if (self->secure) {
-		bytes_written = gnutls_record_send (self->gnutls, buffer, size);
-	} else
+#ifdef HAVE_LIBZ
+	self->compress_level = MIN (level, 9);
+	self->compress_window = CLAMP (window, 9, 15);
+#else
+	/* Built without zlib */
+	self->compress_level = -1;
 #endif
-	{
-		GIOStatus status;
-		status = g_io_channel_write_chars
-			(self->io, buffer, size, &bytes_written, NULL);
-
-		if (status != G_IO_STATUS_NORMAL) {
-			/* Error */
-			return -1;
-		}
-	}
-	return bytes_written;
 }
 
 
 /**
- * \brief Function called when connection was broken
- * \param self KfxmppSession
- * \param condition Condition that caused connection to close
+ * \brief Get compression level
+ * \param self A session
+ * \return zlib compression level, or -1 if compression is disabled
  **/
-static void kfxmpp_session_disconnected (KfxmppSession *self, GIOCondition condition)
+gint kfxmpp_session_get_compression (KfxmppSession *self)
 {
-	kfxmpp_log ("Disconnected\n");
-
-	/* Close underlying socket */
-	gnet_tcp_socket_delete (self->socket);
-	self->socket = NULL;
-
-	/* Clean up session */
-	kfxmpp_session_close (self);
+	g_return_val_if_fail (self, -1);
 
-	/* Notify user of broken connection */
-	if (self->disconnect_callback) {
-		self->disconnect_callback (self, KFXMPP_SESSION_DISCONNECT_STATUS_REMOTE_HOST, self->disconnect_data);
-	}
+	return self->compress_level;
 }
 
 
 /**
- * \brief Callback called when data from remote host is received
- * \param I/O channel on which event occured
- * \param condition A condition that was satisfied
- * \param data A Kfxmpp session
- * \return FALSE if this callback should be removed
+ * \brief Check whether stream is compressed
+ * \param self A session
+ * \return TRUE if server agreed to compress current stream
  **/
-static gboolean kfxmpp_session_io_event (GIOChannel *source, GIOCondition condition, gpointer data)
+gboolean kfxmpp_session_get_compressed (KfxmppSession *self)
 {
-	KfxmppSession *self = data;
-	
-	if (condition & G_IO_IN) {
-		gchar buffer[BUFFER_SIZE];
-		gssize bytes_read;
-
-		bytes_read = kfxmpp_session_read (self, buffer, BUFFER_SIZE, NULL);
-		if (bytes_read > 0) {
-			kfxmpp_stream_parser_feed (self->parser, buffer, bytes_read);
-		}
-	}
-	if (condition & G_IO_HUP) {
-		/* Connection hung up... handle it */
-		/* TODO */
+	g_return_val_if_fail (self, FALSE);
 
-		kfxmpp_log ("G_IO_HUP\n");
-		kfxmpp_session_disconnected (self, condition);
-	}
-	if (condition & G_IO_NVAL) {
-		/* Performing action on a file description that is not open... */
+#ifdef HAVE_LIBZ
+	return self->deflater != NULL;
+#else
+	return FALSE;
+#endif
+}
 
-		kfxmpp_log ("G_IO_NVAL\n");
-		kfxmpp_session_disconnected (self, condition);
-	}
-	if (condition & G_IO_ERR) {
-		/* Some error */
 
-		kfxmpp_log ("G_IO_ERR\n");
-		kfxmpp_session_disconnected (self, condition);
-	}
+/**
+ * \brief Get amount of data stream compression went through
+ * \param self A session
+ * \param sent Location to store number of bytes sent before compression, or NULL
+ * \param sent_compressed Location to store number of bytes sent after compression, or NULL
+ * \param received Location to store number of bytes received after decompression, or NULL
+ * \param received_compressed Location to store number of bytes received before decompression, or NULL
+ *
+ * Counters cover all connections of session.
+ **/
+void kfxmpp_session_get_compression_stats (KfxmppSession *self, gsize *sent, gsize *sent_compressed,
+		gsize *received, gsize *received_compressed)
+{
+	g_return_if_fail (self);
 
-	return TRUE;
+	if (sent)
+		*sent = self->raw_sent;
+	if (sent_compressed)
+		*sent_compressed = self->compressed_sent;
+	if (received)
+		*received = self->raw_received;
+	if (received_compressed)
+		*received_compressed = self->compressed_received;
 }
 
 
-/***********************************************************************
+/**
+ * \brief Set protocol version to use
+ * \param self A session
+ * \param proto A protocol version
  *
- * Network stuff
- * 
- */
+ * There are some minor differences between XMPP 1.0 and legacy Jabber protocol.
+ * KFXMPP_PROTOCOL_AUTO, the default setting, should be suitable for most needs.
+ **/
+void kfxmpp_session_set_protocol (KfxmppSession *self, KfxmppProtocol proto)
+{
+	g_return_if_fail (self);
+
+	self->protocol = proto;
+}
 
 
 /**
- * \brief Callback called when connect timeout expires
- * \param data A KfxmppSession
- * \return FALSE
+ * \brief Get protocol version used it this session
+ * \param self A session
+ * \return Protocol version
  **/
-static gboolean kfxmpp_session_connect_timeout                  (gpointer data)
+KfxmppProtocol kfxmpp_session_get_protocol (KfxmppSession *self)
 {
-	KfxmppSession *self = data;
+	g_return_val_if_fail (self, -1);
 
-	kfxmpp_log ("Timeout expired...\n");
-	
-	/* Unset this timeout */
-	self->connect_timeout_id = 0;
+	return self->protocol;
+}
+
+
+/**
+ * \brief Set timeout length
+ * \param self A session
+ * \param timeout Timeout length (in seconds)
+ **/
+void kfxmpp_session_set_timeout (KfxmppSession *self, gint timeout)
+{
+	g_return_if_fail (self);
+
+	self->timeout = timeout;
+}
+
+
+/**
+ * \brief Get timeout length version used it this session
+ * \param self A session
+ * \return Timeout (in seconds)
+ **/
+KfxmppProtocol kfxmpp_session_get_timeout (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, -1);
+
+	return self->timeout;
+}
+
+
+/**
+ * \brief Enable or disable coalescing of incoming presences
+ * \param self A session
+ * \param window Time (in milliseconds) presences are held before being
+ * 	dispatched. 0 means presences are held until all data received in
+ * 	a single read is parsed. Negative value disables coalescing (default).
+ *
+ * After a reconnect or a roster change, servers tend to send a flood of
+ * presences. With coalescing enabled, only the newest availability presence
+ * of each full JID in a window is dispatched. Other stanzas are never
+ * delayed.
+ **/
+void kfxmpp_session_set_presence_coalescing (KfxmppSession *self, gint window)
+{
+	g_return_if_fail (self);
+
+	if (window < 0) {
+		if (self->coalescer) {
+			kfxmpp_presence_coalescer_flush (self->coalescer);
+			kfxmpp_presence_coalescer_free (self->coalescer);
+			self->coalescer = NULL;
+		}
+		return;
+	}
+
+	if (self->coalescer == NULL) {
+		self->coalescer = kfxmpp_presence_coalescer_new (kfxmpp_session_got_presence, self);
+		if (! self->default_backend)
+			kfxmpp_presence_coalescer_set_io_backend (self->coalescer, self->backend);
+	}
+	kfxmpp_presence_coalescer_set_window (self->coalescer, window, self->context);
+}
+
+
+/**
+ * \brief Get presence coalescing window
+ * \param self A session
+ * \return Window in milliseconds, or -1 if coalescing is disabled
+ **/
+gint kfxmpp_session_get_presence_coalescing (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, -1);
+
+	if (self->coalescer == NULL)
+		return -1;
+	return kfxmpp_presence_coalescer_get_window (self->coalescer);
+}
+
+
+/**
+ * \brief Get number of presences dropped by coalescing
+ * \param self A session
+ * \return Number of presences that were replaced by newer ones before being dispatched
+ **/
+guint kfxmpp_session_get_presences_collapsed (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	if (self->coalescer == NULL)
+		return 0;
+	return kfxmpp_presence_coalescer_get_collapsed (self->coalescer);
+}
+
+
+/**
+ * \brief Get number of incoming stanzas waiting for deferred handlers
+ * \param self A session
+ * \return Number of pending dispatches of all session events
+ **/
+guint kfxmpp_session_get_pending_stanzas (KfxmppSession *self)
+{
+	guint pending = 0;
+	gint i;
+
+	g_return_val_if_fail (self, 0);
+
+	for (i = 0; i < KFXMPP_N_EVENT_TYPES; i++)
+		pending += kfxmpp_event_get_pending (self->events[i]);
+	return pending;
+}
+
+
+/**
+ * \brief Get age of oldest stanza waiting for a deferred handler
+ * \param self A session
+ * \return Time in milliseconds, 0 if nothing is pending
+ **/
+gulong kfxmpp_session_get_pending_age (KfxmppSession *self)
+{
+	gulong age = 0;
+	gint i;
+
+	g_return_val_if_fail (self, 0);
+
+	for (i = 0; i < KFXMPP_N_EVENT_TYPES; i++)
+		age = MAX (age, kfxmpp_event_get_pending_age (self->events[i]));
+	return age;
+}
+
+
+/**
+ * \brief Install a stanza filter on incoming stream
+ * \param self A session
+ * \param filter A filter
+ *
+ * Stanzas matched by \b filter are dropped while being parsed, before
+ * any DOM tree is built for them, so they never reach event handlers.
+ * Filters survive stream restarts after TLS and SASL negotiation.
+ * Session holds its own reference to \b filter.
+ *
+ * Filters must be added and removed from thread running session's main
+ * context.
+ **/
+void kfxmpp_session_add_filter (KfxmppSession *self, KfxmppFilter *filter)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (filter);
+
+	self->filters = g_list_append (self->filters, kfxmpp_filter_ref (filter));
+	kfxmpp_stream_parser_add_filter (self->parser, filter);
+}
+
+
+/**
+ * \brief Remove a stanza filter
+ * \param self A session
+ * \param filter A filter previously added with kfxmpp_session_add_filter
+ **/
+void kfxmpp_session_remove_filter (KfxmppSession *self, KfxmppFilter *filter)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (filter);
+
+	if (g_list_find (self->filters, filter) == NULL)
+		return;
+
+	kfxmpp_stream_parser_remove_filter (self->parser, filter);
+	self->filters = g_list_remove (self->filters, filter);
+	kfxmpp_filter_unref (filter);
+}
+
+
+/**
+ * \brief Set backend notifying session about socket readiness
+ * \param self A session
+ * \param backend A backend, NULL to use GLib main loop of session's context
+ *
+ * Backend also runs session's timers: connect timeout, keepalive,
+ * flushing of output queue and presence coalescing window. Epoll, io_uring
+ * and external backends also write data sent from other threads and
+ * resume deferred event handlers, see kfxmpp_io_backend_invoke. This can
+ * be changed only while session is not connected.
+ *
+ * If backend can do I/O itself, like io_uring one, session lets it
+ * receive and write socket data, except during TLS handshake.
+ **/
+void kfxmpp_session_set_io_backend (KfxmppSession *self, KfxmppIoBackend *backend)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (self->watch == NULL && self->connect_timer == NULL);
+
+	if (backend)
+		kfxmpp_io_backend_ref (backend);
+	if (self->backend)
+		kfxmpp_io_backend_unref (self->backend);
+	self->backend = backend;
+	self->default_backend = FALSE;
+
+	/* Window of held presences expires where everything else does */
+	if (self->coalescer)
+		kfxmpp_presence_coalescer_set_io_backend (self->coalescer, backend);
+}
+
+
+/**
+ * \brief Get backend notifying session about socket readiness
+ * \param self A session
+ * \return A backend, NULL if session has not connected yet and will use default one
+ **/
+KfxmppIoBackend *kfxmpp_session_get_io_backend (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, NULL);
+
+	return self->backend;
+}
+
+
+/**
+ * \brief Get socket descriptor of a session
+ * \param self A session
+ * \return A file descriptor, -1 while session has no socket
+ *
+ * With an external backend, application polls it for conditions returned
+ * by kfxmpp_session_get_interest and passes what it finds to
+ * kfxmpp_session_process.
+ **/
+gint kfxmpp_session_get_fd (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, -1);
+
+	if (self->watch == NULL)
+		return -1;
+	return kfxmpp_io_watch_get_fd (self->watch);
+}
+
+
+/**
+ * \brief Get conditions session waits for on its socket
+ * \param self A session
+ * \return G_IO_IN, with G_IO_OUT while output is queued; 0 while
+ * 	session has no socket
+ **/
+GIOCondition kfxmpp_session_get_interest (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	if (self->watch == NULL)
+		return 0;
+	return kfxmpp_io_watch_get_interest (self->watch);
+}
+
+
+/**
+ * \brief Get time session's next timer expires at
+ * \param self A session
+ * \return Time on clock of kfxmpp_io_get_time, -1 if there is no timer
+ * 	or backend is GLib one
+ *
+ * Deadline may have passed already, e.g. when output was queued and is
+ * to be flushed, reading was deferred, or other threads sent data. Timers of other sessions
+ * sharing the backend do not count, see kfxmpp_io_backend_get_deadline.
+ **/
+gint64 kfxmpp_session_get_deadline (KfxmppSession *self)
+{
+	KfxmppIoTimer *timers[5];
+	gint64 deadline = -1;
+	gint i;
+
+	g_return_val_if_fail (self, -1);
+
+	if (self->backend == NULL)
+		return -1;
+	if (self->watch && kfxmpp_io_watch_get_deferred (self->watch))
+		return kfxmpp_io_get_time ();
+	/* Other threads sent something, see kfxmpp_session_process */
+	if (! kfxmpp_mpsc_queue_is_empty (self->send_queue))
+		return kfxmpp_io_get_time ();
+	if (self->coalescer)
+		deadline = kfxmpp_presence_coalescer_get_deadline (self->coalescer);
+
+	timers[0] = self->connect_timer;
+	timers[1] = self->ping_pong_timer;
+	timers[2] = self->flush_timer;
+	timers[3] = self->resume_timer;
+	timers[4] = self->tls_timer;
+	for (i = 0; i < G_N_ELEMENTS (timers); i++) {
+		gint64 expires;
+
+		if (timers[i] == NULL)
+			continue;
+		expires = kfxmpp_io_timer_get_deadline (timers[i]);
+		if (expires >= 0 && (deadline < 0 || expires < deadline))
+			deadline = expires;
+	}
+
+	return deadline;
+}
+
+
+/**
+ * \brief Handle socket readiness and expired timers of a session
+ * \param self A session with an external backend
+ * \param revents Conditions that hold for socket, 0 if only deadline passed
+ * \param now Current time, see kfxmpp_io_get_time
+ *
+ * This is how application's own loop drives a session, with no GLib
+ * main loop in between. Afterwards, descriptor, interest and deadline are
+ * to be read again. Data other threads sent is written here, and so are
+ * deferred event handlers resumed and coalesced presences delivered,
+ * all by backend's dispatch. Application learns about those through
+ * deadline, or by polling kfxmpp_io_backend_get_wakeup_fd of session's
+ * backend and calling this with no \b revents when it is readable. Only
+ * connecting goes through session's main context, which application
+ * iterates until connect callback is called.
+ *
+ * Calling thread must own session's main context while this runs, as
+ * handlers may touch sources attached to it. When another thread is
+ * iterating the context, nothing is processed, so session should have a
+ * context of its own, see kfxmpp_session_set_context.
+ **/
+void kfxmpp_session_process (KfxmppSession *self, GIOCondition revents, gint64 now)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (self->backend);
+
+	if (! g_main_context_acquire (self->context)) {
+		g_warning ("Session's main context is run by another thread, not processing");
+		return;
+	}
+
+	kfxmpp_session_ref (self);
+	kfxmpp_io_backend_process (self->backend, self->watch, revents, now);
+
+	/* Backend claimed above, what other threads sent since is ours to write */
+	if (! kfxmpp_mpsc_queue_is_empty (self->send_queue))
+		kfxmpp_session_drain_send_queue (self);
+	kfxmpp_session_unref (self);
+
+	g_main_context_release (self->context);
+}
+
+
+/**
+ * \brief Set main context session runs in
+ * \param self A session
+ * \param context A main context, NULL for default one
+ *
+ * Connecting, timers of default backend, data sent from other threads and
+ * deferred event handlers are all dispatched by \b context, so after
+ * this, all functions that are not thread-safe must be called from thread
+ * running it. This can be changed only while session is closed.
+ **/
+void kfxmpp_session_set_context (KfxmppSession *self, GMainContext *context)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (self->state == KFXMPP_SESSION_STATE_CLOSED);
+	g_return_if_fail (self->watch == NULL && self->connect_timer == NULL);
+
+	if (context == NULL)
+		context = g_main_context_default ();
+	if (context == self->context)
+		return;
+
+	g_main_context_ref (context);
+	g_main_context_unref (self->context);
+	self->context = context;
+
+	/* GLib backend of old context is created again on connect */
+	if (self->default_backend)
+		kfxmpp_session_set_io_backend (self, NULL);
+
+	if (self->coalescer)
+		kfxmpp_presence_coalescer_set_window (self->coalescer,
+				kfxmpp_presence_coalescer_get_window (self->coalescer),
+				self->context);
+}
+
+
+/**
+ * \brief Get main context session runs in
+ * \param self A session
+ * \return A main context
+ **/
+GMainContext *kfxmpp_session_get_context (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, NULL);
+
+	return self->context;
+}
+
+
+/**
+ * \brief Set pool new stream parsers take their contexts from
+ * \param self A session
+ * \param pool A pool, NULL to create every context anew
+ *
+ * A session parses a new stream after each connect, TLS negotiation and
+ * SASL authentication. Sessions driven by the same thread may share a
+ * pool. This can be changed only while session is closed.
+ **/
+void kfxmpp_session_set_parser_pool (KfxmppSession *self, KfxmppStreamParserPool *pool)
+{
+	KfxmppStreamParser *old;
+
+	g_return_if_fail (self);
+	g_return_if_fail (self->state == KFXMPP_SESSION_STATE_CLOSED);
+
+	if (pool)
+		kfxmpp_stream_parser_pool_ref (pool);
+	if (self->parser_pool)
+		kfxmpp_stream_parser_pool_unref (self->parser_pool);
+	self->parser_pool = pool;
+
+	/* Parser for next stream comes from new pool */
+	old = self->parser;
+	kfxmpp_session_reset_parser (self);
+	kfxmpp_stream_parser_set_stream_callback (self->parser, kfxmpp_session_got_stream);
+	kfxmpp_stream_parser_unref (old);
+}
+
+
+/**
+ * \brief Set pool TLS handshakes are run on
+ * \param self A session
+ * \param pool A crypto pool, NULL to run handshakes on session's thread
+ *
+ * Handshake steps are CPU-heavy. When many sessions connect at once, they
+ * would hold up sessions already open on the same thread; with a pool
+ * they run on its workers, while reading and writing their records stays
+ * here. Sessions of all threads may share a pool. This can be changed
+ * only while session is closed.
+ **/
+void kfxmpp_session_set_crypto_pool (KfxmppSession *self, KfxmppCryptoPool *pool)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (self->state == KFXMPP_SESSION_STATE_CLOSED);
+
+	if (pool)
+		kfxmpp_crypto_pool_ref (pool);
+	if (self->crypto_pool)
+		kfxmpp_crypto_pool_unref (self->crypto_pool);
+	self->crypto_pool = pool;
+}
+
+
+/**
+ * \brief Get pool TLS handshakes are run on
+ * \param self A session
+ * \return A crypto pool, or NULL
+ **/
+KfxmppCryptoPool *kfxmpp_session_get_crypto_pool (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, NULL);
+
+	return self->crypto_pool;
+}
+
+
+/**
+ * \brief Set limits of data waiting to be written
+ * \param self A session
+ * \param low Writable callback is called when queue drains to this many bytes
+ * \param high kfxmpp_session_send fails when this many bytes are queued, 0 means no limit
+ *
+ * Only kfxmpp_session_send is limited, kfxmpp_session_send_raw always
+ * queues data. Defaults are 256 KiB and 1 MiB.
+ **/
+void kfxmpp_session_set_send_watermarks (KfxmppSession *self, gsize low, gsize high)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (high == 0 || low <= high);
+
+	self->low_watermark = low;
+	self->high_watermark = high;
+}
+
+
+/**
+ * \brief Set function called when send queue drains below low watermark
+ * \param self A session
+ * \param callback A callback
+ * \param data Data that will be passed to callback
+ **/
+void kfxmpp_session_set_writable_callback (KfxmppSession *self, KfxmppSessionWritableCallback callback, gpointer data)
+{
+	g_return_if_fail (self);
+
+	self->writable_callback = callback;
+	self->writable_data = data;
+}
+
+
+/**
+ * \brief Get number of bytes waiting to be written
+ * \param self A session
+ * \return Number of bytes, including data queued by other threads
+ *
+ * This function may be called from any thread. With TLS, encrypted size
+ * of already processed data is counted.
+ **/
+gsize kfxmpp_session_get_pending_bytes (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return g_atomic_int_get (&self->pending_bytes);
+}
+
+
+/**
+ * \brief Get depth of send queue
+ * \param self A session
+ * \return Number of output buffer segments and chunks from other threads waiting to be written
+ *
+ * This function may be called from any thread.
+ **/
+guint kfxmpp_session_get_send_queue_depth (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return g_atomic_int_get (&self->pending_chunks);
+}
+
+
+/**
+ * \brief Choose how much input session processes per wakeup
+ * \param self A session
+ * \param profile A scheduling profile
+ *
+ * With KFXMPP_SCHEDULING_LATENCY, session yields after 16 KiB or 16
+ * stanzas, so that sessions sharing a loop take turns often. With
+ * KFXMPP_SCHEDULING_THROUGHPUT, the default, it yields after 256 KiB or
+ * 512 stanzas and needs fewer wakeups for the same data.
+ *
+ * Profile also sets TLS batching: latency profile seals partially filled
+ * records when output queue is flushed, throughput profile lets them
+ * wait a millisecond for more data. Until a profile is chosen, budgets
+ * are those of throughput profile and partial records are sealed at
+ * flush, like with latency profile.
+ **/
+void kfxmpp_session_set_scheduling_profile (KfxmppSession *self, KfxmppSchedulingProfile profile)
+{
+	g_return_if_fail (self);
+
+	self->profile = profile;
+	switch (profile) {
+		case KFXMPP_SCHEDULING_LATENCY:
+			kfxmpp_session_set_read_budget (self, LATENCY_READ_BUDGET, LATENCY_STANZA_BUDGET);
+			kfxmpp_session_set_tls_batching (self, TLS_RECORD_SIZE, LATENCY_TLS_DELAY);
+			break;
+		case KFXMPP_SCHEDULING_THROUGHPUT:
+		default:
+			kfxmpp_session_set_read_budget (self, THROUGHPUT_READ_BUDGET, THROUGHPUT_STANZA_BUDGET);
+			kfxmpp_session_set_tls_batching (self, TLS_RECORD_SIZE, THROUGHPUT_TLS_DELAY);
+			break;
+	}
+}
+
+
+/**
+ * \brief Get scheduling profile
+ * \param self A session
+ * \return Profile last set, budgets may have been changed since
+ **/
+KfxmppSchedulingProfile kfxmpp_session_get_scheduling_profile (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, KFXMPP_SCHEDULING_THROUGHPUT);
+
+	return self->profile;
+}
+
+
+/**
+ * \brief Set input processed per wakeup
+ * \param self A session
+ * \param bytes Bytes read before yielding to other sessions
+ * \param stanzas Stanzas parsed before yielding to other sessions
+ *
+ * Both are checked after each chunk fed to parser, so a wakeup may
+ * overrun them by up to a receive buffer of data.
+ **/
+void kfxmpp_session_set_read_budget (KfxmppSession *self, gsize bytes, guint stanzas)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (bytes > 0 && stanzas > 0);
+
+	self->read_budget = bytes;
+	self->stanza_budget = stanzas;
+}
+
+
+/**
+ * \brief Set how data sent over TLS is packed into records
+ * \param self A session
+ * \param record_size Data put in one record, up to 16 KiB, or 0 for a record per send
+ * \param delay Milliseconds a partially filled record waits for more data,
+ * 	or 0 to seal it when output queue is flushed (default)
+ *
+ * Stanzas sent close together share records, instead of each paying for
+ * its own record header, MAC and padding. Records are sealed as soon as
+ * they fill up. Data sent in plain, or through kernel TLS, is not affected.
+ **/
+void kfxmpp_session_set_tls_batching (KfxmppSession *self, gsize record_size, guint delay)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (record_size <= TLS_RECORD_SIZE);
+
+#ifdef HAVE_GNUTLS
+	/* Batched data goes out under old settings */
+	kfxmpp_session_seal_records (self, TRUE);
+#endif
+	self->tls_record_size = record_size;
+	self->tls_delay = delay;
+}
+
+
+/**
+ * \brief Get number of TLS records session has sealed
+ * \param self A session
+ * \return Number of records carrying data sent, handshake excluded
+ **/
+guint kfxmpp_session_get_tls_records (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->tls_records;
+}
+
+
+/**
+ * \brief Get histogram of scheduling delays
+ * \param self A session
+ * \return Array of KFXMPP_SESSION_DELAY_BUCKETS counters, owned by session
+ *
+ * A delay is counted each time session yields with input left and gets
+ * its next turn. Bucket 0 counts delays below a microsecond, bucket \b n
+ * those from 2^(n-1) up to 2^n microseconds, and the last one all longer
+ * ones.
+ **/
+const guint *kfxmpp_session_get_scheduling_delays (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, NULL);
+
+	return self->delays;
+}
+
+
+/**
+ * \brief Clear histogram of scheduling delays
+ * \param self A session
+ **/
+void kfxmpp_session_reset_scheduling_delays (KfxmppSession *self)
+{
+	g_return_if_fail (self);
+
+	memset (self->delays, 0, sizeof (self->delays));
+}
+
+
+/**
+ * \brief Limit incoming stanzas waiting for deferred handlers
+ * \param self A session
+ * \param stanzas Reading pauses when this many stanzas are pending, 0 means no limit
+ * \param bytes Reading pauses when stanzas this large in total are pending, 0 means no limit
+ *
+ * Reading resumes when pending stanzas drop to half of both limits.
+ * There are no limits by default.
+ **/
+void kfxmpp_session_set_inbound_limits (KfxmppSession *self, guint stanzas, gsize bytes)
+{
+	g_return_if_fail (self);
+
+	self->inbound_max_stanzas = stanzas;
+	self->inbound_max_bytes = bytes;
+	kfxmpp_session_check_inbound (self);
+}
+
+
+/**
+ * \brief Choose stanzas that are dropped while reading is paused
+ * \param self A session
+ * \param policy Bitwise OR of KfxmppInboundDropPolicy values
+ *
+ * Stanzas still arrive while reading is paused, from data that was read
+ * already. Those matching \b policy are dropped before any handler sees
+ * them.
+ **/
+void kfxmpp_session_set_inbound_drop_policy (KfxmppSession *self, KfxmppInboundDropPolicy policy)
+{
+	g_return_if_fail (self);
+
+	self->inbound_drop = policy;
+}
+
+
+/**
+ * \brief Get drop policy
+ * \param self A session
+ * \return Drop policy
+ **/
+KfxmppInboundDropPolicy kfxmpp_session_get_inbound_drop_policy (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, KFXMPP_INBOUND_DROP_NONE);
+
+	return self->inbound_drop;
+}
+
+
+/**
+ * \brief Get size of incoming stanzas waiting for deferred handlers
+ * \param self A session
+ * \return Approximate size in bytes, as received
+ **/
+gsize kfxmpp_session_get_pending_stanza_bytes (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->inbound_bytes;
+}
+
+
+/**
+ * \brief Check whether session stopped reading because of its backlog
+ * \param self A session
+ * \return TRUE if reading is paused
+ **/
+gboolean kfxmpp_session_get_reading_paused (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, FALSE);
+
+	return self->reading_paused;
+}
+
+
+/**
+ * \brief Get number of times reading was paused
+ * \param self A session
+ * \return Number of pauses
+ **/
+guint kfxmpp_session_get_inbound_pauses (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->n_pauses;
+}
+
+
+/**
+ * \brief Get number of times reading was resumed
+ * \param self A session
+ * \return Number of resumes
+ **/
+guint kfxmpp_session_get_inbound_resumes (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->n_resumes;
+}
+
+
+/**
+ * \brief Get number of stanzas dropped by drop policy
+ * \param self A session
+ * \return Number of dropped stanzas
+ **/
+guint kfxmpp_session_get_inbound_dropped (KfxmppSession *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->n_dropped;
+}
+
+
+/**
+ * \brief Create new parser for incoming stream
+ * \param self A session
+ *
+ * Old parser is released by caller. That may happen within its callback,
+ * as parser holds a reference to itself while it is being fed.
+ **/
+static void kfxmpp_session_reset_parser (KfxmppSession *self)
+{
+	GList *tmp;
+
+	self->parser = kfxmpp_stream_parser_new_from_pool (self->parser_pool,
+			kfxmpp_session_got_xml, self);
+
+	for (tmp = self->filters; tmp; tmp = tmp->next)
+		kfxmpp_stream_parser_add_filter (self->parser, tmp->data);
+}
+
+
+
+/***********************************************************************
+ * 
+ * Network Input/Output
+ *
+ */
+
+/**
+ * \brief Read data from remote host
+ * \param self A session
+ * \param buffer Location of buffer to store read data
+ * \param size Size of buffer
+ * \param error Locatiopn to store error information (may be NULL)
+ * \return Number of bytes read, 0 if no data is available right now.
+ * 	Negative value means error or connection closed by remote host.
+ *
+ * This function does not block.
+ **/
+gssize kfxmpp_session_read (KfxmppSession *self, gchar *buffer, gssize size, GError **error)
+{
+	gssize bytes_read;
+
+	g_return_val_if_fail (self, -999);
+
+	if (self->io == NULL)
+		return -1;
+	
+#ifdef HAVE_GNUTLS
+	if (self->secure && ! (self->ktls_active & KFXMPP_KTLS_RX)) {
+		/* Write through gnutls */
+		bytes_read = gnutls_record_recv (self->gnutls, buffer, size);
+		if (bytes_read == GNUTLS_E_AGAIN || bytes_read == GNUTLS_E_INTERRUPTED)
+			return 0;
+		if (bytes_read <= 0)
+			return -1;
+
+		/* Kernel may take over at a record boundary */
+		if (self->ktls && ! self->ktls_failed && ! self->completion &&
+				gnutls_record_check_pending (self->gnutls) == 0 &&
+				(self->tls_in == NULL || self->tls_in->len == 0))
+			kfxmpp_session_start_ktls (self, KFXMPP_KTLS_RX);
+	} else
+#endif
+	{
+		for (;;) {
+			bytes_read = recv (g_io_channel_unix_get_fd (self->io), buffer, size, MSG_DONTWAIT);
+			if (bytes_read < 0 && errno == EINTR)
+				continue;
+#ifdef HAVE_GNUTLS
+			/* Kernel TLS does not mix control records into data */
+			if (bytes_read < 0 && errno == EIO && (self->ktls_active & KFXMPP_KTLS_RX) &&
+					kfxmpp_session_ktls_skip_record (self))
+				continue;
+#endif
+			break;
+		}
+
+		if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (bytes_read <= 0) {
+			/* Error or end of stream */
+			return -1;
+		}
+	}
+
+#ifdef DEBUG
+	extern gboolean debug_net;
+	if (debug_net) {
+		g_printerr ("\nrecv\n----\n");
+		fwrite (buffer, 1, bytes_read, stderr);
+		g_printerr ("\n");
+	}
+#endif
+
+	return bytes_read;
+}
+
+
+/**
+ * \brief Send an XML stanza to remote host
+ * \param self A session
+ * \param stanza A xml stanza
+ * \param error Location to store error information (may be NULL)
+ * \return Number of bytes written. Negative value means an error.
+ *
+ * This function may be called from any thread, see kfxmpp_session_send_raw.
+ *
+ * When more data than session's high watermark is waiting to be written,
+ * stanza is not sent and KFXMPP_ERROR_WOULD_BLOCK is reported. Writable
+ * callback is called when the queue drains below low watermark.
+ **/
+gssize kfxmpp_session_send (KfxmppSession *self, KfxmppStanza *stanza, GError **error)
+{
+	gchar *xml;
+	gssize ret;
+	
+	g_return_val_if_fail (self, -1);
+	g_return_val_if_fail (stanza, -1);
+
+	if (self->high_watermark > 0 &&
+			(gsize) g_atomic_int_get (&self->pending_bytes) >= self->high_watermark) {
+		if (g_atomic_int_compare_and_exchange (&self->blocked, FALSE, TRUE)) {
+			/* Queue may have drained meanwhile, make sure callback fires */
+			GSource *src;
+
+			src = g_idle_source_new ();
+			g_source_set_callback (src, kfxmpp_session_check_writable,
+					kfxmpp_session_ref (self),
+					(GDestroyNotify) kfxmpp_session_unref);
+			g_source_attach (src, self->context);
+			g_source_unref (src);
+		}
+		g_set_error (error, KFXMPP_ERROR, KFXMPP_ERROR_WOULD_BLOCK,
+				"Send queue is full");
+		return -1;
+	}
+
+	xml = kfxmpp_stanza_to_string (stanza);
+	ret = kfxmpp_session_send_raw (self, xml, strlen (xml), error);
+//	kfxmpp_log ("send\n----\n%s\n", xml);
+	g_free (xml);
+	return ret;
+}
+
+
+/**
+ * \brief Send an XML stanza to remote host and call a handler when a response is received
+ * \param self A session
+ * \param stanza A xml stanza
+ * \param handler An event handler to be called when response is received
+ * \param error Locatiopn to store error information (may be NULL)
+ * \return an ID. Response handler can be canceled with kfxmpp_session_cancel_response.
+ * 	-1 if stanza was not sent, e.g. with KFXMPP_ERROR_WOULD_BLOCK, in
+ * 	which case handler is not registered
+ **/
+gint kfxmpp_session_send_await_response (KfxmppSession *self, KfxmppStanza *stanza, KfxmppEventHandler *handler, GError **error)
+{
+	g_return_val_if_fail (self, -1);
+	g_return_val_if_fail (stanza, -1);
+	g_return_val_if_fail (handler, -1);
+
+	return kfxmpp_session_request (self, stanza, handler, TRUE, error);
+}
+
+
+/**
+ * \brief Send an <iq/> and register a handler for its response
+ * \param self A session
+ * \param stanza A xml stanza
+ * \param handler An event handler to be called when response is received
+ * \param limited Whether send queue's high watermark applies. Protocol
+ * 	steps taken by session itself are never refused.
+ * \param error Location to store error information (may be NULL)
+ * \return an ID, -1 if stanza was not sent
+ **/
+static gint kfxmpp_session_request (KfxmppSession *self, KfxmppStanza *stanza, KfxmppEventHandler *handler,
+					gboolean limited, GError **error)
+{
+	static gint id = 0;
+	gchar idstr[10];	/* Should be enough */
+	gchar *xml;
+	gssize ret;
+
+	snprintf (idstr, 10, RESPONSE_STRING, ++id);
+
+	/* Set the id property */
+	xmlSetProp (stanza->node, BAD_CAST "id", BAD_CAST idstr);
+
+	/* Send stanza */
+	if (limited) {
+		ret = kfxmpp_session_send (self, stanza, error);
+	} else {
+		xml = kfxmpp_stanza_to_string (stanza);
+		ret = kfxmpp_session_send_raw (self, xml, strlen (xml), error);
+		g_free (xml);
+	}
+	if (ret < 0)
+		return -1;
+
+	/* Register handler */
+	kfxmpp_session_await_response (self, idstr, handler);
+
+	return id;
+}
+
+
+/**
+ * \brief Send raw character data to server
+ * \param self A session
+ * \param buffer Character data to be sent
+ * \param size Size of data to be transmitted, or -1 if data is null-terminated
+ * \param error Locatiopn to store error information (may be NULL)
+ * \return Number of bytes sent. Negative value means an error
+ *
+ * This function may be called from any thread. When called from a thread
+ * other than the one dispatching session's I/O backend, data is copied to
+ * session's send queue and handed over to the I/O thread. With GLib
+ * backend, that is the thread running session's main context; when no
+ * thread runs it, caller acquires it and writes data itself. Epoll,
+ * io_uring and external backends belong to thread that dispatches them.
+ *
+ * Data is not written immediately, but appended to session's output
+ * queue, which is flushed once per main loop iteration (or as soon as
+ * FLUSH_THRESHOLD bytes are queued). The return value is
+ * thus the number of bytes queued.
+ **/
+gssize kfxmpp_session_send_raw (KfxmppSession *self, const gchar *buffer, gssize size, GError **error)
+{
+	gssize ret;
+
+	g_return_val_if_fail (self, -9);	/* Magic numbers... FIXME */
+
+	if (size == -1)
+		size = strlen (buffer);
+
+	if (! kfxmpp_session_acquire (self)) {
+		/* Not an I/O thread, let the I/O thread do the job */
+		kfxmpp_session_queue_data (self, buffer, size);
+		return size;
+	}
+
+	/* Backend is ours; keep what other threads queued in order */
+	if (! kfxmpp_mpsc_queue_is_empty (self->send_queue))
+		kfxmpp_session_drain_send_queue (self);
+	ret = kfxmpp_session_write (self, buffer, size);
+	kfxmpp_session_release (self);
+
+	return ret;
+}
+
+
+/**
+ * \brief Check whether calling thread may do session's I/O now
+ * \param self A session
+ * \return TRUE if it may, kfxmpp_session_release must be called then
+ *
+ * Session without a backend yet has its main context checked instead.
+ **/
+static gboolean kfxmpp_session_acquire (KfxmppSession *self)
+{
+	KfxmppIoBackend *backend = self->backend;
+
+	if (backend)
+		return kfxmpp_io_backend_acquire (backend);
+	return g_main_context_acquire (self->context);
+}
+
+
+/**
+ * \brief Let go of session's I/O, see kfxmpp_session_acquire
+ * \param self A session
+ **/
+static void kfxmpp_session_release (KfxmppSession *self)
+{
+	if (self->backend)
+		kfxmpp_io_backend_release (self->backend);
+	else
+		g_main_context_release (self->context);
+}
+
+
+/**
+ * \brief Queue data to be written to remote host
+ * \param self A session
+ * \param buffer Character data to be sent
+ * \param size Size of data to be transmitted
+ * \return Number of bytes queued. Negative value means an error
+ *
+ * This must be called from the thread running session's main context.
+ **/
+static gssize kfxmpp_session_write (KfxmppSession *self, const gchar *buffer, gssize size)
+{
+	if (self->io == NULL)
+		return -1;
+	
+#ifdef DEBUG
+	extern gboolean debug_net;
+	if (debug_net) {
+		g_printerr ("\nsend\n----\n");
+		fwrite (buffer, 1, size, stderr);
+		g_printerr ("\n");
+	}
+#endif
+
+#ifdef HAVE_LIBZ
+	if (self->deflater) {
+		/* Flushed to a byte boundary along with output queue */
+		kfxmpp_session_deflate (self, buffer, size, Z_NO_FLUSH);
+		self->deflate_pending = TRUE;
+		kfxmpp_session_schedule_flush (self);
+		return size;
+	}
+#endif
+
+	return kfxmpp_session_transmit (self, buffer, size);
+}
+
+
+/**
+ * \brief Queue data to be written to socket, below compression layer
+ * \param self A session
+ * \param buffer Data to be sent
+ * \param size Size of data
+ * \return Number of bytes queued
+ **/
+static gssize kfxmpp_session_transmit (KfxmppSession *self, const gchar *buffer, gssize size)
+{
+	gssize bytes_written;
+
+#ifdef HAVE_GNUTLS
+	/* Kernel may take over once records gnutls encrypted are written */
+	if (self->secure && self->ktls && ! self->ktls_failed && ! (self->ktls_active & KFXMPP_KTLS_TX) &&
+			kfxmpp_out_queue_get_bytes (self->out_queue) == 0 &&
+			(self->tls_out == NULL || self->tls_out->len == 0) &&
+			(! self->completion || kfxmpp_io_watch_get_unsent (self->watch) == 0))
+		kfxmpp_session_start_ktls (self, KFXMPP_KTLS_TX);
+
+	if (self->secure && ! (self->ktls_active & KFXMPP_KTLS_TX)) {
+		/* Encrypted records end up in output queue via kfxmpp_session_tls_send */
+		if (self->tls_out == NULL)
+			self->tls_out = g_string_new (NULL);
+		g_string_append_len (self->tls_out, buffer, size);
+		kfxmpp_session_seal_records (self, self->tls_record_size == 0);
+
+		if (self->tls_out->len > 0 && self->tls_delay > 0 && self->tls_timer == NULL)
+			self->tls_timer = kfxmpp_io_backend_add_timer (self->backend, self->tls_delay,
+					kfxmpp_session_seal_timeout, self);
+		bytes_written = size;
+	} else
+#endif
+	{
+		kfxmpp_out_queue_append (self->out_queue, buffer, size);
+		bytes_written = size;
+	}
+
+	kfxmpp_session_account_output (self);
+	kfxmpp_session_schedule_flush (self);
+	return bytes_written;
+}
+
+
+#ifdef HAVE_LIBZ
+/**
+ * \brief Start compressing stream after server agreed to it
+ * \param self A session
+ * \return TRUE on success
+ **/
+static gboolean kfxmpp_session_start_compression (KfxmppSession *self)
+{
+	self->deflater = g_new0 (z_stream, 1);
+	self->inflater = g_new0 (z_stream, 1);
+
+	/* Memory level follows window, so that window bounds both */
+	if (deflateInit2 (self->deflater, self->compress_level, Z_DEFLATED, self->compress_window,
+				CLAMP (self->compress_window - 7, 1, 8), Z_DEFAULT_STRATEGY) != Z_OK) {
+		g_free (self->deflater);
+		self->deflater = NULL;
+	}
+	if (inflateInit (self->inflater) != Z_OK) {
+		g_free (self->inflater);
+		self->inflater = NULL;
+	}
+
+	if (self->deflater == NULL || self->inflater == NULL) {
+		kfxmpp_log ("Could not initialize zlib\n");
+		kfxmpp_session_end_compression (self);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+/**
+ * \brief Compress data and queue the result
+ * \param self A session
+ * \param buffer Data to be compressed
+ * \param size Size of data
+ * \param flush zlib flush mode
+ **/
+static void kfxmpp_session_deflate (KfxmppSession *self, const gchar *buffer, gsize size, gint flush)
+{
+	z_stream *z = self->deflater;
+	gchar out[COMPRESS_CHUNK];
+
+	/* Queueing output may flush, which must not compress again */
+	self->deflating = TRUE;
+
+	z->next_in = (Bytef *) buffer;
+	z->avail_in = size;
+	do {
+		gsize produced;
+
+		z->next_out = (Bytef *) out;
+		z->avail_out = sizeof (out);
+		deflate (z, flush);
+
+		produced = sizeof (out) - z->avail_out;
+		if (produced > 0) {
+			kfxmpp_session_transmit (self, out, produced);
+			self->compressed_sent += produced;
+		}
+	} while (z->avail_out == 0);
+	self->raw_sent += size;
+
+	self->deflating = FALSE;
+}
+#endif
+
+
+/**
+ * \brief Flush compressor, so that server can decompress everything sent so far
+ * \param self A session
+ **/
+static void kfxmpp_session_sync_compression (KfxmppSession *self)
+{
+#ifdef HAVE_LIBZ
+	if (self->deflater && self->deflate_pending && ! self->deflating) {
+		self->deflate_pending = FALSE;
+		kfxmpp_session_deflate (self, NULL, 0, Z_SYNC_FLUSH);
+	}
+#endif
+}
+
+
+/**
+ * \brief Stop compressing stream and free compressor
+ * \param self A session
+ **/
+static void kfxmpp_session_end_compression (KfxmppSession *self)
+{
+#ifdef HAVE_LIBZ
+	if (self->deflater) {
+		deflateEnd (self->deflater);
+		g_free (self->deflater);
+		self->deflater = NULL;
+	}
+	if (self->inflater) {
+		inflateEnd (self->inflater);
+		g_free (self->inflater);
+		self->inflater = NULL;
+	}
+#endif
+	self->compress_requested = FALSE;
+	self->deflate_pending = FALSE;
+}
+
+
+/**
+ * \brief Make sure output queue gets flushed
+ * \param self A session
+ *
+ * Queue is flushed right away when it grows above the threshold,
+ * otherwise at most once per main loop iteration.
+ **/
+static void kfxmpp_session_schedule_flush (KfxmppSession *self)
+{
+	if (self->watch && (kfxmpp_io_watch_get_interest (self->watch) & G_IO_OUT)) {
+		/* Waiting for socket to become writable anyway */
+		return;
+	}
+
+	if (kfxmpp_out_queue_get_bytes (self->out_queue) >= FLUSH_THRESHOLD) {
+		kfxmpp_session_flush (self);
+		return;
+	}
+
+	if (self->flush_timer == NULL)
+		self->flush_timer = kfxmpp_io_backend_add_timer (self->backend, 0,
+				kfxmpp_session_flush_idle, self);
+}
+
+
+/**
+ * \brief Flush output queue once per main loop iteration
+ * \param data A KfxmppSession
+ * \return FALSE
+ **/
+static gboolean kfxmpp_session_flush_idle (gpointer data)
+{
+	KfxmppSession *self = data;
+
+	/* Timer is removed when this returns */
+	self->flush_timer = NULL;
+
+	kfxmpp_session_flush (self);
+	return FALSE;
+}
+
+
+/**
+ * \brief Write as much of output queue as socket accepts
+ * \param self A session
+ * \return TRUE if some data is still left in queue
+ *
+ * When socket buffer fills up, session's watch becomes interested in
+ * writing, to continue as soon as socket accepts more data. In completion
+ * mode whole queue is handed to backend.
+ **/
+static gboolean kfxmpp_session_flush (KfxmppSession *self)
+{
+	gint fd;
+
+	if (self->flush_timer) {
+		kfxmpp_io_timer_remove (self->flush_timer);
+		self->flush_timer = NULL;
+	}
+
+	/* Whatever compressor holds goes out too */
+	kfxmpp_session_sync_compression (self);
+
+#ifdef HAVE_GNUTLS
+	/* Partial record goes out with the rest, unless it may wait for more */
+	if (self->tls_delay == 0)
+		kfxmpp_session_seal_records (self, TRUE);
+#endif
+
+	if (self->io == NULL)
+		goto done;
+
+	if (self->completion) {
+		GString *segment;
+
+		/* Backend writes it and reports G_IO_OUT when it is done */
+		while ((segment = kfxmpp_out_queue_pop (self->out_queue)) != NULL)
+			kfxmpp_io_watch_send (self->watch, segment);
+		kfxmpp_session_account_output (self);
+		kfxmpp_session_check_writable (self);
+		kfxmpp_session_update_interest (self, kfxmpp_io_watch_get_unsent (self->watch) > 0);
+		return FALSE;
+	}
+
+	if (kfxmpp_out_queue_get_bytes (self->out_queue) == 0)
+		goto done;
+
+	fd = g_io_channel_unix_get_fd (self->io);
+	if (kfxmpp_out_queue_flush (self->out_queue, fd) < 0) {
+		/* Connection is broken. Hangup may never be reported, e.g.
+		 * while reading is paused, so session is closed right away */
+		kfxmpp_log ("Write failed: %s\n", g_strerror (errno));
+		kfxmpp_session_disconnected (self, G_IO_ERR);
+		return FALSE;
+	}
+	kfxmpp_session_account_output (self);
+	kfxmpp_session_check_writable (self);
+
+	if (kfxmpp_out_queue_get_bytes (self->out_queue) > 0) {
+		kfxmpp_session_update_interest (self, TRUE);
+		return TRUE;
+	}
+
+done:
+	kfxmpp_session_account_output (self);
+	kfxmpp_session_update_interest (self, FALSE);
+	return FALSE;
+}
+
+
+/**
+ * \brief Cancel pending flushes and drop queued output
+ * \param self A session
+ **/
+static void kfxmpp_session_stop_flushing (KfxmppSession *self)
+{
+	if (self->flush_timer) {
+		kfxmpp_io_timer_remove (self->flush_timer);
+		self->flush_timer = NULL;
+	}
+	if (self->tls_timer) {
+		kfxmpp_io_timer_remove (self->tls_timer);
+		self->tls_timer = NULL;
+	}
+	if (self->tls_out)
+		g_string_truncate (self->tls_out, 0);
+	kfxmpp_session_update_interest (self, FALSE);
+	kfxmpp_out_queue_clear (self->out_queue);
+	kfxmpp_session_account_output (self);
+}
+
+
+/**
+ * \brief Set conditions session's watch waits for
+ * \param self A session
+ * \param writing Whether output is waiting for socket
+ *
+ * Readability is not asked for while reading is paused.
+ **/
+static void kfxmpp_session_update_interest (KfxmppSession *self, gboolean writing)
+{
+	GIOCondition interest = 0;
+
+	if (self->watch == NULL)
+		return;
+
+	if (! self->reading_paused)
+		interest |= G_IO_IN;
+	if (writing)
+		interest |= G_IO_OUT;
+	kfxmpp_io_watch_set_interest (self->watch, interest);
+}
+
+
+/**
+ * \brief Update counters of pending output after output queue changed
+ * \param self A session
+ **/
+static void kfxmpp_session_account_output (KfxmppSession *self)
+{
+	gsize bytes = kfxmpp_out_queue_get_bytes (self->out_queue);
+	guint segments = kfxmpp_out_queue_get_length (self->out_queue);
+
+	if (self->completion)
+		bytes += kfxmpp_io_watch_get_unsent (self->watch);
+	if (self->tls_out)
+		bytes += self->tls_out->len;
+
+	g_atomic_int_add (&self->pending_bytes, (gint) bytes - (gint) self->out_bytes);
+	g_atomic_int_add (&self->pending_chunks, (gint) segments - (gint) self->out_segments);
+	self->out_bytes = bytes;
+	self->out_segments = segments;
+}
+
+
+/**
+ * \brief Call writable callback if a send was refused and queue has drained
+ * \param data A KfxmppSession
+ * \return FALSE
+ **/
+static gboolean kfxmpp_session_check_writable (gpointer data)
+{
+	KfxmppSession *self = data;
+
+	if (g_atomic_int_get (&self->blocked) &&
+			(gsize) g_atomic_int_get (&self->pending_bytes) <= self->low_watermark &&
+			g_atomic_int_compare_and_exchange (&self->blocked, TRUE, FALSE)) {
+		if (self->writable_callback)
+			self->writable_callback (self, self->writable_data);
+	}
+	return FALSE;
+}
+
+
+/**
+ * \brief Queue data to be written by I/O thread
+ * \param self A session
+ * \param buffer Character data to be sent
+ * \param size Size of data
+ *
+ * Only the producer that finds the queue empty schedules a drain in
+ * session's main context, so a whole batch of stanzas queued by any
+ * number of threads costs a single wakeup of the I/O thread.
+ **/
+static void kfxmpp_session_queue_data (KfxmppSession *self, const gchar *buffer, gssize size)
+{
+	GString *chunk;
+
+	chunk = g_string_new_len (buffer, size);
+	g_atomic_int_add (&self->pending_bytes, size);
+	g_atomic_int_add (&self->pending_chunks, 1);
+
+	if (kfxmpp_mpsc_queue_push (self->send_queue, chunk)) {
+		/* First item in this batch, wake up I/O thread */
+		KfxmppIoBackend *backend = self->backend;
+		GSource *src;
+
+		if (backend && kfxmpp_io_backend_invoke (backend, kfxmpp_session_drain_send_queue,
+					kfxmpp_session_ref (self), (GDestroyNotify) kfxmpp_session_unref))
+			return;
+
+		src = g_idle_source_new ();
+		g_source_set_priority (src, G_PRIORITY_DEFAULT);
+		g_source_set_callback (src, kfxmpp_session_drain_send_queue,
+				kfxmpp_session_ref (self),
+				(GDestroyNotify) kfxmpp_session_unref);
+		g_source_attach (src, self->context);
+		g_source_unref (src);
+	}
+}
+
+
+/**
+ * \brief Write all data queued by other threads
+ * \param data A KfxmppSession
+ * \return FALSE
+ **/
+static gboolean kfxmpp_session_drain_send_queue (gpointer data)
+{
+	KfxmppSession *self = data;
+	GSList *items, *tmp;
+
+	items = kfxmpp_mpsc_queue_pop_all (self->send_queue);
+	for (tmp = items; tmp; tmp = tmp->next) {
+		GString *chunk = tmp->data;
+
+		/* Chunk is accounted for again by output queue */
+		g_atomic_int_add (&self->pending_bytes, - (gint) chunk->len);
+		g_atomic_int_add (&self->pending_chunks, -1);
+
+		/* Data queued for closed session is dropped */
+		if (self->io)
+			kfxmpp_session_write (self, chunk->str, chunk->len);
+		kfxmpp_session_free_chunk (chunk);
+	}
+	g_slist_free (items);
+
+	return FALSE;
+}
+
+
+/**
+ * \brief Free a chunk of data from send queue
+ **/
+static void kfxmpp_session_free_chunk (gpointer data)
+{
+	g_string_free (data, TRUE);
+}
+
+
+/**
+ * \brief Function called when connection was broken
+ * \param self KfxmppSession
+ * \param condition Condition that caused connection to close
+ **/
+static void kfxmpp_session_disconnected (KfxmppSession *self, GIOCondition condition)
+{
+	kfxmpp_log ("Disconnected\n");
+
+	/* Address may be stale, it is resolved again next time */
+	if (self->fast_opened && self->state != KFXMPP_SESSION_STATE_OPEN)
+		self->peer_len = 0;
+
+	/* Close underlying socket */
+	kfxmpp_session_delete_socket (self);
+
+	/* Clean up session */
+	kfxmpp_session_close (self);
+
+	/* Notify user of broken connection */
+	if (self->disconnect_callback) {
+		self->disconnect_callback (self, KFXMPP_SESSION_DISCONNECT_STATUS_REMOTE_HOST, self->disconnect_data);
+	}
+}
+
+
+/**
+ * \brief Callback called when socket is ready
+ * \param watch Session's watch
+ * \param condition A condition that was satisfied
+ * \param data A Kfxmpp session
+ * \return FALSE if this callback should be removed
+ **/
+static gboolean kfxmpp_session_io_event (KfxmppIoWatch *watch, GIOCondition condition, gpointer data)
+{
+	KfxmppSession *self = data;
+
+	if (condition & G_IO_OUT) {
+		/* Socket accepts data again */
+		kfxmpp_session_flush (self);
+
+		/* Failed write has closed session already */
+		if (self->io == NULL)
+			return TRUE;
+	}
+	
+#ifdef HAVE_GNUTLS
+	if (self->handshaking && (condition & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+		/* Handshake reads socket itself, failure includes hangup */
+		kfxmpp_session_continue_handshake (self);
+		return TRUE;
+	}
+#endif
+
+	if (condition & G_IO_IN) {
+		if (! kfxmpp_session_read_burst (self)) {
+			kfxmpp_log ("Connection closed while reading\n");
+			kfxmpp_session_disconnected (self, condition);
+			return TRUE;
+		}
+
+		/* Session may have been closed by a handler */
+		if (self->io == NULL)
+			return TRUE;
+
+		/* End of batch */
+		if (self->coalescer && kfxmpp_presence_coalescer_get_window (self->coalescer) == 0)
+			kfxmpp_presence_coalescer_flush (self->coalescer);
+	}
+
+	/* Poll reports these together, session is closed once */
+	if (self->io == NULL)
+		return TRUE;
+	if (condition & G_IO_HUP) {
+		/* Connection hung up... handle it */
+
+		kfxmpp_log ("G_IO_HUP\n");
+		kfxmpp_session_disconnected (self, condition);
+	} else if (condition & G_IO_NVAL) {
+		/* Performing action on a file description that is not open... */
+
+		kfxmpp_log ("G_IO_NVAL\n");
+		kfxmpp_session_disconnected (self, condition);
+	} else if (condition & G_IO_ERR) {
+		/* Some error */
+
+		kfxmpp_log ("G_IO_ERR\n");
+		kfxmpp_session_disconnected (self, condition);
+	}
+
+	return TRUE;
+}
+
+
+/**
+ * \brief Callback called with data backend has received for session
+ * \param watch Session's watch
+ * \param buffer Received data
+ * \param size Size of data, 0 at end of stream, negative on error
+ * \param data A Kfxmpp session
+ **/
+static void kfxmpp_session_io_recv (KfxmppIoWatch *watch, const gchar *buffer, gssize size, gpointer data)
+{
+	KfxmppSession *self = data;
+
+	if (size <= 0) {
+		kfxmpp_log ("Connection closed while reading\n");
+		kfxmpp_session_disconnected (self, size == 0 ? G_IO_HUP : G_IO_ERR);
+		return;
+	}
+
+#ifdef HAVE_GNUTLS
+	if (self->secure) {
+		/* Records are decrypted as gnutls pulls them from tls_in */
+		if (self->tls_in == NULL)
+			self->tls_in = g_string_new (NULL);
+		g_string_append_len (self->tls_in, buffer, size);
+		if (self->reading_paused)
+			return;
+		if (! kfxmpp_session_read_burst (self)) {
+			kfxmpp_log ("Connection closed while reading\n");
+			kfxmpp_session_disconnected (self, G_IO_ERR);
+			return;
+		}
+	} else
+#endif
+	if (self->reading_paused) {
+		/* Backend had this in flight when receiving stopped, hold it until reading resumes */
+		if (self->held_in == NULL)
+			self->held_in = g_string_new (NULL);
+		g_string_append_len (self->held_in, buffer, size);
+		return;
+	} else {
+		kfxmpp_session_feed (self, buffer, size);
+	}
+
+	/* Session may have been closed by a handler */
+	if (self->io == NULL)
+		return;
+
+	/* End of batch */
+	if (self->coalescer && kfxmpp_presence_coalescer_get_window (self->coalescer) == 0)
+		kfxmpp_presence_coalescer_flush (self->coalescer);
+}
+
+
+/**
+ * \brief Pass received data to parser, decompressing it first if stream is compressed
+ * \param self A session
+ * \param buffer Received data, decrypted already
+ * \param size Size of data
+ **/
+static void kfxmpp_session_feed (KfxmppSession *self, const gchar *buffer, gsize size)
+{
+#ifdef HAVE_LIBZ
+	z_stream *z = self->inflater;
+	gchar out[COMPRESS_CHUNK];
+
+	if (z == NULL) {
+		kfxmpp_stream_parser_feed (self->parser, buffer, size);
+		return;
+	}
+
+	self->compressed_received += size;
+	z->next_in = (Bytef *) buffer;
+	z->avail_in = size;
+	do {
+		gsize produced;
+		gint ret;
+
+		z->next_out = (Bytef *) out;
+		z->avail_out = sizeof (out);
+		ret = inflate (z, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			kfxmpp_log ("Decompression failed: %s\n", z->msg ? z->msg : "stream ended");
+			kfxmpp_session_disconnected (self, G_IO_ERR);
+			return;
+		}
+
+		produced = sizeof (out) - z->avail_out;
+		self->raw_received += produced;
+		if (produced > 0)
+			kfxmpp_stream_parser_feed (self->parser, out, produced);
+
+		/* Session may have been closed by a handler */
+		if (self->inflater != z)
+			return;
+	} while (z->avail_in > 0 || z->avail_out == 0);
+#else
+	kfxmpp_stream_parser_feed (self->parser, buffer, size);
+#endif
+}
+
+
+/**
+ * \brief Switch session's watch between completion and readiness mode
+ * \param self A session
+ * \param enable TRUE to let backend do I/O if it can, FALSE to read
+ * 	socket directly
+ **/
+static void kfxmpp_session_set_completion (KfxmppSession *self, gboolean enable)
+{
+	if (self->watch == NULL)
+		return;
+
+	if (enable) {
+		self->completion = kfxmpp_io_watch_set_recv_func (self->watch, kfxmpp_session_io_recv);
+	} else if (self->completion) {
+		kfxmpp_io_watch_set_recv_func (self->watch, NULL);
+		self->completion = FALSE;
+	}
+}
+
+
+/**
+ * \brief Read everything socket has to offer, within session's read budget
+ * \param self A session
+ * \return FALSE if connection was closed or broken
+ *
+ * Receive buffer grows when reads keep filling it up and shrinks back
+ * after a number of wakeups that needed only a small part of it.
+ *
+ * Reading stops once budget of bytes or of stanzas runs out, checked
+ * after each chunk fed to parser. Socket's readiness is then deferred,
+ * which puts session at the tail of backend's ready queue, behind every
+ * other session ready in this dispatch. Time until it gets its next turn
+ * is recorded in scheduling delay histogram.
+ *
+ * With TLS, gnutls may hold decrypted data that no socket readiness event
+ * will ever announce, so it is always consumed before returning, even
+ * past the budget.
+ **/
+static gboolean kfxmpp_session_read_burst (KfxmppSession *self)
+{
+	gsize burst = 0;
+	gsize largest = 0;
+	gboolean drained = FALSE;
+
+	if (self->yielded_at) {
+		kfxmpp_session_record_delay (self, kfxmpp_session_now () - self->yielded_at);
+		self->yielded_at = 0;
+	}
+	self->burst_stanzas = 0;
+
+	if (self->recv_buffer == NULL)
+		self->recv_buffer = g_malloc (self->recv_size);
+
+	while (burst < self->read_budget && self->burst_stanzas < self->stanza_budget &&
+			self->io && ! self->reading_paused && ! self->handshaking) {
+		gssize bytes_read;
+
+		bytes_read = kfxmpp_session_read (self, self->recv_buffer, self->recv_size, NULL);
+		if (bytes_read < 0)
+			return FALSE;
+		if (bytes_read == 0) {
+			drained = TRUE;
+			break;
+		}
+
+		burst += bytes_read;
+		largest = MAX (largest, (gsize) bytes_read);
+		kfxmpp_session_feed (self, self->recv_buffer, bytes_read);
+
+		if ((gsize) bytes_read == self->recv_size && self->recv_size < MAX_BUFFER_SIZE) {
+			/* Buffer was too small for this burst */
+			self->recv_size *= 2;
+			self->recv_buffer = g_realloc (self->recv_buffer, self->recv_size);
+			self->recv_idle = 0;
+#ifdef HAVE_GNUTLS
+		} else if (! self->secure && (gsize) bytes_read < self->recv_size) {
+#else
+		} else if ((gsize) bytes_read < self->recv_size) {
+#endif
+			/* Short read, socket is drained; TLS returns a record at a time */
+			drained = TRUE;
+			break;
+		}
+	}
+
+	if (! drained && self->io && self->watch && ! self->reading_paused && ! self->handshaking) {
+		/* Out of budget; edge-triggered backend would not report what is left */
+		kfxmpp_io_watch_defer (self->watch, G_IO_IN);
+		self->yielded_at = kfxmpp_session_now ();
+	}
+
+#ifdef HAVE_GNUTLS
+	/* Resuming reads what is left */
+	while (self->secure && self->io && ! self->reading_paused &&
+			gnutls_record_check_pending (self->gnutls) > 0) {
+		gssize bytes_read;
+
+		bytes_read = kfxmpp_session_read (self, self->recv_buffer, self->recv_size, NULL);
+		if (bytes_read < 0)
+			return FALSE;
+		if (bytes_read == 0)
+			break;
+
+		largest = MAX (largest, (gsize) bytes_read);
+		kfxmpp_session_feed (self, self->recv_buffer, bytes_read);
+	}
+#endif
+
+	if (largest < self->recv_size / 4 && self->recv_size > BUFFER_SIZE) {
+		if (++self->recv_idle >= BUFFER_SHRINK_WAKEUPS) {
+			self->recv_size /= 2;
+			self->recv_buffer = g_realloc (self->recv_buffer, self->recv_size);
+			self->recv_idle = 0;
+		}
+	} else {
+		self->recv_idle = 0;
+	}
+
+	return TRUE;
+}
+
+
+/**
+ * \brief Get time scheduling delays are measured by
+ * \return Microseconds of monotonic clock
+ **/
+static gint64 kfxmpp_session_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * \brief Count a scheduling delay in its histogram bucket
+ * \param self A session
+ * \param delay Delay in microseconds
+ **/
+static void kfxmpp_session_record_delay (KfxmppSession *self, gint64 delay)
+{
+	guint bucket = 0;
+
+	while (delay > 0 && bucket < KFXMPP_SESSION_DELAY_BUCKETS - 1) {
+		delay >>= 1;
+		bucket++;
+	}
+	self->delays[bucket]++;
+}
+
+
+/***********************************************************************
+ *
+ * Inbound backpressure
+ *
+ */
+
+/**
+ * \brief Account a stanza pinned by a deferred handler
+ * \param self A session
+ * \param bytes Size of stanza
+ **/
+static void kfxmpp_session_inbound_grew (KfxmppSession *self, gsize bytes)
+{
+	self->inbound_stanzas++;
+	self->inbound_bytes += bytes;
+	kfxmpp_session_check_inbound (self);
+}
+
+
+/**
+ * \brief Account a stanza released by a deferred handler
+ * \param self A session
+ * \param bytes Size of stanza
+ **/
+static void kfxmpp_session_inbound_shrank (KfxmppSession *self, gsize bytes)
+{
+	self->inbound_stanzas--;
+	self->inbound_bytes -= MIN (bytes, self->inbound_bytes);
+	kfxmpp_session_check_inbound (self);
+}
+
+
+/**
+ * \brief Pause reading when backlog reaches a limit, resume at low watermark
+ * \param self A session
+ *
+ * Paused socket stops being watched for reading, so that TCP flow
+ * control makes server stop sending. A backend doing I/O itself stops
+ * receiving too, what it had received already is held unparsed.
+ *
+ * Low watermark is half of each limit. Reading resumes from a timer, as
+ * backlog shrinks at the end of a dispatch.
+ **/
+static void kfxmpp_session_check_inbound (KfxmppSession *self)
+{
+	if (! self->reading_paused) {
+		if ((self->inbound_max_stanzas == 0 || self->inbound_stanzas < self->inbound_max_stanzas) &&
+				(self->inbound_max_bytes == 0 || self->inbound_bytes < self->inbound_max_bytes))
+			return;
+		if (self->io == NULL)
+			return;
+
+		kfxmpp_log ("Pausing reads, %u stanzas pending\n", self->inbound_stanzas);
+		self->reading_paused = TRUE;
+		self->n_pauses++;
+		if (self->resume_timer) {
+			kfxmpp_io_timer_remove (self->resume_timer);
+			self->resume_timer = NULL;
+		}
+		if (self->watch)
+			kfxmpp_session_update_interest (self, kfxmpp_io_watch_get_interest (self->watch) & G_IO_OUT);
+		if (self->completion)
+			kfxmpp_io_watch_set_receiving (self->watch, FALSE);
+		return;
+	}
+
+	if ((self->inbound_max_stanzas && self->inbound_stanzas > self->inbound_max_stanzas / 2) ||
+			(self->inbound_max_bytes && self->inbound_bytes > self->inbound_max_bytes / 2))
+		return;
+
+	kfxmpp_log ("Resuming reads, %u stanzas pending\n", self->inbound_stanzas);
+	self->reading_paused = FALSE;
+	self->n_resumes++;
+	if (self->io && self->resume_timer == NULL)
+		self->resume_timer = kfxmpp_io_backend_add_timer (self->backend, 0,
+				kfxmpp_session_resume_reading, self);
+}
+
+
+/**
+ * \brief Start reading again after backlog went down
+ * \param data A KfxmppSession
+ * \return FALSE
+ **/
+static gboolean kfxmpp_session_resume_reading (gpointer data)
+{
+	KfxmppSession *self = data;
+
+	/* Timer is removed when this returns */
+	self->resume_timer = NULL;
+
+	if (self->io == NULL || self->watch == NULL || self->reading_paused)
+		return FALSE;
+
+	kfxmpp_session_update_interest (self, kfxmpp_io_watch_get_interest (self->watch) & G_IO_OUT);
+	if (self->completion)
+		kfxmpp_io_watch_set_receiving (self->watch, TRUE);
+
+	if (self->held_in) {
+		GString *held = self->held_in;
+
+		/* Feeding may pause reading again, the rest is parsed anyway */
+		self->held_in = NULL;
+		kfxmpp_session_feed (self, held->str, held->len);
+		g_string_free (held, TRUE);
+		if (self->io && self->coalescer && kfxmpp_presence_coalescer_get_window (self->coalescer) == 0)
+			kfxmpp_presence_coalescer_flush (self->coalescer);
+	} else if (! self->completion || self->secure) {
+		/* Data and decrypted records may have been waiting all along */
+		kfxmpp_io_watch_defer (self->watch, G_IO_IN);
+	}
+
+	return FALSE;
+}
+
+
+/**
+ * \brief Check whether drop policy applies to a stanza
+ * \param self A session
+ * \param node A stanza
+ * \return TRUE if stanza should not be dispatched
+ **/
+static gboolean kfxmpp_session_should_drop (KfxmppSession *self, xmlNodePtr node)
+{
+	gboolean drop = FALSE;
+
+	if (strcmp ((const gchar *) node->name, "presence") == 0) {
+		drop = (self->inbound_drop & KFXMPP_INBOUND_DROP_PRESENCES) != 0;
+	} else if (strcmp ((const gchar *) node->name, "message") == 0 &&
+			(self->inbound_drop & KFXMPP_INBOUND_DROP_HEADLINES)) {
+		xmlChar *type = xmlGetProp (node, BAD_CAST "type");
+
+		drop = type && xmlStrcmp (type, BAD_CAST "headline") == 0;
+		xmlFree (type);
+	}
+
+	return drop;
+}
+
+
+/**
+ * \brief Estimate size of a stanza as it was received
+ * \param node A stanza
+ * \return Approximate size in bytes
+ **/
+static gsize kfxmpp_session_node_size (xmlNodePtr node)
+{
+	gsize size = 0;
+	xmlAttrPtr attr;
+	xmlNodePtr child;
+
+	if (node->type != XML_ELEMENT_NODE)
+		return node->content ? strlen ((const gchar *) node->content) : 0;
+
+	/* <name> and </name> */
+	size += 2 * strlen ((const gchar *) node->name) + 5;
+	for (attr = node->properties; attr; attr = attr->next) {
+		/* name='value' */
+		size += strlen ((const gchar *) attr->name) + 4;
+		if (attr->children && attr->children->content)
+			size += strlen ((const gchar *) attr->children->content);
+	}
+	for (child = node->children; child; child = child->next)
+		size += kfxmpp_session_node_size (child);
+
+	return size;
+}
+
+
+/***********************************************************************
+ *
+ * Network stuff
+ * 
+ */
+
+
+/**
+ * \brief Callback called when connect timeout expires
+ * \param data A KfxmppSession
+ * \return FALSE
+ **/
+static gboolean kfxmpp_session_connect_timeout                  (gpointer data)
+{
+	KfxmppSession *self = data;
+
+	kfxmpp_log ("Timeout expired...\n");
+	
+	/* Unset this timeout, it is removed when this returns */
+	self->connect_timer = NULL;
 
 	/* Cancel connection */
 	if (self->state == KFXMPP_SESSION_STATE_CONNECTING) {
 		gnet_tcp_socket_connect_async_cancel (self->connect_id);
 		self->state = KFXMPP_SESSION_STATE_CLOSED;
 	}	
-	kfxmpp_session_connect_failed (self, KFXMPP_ERROR_TIMEOUT);
+	kfxmpp_session_connect_failed (self, KFXMPP_ERROR_TIMEOUT);
+
+	return FALSE;
+}
+
+
+/**
+ * \brief Connect to remote host
+ * \param self A session
+ * \param callback Callback to be called when connection is estabilished
+ * or when error is encountered. This callback will be called at most once per call to connect.
+ * \param data User data passed to callback
+ * \param error Location to store error information (may be NULL)
+ * \return TRUE on success, FALSE on failure
+ **/
+gboolean kfxmpp_session_connect (KfxmppSession *self, KfxmppSessionConnectCallback callback, gpointer data, GError **error)
+{
+	const gchar *addr;
+	g_return_val_if_fail (self, FALSE);
+
+	if (self->state != KFXMPP_SESSION_STATE_CLOSED) {
+		/* Error, connection is already opened */
+		g_set_error (error, KFXMPP_ERROR,
+				KFXMPP_ERROR_SESSION_ALREADY_OPEN,
+				"Session is already connected");
+		return FALSE;
+	}
+
+	addr = self->host_address ? self->host_address : self->server;
+
+	kfxmpp_log ("Connecting to %s:%d\n", addr, self->port);
+
+	/* Backend runs timers, so it is needed before socket is there */
+	if (self->backend == NULL) {
+		self->backend = kfxmpp_io_backend_new_glib (self->context);
+		self->default_backend = TRUE;
+	}
+	
+	self->callback = callback;
+	self->callback_data = data;
+
+	/* Setup a timeout */
+	if (self->timeout > 0) {
+		self->connect_timer = kfxmpp_io_backend_add_timer (self->backend,
+				self->timeout*1000,
+				kfxmpp_session_connect_timeout,
+				self);
+	}
+
+	if (self->fast_open && kfxmpp_session_fast_open (self, addr)) {
+		/* Stream header goes out along with SYN */
+		kfxmpp_session_start_stream (self);
+		return TRUE;
+	}
+
+	self->connect_id = gnet_tcp_socket_connect_async_full (addr,
+			self->port, kfxmpp_session_connected, self,
+			NULL, self->context, G_PRIORITY_DEFAULT);
+
+	self->state = KFXMPP_SESSION_STATE_CONNECTING;
+	return TRUE;
+}
+
+
+/**
+ * \brief Cancel connect to remote host
+ * \param self A session
+ *
+ * Cancels a connection process to remote host. If session if not in the
+ * state of connecting (i.e. session->state != KFXMPP_SESSION_STATE_CONNECTING),
+ * this function does nothing.
+ **/
+void kfxmpp_session_cancel_connect (KfxmppSession *self)
+{
+	g_return_if_fail (self);
+
+	if (self->state == KFXMPP_SESSION_STATE_CONNECTING) {
+		gnet_tcp_socket_connect_async_cancel (self->connect_id);
+		kfxmpp_session_close (self);
+		self->state = KFXMPP_SESSION_STATE_CLOSED;
+	}	
+}
 
-	return FALSE;
+static gboolean kfxmpp_session_ping_pong (gpointer data)
+{
+	KfxmppSession *self = data;
+	GError *error = NULL;
+
+	kfxmpp_log ("ping-pong\n");
+	kfxmpp_session_send_raw (self, " ", 1, &error);
+	if (error) {
+		g_error_free (error);
+	}
+	return TRUE;
+}
+
+
+/**
+ * \brief Function called when connection is opened
+ * \param self A session
+ **/
+static void kfxmpp_session_connect_ok (KfxmppSession *self)
+{
+	/* Cancel connect timeout */
+	if (self->connect_timer) {
+		kfxmpp_io_timer_remove (self->connect_timer);
+		self->connect_timer = NULL;
+	}
+	
+	self->state = KFXMPP_SESSION_STATE_OPEN;
+	if (self->callback) {
+		/* Inform user of succesful operation by calling callback */
+
+		self->callback (self, KFXMPP_ERROR_NONE, self->callback_data);
+	}
+
+	/* Setup a ping pong event */
+	self->ping_pong_timer = kfxmpp_io_backend_add_timer (self->backend, 5*1000,
+			kfxmpp_session_ping_pong,
+			self);
+}
+
+
+/**
+ * \brief Function called when an error was encountered while trying to estabilish connection
+ * \param self A session
+ * \param error An error that caused failure
+ **/
+static void kfxmpp_session_connect_failed (KfxmppSession *self, KfxmppError error)
+{
+	/* Address may be stale, it is resolved again next time */
+	if (self->fast_opened)
+		self->peer_len = 0;
+
+	/* Close underlying socket */
+	kfxmpp_session_delete_socket (self);
+	/* Perform a clean-up */
+	kfxmpp_session_close (self);
+	
+	self->state = KFXMPP_SESSION_STATE_CLOSED;
+	if (self->callback) {
+		/* Inform user of error by calling callback */
+
+		self->callback (self, error, self->callback_data);
+	}
+}
+
+
+/**
+ * \brief Disconnect from remote host
+ * \param self A session
+ * \param error Location to store error information (may be NULL)
+ * \return TRUE on success, FALSE otherwise
+ **/
+gboolean kfxmpp_session_disconnect (KfxmppSession *self, GError **error)
+{
+	g_return_val_if_fail (self, FALSE);
+
+	kfxmpp_log ("Disconnecting\n");
+
+	if (self->state == KFXMPP_SESSION_STATE_CLOSED) {
+		/* Trying to close session that is not open */
+		g_set_error (error, KFXMPP_ERROR,
+				KFXMPP_ERROR_SESSION_NOT_OPEN,
+				"Session is not connected");
+		return FALSE;
+	}
+	
+	/* Whatever other threads queued goes before end of stream */
+	if (self->io && ! kfxmpp_mpsc_queue_is_empty (self->send_queue))
+		kfxmpp_session_drain_send_queue (self);
+
+	/* Close XML stream to server */
+	kfxmpp_session_send_raw (self, "</stream:stream>", 16, NULL);
+	kfxmpp_session_sync_compression (self);
+#ifdef HAVE_GNUTLS
+	kfxmpp_session_seal_records (self, TRUE);
+#endif
+	kfxmpp_session_flush (self);
+
+	/* Close underlying socket */
+	kfxmpp_session_delete_socket (self);
+
+	kfxmpp_session_close (self);
+
+	self->state = KFXMPP_SESSION_STATE_CLOSED;
+
+	return TRUE;
+}
+
+
+/**
+ * \brief Set function that will be called when connection closes
+ * \param self A session
+ * \param callback A callback
+ * \param data Data that will be passed to callback
+ **/
+void kfxmpp_session_set_disconnect_callback (KfxmppSession *self, KfxmppSessionDisconnectCallback callback, gpointer data)
+{
+	g_return_if_fail (self);
+
+	self->disconnect_callback = callback;
+	self->disconnect_data = data;
+}
+
+
+/**
+ * \brief Close session and clean it up
+ **/
+static void kfxmpp_session_close (KfxmppSession *self)
+{
+	g_return_if_fail (self);
+
+	/* Cancel connect timeout */
+	if (self->connect_timer) {
+		kfxmpp_io_timer_remove (self->connect_timer);
+		self->connect_timer = NULL;
+	}
+
+	if (self->ping_pong_timer) {
+		kfxmpp_io_timer_remove (self->ping_pong_timer);
+		self->ping_pong_timer = NULL;
+	}
+
+	/* Drop output that was not written yet, backend finishes what it has */
+	self->completion = FALSE;
+	kfxmpp_session_stop_flushing (self);
+	self->io = NULL;
+	self->bind_pipelined = FALSE;
+	if (self->tls_in)
+		g_string_truncate (self->tls_in, 0);
+	self->yielded_at = 0;
+
+	/* Next connection starts reading, backlog pauses it again if still too long */
+	if (self->held_in) {
+		g_string_free (self->held_in, TRUE);
+		self->held_in = NULL;
+	}
+	if (self->resume_timer) {
+		kfxmpp_io_timer_remove (self->resume_timer);
+		self->resume_timer = NULL;
+	}
+	self->reading_paused = FALSE;
+
+#ifdef HAVE_GNUTLS
+	/* Next connection negotiates its own */
+	kfxmpp_session_end_tls (self);
+#endif
+	kfxmpp_session_end_compression (self);
+
+	/* Drop presences that were not dispatched yet */
+	if (self->coalescer)
+		kfxmpp_presence_coalescer_clear (self->coalescer);
+
+	/* Remove socket watch */
+	if (self->watch) {
+		kfxmpp_io_watch_remove (self->watch);
+		self->watch = NULL;
+	}
+}
+
+
+/**
+ * \brief A callback called when session connects to remote host
+ * \param socket A socket object
+ * \param status Status of operation
+ * \data User data - KfxmppSession object passed by kfxmpp_session_connect
+ **/
+static void kfxmpp_session_connected (GTcpSocket *socket, GTcpSocketConnectAsyncStatus status, gpointer data)
+{
+	KfxmppSession *self = data;
+
+	const gchar *addr = self->host_address ? self->host_address : self->server;
+
+	/* TODO: handle errors */
+	
+	if (status == GTCP_SOCKET_CONNECT_ASYNC_STATUS_OK) {
+		/* Connection was succesful */
+
+		kfxmpp_log ("Connected\n");
+
+		self->socket = socket;
+		self->io = gnet_tcp_socket_get_io_channel (socket);
+
+		/* Fast open may skip resolving and connecting next time */
+		self->peer_len = sizeof (self->peer);
+		if (getpeername (g_io_channel_unix_get_fd (self->io),
+					(struct sockaddr *) &self->peer, &self->peer_len) == 0) {
+			g_free (self->peer_host);
+			self->peer_host = g_strdup (addr);
+			self->peer_port = self->port;
+		} else {
+			self->peer_len = 0;
+		}
+
+
+//		g_io_add_watch (self->io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+//				kfxmpp_session_io_event, self);
+//		g_io_add_watch (self->io, G_IO_IN,
+//				kfxmpp_session_io_event, self);
+//		g_io_add_watch (self->io, G_IO_ERR,
+//				kfxmpp_session_io_event, self);
+//		g_io_add_watch (self->io, G_IO_HUP,
+//				kfxmpp_session_io_event, self);
+//		g_io_add_watch (self->io, G_IO_NVAL,
+//				kfxmpp_session_io_event, self);
+
+//		self->source = g_io_create_watch (self->io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL);
+//		g_source_set_callback (self->source, (GSourceFunc) kfxmpp_session_io_event, self, NULL);
+//		g_source_attach (self->source, self->context);
+		
+		
+		kfxmpp_session_start_stream (self);
+		
+	} else if (status == GTCP_SOCKET_CONNECT_ASYNC_STATUS_INETADDR_ERROR) {
+		/* Could not resolve hostname */
+		
+		kfxmpp_log ("Couldnt resolve %s:%d\n", addr, self->port);
+//		self->state = KFXMPP_SESSION_STATE_CLOSED;
+//
+//		if (self->callback) {
+//			/* Inform user of erro by calling callback */
+//
+//			self->callback (self, KFXMPP_ERROR_ADDRESS_LOOKUP_FAILED, self->callback_data);
+//		}
+		
+		kfxmpp_session_connect_failed (self, KFXMPP_ERROR_ADDRESS_LOOKUP_FAILED);
+
+	} else if (status == GTCP_SOCKET_CONNECT_ASYNC_STATUS_TCP_ERROR) {
+		/* Could not connect to remote host */
+		
+		kfxmpp_log ("Couldnt connect to %s:%d\n", addr, self->port);
+//		self->state = KFXMPP_SESSION_STATE_CLOSED;
+//
+//		if (self->callback) {
+//			/* Inform user of erro by calling callback */
+//
+//			self->callback (self, KFXMPP_ERROR_CONNECT_FAILED, self->callback_data);
+//		}
+		
+		kfxmpp_session_connect_failed (self, KFXMPP_ERROR_CONNECT_FAILED);
+	}
 }
 
 
 /**
- * \brief Connect to remote host
+ * \brief Open socket to where last connection went, with TCP Fast Open
  * \param self A session
- * \param callback Callback to be called when connection is estabilished
- * or when error is encountered. This callback will be called at most once per call to connect.
- * \param data User data passed to callback
- * \param error Location to store error information (may be NULL)
- * \return TRUE on success, FALSE on failure
+ * \param addr Host name being connected to
+ * \return TRUE if socket is open, FALSE to resolve and connect the usual way
+ *
+ * Kernel defers connecting until socket is first written to, and sends
+ * that data along with SYN if it has a cookie for server. Otherwise it
+ * connects at once, asking server for a cookie.
  **/
-gboolean kfxmpp_session_connect (KfxmppSession *self, KfxmppSessionConnectCallback callback, gpointer data, GError **error)
+static gboolean kfxmpp_session_fast_open (KfxmppSession *self, const gchar *addr)
 {
-	const gchar *addr;
-	g_return_val_if_fail (self, FALSE);
+#ifdef TCP_FASTOPEN_CONNECT
+	gint fd;
+	gint on = 1;
 
-	if (self->state != KFXMPP_SESSION_STATE_CLOSED) {
-		/* Error, connection is already opened */
-		g_set_error (error, KFXMPP_ERROR,
-				KFXMPP_ERROR_SESSION_ALREADY_OPEN,
-				"Session is already connected");
+	if (self->peer_len == 0 || self->peer_port != self->port || strcmp (self->peer_host, addr) != 0)
+		return FALSE;
+
+	fd = socket (self->peer.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return FALSE;
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+	if (setsockopt (fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof (on)) < 0 ||
+			(connect (fd, (struct sockaddr *) &self->peer, self->peer_len) < 0 &&
+			 errno != EINPROGRESS)) {
+		kfxmpp_log ("Fast open failed: %s\n", g_strerror (errno));
+		close (fd);
 		return FALSE;
 	}
 
-	addr = self->host_address ? self->host_address : self->server;
+	kfxmpp_log ("Fast open to %s:%d\n", addr, self->port);
+	self->io = g_io_channel_unix_new (fd);
+	g_io_channel_set_close_on_unref (self->io, TRUE);
+	self->fast_opened = TRUE;
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
 
-	kfxmpp_log ("Connecting to %s:%d\n", addr, self->port);
-	
-	self->connect_id = gnet_tcp_socket_connect_async (addr,
-			self->port, kfxmpp_session_connected, self);
-	
-	self->callback = callback;
-	self->callback_data = data;
 
-	/* Setup a timeout */
-	if (self->timeout > 0) {
-		self->connect_timeout_id = g_timeout_add (self->timeout*1000,
-				kfxmpp_session_connect_timeout,
-				self);
+/**
+ * \brief Start talking to server once socket is there
+ * \param self A session
+ **/
+static void kfxmpp_session_start_stream (KfxmppSession *self)
+{
+	gint nodelay;
+
+	/* Output is coalesced by session, so Nagle would only add latency */
+	nodelay = 1;
+	setsockopt (g_io_channel_unix_get_fd (self->io), IPPROTO_TCP, TCP_NODELAY,
+			&nodelay, sizeof (nodelay));
+	/* TODO: set appropriate status here */
+	self->state = KFXMPP_SESSION_STATE_CONNECTED;
+
+	/* Setup event notifications, errors and hangups are always reported */
+	self->watch = kfxmpp_io_backend_add_watch (self->backend,
+			g_io_channel_unix_get_fd (self->io), G_IO_IN,
+			kfxmpp_session_io_event, self);
+	/* Backends doing I/O themselves read and write for session */
+	kfxmpp_session_set_completion (self, TRUE);
+
+	if (self->use_tls == KFXMPP_TLS_POLICY_DIRECT) {
+		/* Stream is opened when handshake completes */
+		if (kfxmpp_session_tls_handshake (self) != 0)
+			kfxmpp_session_connect_failed (self, KFXMPP_ERROR_TLS_HANDSHAKE_FAILED);
+		return;
 	}
 
-	self->state = KFXMPP_SESSION_STATE_CONNECTING;
-	return TRUE;
+	/* Open XML stream to remote host */
+	kfxmpp_session_open_stream (self);
 }
 
 
 /**
- * \brief Cancel connect to remote host
+ * \brief Close connection socket, whoever opened it
  * \param self A session
+ **/
+static void kfxmpp_session_delete_socket (KfxmppSession *self)
+{
+	/* Backend still writes what it was handed, it must know before
+	 * descriptor is closed */
+	if (self->watch) {
+		kfxmpp_io_watch_remove (self->watch);
+		self->watch = NULL;
+	}
+
+	if (self->fast_opened) {
+		/* Channel closes socket */
+		g_io_channel_unref (self->io);
+		self->fast_opened = FALSE;
+	} else if (self->socket) {
+		gnet_tcp_socket_delete (self->socket);
+	}
+	self->socket = NULL;
+}
+
+
+/**
+ * \brief Open stream tag to the server
+ **/
+static void kfxmpp_session_open_stream (KfxmppSession *self)
+{
+	gchar *tag;
+
+	g_return_if_fail (self);
+
+	tag = g_strdup_printf ("<?xml version='1.0'?>"
+			"<stream:stream "
+			"to='%s' "
+			"xmlns='jabber:client' "
+			"xmlns:stream='http://etherx.jabber.org/streams' "
+			"version='1.0'>",
+			self->server);
+
+	kfxmpp_session_send_raw (self, tag, -1, NULL);
+	g_free (tag);
+}
+
+
+
+/***********************************************************************
  *
- * Cancels a connection process to remote host. If session if not in the
- * state of connecting (i.e. session->state != KFXMPP_SESSION_STATE_CONNECTING),
- * this function does nothing.
+ * TLS layer stuff
+ * 
+ */
+
+
+/**
+ * \brief Request TLS negotiation
+ * \param session A session
+ *
+ * This is automatically performed by kfxmpp_session_connect, so, on
+ * most cases, you'll probably don't need to call this ditectly.
  **/
-void kfxmpp_session_cancel_connect (KfxmppSession *self)
+void kfxmpp_session_starttls (KfxmppSession *self)
 {
 	g_return_if_fail (self);
 
-	if (self->state == KFXMPP_SESSION_STATE_CONNECTING) {
-		gnet_tcp_socket_connect_async_cancel (self->connect_id);
-		self->state = KFXMPP_SESSION_STATE_CLOSED;
-	}	
+	kfxmpp_session_send_raw (self, KFXMPP_SESSION_TLS, sizeof (KFXMPP_SESSION_TLS)-1, NULL);
+									/* -1 is for '\0' character */
 }
 
-static gboolean kfxmpp_session_ping_pong (gpointer data)
+
+/**
+ * \brief Start TLS handshake
+ * \param session A session
+ * \return 0 if handshake is under way, negative value if it could not start
+ *
+ * Handshake does not block, it goes on as socket becomes ready. When it
+ * succeeds, stream is restarted over TLS; when it fails, connect callback
+ * gets KFXMPP_ERROR_TLS_HANDSHAKE_FAILED.
+ **/
+gint kfxmpp_session_tls_handshake (KfxmppSession *self)
 {
-	KfxmppSession *self = data;
-	GError *error = NULL;
+	gnutls_certificate_credentials_t cred;
 
-	kfxmpp_log ("ping-pong\n");
-	kfxmpp_session_send_raw (self, " ", 1, &error);
-	if (error) {
-		g_error_free (error);
+	g_return_val_if_fail (self, -99);
+	g_return_val_if_fail (self->gnutls == NULL, -1);
+
+	if (self->io == NULL)
+		return -1;
+
+	/* Credentials and trust store are shared by all sessions */
+	cred = kfxmpp_tls_cache_get_credentials ();
+	if (cred == NULL)
+		return -1;
+
+	/* Initialize gnutls session object */
+	if (gnutls_init (&self->gnutls, GNUTLS_CLIENT) < 0) {
+		self->gnutls = NULL;
+		return -1;
 	}
-	return TRUE;
+	/* Set default priorities on the ciphers, key exchange methods, macs and
+	 * compression methods. Think it should be fine */
+	gnutls_set_default_priority (self->gnutls);
+	/* Assign credentials to gnutls session */
+	gnutls_credentials_set (self->gnutls, GNUTLS_CRD_CERTIFICATE, cred);
+	/* Certificate is checked within handshake, on worker if offloaded */
+	gnutls_session_set_ptr (self->gnutls, self);
+	gnutls_session_set_verify_function (self->gnutls, kfxmpp_session_verify_peer);
+	if (self->server)
+		gnutls_server_name_set (self->gnutls, GNUTLS_NAME_DNS, self->server, strlen (self->server));
+	/* Direct TLS endpoints may serve other protocols on the same port */
+	if (self->use_tls == KFXMPP_TLS_POLICY_DIRECT) {
+		gnutls_datum_t alpn = { (guchar *) KFXMPP_SESSION_ALPN, sizeof (KFXMPP_SESSION_ALPN) - 1 };
+
+		gnutls_alpn_set_protocols (self->gnutls, &alpn, 1, 0);
+	}
+	/* Offer session of last connection to this server */
+	if (self->server)
+		kfxmpp_tls_cache_offer (self->gnutls, self->server);
+
+	/* Handshake reads socket itself */
+	kfxmpp_session_set_completion (self, FALSE);
+
+	/* Setup transport layer */
+	gnutls_transport_set_lowat (self->gnutls, 0);
+	if (self->crypto_pool) {
+		/* Steps run on a worker, which only sees memory buffers */
+		self->offload = g_new0 (KfxmppSessionHandshake, 1);
+		self->offload->session = self;
+		self->offload->gnutls = self->gnutls;
+		self->offload->in = g_string_new (NULL);
+		self->offload->out = g_string_new (NULL);
+		gnutls_transport_set_push_function (self->gnutls, kfxmpp_session_hs_send);
+		gnutls_transport_set_pull_function (self->gnutls, kfxmpp_session_hs_recv);
+		gnutls_transport_set_ptr (self->gnutls, (gnutls_transport_ptr_t) self->offload);
+	} else {
+		gnutls_transport_set_push_function (self->gnutls, kfxmpp_session_tls_send);
+		gnutls_transport_set_pull_function (self->gnutls, kfxmpp_session_tls_recv);
+		gnutls_transport_set_ptr (self->gnutls, (gnutls_transport_ptr_t) self);
+	}
+
+	self->handshaking = TRUE;
+	kfxmpp_session_continue_handshake (self);
+	return 0;
 }
 
 
 /**
- * \brief Function called when connection is opened
+ * \brief Run TLS handshake as far as data received so far allows
  * \param self A session
+ *
+ * Called when handshake starts and each time socket becomes readable.
+ * Handshake messages are queued by push function and written as socket
+ * accepts them, which asks for writability while some are left, so the
+ * only thing handshake ever waits for is data from server.
  **/
-static void kfxmpp_session_connect_ok (KfxmppSession *self)
+static void kfxmpp_session_continue_handshake (KfxmppSession *self)
 {
-	/* Cancel connect timeout */
-	if (self->connect_timeout_id != 0) {
-		g_source_remove (self->connect_timeout_id);
-		self->connect_timeout_id = 0;
+	gint ret;
+
+	if (self->offload) {
+		kfxmpp_session_offload_handshake (self);
+		return;
 	}
-	
-	self->state = KFXMPP_SESSION_STATE_OPEN;
-	if (self->callback) {
-		/* Inform user of succesful operation by calling callback */
 
-		self->callback (self, KFXMPP_ERROR_NONE, self->callback_data);
+	ret = gnutls_handshake (self->gnutls);
+	if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+		kfxmpp_session_flush (self);
+		return;
 	}
 
-	/* Setup a ping pong event */
-	self->ping_pong_id = g_timeout_add (5*1000,
-			kfxmpp_session_ping_pong,
-			self);
+	kfxmpp_session_finish_handshake (self, ret);
 }
 
 
 /**
- * \brief Function called when an error was encountered while trying to estabilish connection
+ * \brief Read socket for a handshake run on crypto pool, and run its next step
  * \param self A session
- * \param error An error that caused failure
+ *
+ * Socket is read until it would block even while a step runs, so that a
+ * level-triggered backend does not report it again and again, and so that
+ * a hangup is noticed. Next step runs once last one is done and either
+ * no step was run yet, or there is something new for it.
  **/
-static void kfxmpp_session_connect_failed (KfxmppSession *self, KfxmppError error)
+static void kfxmpp_session_offload_handshake (KfxmppSession *self)
 {
-	/* Close underlying socket */
-	gnet_tcp_socket_delete (self->socket);
-	self->socket = NULL;
-	/* Perform a clean-up */
-	kfxmpp_session_close (self);
-	
-	self->state = KFXMPP_SESSION_STATE_CLOSED;
-	if (self->callback) {
-		/* Inform user of error by calling callback */
+	KfxmppSessionHandshake *hs = self->offload;
+	gchar buffer[4096];
+	gssize bytes_read;
 
-		self->callback (self, error, self->callback_data);
+	if (self->tls_in == NULL)
+		self->tls_in = g_string_new (NULL);
+
+	for (;;) {
+		bytes_read = recv (g_io_channel_unix_get_fd (self->io), buffer, sizeof (buffer), MSG_DONTWAIT);
+		if (bytes_read > 0) {
+			g_string_append_len (self->tls_in, buffer, bytes_read);
+		} else if (bytes_read < 0 && errno == EINTR) {
+			continue;
+		} else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			kfxmpp_log ("TLS handshake failed: connection lost\n");
+			self->handshaking = FALSE;
+			kfxmpp_session_connect_failed (self, KFXMPP_ERROR_TLS_HANDSHAKE_FAILED);
+			return;
+		}
 	}
+
+	if (hs->busy || (hs->started && self->tls_in->len == 0))
+		return;
+
+	g_string_append_len (hs->in, self->tls_in->str, self->tls_in->len);
+	g_string_truncate (self->tls_in, 0);
+	hs->started = TRUE;
+	hs->busy = TRUE;
+	kfxmpp_session_ref (self);
+	kfxmpp_crypto_pool_push (self->crypto_pool, kfxmpp_session_handshake_step,
+				kfxmpp_session_handshake_done, hs, self->context);
 }
 
 
 /**
- * \brief Disconnect from remote host
- * \param self A session
- * \param error Location to store error information (may be NULL)
- * \return TRUE on success, FALSE otherwise
+ * \brief Run a handshake step on a worker
+ * \param data A KfxmppSessionHandshake
  **/
-gboolean kfxmpp_session_disconnect (KfxmppSession *self, GError **error)
+static void kfxmpp_session_handshake_step (gpointer data)
 {
-	g_return_val_if_fail (self, FALSE);
+	KfxmppSessionHandshake *hs = data;
 
-	kfxmpp_log ("Disconnecting\n");
+	hs->result = gnutls_handshake (hs->gnutls);
+}
 
-	if (self->state == KFXMPP_SESSION_STATE_CLOSED) {
-		/* Trying to close session that is not open */
-		g_set_error (error, KFXMPP_ERROR,
-				KFXMPP_ERROR_SESSION_NOT_OPEN,
-				"Session is not connected");
+
+/**
+ * \brief Take result of a handshake step back on session's thread
+ * \param data A KfxmppSessionHandshake
+ * \return FALSE
+ **/
+static gboolean kfxmpp_session_handshake_done (gpointer data)
+{
+	KfxmppSessionHandshake *hs = data;
+	KfxmppSession *self = hs->session;
+	gint ret = hs->result;
+
+	hs->busy = FALSE;
+	if (hs->cancelled) {
+		/* Session was closed meanwhile, handshake is ours to release */
+		kfxmpp_session_free_handshake (hs);
+		kfxmpp_session_unref (self);
 		return FALSE;
 	}
-	
-	/* Close XML stream to server */
-	kfxmpp_session_send_raw (self, "</stream:stream>", 16, NULL);
 
-	/* Close underlying socket */
-	gnet_tcp_socket_delete (self->socket);
-	self->socket = NULL;
+	if (hs->out->len > 0) {
+		kfxmpp_out_queue_append (self->out_queue, hs->out->str, hs->out->len);
+		g_string_truncate (hs->out, 0);
+		kfxmpp_session_account_output (self);
+		kfxmpp_session_flush (self);
+	}
 
-	kfxmpp_session_close (self);
+	if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+		/* Server may have answered while step was running */
+		if (self->tls_in->len > 0)
+			kfxmpp_session_offload_handshake (self);
+		kfxmpp_session_unref (self);
+		return FALSE;
+	}
 
-	self->state = KFXMPP_SESSION_STATE_CLOSED;
+	/* Records from here on go through session again, starting with those
+	 * received along with last handshake message */
+	gnutls_transport_set_push_function (self->gnutls, kfxmpp_session_tls_send);
+	gnutls_transport_set_pull_function (self->gnutls, kfxmpp_session_tls_recv);
+	gnutls_transport_set_ptr (self->gnutls, (gnutls_transport_ptr_t) self);
+	g_string_prepend_len (self->tls_in, hs->in->str, hs->in->len);
+	self->offload = NULL;
+	kfxmpp_session_free_handshake (hs);
 
-	return TRUE;
+	kfxmpp_session_finish_handshake (self, ret);
+	kfxmpp_session_unref (self);
+	return FALSE;
 }
 
 
 /**
- * \brief Set function that will be called when connection closes
+ * \brief Secure stream after handshake finished, or give up
  * \param self A session
- * \param callback A callback
- * \param data Data that will be passed to callback
+ * \param ret Return value of gnutls_handshake
  **/
-void kfxmpp_session_set_disconnect_callback (KfxmppSession *self, KfxmppSessionDisconnectCallback callback, gpointer data)
+static void kfxmpp_session_finish_handshake (KfxmppSession *self, gint ret)
 {
-	g_return_if_fail (self);
+	gnutls_datum_t alpn;
 
-	self->disconnect_callback = callback;
-	self->disconnect_data = data;
+	self->handshaking = FALSE;
+	if (ret < 0) {
+		kfxmpp_log ("TLS handshake failed: %s\n", gnutls_strerror (ret));
+		kfxmpp_session_connect_failed (self, KFXMPP_ERROR_TLS_HANDSHAKE_FAILED);
+		return;
+	}
+
+	/* Endpoint serving another protocol on this port would not understand us */
+	if (self->use_tls == KFXMPP_TLS_POLICY_DIRECT &&
+			gnutls_alpn_get_selected_protocol (self->gnutls, &alpn) == 0 &&
+			(alpn.size != sizeof (KFXMPP_SESSION_ALPN) - 1 ||
+			 memcmp (alpn.data, KFXMPP_SESSION_ALPN, alpn.size) != 0)) {
+		kfxmpp_log ("Server selected another ALPN protocol\n");
+		kfxmpp_session_connect_failed (self, KFXMPP_ERROR_TLS_HANDSHAKE_FAILED);
+		return;
+	}
+
+	/* Mark that we had secured the connection */
+	self->secure = TRUE;
+	if (self->server)
+		kfxmpp_tls_cache_handshake_done (self->gnutls, self->server);
+	/* Records come from backend again, through tls_in */
+	kfxmpp_session_set_completion (self, TRUE);
+
+	/* Re-initialize the stream, header goes out with last handshake message */
+	kfxmpp_stream_parser_unref (self->parser);
+	kfxmpp_session_reset_parser (self);
+	kfxmpp_session_open_stream (self);
+	kfxmpp_session_seal_records (self, TRUE);
+
+	/* Records read along with last handshake message are not announced by socket */
+	if (self->watch && (gnutls_record_check_pending (self->gnutls) > 0 ||
+				(self->tls_in && self->tls_in->len > 0)))
+		kfxmpp_io_watch_defer (self->watch, G_IO_IN);
+}
+
+
+/**
+ * \brief Release a handshake run on crypto pool
+ * \param hs A handshake
+ *
+ * gnutls session is released only if handshake owns it, which it does
+ * once it was cancelled.
+ **/
+static void kfxmpp_session_free_handshake (KfxmppSessionHandshake *hs)
+{
+	if (hs->cancelled)
+		gnutls_deinit (hs->gnutls);
+	g_string_free (hs->in, TRUE);
+	g_string_free (hs->out, TRUE);
+	g_free (hs);
+}
+
+
+/**
+ * \brief Release TLS state of a connection
+ * \param self A session
+ **/
+static void kfxmpp_session_end_tls (KfxmppSession *self)
+{
+	if (self->offload && self->offload->busy) {
+		/* Worker still uses it, it goes when its step is done */
+		self->offload->cancelled = TRUE;
+		self->gnutls = NULL;
+	} else if (self->offload) {
+		kfxmpp_session_free_handshake (self->offload);
+	}
+	self->offload = NULL;
+
+	/* TLS 1.3 tickets come after handshake, store them for next time */
+	if (self->secure && self->gnutls && self->server)
+		kfxmpp_tls_cache_store (self->gnutls, self->server);
+
+	if (self->gnutls) {
+		gnutls_deinit (self->gnutls);
+		self->gnutls = NULL;
+	}
+	self->secure = FALSE;
+	self->handshaking = FALSE;
+	self->ktls_ulp = FALSE;
+	self->ktls_failed = FALSE;
+	self->ktls_active = KFXMPP_KTLS_NONE;
+}
+
+
+/**
+ * \brief Verify server certificate during handshake
+ * \param session A gnutls session of a KfxmppSession
+ * \return 0 to go on with handshake, nonzero to fail it
+ *
+ * Runs on a crypto pool worker when handshake is offloaded. Chains
+ * verified before are not verified again, see kfxmpp_tls_cache_verify.
+ **/
+static int kfxmpp_session_verify_peer (gnutls_session_t session)
+{
+	KfxmppSession *self = gnutls_session_get_ptr (session);
+
+	if (! self->verify)
+		return 0;
+	if (self->server == NULL || ! kfxmpp_tls_cache_verify (session, self->server)) {
+		kfxmpp_log ("Server certificate verification failed\n");
+		return -1;
+	}
+	return 0;
 }
 
 
 /**
- * \brief Close session and clean it up
+ * \brief Hand keys of one direction to kernel TLS
+ * \param self A session
+ * \param direction KFXMPP_KTLS_TX or KFXMPP_KTLS_RX
+ *
+ * Caller makes sure no record of that direction is half way through
+ * gnutls. On failure, gnutls goes on and no further attempt is made.
  **/
-static void kfxmpp_session_close (KfxmppSession *self)
+static void kfxmpp_session_start_ktls (KfxmppSession *self, KfxmppKtlsDirection direction)
 {
-	g_return_if_fail (self);
-
-	/* Cancel connect timeout */
-	if (self->connect_timeout_id != 0) {
-		g_source_remove (self->connect_timeout_id);
-		self->connect_timeout_id = 0;
+#ifdef HAVE_LINUX_TLS_H
+	union {
+		struct tls12_crypto_info_aes_gcm_128 aes128;
+		struct tls12_crypto_info_aes_gcm_256 aes256;
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+	} info;
+	gnutls_datum_t mac_key, iv, key;
+	guchar seq[8];
+	gboolean tls13;
+	socklen_t size;
+	gint fd;
+
+	fd = g_io_channel_unix_get_fd (self->io);
+	self->ktls_failed = TRUE;
+
+	tls13 = gnutls_protocol_get_version (self->gnutls) == GNUTLS_TLS1_3;
+	if (! tls13 && gnutls_protocol_get_version (self->gnutls) != GNUTLS_TLS1_2)
+		return;
+#if ! HAVE_DECL_TLS_1_3_VERSION
+	if (tls13)
+		return;
+#endif
+#if ! HAVE_DECL_TLS_GET_RECORD_TYPE
+	/* Control records could not be told apart from broken ones */
+	if (direction == KFXMPP_KTLS_RX)
+		return;
+#endif
+	if (gnutls_record_get_state (self->gnutls, direction == KFXMPP_KTLS_RX,
+				&mac_key, &iv, &key, seq) < 0)
+		return;
+
+	memset (&info, 0, sizeof (info));
+	switch (gnutls_cipher_get (self->gnutls)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		/* TLS 1.2 sends explicit part of nonce, kernel counts it from sequence number */
+		memcpy (info.aes128.iv, tls13 ? iv.data + 4 : seq, 8);
+		memcpy (info.aes128.salt, iv.data, 4);
+		memcpy (info.aes128.key, key.data, sizeof (info.aes128.key));
+		memcpy (info.aes128.rec_seq, seq, 8);
+		size = sizeof (info.aes128);
+		break;
+	case GNUTLS_CIPHER_AES_256_GCM:
+		info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy (info.aes256.iv, tls13 ? iv.data + 4 : seq, 8);
+		memcpy (info.aes256.salt, iv.data, 4);
+		memcpy (info.aes256.key, key.data, sizeof (info.aes256.key));
+		memcpy (info.aes256.rec_seq, seq, 8);
+		size = sizeof (info.aes256);
+		break;
+#if HAVE_DECL_TLS_CIPHER_CHACHA20_POLY1305
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy (info.chacha.iv, iv.data, sizeof (info.chacha.iv));
+		memcpy (info.chacha.key, key.data, sizeof (info.chacha.key));
+		memcpy (info.chacha.rec_seq, seq, 8);
+		size = sizeof (info.chacha);
+		break;
+#endif
+	default:
+		kfxmpp_log ("Kernel TLS: cipher not supported\n");
+		return;
 	}
+	/* Version comes first in each of them */
+#if HAVE_DECL_TLS_1_3_VERSION
+	info.aes128.info.version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+#else
+	info.aes128.info.version = TLS_1_2_VERSION;
+#endif
 
-	if (self->ping_pong_id) {
-		g_source_remove (self->ping_pong_id);
-		self->ping_pong_id = 0;
+	if (! self->ktls_ulp) {
+		if (setsockopt (fd, SOL_TCP, TCP_ULP, "tls", sizeof ("tls")) < 0) {
+			kfxmpp_log ("Kernel TLS not available: %s\n", g_strerror (errno));
+			return;
+		}
+		self->ktls_ulp = TRUE;
 	}
-
-	/* Remove event handlers */
-	int i;
-	for (i = 0; i < 4; i++) {
-		if (self->sources[i])
-			g_source_destroy (self->sources[i]);
-		self->sources[i] = NULL;
+	if (setsockopt (fd, SOL_TLS, direction == KFXMPP_KTLS_RX ? TLS_RX : TLS_TX, &info, size) < 0) {
+		kfxmpp_log ("Kernel TLS rejected keys: %s\n", g_strerror (errno));
+		return;
 	}
+
+	self->ktls_failed = FALSE;
+	self->ktls_active |= direction;
+#else
+	self->ktls_failed = TRUE;
+#endif
 }
 
 
 /**
- * \brief Add a watch to session
- * \param self A KfxmppSession
- * \param condition Condition to meet
- * \func Callback called when condifion is fulfilled
- * \return A new GSource
+ * \brief Take a control record kernel TLS received off socket
+ * \param self A session
+ * \return TRUE if record was skipped and data may follow, FALSE if
+ * 	connection can not go on
+ *
+ * Kernel fails plain reads when next record is not data. Handshake
+ * records after handshake carry session tickets, which are of no use by
+ * now, and TLS 1.2 renegotiation requests, which may be ignored. Anything
+ * else, TLS 1.3 key updates in particular, changes keys kernel does not
+ * know about, so every later record would fail to decrypt. Such a record,
+ * like an alert, ends the connection.
  **/
-static GSource *kfxmpp_create_watch (KfxmppSession *self, GIOCondition condition, GSourceFunc func)
+static gboolean kfxmpp_session_ktls_skip_record (KfxmppSession *self)
 {
-	GSource *src;
+#if defined (HAVE_LINUX_TLS_H) && HAVE_DECL_TLS_GET_RECORD_TYPE
+	guchar record[16384 + 256];
+	gchar control[CMSG_SPACE (sizeof (guchar))];
+	struct iovec vec = { record, sizeof (record) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	guchar type = 0;
+	gssize size, i;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+
+	size = recvmsg (g_io_channel_unix_get_fd (self->io), &msg, MSG_DONTWAIT);
+	if (size < 0)
+		return FALSE;
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+		type = *(guchar *) CMSG_DATA (cmsg);
+
+	/* 22 is handshake, 21 alert, close_notify included */
+	if (type != 22) {
+		kfxmpp_log ("Kernel TLS: got record of type %d\n", type);
+		return FALSE;
+	}
 
-	src = g_io_create_watch (self->io, condition);
-	g_source_set_callback (src, (GSourceFunc) func, self, NULL);
-	g_source_attach (src, self->context);
+	/* Each message is type and 24-bit length; 4 is a ticket, 0 a hello request */
+	for (i = 0; i < size; i += 4 + ((record[i + 1] << 16) | (record[i + 2] << 8) | record[i + 3])) {
+		if (i + 4 > size || (record[i] != 4 && record[i] != 0)) {
+			kfxmpp_log ("Kernel TLS: can not follow handshake message %d\n",
+					i + 4 > size ? -1 : record[i]);
+			return FALSE;
+		}
+	}
 
-	return src;
+	kfxmpp_log ("Kernel TLS: skipped handshake record\n");
+	return TRUE;
+#else
+	return FALSE;
+#endif
 }
 
 
 /**
- * \brief A callback called when session connects to remote host
- * \param socket A socket object
- * \param status Status of operation
- * \data User data - KfxmppSession object passed by kfxmpp_session_connect
+ * \brief Encrypt batched data into TLS records
+ * \param self A session
+ * \param partial Whether data not filling a whole record is sealed too
  **/
-static void kfxmpp_session_connected (GTcpSocket *socket, GTcpSocketConnectAsyncStatus status, gpointer data)
+static void kfxmpp_session_seal_records (KfxmppSession *self, gboolean partial)
 {
-	KfxmppSession *self = data;
-
-	const gchar *addr = self->host_address ? self->host_address : self->server;
-
-	/* TODO: handle errors */
-	
-	if (status == GTCP_SOCKET_CONNECT_ASYNC_STATUS_OK) {
-		/* Connection was succesful */
-
-		kfxmpp_log ("Connected\n");
-
-		self->socket = socket;
-		self->io = gnet_tcp_socket_get_io_channel (socket);
-		/* TODO: set appropriate status here */
-		self->state = KFXMPP_SESSION_STATE_CONNECTED;
-
-		/* Setup event notifications */
-		self->sources[0] = kfxmpp_create_watch (self, G_IO_IN,   kfxmpp_session_io_event);
-		self->sources[1] = kfxmpp_create_watch (self, G_IO_ERR,  kfxmpp_session_io_event);
-		self->sources[2] = kfxmpp_create_watch (self, G_IO_HUP,  kfxmpp_session_io_event);
-		self->sources[3] = kfxmpp_create_watch (self, G_IO_NVAL, kfxmpp_session_io_event);
-
-
-//		g_io_add_watch (self->io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-//				kfxmpp_session_io_event, self);
-//		g_io_add_watch (self->io, G_IO_IN,
-//				kfxmpp_session_io_event, self);
-//		g_io_add_watch (self->io, G_IO_ERR,
-//				kfxmpp_session_io_event, self);
-//		g_io_add_watch (self->io, G_IO_HUP,
-//				kfxmpp_session_io_event, self);
-//		g_io_add_watch (self->io, G_IO_NVAL,
-//				kfxmpp_session_io_event, self);
+	gsize record_size = self->tls_record_size ? self->tls_record_size : TLS_RECORD_SIZE;
+	gsize sealed = 0;
+	gssize ret;
 
-//		self->source = g_io_create_watch (self->io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL);
-//		g_source_set_callback (self->source, (GSourceFunc) kfxmpp_session_io_event, self, NULL);
-//		g_source_attach (self->source, self->context);
-		
-		
-		/* Open XML stream to remote host */
-		kfxmpp_session_open_stream (self);
-		
-	} else if (status == GTCP_SOCKET_CONNECT_ASYNC_STATUS_INETADDR_ERROR) {
-		/* Could not resolve hostname */
-		
-		kfxmpp_log ("Couldnt resolve %s:%d\n", addr, self->port);
-//		self->state = KFXMPP_SESSION_STATE_CLOSED;
-//
-//		if (self->callback) {
-//			/* Inform user of erro by calling callback */
-//
-//			self->callback (self, KFXMPP_ERROR_ADDRESS_LOOKUP_FAILED, self->callback_data);
-//		}
-		
-		kfxmpp_session_connect_failed (self, KFXMPP_ERROR_ADDRESS_LOOKUP_FAILED);
+	if (self->gnutls == NULL || self->tls_out == NULL || self->tls_out->len == 0)
+		return;
+
+	while (self->tls_out->len - sealed >= record_size ||
+			(partial && sealed < self->tls_out->len)) {
+		ret = gnutls_record_send (self->gnutls, self->tls_out->str + sealed,
+				MIN (self->tls_out->len - sealed, record_size));
+		if (ret < 0) {
+			/* Output never blocks, so session is broken */
+			kfxmpp_log ("TLS send failed: %s\n", gnutls_strerror (ret));
+			g_string_truncate (self->tls_out, 0);
+			kfxmpp_session_account_output (self);
+			if (self->tls_timer) {
+				kfxmpp_io_timer_remove (self->tls_timer);
+				self->tls_timer = NULL;
+			}
+			kfxmpp_session_disconnected (self, G_IO_ERR);
+			return;
+		}
+		sealed += ret;
+		self->tls_records++;
+	}
+	g_string_erase (self->tls_out, 0, sealed);
+	kfxmpp_session_account_output (self);
 
-	} else if (status == GTCP_SOCKET_CONNECT_ASYNC_STATUS_TCP_ERROR) {
-		/* Could not connect to remote host */
-		
-		kfxmpp_log ("Couldnt connect to %s:%d\n", addr, self->port);
-//		self->state = KFXMPP_SESSION_STATE_CLOSED;
-//
-//		if (self->callback) {
-//			/* Inform user of erro by calling callback */
-//
-//			self->callback (self, KFXMPP_ERROR_CONNECT_FAILED, self->callback_data);
-//		}
-		
-		kfxmpp_session_connect_failed (self, KFXMPP_ERROR_CONNECT_FAILED);
+	if (self->tls_out->len == 0 && self->tls_timer) {
+		kfxmpp_io_timer_remove (self->tls_timer);
+		self->tls_timer = NULL;
 	}
 }
 
 
 /**
- * \brief Open stream tag to the server
+ * \brief Seal a partial record that waited long enough for more data
+ * \param data A KfxmppSession
+ * \return FALSE
  **/
-static void kfxmpp_session_open_stream (KfxmppSession *self)
+static gboolean kfxmpp_session_seal_timeout (gpointer data)
 {
-	gchar *tag;
-
-	g_return_if_fail (self);
+	KfxmppSession *self = data;
 
-	tag = g_strdup_printf ("<?xml version='1.0'?>"
-			"<stream:stream "
-			"to='%s' "
-			"xmlns='jabber:client' "
-			"xmlns:stream='http://etherx.jabber.org/streams' "
-			"version='1.0'>",
-			self->server);
+	/* Timer is removed when this returns */
+	self->tls_timer = NULL;
 
-	kfxmpp_session_send_raw (self, tag, -1, NULL);
-	g_free (tag);
+	/* Records schedule their own flush */
+	kfxmpp_session_seal_records (self, TRUE);
+	return FALSE;
 }
 
 
-
-/***********************************************************************
- *
- * TLS layer stuff
- * 
- */
-
-
 /**
- * \brief Request TLS negotiation
- * \param session A session
- *
- * This is automatically performed by kfxmpp_session_connect, so, on
- * most cases, you'll probably don't need to call this ditectly.
+ * \brief Send function for gnutls
  **/
-void kfxmpp_session_starttls (KfxmppSession *self)
+static gssize kfxmpp_session_tls_send (gnutls_transport_ptr_t p, const void*data, gsize size)
 {
-	g_return_if_fail (self);
+	KfxmppSession *self = p;
 
-	kfxmpp_session_send_raw (self, KFXMPP_SESSION_TLS, sizeof (KFXMPP_SESSION_TLS)-1, NULL);
-									/* -1 is for '\0' character */
+	kfxmpp_out_queue_append (self->out_queue, data, size);
+	kfxmpp_session_account_output (self);
+	kfxmpp_session_schedule_flush (self);
+	return size;
 }
 
 
 /**
- * \brief Perform TLS handshake
- * \param session A session
+ * \brief Send function for gnutls running a handshake on a worker
  **/
-gint kfxmpp_session_tls_handshake (KfxmppSession *self)
+static gssize kfxmpp_session_hs_send (gnutls_transport_ptr_t p, const void*data, gsize size)
 {
-	gint ret;
-	
-	g_return_val_if_fail (self, -99);
-
-	/* TODO: check status of operations */
-	/* Todo check certificate */
-
-	/* Allocate certificate credentials */
-	gnutls_certificate_allocate_credentials (&self->cred);
-	/* Initialize gnutls session object */
-	gnutls_init (&self->gnutls, GNUTLS_CLIENT);
-	/* Set default priorities on the ciphers, key exchange methods, macs and
-	 * compression methods. Think it should be fine */
-	gnutls_set_default_priority (self->gnutls);
-	/* Assign credentials to gnutls session */
-	gnutls_credentials_set (self->gnutls, GNUTLS_CRD_CERTIFICATE, self->cred);
-
-	/* Setup transport layer */
-	gnutls_transport_set_push_function (self->gnutls, kfxmpp_session_tls_send);
-	gnutls_transport_set_pull_function (self->gnutls, kfxmpp_session_tls_recv);
-	gnutls_transport_set_ptr (self->gnutls, (gnutls_transport_ptr_t) self);
-	gnutls_transport_set_lowat (self->gnutls, 0);
+	KfxmppSessionHandshake *hs = p;
 
-	ret = gnutls_handshake (self->gnutls);
-	if (ret != 0) {
-		/* Something has gone wrong */
-		gnutls_deinit (self->gnutls);
-		gnutls_certificate_free_credentials (self->cred);
-		
-		kfxmpp_log ("TLS handshake failed\n");
-
-		/* Some kind of error */
-		return -1;
-	}
-
-	/* Mark that we had secured the connection */
-	self->secure = TRUE;
-	return 0;
+	g_string_append_len (hs->out, data, size);
+	return size;
 }
 
 
 /**
- * \brief Send function for gnutls
+ * \brief Recv function for gnutls running a handshake on a worker
  **/
-static gssize kfxmpp_session_tls_send (gnutls_transport_ptr_t p, const void*data, gsize size)
+static gssize kfxmpp_session_hs_recv (gnutls_transport_ptr_t p, void* data, gsize size)
 {
-	KfxmppSession *self = p;
-	GError *error = NULL;
-	gint bytes_written;
-	GIOStatus status;
-	
-	status = g_io_channel_write_chars (self->io, data, size, &bytes_written, &error);
-	return bytes_written;
+	KfxmppSessionHandshake *hs = p;
+	gsize bytes_read;
+
+	if (hs->in->len == 0) {
+		gnutls_transport_set_errno (hs->gnutls, EAGAIN);
+		return -1;
+	}
+	bytes_read = MIN (size, hs->in->len);
+	memcpy (data, hs->in->str, bytes_read);
+	g_string_erase (hs->in, 0, bytes_read);
+	return bytes_read;
 }
 
 
@@ -1182,11 +4140,27 @@ static gssize kfxmpp_session_tls_send (gnutls_transport_ptr_t p, const void*data
 static gssize kfxmpp_session_tls_recv (gnutls_transport_ptr_t p, void* data, gsize size)
 {
 	KfxmppSession *self = p;
-	GError *error = NULL;
-	gint bytes_read;
-	GIOStatus status;
-	
-	status = g_io_channel_read_chars (self->io, data, size, &bytes_read, &error);
+	gssize bytes_read;
+
+	/* Records received earlier come first, socket is read directly only
+	 * after they have been taken */
+	if (self->tls_in && self->tls_in->len > 0) {
+		bytes_read = MIN (size, self->tls_in->len);
+		memcpy (data, self->tls_in->str, bytes_read);
+		g_string_erase (self->tls_in, 0, bytes_read);
+		return bytes_read;
+	}
+	if (self->completion) {
+		gnutls_transport_set_errno (self->gnutls, EAGAIN);
+		return -1;
+	}
+
+	do {
+		bytes_read = recv (g_io_channel_unix_get_fd (self->io), data, size, MSG_DONTWAIT);
+	} while (bytes_read < 0 && errno == EINTR);
+
+	if (bytes_read < 0)
+		gnutls_transport_set_errno (self->gnutls, errno);
 	return bytes_read;
 }
 
@@ -1239,13 +4213,124 @@ static void kfxmpp_session_got_stream (KfxmppStreamParser *parser, gint version,
 static void kfxmpp_session_got_xml (KfxmppStreamParser *parser, xmlNodePtr node, gpointer data)
 {
 	KfxmppSession *self = data;
-	KfxmppStanza *stanza;
 
 	kfxmpp_log ("Got <%s>\n", node->name);
+	self->burst_stanzas++;
+
+	if (self->reading_paused && kfxmpp_session_should_drop (self, node)) {
+		self->n_dropped++;
+		return;
+	}
+
+	/* Presences may be held by coalescer */
+	if (self->coalescer && kfxmpp_presence_coalescer_push (self->coalescer, node))
+		return;
+
+	kfxmpp_session_dispatch_xml (self, node);
+}
+
+
+/**
+ * \brief Callback called when coalescer releases a presence
+ **/
+static void kfxmpp_session_got_presence (KfxmppPresenceCoalescer *coalescer, xmlNodePtr node, gpointer data)
+{
+	kfxmpp_session_dispatch_xml (data, node);
+}
+
+
+/**
+ * \brief Trigger XML event for a stanza
+ **/
+static void kfxmpp_session_dispatch_xml (KfxmppSession *self, xmlNodePtr node)
+{
+	KfxmppStanza *stanza;
+
 	stanza = kfxmpp_stanza_new_from_xml (node);
 
 	/* Trigger an event */
-	kfxmpp_event_trigger (self->events[KFXMPP_EVENT_TYPE_XML], stanza);
+	kfxmpp_event_trigger_with_backend (self->events[KFXMPP_EVENT_TYPE_XML], stanza,
+			kfxmpp_session_pin_stanza, kfxmpp_session_unpin_stanza, self->context, self->backend);
+	kfxmpp_stanza_free (stanza);
+}
+
+
+/**
+ * \brief Keep a stanza alive while its handler is pending
+ *
+ * Parser frees nodes as soon as they are dispatched, so pinned stanza
+ * gets its own copy of the tree.
+ **/
+static gpointer kfxmpp_session_pin_stanza (gpointer source, gpointer data)
+{
+	KfxmppSession *self = source;
+	KfxmppStanza *stanza = data;
+
+	KfxmppStanza *pinned;
+	gsize size;
+
+	kfxmpp_session_ref (self);
+	pinned = kfxmpp_stanza_new_from_xml (xmlCopyNode (stanza->node, 1));
+
+	size = kfxmpp_session_node_size (pinned->node);
+	g_hash_table_insert (self->pinned, pinned, GUINT_TO_POINTER (size));
+	kfxmpp_session_inbound_grew (self, size);
+
+	return pinned;
+}
+
+
+/**
+ * \brief Release a stanza pinned by kfxmpp_session_pin_stanza
+ **/
+static void kfxmpp_session_unpin_stanza (gpointer source, gpointer data)
+{
+	KfxmppSession *self = source;
+	KfxmppStanza *stanza = data;
+	gsize size;
+
+	size = GPOINTER_TO_UINT (g_hash_table_lookup (self->pinned, stanza));
+	g_hash_table_remove (self->pinned, stanza);
+	kfxmpp_session_inbound_shrank (self, size);
+
+	xmlFreeNode (stanza->node);
+	kfxmpp_stanza_free (stanza);
+	kfxmpp_session_unref (source);
+}
+
+
+/**
+ * \brief Keep a message alive while its handler is pending
+ **/
+static gpointer kfxmpp_session_pin_message (gpointer source, gpointer data)
+{
+	KfxmppSession *self = source;
+	gsize size;
+
+	/* Message is accounted by size of stanza it was parsed from */
+	size = self->dispatching ? kfxmpp_session_node_size (self->dispatching) : 0;
+	g_hash_table_insert (self->pinned, data, GUINT_TO_POINTER (size));
+	kfxmpp_session_inbound_grew (self, size);
+
+	kfxmpp_session_ref (source);
+	return kfxmpp_message_ref (data);
+}
+
+
+/**
+ * \brief Release a message pinned by kfxmpp_session_pin_message
+ **/
+static void kfxmpp_session_unpin_message (gpointer source, gpointer data)
+{
+	KfxmppSession *self = source;
+	gsize size;
+
+	size = GPOINTER_TO_UINT (g_hash_table_lookup (self->pinned, data));
+	g_hash_table_remove (self->pinned, data);
+	kfxmpp_session_inbound_shrank (self, size);
+
+	kfxmpp_message_unref (data);
+	kfxmpp_session_unref (source);
 }
 
 
@@ -1313,7 +4398,11 @@ static gboolean kfxmpp_session_xml_event (KfxmppEventHandler *handler, KfxmppSes
 
 		msg = kfxmpp_message_new (NULL);
 		kfxmpp_message_parse_stanza (msg, stanza);
-		kfxmpp_event_trigger (self->events[KFXMPP_EVENT_TYPE_MESSAGE], msg);
+		self->dispatching = root;
+		kfxmpp_event_trigger_with_backend (self->events[KFXMPP_EVENT_TYPE_MESSAGE], msg,
+				kfxmpp_session_pin_message, kfxmpp_session_unpin_message, self->context,
+				self->backend);
+		self->dispatching = NULL;
 		kfxmpp_message_unref (msg);
 	} else if (strcmp (name, "features") == 0) {
 		/* Server advertises features it supports */
@@ -1343,11 +4432,25 @@ static gboolean kfxmpp_session_xml_event (KfxmppEventHandler *handler, KfxmppSes
 				/* Bind resource */
 //				kfxmpp_session_bind_resource (self);
 				features |= KFXMPP_SESSION_STREAM_FEATURES_BIND;
+			} else if (strcmp (node->name, "compression") == 0) {
+				/* Stream compression, only zlib is known */
+				xmlNodePtr method;
+
+				for (method = node->children; method; method = method->next) {
+					xmlChar *tmp;
+
+					if (method->type != XML_ELEMENT_NODE || strcmp (method->name, "method") != 0)
+						continue;
+					tmp = xmlNodeGetContent (method);
+					if (tmp && strcmp (tmp, "zlib") == 0)
+						features |= KFXMPP_SESSION_STREAM_FEATURES_COMPRESSION;
+					xmlFree (tmp);
+				}
 			}
 		}
 
-		/* TLS */
-		if (self->use_tls != KFXMPP_TLS_POLICY_NEVER) {
+		/* TLS, unless stream runs over it already */
+		if (self->use_tls != KFXMPP_TLS_POLICY_NEVER && ! self->secure) {
 			if (features & KFXMPP_SESSION_STREAM_FEATURES_STARTTLS) {
 				/* STARTTLS is supported */
 				/* Request TLS encryption */
@@ -1369,7 +4472,17 @@ static gboolean kfxmpp_session_xml_event (KfxmppEventHandler *handler, KfxmppSes
 			return TRUE;
 		}
 
-		/* Resource binding */
+		/* Compression, binding follows on compressed stream */
+		if (self->compress_level >= 0 && ! kfxmpp_session_get_compressed (self)
+				&& features & KFXMPP_SESSION_STREAM_FEATURES_COMPRESSION) {
+			kfxmpp_session_send_raw (self, KFXMPP_SESSION_COMPRESS, sizeof (KFXMPP_SESSION_COMPRESS)-1, NULL);
+			self->compress_requested = TRUE;
+			return TRUE;
+		}
+
+		/* Resource binding, unless it was requested along with stream header */
+		if (self->bind_pipelined)
+			return TRUE;
 		if (features & KFXMPP_SESSION_STREAM_FEATURES_BIND) {
 			kfxmpp_session_bind_resource (self);
 			return TRUE;
@@ -1397,14 +4510,8 @@ static gboolean kfxmpp_session_xml_event (KfxmppEventHandler *handler, KfxmppSes
 		/* Server wants us to proceed with TLS handshake */
 		kfxmpp_log ("->proceed\n");
 		
-		if (kfxmpp_session_tls_handshake (self) == 0) {
-
-			/* Re-initialize the stream */
-//			kfxmpp_stream_parser_unref (self->parser);
-			self->parser = kfxmpp_stream_parser_new (kfxmpp_session_got_xml, self);
-
-			kfxmpp_session_open_stream (self);
-		} else {
+		/* Stream is restarted when handshake completes */
+		if (kfxmpp_session_tls_handshake (self) != 0) {
 			/* Do something with error */
 			kfxmpp_log ("Error during TLS handshake\n");
 			
@@ -1414,10 +4521,34 @@ static gboolean kfxmpp_session_xml_event (KfxmppEventHandler *handler, KfxmppSes
 		/* We have succeeded with SASL authentication */
 
 		/* Re-initialize the stream */
-//		kfxmpp_stream_parser_unref (self->parser);
-		self->parser = kfxmpp_stream_parser_new (kfxmpp_session_got_xml, self);
+		kfxmpp_stream_parser_unref (self->parser);
+		kfxmpp_session_reset_parser (self);
 		kfxmpp_session_open_stream (self);
 		self->state = KFXMPP_SESSION_STATE_OPEN;
+
+		/* Servers have to offer binding now, so ask for it in the same write,
+		 * unless compression may have to be negotiated first */
+		if (self->bind_pipelining && self->compress_level < 0) {
+			kfxmpp_session_bind_resource (self);
+			self->bind_pipelined = TRUE;
+		}
+	} else if (strcmp (name, "compressed") == 0) {
+		/* Server compresses from now on, stream is restarted compressed */
+		self->compress_requested = FALSE;
+#ifdef HAVE_LIBZ
+		if (kfxmpp_session_start_compression (self)) {
+			kfxmpp_stream_parser_unref (self->parser);
+			kfxmpp_session_reset_parser (self);
+			kfxmpp_session_open_stream (self);
+			return FALSE;
+		}
+#endif
+		kfxmpp_session_connect_failed (self, KFXMPP_ERROR_CONNECT_FAILED);
+	} else if (strcmp (name, "failure") == 0 && self->compress_requested) {
+		/* Server would not compress, go on without it */
+		kfxmpp_log ("Compression refused\n");
+		self->compress_requested = FALSE;
+		kfxmpp_session_bind_resource (self);
 	} else if (strcmp (name, "failure") == 0) {
 		/* Some kind of a failure */
 
@@ -1500,7 +4631,7 @@ static void kfxmpp_session_bind_resource (KfxmppSession *self)
 
 	/* Prepare handler */
 	handler = kfxmpp_event_handler_new (kfxmpp_session_bind_resource_response, NULL, NULL);
-	kfxmpp_session_send_await_response (self, stanza, handler, NULL);
+	kfxmpp_session_request (self, stanza, handler, FALSE, NULL);
 	kfxmpp_event_handler_unref (handler);
 	kfxmpp_stanza_free (stanza);
 }
@@ -1563,7 +4694,7 @@ static void kfxmpp_session_iq_auth (KfxmppSession *self)
 
 	/* Prepare handler */
 	handler = kfxmpp_event_handler_new (kfxmpp_session_iq_auth_response, NULL, NULL);
-	kfxmpp_session_send_await_response (self, iq, handler, NULL);
+	kfxmpp_session_request (self, iq, handler, FALSE, NULL);
 	kfxmpp_event_handler_unref (handler);
 	kfxmpp_stanza_free (iq);
 }
@@ -1607,7 +4738,7 @@ static gboolean kfxmpp_session_iq_auth_response (KfxmppEventHandler *h, gpointer
 	
 	/* Prepare handler */
 	handler = kfxmpp_event_handler_new (kfxmpp_session_iq_auth_response2, NULL, NULL);
-	kfxmpp_session_send_await_response (self, iq, handler, NULL);
+	kfxmpp_session_request (self, iq, handler, FALSE, NULL);
 	kfxmpp_event_handler_unref (handler);
 	kfxmpp_stanza_free (iq);
 	return TRUE;
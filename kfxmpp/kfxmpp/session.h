@@ -29,9 +29,13 @@
 
 #include <glib.h>
 #include <kfxmpp/core.h>
+#include <kfxmpp/cryptopool.h>
 #include <kfxmpp/event.h>
 #include <kfxmpp/stanza.h>
 #include <kfxmpp/error.h>
+#include <kfxmpp/filter.h>
+#include <kfxmpp/iobackend.h>
+#include <kfxmpp/streamparser.h>
 
 G_BEGIN_DECLS
 
@@ -57,7 +61,8 @@ typedef enum {
 	KFXMPP_SESSION_STREAM_FEATURES_NONE = 0,		/**< None */
 	KFXMPP_SESSION_STREAM_FEATURES_STARTTLS	= 1 << 0,	/**< STARTTLS encryption layer */
 	KFXMPP_SESSION_STREAM_FEATURES_SASL	= 1 << 1,	/**< SASL authentication mechanism */
-	KFXMPP_SESSION_STREAM_FEATURES_BIND	= 1 << 2	/**< Resource binding */
+	KFXMPP_SESSION_STREAM_FEATURES_BIND	= 1 << 2,	/**< Resource binding */
+	KFXMPP_SESSION_STREAM_FEATURES_COMPRESSION = 1 << 3	/**< zlib stream compression */
 } KfxmppSessionStreamFeatures;
 
 
@@ -76,9 +81,41 @@ typedef enum {
 typedef enum {
 	KFXMPP_TLS_POLICY_ALWAYS,	/**< Always use TLS */
 	KFXMPP_TLS_POLICY_IF_AVAILABLE,	/**< Use TLS only if it is available (default policy) */
-	KFXMPP_TLS_POLICY_NEVER		/**< Never use TLS, even if it is available */
+	KFXMPP_TLS_POLICY_NEVER,	/**< Never use TLS, even if it is available */
+	KFXMPP_TLS_POLICY_DIRECT	/**< Start TLS right after connecting, without STARTTLS */
 } KfxmppTlsUsagePolicy;
 
+/**
+ * \brief Directions of TLS records kernel encrypts or decrypts
+ **/
+typedef enum {
+	KFXMPP_KTLS_NONE	= 0,		/**< gnutls handles all records */
+	KFXMPP_KTLS_TX		= 1 << 0,	/**< Kernel encrypts records sent */
+	KFXMPP_KTLS_RX		= 1 << 1	/**< Kernel decrypts records received */
+} KfxmppKtlsDirection;
+
+/**
+ * \brief Input scheduling profile
+ **/
+typedef enum {
+	KFXMPP_SCHEDULING_LATENCY,	/**< Small batches, sessions sharing a loop take turns often */
+	KFXMPP_SCHEDULING_THROUGHPUT	/**< Large batches, fewer wakeups for the same data (default profile) */
+} KfxmppSchedulingProfile;
+
+/**
+ * \brief Stanzas dropped instead of dispatched while reading is paused
+ **/
+typedef enum {
+	KFXMPP_INBOUND_DROP_NONE	= 0,		/**< Dispatch everything (default policy) */
+	KFXMPP_INBOUND_DROP_HEADLINES	= 1 << 0,	/**< Drop messages of type headline */
+	KFXMPP_INBOUND_DROP_PRESENCES	= 1 << 1	/**< Drop presences */
+} KfxmppInboundDropPolicy;
+
+/**
+ * \brief Number of buckets in histogram of scheduling delays
+ **/
+#define KFXMPP_SESSION_DELAY_BUCKETS 20
+
 /**
  * \brief Callback called when connection estabilishes or an error is encountered.
  * \param session Calling session
@@ -88,6 +125,16 @@ typedef enum {
 typedef void (*KfxmppSessionConnectCallback) (KfxmppSession *session, KfxmppError error, gpointer data);
 typedef void (*KfxmppSessionDisconnectCallback) (KfxmppSession *session, KfxmppSessionDisconnectStatus status, gpointer data);
 
+/**
+ * \brief Callback called when send queue drains below its low watermark
+ * \param session Calling session
+ * \param data User supplied data
+ *
+ * It is called only after kfxmpp_session_send has failed with
+ * KFXMPP_ERROR_WOULD_BLOCK, from the thread running session's main context.
+ **/
+typedef void (*KfxmppSessionWritableCallback) (KfxmppSession *session, gpointer data);
+
 
 
 /* General usage */
@@ -113,10 +160,61 @@ void kfxmpp_session_set_priority (KfxmppSession *self, int priority);
 int kfxmpp_session_get_priority (KfxmppSession *self);
 void kfxmpp_session_set_use_tls (KfxmppSession *self, KfxmppTlsUsagePolicy use_tls);
 KfxmppTlsUsagePolicy kfxmpp_session_get_use_tls (KfxmppSession *self);
+void kfxmpp_session_set_verify_certificate (KfxmppSession *self, gboolean verify);
+gboolean kfxmpp_session_get_verify_certificate (KfxmppSession *self);
+void kfxmpp_session_set_ktls (KfxmppSession *self, gboolean enable);
+gboolean kfxmpp_session_get_ktls (KfxmppSession *self);
+KfxmppKtlsDirection kfxmpp_session_get_ktls_active (KfxmppSession *self);
+void kfxmpp_session_set_fast_open (KfxmppSession *self, gboolean enable);
+gboolean kfxmpp_session_get_fast_open (KfxmppSession *self);
+void kfxmpp_session_set_bind_pipelining (KfxmppSession *self, gboolean enable);
+gboolean kfxmpp_session_get_bind_pipelining (KfxmppSession *self);
+void kfxmpp_session_set_compression (KfxmppSession *self, gint level, gint window);
+gint kfxmpp_session_get_compression (KfxmppSession *self);
+gboolean kfxmpp_session_get_compressed (KfxmppSession *self);
+void kfxmpp_session_get_compression_stats (KfxmppSession *self, gsize *sent, gsize *sent_compressed,
+		gsize *received, gsize *received_compressed);
 void kfxmpp_session_set_protocol (KfxmppSession *self, KfxmppProtocol proto);
 KfxmppProtocol kfxmpp_session_get_protocol (KfxmppSession *self);
 void kfxmpp_session_set_timeout (KfxmppSession *self, gint timeout);
 KfxmppProtocol kfxmpp_session_get_timeout (KfxmppSession *self);
+void kfxmpp_session_set_presence_coalescing (KfxmppSession *self, gint window);
+gint kfxmpp_session_get_presence_coalescing (KfxmppSession *self);
+guint kfxmpp_session_get_presences_collapsed (KfxmppSession *self);
+guint kfxmpp_session_get_pending_stanzas (KfxmppSession *self);
+gulong kfxmpp_session_get_pending_age (KfxmppSession *self);
+void kfxmpp_session_add_filter (KfxmppSession *self, KfxmppFilter *filter);
+void kfxmpp_session_remove_filter (KfxmppSession *self, KfxmppFilter *filter);
+void kfxmpp_session_set_io_backend (KfxmppSession *self, KfxmppIoBackend *backend);
+KfxmppIoBackend *kfxmpp_session_get_io_backend (KfxmppSession *self);
+gint kfxmpp_session_get_fd (KfxmppSession *self);
+GIOCondition kfxmpp_session_get_interest (KfxmppSession *self);
+gint64 kfxmpp_session_get_deadline (KfxmppSession *self);
+void kfxmpp_session_process (KfxmppSession *self, GIOCondition revents, gint64 now);
+void kfxmpp_session_set_context (KfxmppSession *self, GMainContext *context);
+GMainContext *kfxmpp_session_get_context (KfxmppSession *self);
+void kfxmpp_session_set_parser_pool (KfxmppSession *self, KfxmppStreamParserPool *pool);
+void kfxmpp_session_set_send_watermarks (KfxmppSession *self, gsize low, gsize high);
+void kfxmpp_session_set_writable_callback (KfxmppSession *self, KfxmppSessionWritableCallback callback, gpointer data);
+gsize kfxmpp_session_get_pending_bytes (KfxmppSession *self);
+guint kfxmpp_session_get_send_queue_depth (KfxmppSession *self);
+void kfxmpp_session_set_scheduling_profile (KfxmppSession *self, KfxmppSchedulingProfile profile);
+KfxmppSchedulingProfile kfxmpp_session_get_scheduling_profile (KfxmppSession *self);
+void kfxmpp_session_set_read_budget (KfxmppSession *self, gsize bytes, guint stanzas);
+void kfxmpp_session_set_tls_batching (KfxmppSession *self, gsize record_size, guint delay);
+guint kfxmpp_session_get_tls_records (KfxmppSession *self);
+const guint *kfxmpp_session_get_scheduling_delays (KfxmppSession *self);
+void kfxmpp_session_reset_scheduling_delays (KfxmppSession *self);
+void kfxmpp_session_set_inbound_limits (KfxmppSession *self, guint stanzas, gsize bytes);
+void kfxmpp_session_set_inbound_drop_policy (KfxmppSession *self, KfxmppInboundDropPolicy policy);
+KfxmppInboundDropPolicy kfxmpp_session_get_inbound_drop_policy (KfxmppSession *self);
+gsize kfxmpp_session_get_pending_stanza_bytes (KfxmppSession *self);
+gboolean kfxmpp_session_get_reading_paused (KfxmppSession *self);
+guint kfxmpp_session_get_inbound_pauses (KfxmppSession *self);
+guint kfxmpp_session_get_inbound_resumes (KfxmppSession *self);
+guint kfxmpp_session_get_inbound_dropped (KfxmppSession *self);
+void kfxmpp_session_set_crypto_pool (KfxmppSession *self, KfxmppCryptoPool *pool);
+KfxmppCryptoPool *kfxmpp_session_get_crypto_pool (KfxmppSession *self);
 
 /* Network I/O */
 gssize kfxmpp_session_read (KfxmppSession *self, gchar *buffer, gssize size, GError **error);
@@ -0,0 +1,328 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/** \file sessionpool.h */
+
+#include "kfxmpp.h"
+#include "sessionpool.h"
+
+struct _KfxmppSessionPool {
+	gint ref_count;			/**< Number of references to this object */
+	KfxmppIoBackend *backend;	/**< io_uring or edge-triggered epoll backend */
+	GHashTable *sessions;		/**< Sessions in pool, each holding a reference */
+};
+
+/**
+ * \brief GSource dispatching a pool
+ **/
+typedef struct {
+	GSource source;			/**< Parent */
+	GPollFD pollfd;			/**< Descriptor of pool's backend */
+	KfxmppSessionPool *pool;	/**< Pool */
+} KfxmppSessionPoolSource;
+
+
+/***********************************************************************
+ *
+ * Static function prototypes
+ *
+ */
+
+static gboolean kfxmpp_session_pool_source_prepare (GSource *source, gint *timeout);
+static gboolean kfxmpp_session_pool_source_check (GSource *source);
+static gboolean kfxmpp_session_pool_source_dispatch (GSource *source, GSourceFunc callback, gpointer data);
+static void kfxmpp_session_pool_source_finalize (GSource *source);
+
+static GSourceFuncs pool_source_funcs = {
+	kfxmpp_session_pool_source_prepare,
+	kfxmpp_session_pool_source_check,
+	kfxmpp_session_pool_source_dispatch,
+	kfxmpp_session_pool_source_finalize
+};
+
+
+/**
+ * \brief Create a new KfxmppSessionPool
+ * \return A new pool, or NULL if neither io_uring nor epoll is available
+ *
+ * Pool uses io_uring backend where kernel supports it, edge-triggered
+ * epoll one otherwise.
+ **/
+KfxmppSessionPool *kfxmpp_session_pool_new (void)
+{
+	KfxmppSessionPool *self;
+	KfxmppIoBackend *backend;
+
+	backend = kfxmpp_io_backend_new_uring ();
+	if (backend == NULL)
+		backend = kfxmpp_io_backend_new_epoll_full (TRUE);
+	if (backend == NULL)
+		return NULL;
+
+	self = kfxmpp_session_pool_new_with_backend (backend);
+	kfxmpp_io_backend_unref (backend);
+
+	return self;
+}
+
+
+/**
+ * \brief Create a new KfxmppSessionPool driven by given backend
+ * \param backend An epoll or io_uring backend
+ * \return A new pool
+ *
+ * This is mostly for comparing backends. Level-triggered epoll works, but
+ * wakes up for every session with queued output.
+ **/
+KfxmppSessionPool *kfxmpp_session_pool_new_with_backend (KfxmppIoBackend *backend)
+{
+	KfxmppSessionPool *self;
+
+	g_return_val_if_fail (backend, NULL);
+	g_return_val_if_fail (kfxmpp_io_backend_get_fd (backend) >= 0, NULL);
+
+	self = g_new0 (KfxmppSessionPool, 1);
+	self->ref_count = 1;
+	self->backend = kfxmpp_io_backend_ref (backend);
+	self->sessions = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			(GDestroyNotify) kfxmpp_session_unref, NULL);
+
+	return self;
+}
+
+
+/**
+ * \brief Free a pool
+ * \param self A pool
+ *
+ * Sessions are released, but they keep using pool's backend until they
+ * disconnect.
+ **/
+void kfxmpp_session_pool_free (KfxmppSessionPool *self)
+{
+	g_return_if_fail (self);
+
+	g_hash_table_destroy (self->sessions);
+	kfxmpp_io_backend_unref (self->backend);
+	g_free (self);
+}
+
+
+/**
+ * \brief Add a reference to KfxmppSessionPool
+ *
+ * This function is thread-safe.
+ **/
+KfxmppSessionPool *kfxmpp_session_pool_ref (KfxmppSessionPool *self)
+{
+	g_return_val_if_fail (self, NULL);
+	g_atomic_int_inc (&self->ref_count);
+	return self;
+}
+
+
+/**
+ * \brief Remove a reference from KfxmppSessionPool
+ *
+ * Object will be deleted when reference count reaches 0. This function is
+ * thread-safe.
+ **/
+void kfxmpp_session_pool_unref (KfxmppSessionPool *self)
+{
+	g_return_if_fail (self);
+	if (g_atomic_int_dec_and_test (&self->ref_count))
+		kfxmpp_session_pool_free (self);
+}
+
+
+/**
+ * \brief Add a session to pool
+ * \param self A pool
+ * \param session A session that is not connected
+ *
+ * Session's socket and timers will be driven by pool from its next
+ * connect on. Pool holds a reference to \b session.
+ **/
+void kfxmpp_session_pool_add (KfxmppSessionPool *self, KfxmppSession *session)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (session);
+
+	if (g_hash_table_lookup (self->sessions, session))
+		return;
+
+	kfxmpp_session_set_io_backend (session, self->backend);
+	g_hash_table_insert (self->sessions, kfxmpp_session_ref (session), session);
+}
+
+
+/**
+ * \brief Remove a session from pool
+ * \param self A pool
+ * \param session A session that is not connected
+ *
+ * Session goes back to GLib main loop of its context.
+ **/
+void kfxmpp_session_pool_remove (KfxmppSessionPool *self, KfxmppSession *session)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (session);
+
+	if (g_hash_table_lookup (self->sessions, session) == NULL)
+		return;
+
+	kfxmpp_session_set_io_backend (session, NULL);
+	g_hash_table_remove (self->sessions, session);
+}
+
+
+/**
+ * \brief Get number of sessions in pool
+ * \param self A pool
+ * \return Number of sessions
+ **/
+guint kfxmpp_session_pool_get_n_sessions (KfxmppSessionPool *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return g_hash_table_size (self->sessions);
+}
+
+
+/**
+ * \brief Get backend driving sessions of a pool
+ * \param self A pool
+ * \return An io_uring or edge-triggered epoll backend
+ *
+ * Application may add its own watches and timers to it.
+ **/
+KfxmppIoBackend *kfxmpp_session_pool_get_io_backend (KfxmppSessionPool *self)
+{
+	g_return_val_if_fail (self, NULL);
+
+	return self->backend;
+}
+
+
+/**
+ * \brief Get file descriptor that becomes readable when sessions have I/O
+ * \param self A pool
+ * \return Descriptor of pool's backend
+ *
+ * Poll it for reading with timeout from kfxmpp_session_pool_get_timeout,
+ * then call kfxmpp_session_pool_dispatch with zero timeout.
+ **/
+gint kfxmpp_session_pool_get_fd (KfxmppSessionPool *self)
+{
+	g_return_val_if_fail (self, -1);
+
+	return kfxmpp_io_backend_get_fd (self->backend);
+}
+
+
+/**
+ * \brief Get time until pool has to be dispatched
+ * \param self A pool
+ * \return Time in milliseconds until next timer of a session expires,
+ * 	0 if pool has work to do right away, -1 if there are no timers
+ **/
+gint kfxmpp_session_pool_get_timeout (KfxmppSessionPool *self)
+{
+	g_return_val_if_fail (self, -1);
+
+	return kfxmpp_io_backend_get_timeout (self->backend);
+}
+
+
+/**
+ * \brief Handle I/O and timers of sessions
+ * \param self A pool
+ * \param timeout Maximum time to wait for I/O, in milliseconds. -1 waits
+ * 	until next timer.
+ * \return Number of callbacks called, -1 on error
+ **/
+gint kfxmpp_session_pool_dispatch (KfxmppSessionPool *self, gint timeout)
+{
+	g_return_val_if_fail (self, -1);
+
+	return kfxmpp_io_backend_dispatch (self->backend, timeout);
+}
+
+
+/**
+ * \brief Create a GSource dispatching a pool
+ * \param self A pool
+ * \return A new GSource, to be attached to main context of pool's sessions
+ *
+ * GLib main loop then polls a single descriptor, no matter how many
+ * sessions there are.
+ **/
+GSource *kfxmpp_session_pool_create_source (KfxmppSessionPool *self)
+{
+	KfxmppSessionPoolSource *src;
+
+	g_return_val_if_fail (self, NULL);
+
+	src = (KfxmppSessionPoolSource *) g_source_new (&pool_source_funcs, sizeof (KfxmppSessionPoolSource));
+	src->pool = kfxmpp_session_pool_ref (self);
+	src->pollfd.fd = kfxmpp_session_pool_get_fd (self);
+	src->pollfd.events = G_IO_IN;
+	g_source_add_poll ((GSource *) src, &src->pollfd);
+
+	return (GSource *) src;
+}
+
+
+static gboolean kfxmpp_session_pool_source_prepare (GSource *source, gint *timeout)
+{
+	KfxmppSessionPoolSource *src = (KfxmppSessionPoolSource *) source;
+
+	*timeout = kfxmpp_session_pool_get_timeout (src->pool);
+	return *timeout == 0;
+}
+
+
+static gboolean kfxmpp_session_pool_source_check (GSource *source)
+{
+	KfxmppSessionPoolSource *src = (KfxmppSessionPoolSource *) source;
+
+	return (src->pollfd.revents & G_IO_IN) ||
+		kfxmpp_session_pool_get_timeout (src->pool) == 0;
+}
+
+
+static gboolean kfxmpp_session_pool_source_dispatch (GSource *source, GSourceFunc callback, gpointer data)
+{
+	KfxmppSessionPoolSource *src = (KfxmppSessionPoolSource *) source;
+
+	kfxmpp_session_pool_dispatch (src->pool, 0);
+	return TRUE;
+}
+
+
+static void kfxmpp_session_pool_source_finalize (GSource *source)
+{
+	KfxmppSessionPoolSource *src = (KfxmppSessionPoolSource *) source;
+
+	kfxmpp_session_pool_unref (src->pool);
+}
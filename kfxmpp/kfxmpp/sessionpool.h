@@ -0,0 +1,81 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/** \file sessionpool.h */
+
+#ifndef __SESSIONPOOL_H__
+#define __SESSIONPOOL_H__
+
+#include <glib.h>
+#include <kfxmpp/session.h>
+#include <kfxmpp/iobackend.h>
+
+G_BEGIN_DECLS
+
+/**
+ * \brief Many sessions driven by a single io_uring or epoll instance
+ *
+ * A gateway running a session per user account has tens of thousands of
+ * them, each with a socket watch and a keepalive timer. As GLib sources,
+ * these are walked by every main loop iteration. Sessions in a pool
+ * instead register their socket and timers with the pool's backend, so an
+ * iteration costs only as much as the number of sessions that actually
+ * got data, and an idle pool costs nothing.
+ *
+ * Where kernel supports it, backend is io_uring, which also receives and
+ * writes data of every session, all of it submitted by one system call
+ * per dispatch. Elsewhere it is edge-triggered epoll.
+ *
+ * Pool is driven by polling descriptor returned by
+ * kfxmpp_session_pool_get_fd, or by attaching a source returned by
+ * kfxmpp_session_pool_create_source to a GLib main loop. Either way, it
+ * must be dispatched from the thread running main context of its
+ * sessions, which still handles connecting and data sent from other
+ * threads.
+ *
+ * Thread safety: kfxmpp_session_pool_ref and kfxmpp_session_pool_unref
+ * are atomic, other functions must be called from the thread that
+ * dispatches the pool.
+ **/
+typedef struct _KfxmppSessionPool KfxmppSessionPool;
+
+
+KfxmppSessionPool *kfxmpp_session_pool_new (void);
+KfxmppSessionPool *kfxmpp_session_pool_new_with_backend (KfxmppIoBackend *backend);
+void kfxmpp_session_pool_free (KfxmppSessionPool *self);
+KfxmppSessionPool *kfxmpp_session_pool_ref (KfxmppSessionPool *self);
+void kfxmpp_session_pool_unref (KfxmppSessionPool *self);
+
+void kfxmpp_session_pool_add (KfxmppSessionPool *self, KfxmppSession *session);
+void kfxmpp_session_pool_remove (KfxmppSessionPool *self, KfxmppSession *session);
+guint kfxmpp_session_pool_get_n_sessions (KfxmppSessionPool *self);
+KfxmppIoBackend *kfxmpp_session_pool_get_io_backend (KfxmppSessionPool *self);
+
+gint kfxmpp_session_pool_get_fd (KfxmppSessionPool *self);
+gint kfxmpp_session_pool_get_timeout (KfxmppSessionPool *self);
+gint kfxmpp_session_pool_dispatch (KfxmppSessionPool *self, gint timeout);
+GSource *kfxmpp_session_pool_create_source (KfxmppSessionPool *self);
+
+G_END_DECLS
+
+#endif /* __SESSIONPOOL_H__ */
@@ -0,0 +1,570 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/** \file shardmanager.h */
+
+#include "kfxmpp.h"
+#include "shardmanager.h"
+#include "mpscqueue.h"
+
+#include <unistd.h>
+
+/* Idle parser contexts kept by each shard */
+#define PARSER_POOL_SIZE 64
+
+/**
+ * \brief Kind of work handed to a shard
+ **/
+typedef enum {
+	KFXMPP_SHARD_JOB_ADD,		/**< Take a session and connect it */
+	KFXMPP_SHARD_JOB_REMOVE,	/**< Disconnect a session and release it */
+	KFXMPP_SHARD_JOB_INVOKE,	/**< Call a function */
+	KFXMPP_SHARD_JOB_QUIT		/**< Stop main loop of shard */
+} KfxmppShardJobType;
+
+/**
+ * \brief Work queued for a shard by other threads
+ **/
+typedef struct {
+	KfxmppShardJobType type;	/**< What to do */
+	KfxmppSession *session;		/**< Session to add or remove, holding a reference */
+	KfxmppSessionConnectCallback callback;	/**< Connect callback of added session */
+	GSourceFunc func;		/**< Function to invoke */
+	gpointer data;			/**< Data passed to \b callback or \b func */
+	GDestroyNotify notify;		/**< Called for \b data of invoked function */
+} KfxmppShardJob;
+
+/**
+ * \brief A worker thread and everything its sessions use
+ **/
+typedef struct {
+	GThread *thread;		/**< Worker thread */
+	GMainContext *context;		/**< Main context run by \b thread */
+	GMainLoop *loop;		/**< Main loop run by \b thread */
+	KfxmppSessionPool *pool;	/**< Backend of sessions, NULL if neither io_uring nor epoll is available */
+	GSource *pool_source;		/**< Source dispatching \b pool */
+	KfxmppStreamParserPool *parser_pool;	/**< Parser contexts of sessions */
+	KfxmppMpscQueue *jobs;		/**< Work from other threads */
+	GHashTable *sessions;		/**< Sessions of shard, each holding a reference, used only by \b thread */
+	gint n_sessions;		/**< Number of sessions, including those still queued (atomic) */
+} KfxmppShard;
+
+struct _KfxmppShardManager {
+	gint ref_count;			/**< Number of references to this object */
+	KfxmppShard *shards;		/**< Shards */
+	guint n_shards;			/**< Number of shards */
+	KfxmppShardPolicy policy;	/**< How sessions are assigned */
+	gint next;			/**< Next shard for round-robin assignment (atomic) */
+};
+
+
+/***********************************************************************
+ *
+ * Static function prototypes
+ *
+ */
+
+static gpointer kfxmpp_shard_run (gpointer data);
+static void kfxmpp_shard_post (KfxmppShard *shard, KfxmppShardJob *job);
+static gboolean kfxmpp_shard_run_jobs (gpointer data);
+static void kfxmpp_shard_run_job (KfxmppShard *shard, KfxmppShardJob *job);
+static void kfxmpp_shard_job_free (gpointer data);
+static void kfxmpp_shard_forget (KfxmppShard *shard, KfxmppSession *session);
+static void kfxmpp_shard_forget_one (gpointer key, gpointer value, gpointer data);
+static guint kfxmpp_shard_manager_pick (KfxmppShardManager *self);
+
+
+/**
+ * \brief Create a new KfxmppShardManager and start its threads
+ * \param n_shards Number of shards, 0 for one per online processor
+ * \return A new shard manager
+ *
+ * Shards drive their sessions with io_uring or edge-triggered epoll, like
+ * KfxmppSessionPool does, or with GLib main loop where neither is
+ * available.
+ **/
+KfxmppShardManager *kfxmpp_shard_manager_new (guint n_shards)
+{
+	KfxmppShardManager *self;
+	guint i;
+
+	if (n_shards == 0)
+		n_shards = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+
+	self = g_new0 (KfxmppShardManager, 1);
+	self->ref_count = 1;
+	self->n_shards = n_shards;
+	self->shards = g_new0 (KfxmppShard, n_shards);
+	self->policy = KFXMPP_SHARD_POLICY_ROUND_ROBIN;
+
+	for (i = 0; i < n_shards; i++) {
+		KfxmppShard *shard = &self->shards[i];
+
+		shard->context = g_main_context_new ();
+		shard->loop = g_main_loop_new (shard->context, FALSE);
+		shard->parser_pool = kfxmpp_stream_parser_pool_new (PARSER_POOL_SIZE);
+		shard->jobs = kfxmpp_mpsc_queue_new ();
+		shard->sessions = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+				(GDestroyNotify) kfxmpp_session_unref, NULL);
+
+		shard->pool = kfxmpp_session_pool_new ();
+		if (shard->pool) {
+			shard->pool_source = kfxmpp_session_pool_create_source (shard->pool);
+			g_source_attach (shard->pool_source, shard->context);
+		}
+
+		shard->thread = g_thread_create (kfxmpp_shard_run, shard, TRUE, NULL);
+	}
+
+	return self;
+}
+
+
+/**
+ * \brief Stop shards and free a manager
+ * \param self A shard manager
+ *
+ * Sessions still in manager are disconnected and released.
+ **/
+void kfxmpp_shard_manager_free (KfxmppShardManager *self)
+{
+	KfxmppShardJob *job;
+	guint i;
+
+	g_return_if_fail (self);
+
+	/* Loop would not notice a quit that comes before it starts running */
+	for (i = 0; i < self->n_shards; i++) {
+		job = g_new0 (KfxmppShardJob, 1);
+		job->type = KFXMPP_SHARD_JOB_QUIT;
+		kfxmpp_shard_post (&self->shards[i], job);
+	}
+
+	for (i = 0; i < self->n_shards; i++) {
+		KfxmppShard *shard = &self->shards[i];
+
+		g_thread_join (shard->thread);
+
+		/* Thread is gone, sessions are ours now */
+		g_main_context_acquire (shard->context);
+		if (shard->pool)
+			kfxmpp_io_backend_claim (kfxmpp_session_pool_get_io_backend (shard->pool));
+		kfxmpp_mpsc_queue_free (shard->jobs, kfxmpp_shard_job_free);
+		g_hash_table_foreach (shard->sessions, kfxmpp_shard_forget_one, shard);
+		g_hash_table_destroy (shard->sessions);
+		g_main_context_release (shard->context);
+
+		if (shard->pool) {
+			g_source_destroy (shard->pool_source);
+			g_source_unref (shard->pool_source);
+			kfxmpp_session_pool_unref (shard->pool);
+		}
+		kfxmpp_stream_parser_pool_unref (shard->parser_pool);
+		g_main_loop_unref (shard->loop);
+		g_main_context_unref (shard->context);
+	}
+
+	g_free (self->shards);
+	g_free (self);
+}
+
+
+/**
+ * \brief Add a reference to KfxmppShardManager
+ *
+ * This function is thread-safe.
+ **/
+KfxmppShardManager *kfxmpp_shard_manager_ref (KfxmppShardManager *self)
+{
+	g_return_val_if_fail (self, NULL);
+	g_atomic_int_inc (&self->ref_count);
+	return self;
+}
+
+
+/**
+ * \brief Remove a reference from KfxmppShardManager
+ *
+ * Object will be deleted when reference count reaches 0. This function is
+ * thread-safe.
+ **/
+void kfxmpp_shard_manager_unref (KfxmppShardManager *self)
+{
+	g_return_if_fail (self);
+	if (g_atomic_int_dec_and_test (&self->ref_count))
+		kfxmpp_shard_manager_free (self);
+}
+
+
+/**
+ * \brief Set how sessions are assigned to shards
+ * \param self A shard manager
+ * \param policy A policy, round-robin by default
+ *
+ * Round-robin spreads sessions evenly when they all live about as long.
+ * When many of them come and go, least loaded shard is a better choice.
+ **/
+void kfxmpp_shard_manager_set_policy (KfxmppShardManager *self, KfxmppShardPolicy policy)
+{
+	g_return_if_fail (self);
+
+	self->policy = policy;
+}
+
+
+/**
+ * \brief Get how sessions are assigned to shards
+ * \param self A shard manager
+ * \return A policy
+ **/
+KfxmppShardPolicy kfxmpp_shard_manager_get_policy (KfxmppShardManager *self)
+{
+	g_return_val_if_fail (self, KFXMPP_SHARD_POLICY_ROUND_ROBIN);
+
+	return self->policy;
+}
+
+
+/**
+ * \brief Get number of shards
+ * \param self A shard manager
+ * \return Number of shards
+ **/
+guint kfxmpp_shard_manager_get_n_shards (KfxmppShardManager *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return self->n_shards;
+}
+
+
+/**
+ * \brief Get number of sessions of a shard
+ * \param self A shard manager
+ * \param shard Index of shard
+ * \return Number of sessions, including those not taken by shard yet
+ **/
+guint kfxmpp_shard_manager_get_n_sessions (KfxmppShardManager *self, guint shard)
+{
+	g_return_val_if_fail (self, 0);
+	g_return_val_if_fail (shard < self->n_shards, 0);
+
+	return g_atomic_int_get (&self->shards[shard].n_sessions);
+}
+
+
+/**
+ * \brief Get main context of a shard
+ * \param self A shard manager
+ * \param shard Index of shard
+ * \return Main context run by shard's thread
+ *
+ * Application may attach its own sources to it, they are dispatched
+ * along with sessions of the shard.
+ **/
+GMainContext *kfxmpp_shard_manager_get_context (KfxmppShardManager *self, guint shard)
+{
+	g_return_val_if_fail (self, NULL);
+	g_return_val_if_fail (shard < self->n_shards, NULL);
+
+	return self->shards[shard].context;
+}
+
+
+/**
+ * \brief Assign a session to a shard and connect it there
+ * \param self A shard manager
+ * \param session A closed session that is not in manager
+ * \param callback Connect callback, called from shard's thread
+ * \param data Data passed to \b callback
+ * \return Index of shard, -1 if session could not be added
+ *
+ * Session is moved to shard's main context, and from now on functions of
+ * session that are not thread-safe must be called from shard's thread,
+ * e.g. by kfxmpp_shard_manager_invoke. Manager holds a reference to
+ * \b session until it is removed.
+ **/
+gint kfxmpp_shard_manager_add (KfxmppShardManager *self, KfxmppSession *session, KfxmppSessionConnectCallback callback, gpointer data)
+{
+	KfxmppShard *shard;
+	KfxmppShardJob *job;
+	guint i;
+
+	g_return_val_if_fail (self, -1);
+	g_return_val_if_fail (session, -1);
+
+	i = kfxmpp_shard_manager_pick (self);
+	shard = &self->shards[i];
+
+	kfxmpp_session_set_context (session, shard->context);
+	if (kfxmpp_session_get_context (session) != shard->context)
+		return -1;
+	kfxmpp_session_set_parser_pool (session, shard->parser_pool);
+
+	/* Count it right away, so that next pick sees it */
+	g_atomic_int_inc (&shard->n_sessions);
+
+	job = g_new0 (KfxmppShardJob, 1);
+	job->type = KFXMPP_SHARD_JOB_ADD;
+	job->session = kfxmpp_session_ref (session);
+	job->callback = callback;
+	job->data = data;
+	kfxmpp_shard_post (shard, job);
+
+	return i;
+}
+
+
+/**
+ * \brief Disconnect a session and release it
+ * \param self A shard manager
+ * \param session A session added to manager
+ *
+ * This is done by session's shard, some time after this returns. Session
+ * then goes back to default main context.
+ **/
+void kfxmpp_shard_manager_remove (KfxmppShardManager *self, KfxmppSession *session)
+{
+	KfxmppShardJob *job;
+	gint i;
+
+	g_return_if_fail (self);
+	g_return_if_fail (session);
+
+	i = kfxmpp_shard_manager_find (self, session);
+	if (i < 0)
+		return;
+
+	job = g_new0 (KfxmppShardJob, 1);
+	job->type = KFXMPP_SHARD_JOB_REMOVE;
+	job->session = kfxmpp_session_ref (session);
+	kfxmpp_shard_post (&self->shards[i], job);
+}
+
+
+/**
+ * \brief Find shard of a session
+ * \param self A shard manager
+ * \param session A session
+ * \return Index of shard, -1 if session is not in manager
+ **/
+gint kfxmpp_shard_manager_find (KfxmppShardManager *self, KfxmppSession *session)
+{
+	GMainContext *context;
+	guint i;
+
+	g_return_val_if_fail (self, -1);
+	g_return_val_if_fail (session, -1);
+
+	context = kfxmpp_session_get_context (session);
+	for (i = 0; i < self->n_shards; i++) {
+		if (self->shards[i].context == context)
+			return i;
+	}
+	return -1;
+}
+
+
+/**
+ * \brief Call a function from thread of a shard
+ * \param self A shard manager
+ * \param shard Index of shard
+ * \param func Function, called once; its return value is ignored
+ * \param data Data passed to \b func
+ * \param notify Function called for \b data afterwards (may be NULL)
+ *
+ * Calls queued for a shard are made in order, each batch after a single
+ * wakeup of shard's thread. This is how an application reaches sessions
+ * of a shard, or hands work from one shard to another.
+ **/
+void kfxmpp_shard_manager_invoke (KfxmppShardManager *self, guint shard, GSourceFunc func, gpointer data, GDestroyNotify notify)
+{
+	KfxmppShardJob *job;
+
+	g_return_if_fail (self);
+	g_return_if_fail (shard < self->n_shards);
+	g_return_if_fail (func);
+
+	job = g_new0 (KfxmppShardJob, 1);
+	job->type = KFXMPP_SHARD_JOB_INVOKE;
+	job->func = func;
+	job->data = data;
+	job->notify = notify;
+	kfxmpp_shard_post (&self->shards[shard], job);
+}
+
+
+/**
+ * \brief Choose shard for next session
+ * \param self A shard manager
+ * \return Index of shard
+ **/
+static guint kfxmpp_shard_manager_pick (KfxmppShardManager *self)
+{
+	guint i, best = 0;
+	gint load, best_load = G_MAXINT;
+
+	if (self->policy == KFXMPP_SHARD_POLICY_ROUND_ROBIN)
+		return (guint) g_atomic_int_exchange_and_add (&self->next, 1) % self->n_shards;
+
+	for (i = 0; i < self->n_shards; i++) {
+		load = g_atomic_int_get (&self->shards[i].n_sessions);
+		if (load < best_load) {
+			best = i;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+
+/***********************************************************************
+ *
+ * Shards
+ *
+ */
+
+/**
+ * \brief Body of shard's thread
+ **/
+static gpointer kfxmpp_shard_run (gpointer data)
+{
+	KfxmppShard *shard = data;
+
+	g_main_loop_run (shard->loop);
+	return NULL;
+}
+
+
+/**
+ * \brief Queue work for a shard
+ * \param shard A shard
+ * \param job Job, owned by shard from now on
+ **/
+static void kfxmpp_shard_post (KfxmppShard *shard, KfxmppShardJob *job)
+{
+	if (kfxmpp_mpsc_queue_push (shard->jobs, job)) {
+		/* First job in this batch, wake up shard */
+		GSource *src;
+
+		src = g_idle_source_new ();
+		g_source_set_priority (src, G_PRIORITY_DEFAULT);
+		g_source_set_callback (src, kfxmpp_shard_run_jobs, shard, NULL);
+		g_source_attach (src, shard->context);
+		g_source_unref (src);
+	}
+}
+
+
+/**
+ * \brief Do all work queued for a shard
+ * \param data A KfxmppShard
+ * \return FALSE
+ **/
+static gboolean kfxmpp_shard_run_jobs (gpointer data)
+{
+	KfxmppShard *shard = data;
+	GSList *items, *tmp;
+
+	items = kfxmpp_mpsc_queue_pop_all (shard->jobs);
+	for (tmp = items; tmp; tmp = tmp->next) {
+		kfxmpp_shard_run_job (shard, tmp->data);
+		kfxmpp_shard_job_free (tmp->data);
+	}
+	g_slist_free (items);
+
+	return FALSE;
+}
+
+
+static void kfxmpp_shard_run_job (KfxmppShard *shard, KfxmppShardJob *job)
+{
+	GError *error = NULL;
+
+	switch (job->type) {
+	case KFXMPP_SHARD_JOB_ADD:
+		g_hash_table_insert (shard->sessions, kfxmpp_session_ref (job->session), job->session);
+		if (shard->pool)
+			kfxmpp_session_pool_add (shard->pool, job->session);
+
+		if (! kfxmpp_session_connect (job->session, job->callback, job->data, &error)) {
+			if (job->callback)
+				job->callback (job->session, error->code, job->data);
+			g_error_free (error);
+		}
+		break;
+
+	case KFXMPP_SHARD_JOB_REMOVE:
+		if (g_hash_table_lookup (shard->sessions, job->session) == NULL)
+			break;
+		kfxmpp_shard_forget (shard, job->session);
+		g_hash_table_remove (shard->sessions, job->session);
+		break;
+
+	case KFXMPP_SHARD_JOB_INVOKE:
+		job->func (job->data);
+		break;
+
+	case KFXMPP_SHARD_JOB_QUIT:
+		g_main_loop_quit (shard->loop);
+		break;
+	}
+}
+
+
+static void kfxmpp_shard_job_free (gpointer data)
+{
+	KfxmppShardJob *job = data;
+
+	if (job->session)
+		kfxmpp_session_unref (job->session);
+	if (job->notify)
+		job->notify (job->data);
+	g_free (job);
+}
+
+
+/**
+ * \brief Disconnect a session and give it back to default main context
+ * \param shard A shard
+ * \param session A session of \b shard, still in its table
+ **/
+static void kfxmpp_shard_forget (KfxmppShard *shard, KfxmppSession *session)
+{
+	kfxmpp_session_cancel_connect (session);
+	kfxmpp_session_disconnect (session, NULL);
+
+	if (shard->pool)
+		kfxmpp_session_pool_remove (shard->pool, session);
+	kfxmpp_session_set_parser_pool (session, NULL);
+	kfxmpp_session_set_context (session, NULL);
+
+	g_atomic_int_add (&shard->n_sessions, -1);
+}
+
+
+static void kfxmpp_shard_forget_one (gpointer key, gpointer value, gpointer data)
+{
+	kfxmpp_shard_forget (data, key);
+}
@@ -0,0 +1,82 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/** \file shardmanager.h */
+
+#ifndef __SHARDMANAGER_H__
+#define __SHARDMANAGER_H__
+
+#include <glib.h>
+#include <kfxmpp/session.h>
+
+G_BEGIN_DECLS
+
+/**
+ * \brief How sessions are assigned to shards
+ **/
+typedef enum {
+	KFXMPP_SHARD_POLICY_ROUND_ROBIN,	/**< Shards get sessions in turn */
+	KFXMPP_SHARD_POLICY_LEAST_LOADED	/**< Shard with fewest sessions gets next one */
+} KfxmppShardPolicy;
+
+
+/**
+ * \brief Sessions spread over worker threads, each running its own main context
+ *
+ * A single thread dispatching all sessions is bound by one core. Shard
+ * manager starts a number of worker threads, one per core by default.
+ * Every shard has its own GMainContext, its own session pool with a timer
+ * wheel and its own pool of parser contexts, so shards share no mutable
+ * state and never wait for one another.
+ *
+ * A session belongs to a single shard for its whole life in manager, and
+ * all its callbacks and event handlers run in that shard's thread. Data
+ * sent to it from other threads, including other shards, goes through
+ * session's lock-free send queue and is written by its own shard.
+ *
+ * Thread safety: all functions may be called from any thread, except
+ * kfxmpp_shard_manager_free, which must not be called from a shard.
+ **/
+typedef struct _KfxmppShardManager KfxmppShardManager;
+
+
+KfxmppShardManager *kfxmpp_shard_manager_new (guint n_shards);
+void kfxmpp_shard_manager_free (KfxmppShardManager *self);
+KfxmppShardManager *kfxmpp_shard_manager_ref (KfxmppShardManager *self);
+void kfxmpp_shard_manager_unref (KfxmppShardManager *self);
+
+void kfxmpp_shard_manager_set_policy (KfxmppShardManager *self, KfxmppShardPolicy policy);
+KfxmppShardPolicy kfxmpp_shard_manager_get_policy (KfxmppShardManager *self);
+guint kfxmpp_shard_manager_get_n_shards (KfxmppShardManager *self);
+guint kfxmpp_shard_manager_get_n_sessions (KfxmppShardManager *self, guint shard);
+GMainContext *kfxmpp_shard_manager_get_context (KfxmppShardManager *self, guint shard);
+
+gint kfxmpp_shard_manager_add (KfxmppShardManager *self, KfxmppSession *session, KfxmppSessionConnectCallback callback, gpointer data);
+void kfxmpp_shard_manager_remove (KfxmppShardManager *self, KfxmppSession *session);
+gint kfxmpp_shard_manager_find (KfxmppShardManager *self, KfxmppSession *session);
+void kfxmpp_shard_manager_invoke (KfxmppShardManager *self, guint shard, GSourceFunc func, gpointer data, GDestroyNotify notify);
+
+G_END_DECLS
+
+#endif /* __SHARDMANAGER_H__ */
@@ -22,10 +22,24 @@
 
 /** file streamparser.h */
 
+#include <string.h>
 #include <libxml/parser.h>
+#include <libxml/parserInternals.h>
 #include "kfxmpp.h"
 #include "streamparser.h"
+#include "filter.h"
 
+/* Number of streams a pooled context parses before it is dropped, so that
+ * its dictionary does not keep every name ever seen */
+#define POOL_MAX_USES 256
+
+/**
+ * \brief Incremental parser of XML stream
+ *
+ * Thread safety: kfxmpp_stream_parser_ref and kfxmpp_stream_parser_unref
+ * are atomic and may be called from any thread. A parser must be fed from
+ * one thread at a time; its callbacks are run in the feeding thread.
+ **/
 struct _KfxmppStreamParser {
 	xmlParserCtxtPtr parser;	/**< XML parser context */
 	gint depth;			/**< Current depth of an xml tree */
@@ -42,7 +56,28 @@ struct _KfxmppStreamParser {
 	/* Stream callback */
 	KfxmppStreamParserStreamCallback stream_callback;	/**< Callback called when stream is opened */
 
+	/* Filters */
+	GList *filters;			/**< Filters rejecting stanzas before nodes are built */
+	gint *filter_state;		/**< Per filter: -1 if current stanza does not match, mask of satisfied children otherwise */
+	gboolean filter_pending;	/**< Whether some filter waits for children of current stanza */
+	gchar **stream_attrs;		/**< Attributes of stream tag, for namespace lookups */
+	gchar *stanza_ns;		/**< Namespace of current stanza */
+	gint skip_depth;		/**< Depth of element being skipped, 0 if not skipping */
+	KfxmppFilter *skip_filter;	/**< Filter that caused skipping */
+	guint skipped;			/**< Number of elements skipped so far */
+
 	/* Misc stuff */
+	KfxmppStreamParserPool *pool;	/**< Pool \b parser goes back to, NULL if none */
+	gint ref_count;			/**< Reference count */
+};
+
+
+struct _KfxmppStreamParserPool {
+	GMutex *lock;			/**< Lock protecting fields below */
+	GSList *idle;			/**< Idle parser contexts */
+	guint n_idle;			/**< Length of \b idle */
+	guint max_idle;			/**< Contexts beyond this many are freed */
+	guint reused;			/**< Number of contexts taken from pool */
 	gint ref_count;			/**< Reference count */
 };
 
@@ -53,6 +88,12 @@ struct _KfxmppStreamParser {
  *
  */
 
+static xmlParserCtxtPtr kfxmpp_stream_parser_create_context (KfxmppStreamParser *self);
+
+/* Pooling */
+static xmlParserCtxtPtr kfxmpp_stream_parser_pool_take (KfxmppStreamParserPool *self, KfxmppStreamParser *parser);
+static void kfxmpp_stream_parser_pool_give (KfxmppStreamParserPool *self, xmlParserCtxtPtr context);
+
 /* SAX handlers */
 static void onInternalSubset (void * ctx, const xmlChar * name, const xmlChar * ExternalID, const xmlChar * SystemID);
 static int onIsStandalone (void * ctx);
@@ -76,16 +117,58 @@ static void onComment (void * ctx, const xmlChar * value);
 static void onStartElement (void * ctx, const xmlChar * name, const xmlChar **attrs);
 static void onEndElement (void * ctx, const xmlChar * name);
 
+/* Filtering */
+static const gchar *kfxmpp_stream_parser_resolve_ns (KfxmppStreamParser *self, const gchar *name, const gchar **attrs, const gchar *inherited, const gchar **local);
+static gboolean kfxmpp_stream_parser_filter_stanza (KfxmppStreamParser *self, const xmlChar *name, const xmlChar **attrs);
+static gboolean kfxmpp_stream_parser_filter_child (KfxmppStreamParser *self, const xmlChar *name, const xmlChar **attrs);
+static void kfxmpp_stream_parser_skip (KfxmppStreamParser *self, KfxmppFilter *filter);
+
 
 /**
  * \brief create a new Stream parser
  **/
 KfxmppStreamParser *kfxmpp_stream_parser_new (KfxmppStreamParserCallback callback, gpointer data)
+{
+	return kfxmpp_stream_parser_new_from_pool (NULL, callback, data);
+}
+
+
+/**
+ * \brief Create a new stream parser reusing an idle context of a pool
+ * \param pool A pool, NULL to always create a new context
+ * \param callback Callback called when xml stanza is parsed
+ * \param data User data
+ * \return A new stream parser
+ *
+ * Context goes back to \b pool when parser is freed.
+ **/
+KfxmppStreamParser *kfxmpp_stream_parser_new_from_pool (KfxmppStreamParserPool *pool, KfxmppStreamParserCallback callback, gpointer data)
 {
 	KfxmppStreamParser *self;
 
 	self = g_new0 (KfxmppStreamParser, 1);
 
+	if (pool) {
+		self->pool = kfxmpp_stream_parser_pool_ref (pool);
+		self->parser = kfxmpp_stream_parser_pool_take (pool, self);
+	}
+	if (self->parser == NULL)
+		self->parser = kfxmpp_stream_parser_create_context (self);
+
+	self->callback = callback;
+	self->callback_data = data;
+	self->version = -1;
+	self->ref_count = 1;
+
+	return self;
+}
+
+
+/**
+ * \brief Create XML push parser context of a stream parser
+ **/
+static xmlParserCtxtPtr kfxmpp_stream_parser_create_context (KfxmppStreamParser *self)
+{
 	/* Setup SAX handler that will parse XML data. In most cases we'll
 	 * use standard tree building functions from libxml library.
 	 * It may be a dirty hack, but it works, and, as of now, I have no
@@ -123,18 +206,11 @@ KfxmppStreamParser *kfxmpp_stream_parser_new (KfxmppStreamParserCallback callbac
 
 
 	/* Create XML parser */
-	self->parser = xmlCreatePushParserCtxt	(sax,	/* Our hacked SAX handler */
-						self,	/* No data passed to SAX handler */
-						NULL,	/* No initial characters passed to parse */
-						0,	/* Length */
-						"stream"); /* URI */
-
-	self->callback = callback;
-	self->callback_data = data;
-	self->version = -1;
-	self->ref_count = 1;
-
-	return self;
+	return xmlCreatePushParserCtxt	(sax,	/* Our hacked SAX handler */
+					self,	/* No data passed to SAX handler */
+					NULL,	/* No initial characters passed to parse */
+					0,	/* Length */
+					"stream"); /* URI */
 }
 
 
@@ -146,19 +222,34 @@ void kfxmpp_stream_parser_free (KfxmppStreamParser *self)
 {
 	kfxmpp_log ("Freeing parser %p\n", self);
 	xmlFreeDoc (self->parser->myDoc);
-	xmlFreeParserCtxt (self->parser);
+	self->parser->myDoc = NULL;
+	if (self->pool) {
+		kfxmpp_stream_parser_pool_give (self->pool, self->parser);
+		kfxmpp_stream_parser_pool_unref (self->pool);
+	} else {
+		xmlFreeParserCtxt (self->parser);
+	}
 	g_free (self->id);
+
+	g_list_foreach (self->filters, (GFunc) kfxmpp_filter_unref, NULL);
+	g_list_free (self->filters);
+	g_free (self->filter_state);
+	g_strfreev (self->stream_attrs);
+	g_free (self->stanza_ns);
+
 	g_free (self);
 }
 
 
 /**
  * \brief Add a reference to KfxmppStreamParser
+ *
+ * This function is thread-safe.
  **/
 KfxmppStreamParser* kfxmpp_stream_parser_ref (KfxmppStreamParser *self)
 {
         g_return_val_if_fail (self, NULL);
-        self->ref_count++;
+        g_atomic_int_inc (&self->ref_count);
         return self;
 }
 
@@ -166,13 +257,13 @@ KfxmppStreamParser* kfxmpp_stream_parser_ref (KfxmppStreamParser *self)
 /**
  * \brief Remove a reference from KfxmppStreamParser
  *
- * Object will be deleted when reference count reaches 0
+ * Object will be deleted when reference count reaches 0.
+ * This function is thread-safe.
  **/
 void kfxmpp_stream_parser_unref (KfxmppStreamParser *self)
 {
         g_return_if_fail (self);
-        self->ref_count--;
-        if (self->ref_count == 0)
+        if (g_atomic_int_dec_and_test (&self->ref_count))
                 kfxmpp_stream_parser_free (self);
 }
 
@@ -187,6 +278,9 @@ void kfxmpp_stream_parser_feed (KfxmppStreamParser *self, const gchar *data, gsi
 {
 	g_return_if_fail (self);
 
+	/* Callback may drop the last reference to parser */
+	kfxmpp_stream_parser_ref (self);
+
 	/* Pass data to parser */
 	xmlParseChunk (self->parser, data, len, 0);
 
@@ -211,6 +305,8 @@ void kfxmpp_stream_parser_feed (KfxmppStreamParser *self, const gchar *data, gsi
 		node = tmp;
 	}
 	self->nodes = NULL;
+
+	kfxmpp_stream_parser_unref (self);
 }
 
 
@@ -243,6 +339,213 @@ void kfxmpp_stream_parser_set_stream_callback (KfxmppStreamParser *parser, Kfxmp
 }
 
 
+/**
+ * \brief Add a filter to parser
+ * \param self A stream parser
+ * \param filter A filter
+ *
+ * Stanzas matching the filter are dropped while being parsed: their
+ * elements are skipped without building xml nodes, and callback is not
+ * called for them.
+ **/
+void kfxmpp_stream_parser_add_filter (KfxmppStreamParser *self, KfxmppFilter *filter)
+{
+	g_return_if_fail (self);
+	g_return_if_fail (filter);
+
+	self->filters = g_list_append (self->filters, kfxmpp_filter_ref (filter));
+	self->filter_state = g_renew (gint, self->filter_state, g_list_length (self->filters));
+	self->filter_state[g_list_length (self->filters) - 1] = -1;
+}
+
+
+/**
+ * \brief Remove a filter from parser
+ * \param self A stream parser
+ * \param filter A filter
+ **/
+void kfxmpp_stream_parser_remove_filter (KfxmppStreamParser *self, KfxmppFilter *filter)
+{
+	GList *link;
+	guint i;
+
+	g_return_if_fail (self);
+	g_return_if_fail (filter);
+
+	link = g_list_find (self->filters, filter);
+	if (link == NULL)
+		return;
+
+	self->filters = g_list_delete_link (self->filters, link);
+	kfxmpp_filter_unref (filter);
+
+	/* Forget partial matches of current stanza */
+	for (i = 0; i < g_list_length (self->filters); i++)
+		self->filter_state[i] = -1;
+	self->filter_pending = FALSE;
+	if (self->skip_filter == filter)
+		self->skip_filter = NULL;
+}
+
+
+/***********************************************************************
+ *
+ * Pooling
+ *
+ */
+
+/**
+ * \brief Create a new pool of parser contexts
+ * \param max_idle Maximum number of idle contexts kept
+ * \return A new pool
+ **/
+KfxmppStreamParserPool *kfxmpp_stream_parser_pool_new (guint max_idle)
+{
+	KfxmppStreamParserPool *self;
+
+	self = g_new0 (KfxmppStreamParserPool, 1);
+	self->lock = g_mutex_new ();
+	self->max_idle = max_idle;
+	self->ref_count = 1;
+
+	return self;
+}
+
+
+/**
+ * \brief Free a pool and its idle contexts
+ * \param self A pool
+ **/
+void kfxmpp_stream_parser_pool_free (KfxmppStreamParserPool *self)
+{
+	GSList *tmp;
+
+	g_return_if_fail (self);
+
+	for (tmp = self->idle; tmp; tmp = tmp->next)
+		xmlFreeParserCtxt (tmp->data);
+	g_slist_free (self->idle);
+	g_mutex_free (self->lock);
+	g_free (self);
+}
+
+
+/**
+ * \brief Add a reference to KfxmppStreamParserPool
+ *
+ * This function is thread-safe.
+ **/
+KfxmppStreamParserPool *kfxmpp_stream_parser_pool_ref (KfxmppStreamParserPool *self)
+{
+	g_return_val_if_fail (self, NULL);
+	g_atomic_int_inc (&self->ref_count);
+	return self;
+}
+
+
+/**
+ * \brief Remove a reference from KfxmppStreamParserPool
+ *
+ * Object will be deleted when reference count reaches 0. Parsers created
+ * from pool hold a reference to it. This function is thread-safe.
+ **/
+void kfxmpp_stream_parser_pool_unref (KfxmppStreamParserPool *self)
+{
+	g_return_if_fail (self);
+	if (g_atomic_int_dec_and_test (&self->ref_count))
+		kfxmpp_stream_parser_pool_free (self);
+}
+
+
+/**
+ * \brief Get number of idle contexts in pool
+ * \param self A pool
+ * \return Number of contexts
+ **/
+guint kfxmpp_stream_parser_pool_get_n_idle (KfxmppStreamParserPool *self)
+{
+	guint n;
+
+	g_return_val_if_fail (self, 0);
+
+	g_mutex_lock (self->lock);
+	n = self->n_idle;
+	g_mutex_unlock (self->lock);
+	return n;
+}
+
+
+/**
+ * \brief Get number of parsers that got a context from pool
+ * \param self A pool
+ * \return Number of reused contexts
+ **/
+guint kfxmpp_stream_parser_pool_get_reused (KfxmppStreamParserPool *self)
+{
+	guint n;
+
+	g_return_val_if_fail (self, 0);
+
+	g_mutex_lock (self->lock);
+	n = self->reused;
+	g_mutex_unlock (self->lock);
+	return n;
+}
+
+
+/**
+ * \brief Take an idle context and prepare it for a new stream
+ * \param self A pool
+ * \param parser Parser that will own context
+ * \return A context, NULL if pool is empty
+ **/
+static xmlParserCtxtPtr kfxmpp_stream_parser_pool_take (KfxmppStreamParserPool *self, KfxmppStreamParser *parser)
+{
+	xmlParserCtxtPtr context = NULL;
+
+	g_mutex_lock (self->lock);
+	if (self->idle) {
+		context = self->idle->data;
+		self->idle = g_slist_delete_link (self->idle, self->idle);
+		self->n_idle--;
+		self->reused++;
+	}
+	g_mutex_unlock (self->lock);
+
+	if (context == NULL)
+		return NULL;
+
+	/* SAX handler is kept, only its data changes. So does dictionary */
+	xmlCtxtResetPush (context, NULL, 0, "stream", NULL);
+	context->userData = parser;
+	context->_private = GINT_TO_POINTER (GPOINTER_TO_INT (context->_private) + 1);
+
+	return context;
+}
+
+
+/**
+ * \brief Put context of a freed parser back to pool
+ * \param self A pool
+ * \param context A context without document
+ **/
+static void kfxmpp_stream_parser_pool_give (KfxmppStreamParserPool *self, xmlParserCtxtPtr context)
+{
+	if (GPOINTER_TO_INT (context->_private) < POOL_MAX_USES) {
+		g_mutex_lock (self->lock);
+		if (self->n_idle < self->max_idle) {
+			self->idle = g_slist_prepend (self->idle, context);
+			self->n_idle++;
+			context = NULL;
+		}
+		g_mutex_unlock (self->lock);
+	}
+
+	if (context)
+		xmlFreeParserCtxt (context);
+}
+
+
 /***********************************************************************
  *
  * SAX handlers
@@ -325,26 +628,36 @@ static void onEndDocument (void * ctx)
 
 static void onReference (void * ctx, const xmlChar * name)
 {
+	if (((KfxmppStreamParser *) ctx)->skip_depth)
+		return;
 	xmlSAX2Reference (((KfxmppStreamParser *) ctx)->parser, name);
 }
 
 static void onCharacters (void * ctx, const xmlChar * ch, int len)
 {
+	if (((KfxmppStreamParser *) ctx)->skip_depth)
+		return;
 	xmlSAX2Characters (((KfxmppStreamParser *) ctx)->parser, ch, len);
 }
 
 static void onIgnorableWhitespace (void * ctx, const xmlChar * ch, int len)
 {
+	if (((KfxmppStreamParser *) ctx)->skip_depth)
+		return;
 	xmlSAX2IgnorableWhitespace (((KfxmppStreamParser *) ctx)->parser, ch, len);
 }
 
 static void onProcessingInstruction (void * ctx, const xmlChar * target, const xmlChar * data)
 {
+	if (((KfxmppStreamParser *) ctx)->skip_depth)
+		return;
 	xmlSAX2ProcessingInstruction (((KfxmppStreamParser *) ctx)->parser, target, data);
 }
 
 static void onComment (void * ctx, const xmlChar * value)
 {
+	if (((KfxmppStreamParser *) ctx)->skip_depth)
+		return;
 	xmlSAX2Comment (((KfxmppStreamParser *) ctx)->parser, value);
 }
 
@@ -356,6 +669,21 @@ static void onComment (void * ctx, const xmlChar * value)
 static void onStartElement (void * ctx, const xmlChar * name, const xmlChar **attrs)
 {
 	KfxmppStreamParser *self = ctx;
+
+	if (self->skip_depth) {
+		/* Inside of rejected stanza */
+		self->depth++;
+		self->skipped++;
+		return;
+	}
+
+	if (self->filters) {
+		if (self->depth == 1 && kfxmpp_stream_parser_filter_stanza (self, name, attrs))
+			return;
+		if (self->depth == 2 && kfxmpp_stream_parser_filter_child (self, name, attrs))
+			return;
+	}
+
 	xmlSAX2StartElement (self->parser, name, attrs);
 
 	/* Note that with opening tag depth of processed
@@ -367,7 +695,10 @@ static void onStartElement (void * ctx, const xmlChar * name, const xmlChar **at
 		int i;
 		self->version = 0;
 
-		for (i = 0; attrs[i]; i += 2) {
+		g_strfreev (self->stream_attrs);
+		self->stream_attrs = g_strdupv ((gchar **) attrs);
+
+		for (i = 0; attrs && attrs[i]; i += 2) {
 			if (xmlStrcmp (attrs[i], "version") == 0) {
 				/* Version attribute */
 				self->version = atoi (attrs[i+1]);
@@ -391,6 +722,18 @@ static void onEndElement (void * ctx, const xmlChar * name)
 {
 	KfxmppStreamParser *self = ctx;
 	xmlNodePtr node = NULL;
+
+	if (self->skip_depth) {
+		if (self->depth == self->skip_depth) {
+			/* End of rejected stanza */
+			if (self->skip_filter)
+				kfxmpp_filter_count_skipped (self->skip_filter, self->skipped);
+			self->skip_depth = 0;
+			self->skip_filter = NULL;
+		}
+		self->depth--;
+		return;
+	}
 	
 	/* Depth has decreased with closing tag */
 	--(self->depth);
@@ -427,3 +770,165 @@ static void onEndElement (void * ctx, const xmlChar * name)
 }
 
 
+/***********************************************************************
+ *
+ * Filtering
+ *
+ */
+
+/**
+ * \brief Find namespace of an element
+ * \param self A stream parser
+ * \param name Qualified element name
+ * \param attrs Attributes of element
+ * \param inherited Default namespace of parent element
+ * \param local Location to store local part of name
+ * \return Namespace, or NULL if unknown
+ *
+ * Prefixes are looked up in element itself and in stream tag, which is
+ * where servers declare them.
+ **/
+static const gchar *kfxmpp_stream_parser_resolve_ns (KfxmppStreamParser *self, const gchar *name, const gchar **attrs, const gchar *inherited, const gchar **local)
+{
+	const gchar *colon = strchr (name, ':');
+	gchar *decl;
+	const gchar *ret = NULL;
+	gint i;
+
+	if (colon) {
+		*local = colon + 1;
+		decl = g_strdup_printf ("xmlns:%.*s", (gint) (colon - name), name);
+	} else {
+		*local = name;
+		decl = g_strdup ("xmlns");
+	}
+
+	for (i = 0; attrs && attrs[i]; i += 2) {
+		if (strcmp (attrs[i], decl) == 0) {
+			ret = attrs[i+1];
+			break;
+		}
+	}
+
+	if (ret == NULL && colon) {
+		for (i = 0; self->stream_attrs && self->stream_attrs[i]; i += 2) {
+			if (strcmp (self->stream_attrs[i], decl) == 0) {
+				ret = self->stream_attrs[i+1];
+				break;
+			}
+		}
+	} else if (ret == NULL) {
+		ret = inherited;
+	}
+
+	g_free (decl);
+	return ret;
+}
+
+
+/**
+ * \brief Test opening tag of a stanza against filters
+ * \return TRUE if stanza has been rejected
+ **/
+static gboolean kfxmpp_stream_parser_filter_stanza (KfxmppStreamParser *self, const xmlChar *name, const xmlChar **attrs)
+{
+	const gchar *stream_ns = NULL;
+	const gchar *ns;
+	const gchar *local;
+	GList *tmp;
+	gint i;
+
+	for (i = 0; self->stream_attrs && self->stream_attrs[i]; i += 2) {
+		if (strcmp (self->stream_attrs[i], "xmlns") == 0)
+			stream_ns = self->stream_attrs[i+1];
+	}
+
+	ns = kfxmpp_stream_parser_resolve_ns (self, (const gchar *) name,
+			(const gchar **) attrs, stream_ns, &local);
+
+	g_free (self->stanza_ns);
+	self->stanza_ns = g_strdup (ns);
+	self->filter_pending = FALSE;
+
+	for (tmp = self->filters, i = 0; tmp; tmp = tmp->next, i++) {
+		KfxmppFilter *filter = tmp->data;
+
+		self->filter_state[i] = -1;
+		if (! kfxmpp_filter_match_stanza (filter, ns, local, (const gchar **) attrs))
+			continue;
+
+		if (kfxmpp_filter_get_children_mask (filter) == 0) {
+			/* No more conditions, reject whole stanza */
+			kfxmpp_filter_count_match (filter);
+			kfxmpp_stream_parser_skip (self, filter);
+			return TRUE;
+		}
+
+		/* Wait for children */
+		self->filter_state[i] = 0;
+		self->filter_pending = TRUE;
+	}
+
+	return FALSE;
+}
+
+
+/**
+ * \brief Test a direct child of stanza against filters
+ * \return TRUE if stanza has been rejected
+ **/
+static gboolean kfxmpp_stream_parser_filter_child (KfxmppStreamParser *self, const xmlChar *name, const xmlChar **attrs)
+{
+	const gchar *ns;
+	const gchar *local;
+	GList *tmp;
+	gint i;
+
+	if (! self->filter_pending)
+		return FALSE;
+
+	ns = kfxmpp_stream_parser_resolve_ns (self, (const gchar *) name,
+			(const gchar **) attrs, self->stanza_ns, &local);
+
+	for (tmp = self->filters, i = 0; tmp; tmp = tmp->next, i++) {
+		KfxmppFilter *filter = tmp->data;
+		xmlNodePtr node;
+
+		if (self->filter_state[i] < 0)
+			continue;
+
+		self->filter_state[i] |= kfxmpp_filter_match_child (filter, ns, local, (const gchar **) attrs);
+		if (self->filter_state[i] != kfxmpp_filter_get_children_mask (filter))
+			continue;
+
+		/* All conditions are met. Close stanza the way its end tag
+		 * would, then throw away what has been built so far */
+		node = self->parser->node;
+		xmlSAX2EndElement (self->parser, node->name);
+		xmlUnlinkNode (node);
+		xmlFreeNode (node);
+
+		kfxmpp_filter_count_match (filter);
+		kfxmpp_stream_parser_skip (self, filter);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+/**
+ * \brief Start skipping current stanza
+ * \param self A stream parser
+ * \param filter Filter that rejected stanza
+ *
+ * Must be called from opening tag handler, before depth is increased.
+ **/
+static void kfxmpp_stream_parser_skip (KfxmppStreamParser *self, KfxmppFilter *filter)
+{
+	self->depth++;
+	self->skip_depth = 2;
+	self->skip_filter = filter;
+	self->skipped = 1;
+	self->filter_pending = FALSE;
+}
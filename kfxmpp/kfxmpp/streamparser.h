@@ -27,11 +27,24 @@
 
 #include <glib.h>
 #include <libxml/tree.h>
+#include <kfxmpp/filter.h>
 
 G_BEGIN_DECLS
 
 typedef struct _KfxmppStreamParser KfxmppStreamParser;
 
+/**
+ * \brief Set of idle XML parser contexts, reused by new stream parsers
+ *
+ * Every stream restart creates a new parser. Taking a context from a pool
+ * saves allocating one, and names interned by its dictionary are already
+ * there. A pool is meant to be shared by sessions of one thread.
+ *
+ * Thread safety: all functions are thread-safe, though a pool used from
+ * a single thread never contends for its lock.
+ **/
+typedef struct _KfxmppStreamParserPool KfxmppStreamParserPool;
+
 
 /**
  * \brief Callback called when xmlNode is read
@@ -52,6 +65,7 @@ typedef void (*KfxmppStreamParserCallback) (KfxmppStreamParser *parser, xmlNodeP
 typedef void (*KfxmppStreamParserStreamCallback) (KfxmppStreamParser *parser, gint version, const gchar *id, gpointer data);
 
 KfxmppStreamParser *kfxmpp_stream_parser_new (KfxmppStreamParserCallback callback, gpointer data);
+KfxmppStreamParser *kfxmpp_stream_parser_new_from_pool (KfxmppStreamParserPool *pool, KfxmppStreamParserCallback callback, gpointer data);
 void kfxmpp_stream_parser_free (KfxmppStreamParser *self);
 KfxmppStreamParser* kfxmpp_stream_parser_ref (KfxmppStreamParser *self);
 void kfxmpp_stream_parser_unref (KfxmppStreamParser *self);
@@ -63,6 +77,16 @@ const gchar *kfxmpp_stream_parser_get_id (KfxmppStreamParser *self);
 
 void kfxmpp_stream_parser_set_stream_callback (KfxmppStreamParser *parser, KfxmppStreamParserStreamCallback callback);
 
+void kfxmpp_stream_parser_add_filter (KfxmppStreamParser *self, KfxmppFilter *filter);
+void kfxmpp_stream_parser_remove_filter (KfxmppStreamParser *self, KfxmppFilter *filter);
+
+KfxmppStreamParserPool *kfxmpp_stream_parser_pool_new (guint max_idle);
+void kfxmpp_stream_parser_pool_free (KfxmppStreamParserPool *self);
+KfxmppStreamParserPool *kfxmpp_stream_parser_pool_ref (KfxmppStreamParserPool *self);
+void kfxmpp_stream_parser_pool_unref (KfxmppStreamParserPool *self);
+guint kfxmpp_stream_parser_pool_get_n_idle (KfxmppStreamParserPool *self);
+guint kfxmpp_stream_parser_pool_get_reused (KfxmppStreamParserPool *self);
+
 G_END_DECLS
 
 #endif /* __STREAMPARSER_H__ */
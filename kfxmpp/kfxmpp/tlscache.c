@@ -0,0 +1,354 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/** \file tlscache.h */
+
+#include "kfxmpp.h"
+#include "tlscache.h"
+
+#include <time.h>
+
+#ifdef HAVE_GNUTLS
+#  include <gnutls/x509.h>
+#endif
+
+/** Default time a verified chain is trusted without verifying it again, in seconds */
+#define KFXMPP_TLS_CACHE_VERIFY_TTL 3600
+
+static GStaticMutex cache_mutex = G_STATIC_MUTEX_INIT;
+static GHashTable *cache = NULL;	/**< Resumption data (GString) indexed by server name */
+static gint hits = 0;			/**< Handshakes that resumed a session (atomic) */
+static gint misses = 0;			/**< Full handshakes (atomic) */
+static GHashTable *verified = NULL;	/**< Expiry times (time_t) of verified chains, indexed by name and fingerprint */
+static gint verify_ttl = KFXMPP_TLS_CACHE_VERIFY_TTL;	/**< Longest time a chain stays verified (atomic) */
+static gint verify_hits = 0;		/**< Chains found verified (atomic) */
+static gint verify_misses = 0;		/**< Chains verified (atomic) */
+#ifdef HAVE_GNUTLS
+static gnutls_certificate_credentials_t credentials = NULL;	/**< Credentials of all sessions */
+#endif
+
+
+/**
+ * \brief Forget all cached sessions and verified chains
+ *
+ * Counters are reset as well.
+ **/
+void kfxmpp_tls_cache_clear (void)
+{
+	g_static_mutex_lock (&cache_mutex);
+	if (cache) {
+		g_hash_table_destroy (cache);
+		cache = NULL;
+	}
+	if (verified) {
+		g_hash_table_destroy (verified);
+		verified = NULL;
+	}
+	g_static_mutex_unlock (&cache_mutex);
+
+	g_atomic_int_set (&hits, 0);
+	g_atomic_int_set (&misses, 0);
+	g_atomic_int_set (&verify_hits, 0);
+	g_atomic_int_set (&verify_misses, 0);
+}
+
+
+/**
+ * \brief Release everything TLS cache holds
+ *
+ * Called by kfxmpp_deinit, when no session uses shared credentials
+ * any more.
+ **/
+void kfxmpp_tls_cache_deinit (void)
+{
+	kfxmpp_tls_cache_clear ();
+
+#ifdef HAVE_GNUTLS
+	g_static_mutex_lock (&cache_mutex);
+	if (credentials) {
+		gnutls_certificate_free_credentials (credentials);
+		credentials = NULL;
+	}
+	g_static_mutex_unlock (&cache_mutex);
+#endif
+}
+
+
+/**
+ * \brief Get number of servers with a cached session
+ * \return Number of entries
+ **/
+guint kfxmpp_tls_cache_get_size (void)
+{
+	guint size;
+
+	g_static_mutex_lock (&cache_mutex);
+	size = cache ? g_hash_table_size (cache) : 0;
+	g_static_mutex_unlock (&cache_mutex);
+
+	return size;
+}
+
+
+/**
+ * \brief Get number of handshakes that resumed a session
+ * \return Number of handshakes
+ **/
+guint kfxmpp_tls_cache_get_hits (void)
+{
+	return g_atomic_int_get (&hits);
+}
+
+
+/**
+ * \brief Get number of full handshakes
+ * \return Number of handshakes
+ **/
+guint kfxmpp_tls_cache_get_misses (void)
+{
+	return g_atomic_int_get (&misses);
+}
+
+
+/**
+ * \brief Set longest time a verified chain is trusted without verifying it again
+ * \param seconds Time in seconds, 0 to verify every chain
+ *
+ * Chains verified already keep their expiry time.
+ **/
+void kfxmpp_tls_cache_set_verify_ttl (guint seconds)
+{
+	g_atomic_int_set (&verify_ttl, seconds);
+}
+
+
+/**
+ * \brief Get longest time a verified chain is trusted without verifying it again
+ * \return Time in seconds
+ **/
+guint kfxmpp_tls_cache_get_verify_ttl (void)
+{
+	return g_atomic_int_get (&verify_ttl);
+}
+
+
+/**
+ * \brief Get number of chains found verified before
+ * \return Number of chains
+ **/
+guint kfxmpp_tls_cache_get_verify_hits (void)
+{
+	return g_atomic_int_get (&verify_hits);
+}
+
+
+/**
+ * \brief Get number of chains verified
+ * \return Number of chains, whether they verified or not
+ **/
+guint kfxmpp_tls_cache_get_verify_misses (void)
+{
+	return g_atomic_int_get (&verify_misses);
+}
+
+
+#ifdef HAVE_GNUTLS
+
+static void kfxmpp_tls_cache_free_entry (gpointer data)
+{
+	g_string_free (data, TRUE);
+}
+
+
+/**
+ * \brief Get credentials shared by client sessions
+ * \return Credentials, or NULL if they could not be allocated
+ *
+ * System trust store is loaded with first call. Credentials must not be
+ * changed once a handshake uses them.
+ **/
+gnutls_certificate_credentials_t kfxmpp_tls_cache_get_credentials (void)
+{
+	gnutls_certificate_credentials_t cred;
+
+	g_static_mutex_lock (&cache_mutex);
+	if (credentials == NULL) {
+		if (gnutls_certificate_allocate_credentials (&credentials) < 0)
+			credentials = NULL;
+		else if (gnutls_certificate_set_x509_system_trust (credentials) < 0)
+			kfxmpp_log ("Could not load system trust store\n");
+	}
+	cred = credentials;
+	g_static_mutex_unlock (&cache_mutex);
+
+	return cred;
+}
+
+
+/**
+ * \brief Verify certificate chain server has sent
+ * \param session A gnutls session, during or after handshake
+ * \param name Server name certificate has to be issued for
+ * \return TRUE if chain verified now or earlier
+ *
+ * Only chains that verified are remembered, others are verified again
+ * next time.
+ **/
+gboolean kfxmpp_tls_cache_verify (gnutls_session_t session, const gchar *name)
+{
+	const gnutls_datum_t *chain;
+	unsigned int chain_size, status;
+	guchar fingerprint[32];
+	gsize fingerprint_size = sizeof (fingerprint);
+	gnutls_x509_crt_t leaf;
+	time_t now, expires, *entry;
+	GString *key;
+	gboolean ok;
+	guint i;
+
+	g_return_val_if_fail (session, FALSE);
+	g_return_val_if_fail (name, FALSE);
+
+	chain = gnutls_certificate_get_peers (session, &chain_size);
+	if (chain == NULL || chain_size == 0)
+		return FALSE;
+	if (gnutls_fingerprint (GNUTLS_DIG_SHA256, &chain[0], fingerprint, &fingerprint_size) < 0)
+		return FALSE;
+
+	key = g_string_new (name);
+	g_string_append_c (key, ' ');
+	for (i = 0; i < fingerprint_size; i++)
+		g_string_append_printf (key, "%02x", fingerprint[i]);
+
+	now = time (NULL);
+	g_static_mutex_lock (&cache_mutex);
+	entry = verified ? g_hash_table_lookup (verified, key->str) : NULL;
+	ok = entry && *entry > now;
+	g_static_mutex_unlock (&cache_mutex);
+
+	if (ok) {
+		g_atomic_int_inc (&verify_hits);
+		g_string_free (key, TRUE);
+		return TRUE;
+	}
+
+	g_atomic_int_inc (&verify_misses);
+	ok = gnutls_certificate_verify_peers3 (session, name, &status) == 0 && status == 0;
+
+	expires = now + g_atomic_int_get (&verify_ttl);
+	if (ok && expires > now && gnutls_x509_crt_init (&leaf) == 0) {
+		if (gnutls_x509_crt_import (leaf, &chain[0], GNUTLS_X509_FMT_DER) == 0)
+			expires = MIN (expires, gnutls_x509_crt_get_expiration_time (leaf));
+		gnutls_x509_crt_deinit (leaf);
+
+		entry = g_new (time_t, 1);
+		*entry = expires;
+		g_static_mutex_lock (&cache_mutex);
+		if (verified == NULL)
+			verified = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+		g_hash_table_replace (verified, g_string_free (key, FALSE), entry);
+		g_static_mutex_unlock (&cache_mutex);
+	} else {
+		g_string_free (key, TRUE);
+	}
+
+	return ok;
+}
+
+
+/**
+ * \brief Offer cached session to server
+ * \param session A gnutls session, before handshake
+ * \param name Server name
+ * \return TRUE if a session was offered
+ **/
+gboolean kfxmpp_tls_cache_offer (gnutls_session_t session, const gchar *name)
+{
+	GString *data;
+	gboolean offered = FALSE;
+
+	g_return_val_if_fail (session, FALSE);
+	g_return_val_if_fail (name, FALSE);
+
+	g_static_mutex_lock (&cache_mutex);
+	data = cache ? g_hash_table_lookup (cache, name) : NULL;
+	if (data && gnutls_session_set_data (session, data->str, data->len) == 0)
+		offered = TRUE;
+	g_static_mutex_unlock (&cache_mutex);
+
+	return offered;
+}
+
+
+/**
+ * \brief Count a successful handshake and store its session
+ * \param session A gnutls session, after handshake
+ * \param name Server name
+ **/
+void kfxmpp_tls_cache_handshake_done (gnutls_session_t session, const gchar *name)
+{
+	g_return_if_fail (session);
+
+	if (gnutls_session_is_resumed (session))
+		g_atomic_int_inc (&hits);
+	else
+		g_atomic_int_inc (&misses);
+
+	kfxmpp_tls_cache_store (session, name);
+}
+
+
+/**
+ * \brief Store session to resume with next handshake
+ * \param session A gnutls session
+ * \param name Server name
+ *
+ * Nothing is stored if session cannot be resumed, such as a TLS 1.3
+ * session before server sent a ticket.
+ **/
+void kfxmpp_tls_cache_store (gnutls_session_t session, const gchar *name)
+{
+	gnutls_datum_t datum;
+	GString *data;
+
+	g_return_if_fail (session);
+	g_return_if_fail (name);
+
+	if (gnutls_protocol_get_version (session) == GNUTLS_TLS1_3 &&
+			! (gnutls_session_get_flags (session) & GNUTLS_SFLAGS_SESSION_TICKET))
+		return;
+	if (gnutls_session_get_data2 (session, &datum) < 0)
+		return;
+
+	data = g_string_new_len ((const gchar *) datum.data, datum.size);
+	gnutls_free (datum.data);
+
+	g_static_mutex_lock (&cache_mutex);
+	if (cache == NULL)
+		cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, kfxmpp_tls_cache_free_entry);
+	g_hash_table_replace (cache, g_strdup (name), data);
+	g_static_mutex_unlock (&cache_mutex);
+}
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * kfxmpp
+ * ------
+ *
+ * Copyright (C) 2003-2004 Przemysław Sitek <psitek@rams.pl> 
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+/** \file tlscache.h */
+
+#ifndef __TLSCACHE_H__
+#define __TLSCACHE_H__
+
+#include <glib.h>
+#include <kfxmpp/core.h>
+
+#ifdef HAVE_GNUTLS
+#  include <gnutls/gnutls.h>
+#endif
+
+G_BEGIN_DECLS
+
+/**
+ * \brief Process-wide TLS state shared by sessions
+ *
+ * All sessions use the same client credentials, with system trust store
+ * loaded once, when first handshake starts.
+ *
+ * After each handshake, sessions store what gnutls needs to resume the
+ * TLS session, keyed by server name. Next handshake with the same server
+ * offers it, and if server agrees, handshake takes one round trip and no
+ * certificate is sent or checked. With TLS 1.3, resumption data exist
+ * only once server has sent a ticket after handshake, so sessions store
+ * them again when they close.
+ *
+ * A handshake counts as a hit if it resumed a session, and as a miss
+ * otherwise, whether or not anything was offered.
+ *
+ * Certificate chains that verified are remembered by SHA-256 fingerprint
+ * of their leaf certificate and server name, until leaf expires or for
+ * at most kfxmpp_tls_cache_set_verify_ttl seconds. Sessions to a server
+ * seen before skip chain verification meanwhile, revocation included.
+ *
+ * Thread safety: all functions may be called from any thread.
+ **/
+
+void kfxmpp_tls_cache_clear (void);
+void kfxmpp_tls_cache_deinit (void);
+guint kfxmpp_tls_cache_get_size (void);
+guint kfxmpp_tls_cache_get_hits (void);
+guint kfxmpp_tls_cache_get_misses (void);
+void kfxmpp_tls_cache_set_verify_ttl (guint seconds);
+guint kfxmpp_tls_cache_get_verify_ttl (void);
+guint kfxmpp_tls_cache_get_verify_hits (void);
+guint kfxmpp_tls_cache_get_verify_misses (void);
+
+#ifdef HAVE_GNUTLS
+gnutls_certificate_credentials_t kfxmpp_tls_cache_get_credentials (void);
+gboolean kfxmpp_tls_cache_verify (gnutls_session_t session, const gchar *name);
+gboolean kfxmpp_tls_cache_offer (gnutls_session_t session, const gchar *name);
+void kfxmpp_tls_cache_handshake_done (gnutls_session_t session, const gchar *name);
+void kfxmpp_tls_cache_store (gnutls_session_t session, const gchar *name);
+#endif
+
+G_END_DECLS
+
+#endif /* __TLSCACHE_H__ */
@@ -0,0 +1,128 @@
+/*
+ * kfxmpp output queue benchmark
+ * -----------------------------
+ *
+ * Sends a burst of stanzas over a local socket, first with one write per
+ * stanza (the way sessions used to do it), then through a KfxmppOutQueue
+ * flushed with gather writes. Reader thread checks that every byte
+ * arrives, in order, in both cases.
+ *
+ * output:
+Burst: 1000 stanzas, <n> bytes
+Plain writes: 1000 syscalls, 1.000 per stanza, <n> ms
+Output queue: <n> syscalls, <n> per stanza, <n> ms
+Received data intact: yes
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+#include <kfxmpp/outqueue.h>
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define N_STANZAS	1000
+
+#define STANZA "<message to='someone@example.com' type='chat' id='%06d'><body>Hello, this is message number %d</body></message>"
+
+static gint sockets[2];
+
+
+static gpointer reader (gpointer data)
+{
+	GString *received = g_string_new (NULL);
+	gsize expected = GPOINTER_TO_UINT (data);
+	gchar buffer[65536];
+
+	while (received->len < expected) {
+		gssize n = read (sockets[1], buffer, sizeof (buffer));
+
+		if (n <= 0)
+			break;
+		g_string_append_len (received, buffer, n);
+	}
+	return received;
+}
+
+
+static GString *run (const gchar **stanzas, gsize total, gboolean queued, guint *syscalls, gdouble *elapsed)
+{
+	GThread *thread;
+	GTimer *timer;
+	gint i;
+
+	thread = g_thread_create (reader, GUINT_TO_POINTER (total), TRUE, NULL);
+	timer = g_timer_new ();
+
+	if (queued) {
+		KfxmppOutQueue *queue = kfxmpp_out_queue_new ();
+
+		for (i = 0; i < N_STANZAS; i++)
+			kfxmpp_out_queue_append (queue, stanzas[i], strlen (stanzas[i]));
+
+		while (kfxmpp_out_queue_get_bytes (queue) > 0) {
+			struct pollfd pfd = { sockets[0], POLLOUT, 0 };
+
+			if (kfxmpp_out_queue_flush (queue, sockets[0]) < 0)
+				break;
+			if (kfxmpp_out_queue_get_bytes (queue) > 0)
+				poll (&pfd, 1, -1);
+		}
+		*syscalls = kfxmpp_out_queue_get_syscalls (queue);
+		kfxmpp_out_queue_free (queue);
+	} else {
+		*syscalls = 0;
+		for (i = 0; i < N_STANZAS; i++) {
+			write (sockets[0], stanzas[i], strlen (stanzas[i]));
+			(*syscalls)++;
+		}
+	}
+
+	*elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	return g_thread_join (thread);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	const gchar *stanzas[N_STANZAS];
+	GString *expected, *plain, *queued;
+	guint syscalls;
+	gdouble elapsed;
+	gboolean ok;
+	gint i;
+
+	g_thread_init (NULL);
+	socketpair (AF_UNIX, SOCK_STREAM, 0, sockets);
+
+	expected = g_string_new (NULL);
+	for (i = 0; i < N_STANZAS; i++) {
+		stanzas[i] = g_strdup_printf (STANZA, i, i);
+		g_string_append (expected, stanzas[i]);
+	}
+	g_print ("Burst: %d stanzas, %d bytes\n", N_STANZAS, (gint) expected->len);
+
+	plain = run (stanzas, expected->len, FALSE, &syscalls, &elapsed);
+	g_print ("Plain writes: %u syscalls, %.3f per stanza, %.2f ms\n",
+			syscalls, (gdouble) syscalls / N_STANZAS, elapsed * 1000);
+
+	queued = run (stanzas, expected->len, TRUE, &syscalls, &elapsed);
+	g_print ("Output queue: %u syscalls, %.3f per stanza, %.2f ms\n",
+			syscalls, (gdouble) syscalls / N_STANZAS, elapsed * 1000);
+
+	ok = strcmp (plain->str, expected->str) == 0 && strcmp (queued->str, expected->str) == 0;
+	g_print ("Received data intact: %s\n", ok ? "yes" : "no");
+
+	for (i = 0; i < N_STANZAS; i++)
+		g_free ((gchar *) stanzas[i]);
+	g_string_free (expected, TRUE);
+	g_string_free (plain, TRUE);
+	g_string_free (queued, TRUE);
+
+	return ok ? 0 : 1;
+}
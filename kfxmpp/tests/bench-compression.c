@@ -0,0 +1,150 @@
+/*
+ * kfxmpp stream compression benchmark
+ * -----------------------------------
+ *
+ * Connects a session to a stand-in server over loopback, which offers
+ * zlib compression after authentication, and sends verbose log messages
+ * carrying data forms, a few at a time per main loop iteration. First run
+ * goes without compression, others compress with different levels and
+ * windows. Server decompresses what it gets and counts messages.
+ *
+ * For each run, bytes that went on the wire per message are reported
+ * along with CPU time main thread spent per message, from first send
+ * until output queue drained. Compressor memory is estimated from window.
+ *
+ * output:
+Messages: 4000 of <n> bytes each, 8 per iteration
+  none: <n> bytes/message, ratio 1.0, <n> us CPU/message
+  level 1, window 15 (256 KB): <n> bytes/message, ratio <n>, <n> us CPU/message
+  level 6, window 15 (256 KB): <n> bytes/message, ratio <n>, <n> us CPU/message
+  level 9, window 15 (256 KB): <n> bytes/message, ratio <n>, <n> us CPU/message
+  level 6, window 12 (32 KB): <n> bytes/message, ratio <n>, <n> us CPU/message
+  level 6, window 9 (4 KB): <n> bytes/message, ratio <n>, <n> us CPU/message
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <string.h>
+#include <time.h>
+
+#include "stand-in-server.h"
+
+#define MESSAGES	4000
+#define BATCH		8
+
+static StandInServer *server;
+
+
+static gchar *make_message (gint n)
+{
+	/* What a monitoring bot would send */
+	return g_strdup_printf ("<message to='sink@localhost/bench' type='normal' id='m%05d'>"
+			"<body>2026-10-18T12:%02d:%02d.%03dZ INFO worker-%02d: processed batch %05d of "
+			"queue ingest.events in %3d ms, %4d records, 0 errors, 0 retries</body>"
+			"<x xmlns='jabber:x:data' type='result'>"
+			"<field var='host'><value>node-%02d.example.net</value></field>"
+			"<field var='queue'><value>ingest.events</value></field>"
+			"<field var='status'><value>ok</value></field>"
+			"<field var='latency'><value>%d</value></field>"
+			"<field var='records'><value>%d</value></field>"
+			"</x></message>",
+			n, (n / 60) % 60, n % 60, (n * 37) % 1000, n % 16, n,
+			(n * 13) % 500, (n * 7) % 2000, n % 16, (n * 13) % 500, (n * 7) % 2000);
+}
+
+
+static gint64 thread_cpu (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (gint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static gboolean run (KfxmppSession *session, gchar **messages, gsize raw, gint level, gint window)
+{
+	gchar *name;
+	gsize sent_before, sent_after, wire;
+	gint64 cpu;
+	gint i;
+
+	if (level < 0)
+		name = g_strdup ("none");
+	else
+		name = g_strdup_printf ("level %d, window %d (%d KB)", level, window, 1 << (window - 7));
+
+	stand_in_server_reset (server);
+	kfxmpp_session_set_compression (session, level, window);
+	if (! stand_in_session_connect (session) ||
+			kfxmpp_session_get_compressed (session) != (level >= 0)) {
+		g_print ("  %s: connection FAILED\n", name);
+		g_free (name);
+		return FALSE;
+	}
+
+	kfxmpp_session_get_compression_stats (session, NULL, &sent_before, NULL, NULL);
+	cpu = thread_cpu ();
+	for (i = 0; i < MESSAGES; i++) {
+		kfxmpp_session_send_raw (session, messages[i], strlen (messages[i]), NULL);
+		if ((i + 1) % BATCH == 0)
+			while (g_main_context_iteration (NULL, FALSE))
+				;
+	}
+	while (kfxmpp_session_get_pending_bytes (session) > 0)
+		g_main_context_iteration (NULL, TRUE);
+	cpu = thread_cpu () - cpu;
+	kfxmpp_session_get_compression_stats (session, NULL, &sent_after, NULL, NULL);
+	wire = level < 0 ? raw : sent_after - sent_before;
+
+	/* Server has to see every message whole */
+	while (stand_in_server_get_messages (server) < MESSAGES)
+		if (! g_main_context_iteration (NULL, FALSE))
+			g_usleep (1000);
+
+	g_print ("  %s: %.0f bytes/message, ratio %.1f, %.2f us CPU/message\n", name,
+			(gdouble) wire / MESSAGES, (gdouble) raw / wire, (gdouble) cpu / MESSAGES);
+	kfxmpp_session_disconnect (session, NULL);
+	g_free (name);
+
+	return TRUE;
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	KfxmppSession *session;
+	gchar *messages[MESSAGES];
+	gsize raw = 0;
+	gboolean ok;
+	gint i;
+
+	kfxmpp_init ();
+	server = stand_in_server_new (NULL, STAND_IN_XMPP | STAND_IN_COMPRESSION);
+
+	for (i = 0; i < MESSAGES; i++) {
+		messages[i] = make_message (i);
+		raw += strlen (messages[i]);
+	}
+
+	/* Compression alone is measured, stand-in server does not offer TLS */
+	session = stand_in_session_new (server);
+
+	g_print ("Messages: %d of %lu bytes each, %d per iteration\n", MESSAGES,
+			(gulong) (raw / MESSAGES), BATCH);
+	ok = run (session, messages, raw, -1, 15);
+	ok = run (session, messages, raw, 1, 15) && ok;
+	ok = run (session, messages, raw, 6, 15) && ok;
+	ok = run (session, messages, raw, 9, 15) && ok;
+	ok = run (session, messages, raw, 6, 12) && ok;
+	ok = run (session, messages, raw, 6, 9) && ok;
+
+	for (i = 0; i < MESSAGES; i++)
+		g_free (messages[i]);
+	kfxmpp_session_unref (session);
+	stand_in_server_free (server);
+	kfxmpp_deinit ();
+
+	return ok ? 0 : 1;
+}
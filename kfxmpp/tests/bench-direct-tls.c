@@ -0,0 +1,76 @@
+/*
+ * kfxmpp direct TLS benchmark
+ * ---------------------------
+ *
+ * Connects a session to a stand-in server over loopback, once through
+ * STARTTLS and once with direct TLS. Server delays each flight of data
+ * it receives by a simulated round trip, and counts flights until it
+ * sends SASL <success/> and until it answers resource binding. TCP
+ * connect counts as one more round trip. Server also reports ALPN
+ * protocol session offered.
+ *
+ * output:
+Simulated round trip: 20 ms
+  STARTTLS: 6 round trips to authenticated, 8 to bound, <n> ms
+  direct TLS (ALPN xmpp-client): 4 round trips to authenticated, 6 to bound, <n> ms
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include "stand-in-server.h"
+
+#define RTT	20	/* Milliseconds */
+
+
+static void run (const gchar *name, StandInServer *server)
+{
+	KfxmppSession *session;
+	GTimer *timer;
+	gchar *alpn;
+
+	session = stand_in_session_new (server);
+	stand_in_server_reset (server);
+
+	timer = g_timer_new ();
+	if (! stand_in_session_connect (session)) {
+		g_print ("  %s: connection FAILED\n", name);
+	} else {
+		/* Server saw last flight before it answered */
+		g_print ("  %s", name);
+		alpn = stand_in_server_get_alpn (server);
+		if (alpn)
+			g_print (" (ALPN %s)", alpn);
+		g_free (alpn);
+		g_print (": %d round trips to authenticated, %d to bound, %.0f ms\n",
+				stand_in_server_get_auth_flights (server) + 1,
+				stand_in_server_get_bind_flights (server) + 1,
+				g_timer_elapsed (timer, NULL) * 1000);
+		kfxmpp_session_disconnect (session, NULL);
+	}
+
+	kfxmpp_session_unref (session);
+	g_timer_destroy (timer);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	StandInServer *starttls, *direct;
+
+	kfxmpp_init ();
+	starttls = stand_in_server_new (NULL, STAND_IN_XMPP | STAND_IN_STARTTLS);
+	direct = stand_in_server_new (NULL, STAND_IN_XMPP | STAND_IN_DIRECT_TLS);
+	stand_in_server_set_round_trip (starttls, RTT);
+	stand_in_server_set_round_trip (direct, RTT);
+
+	g_print ("Simulated round trip: %d ms\n", RTT);
+	run ("STARTTLS", starttls);
+	run ("direct TLS", direct);
+
+	stand_in_server_free (starttls);
+	stand_in_server_free (direct);
+	kfxmpp_deinit ();
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * kfxmpp fast open benchmark
+ * --------------------------
+ *
+ * Connects a session through STARTTLS to a stand-in server over loopback,
+ * first without fast open, then twice with it: the first time kernel
+ * asks server for a TCP Fast Open cookie, the second time stream header
+ * goes along with SYN. Fast open runs also pipeline resource binding.
+ * Server delays each flight of data it receives by a simulated round
+ * trip, and counts flights until it answers resource binding. TCP
+ * connect counts as one more round trip, unless SYN carried data.
+ *
+ * Loopback needs server side fast open too, which has to be enabled by
+ * setting net.ipv4.tcp_fastopen sysctl to 3; otherwise SYN never carries
+ * data. Kernel keeps cookies, so on later runs the first fast open may
+ * carry data as well.
+ *
+ * output:
+Simulated round trip: 20 ms
+  plain: SYN data no, 8 round trips to bound, <n> ms
+  fast open 1: SYN data no, 7 round trips to bound, <n> ms
+  fast open 2: SYN data yes, 6 round trips to bound, <n> ms
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include "stand-in-server.h"
+
+#define RTT	20	/* Milliseconds */
+
+static StandInServer *server;
+
+
+static void run (KfxmppSession *session, const gchar *name)
+{
+	GTimer *timer;
+	gboolean syn;
+
+	stand_in_server_reset (server);
+
+	timer = g_timer_new ();
+	if (! stand_in_session_connect (session)) {
+		g_print ("  %s: connection FAILED\n", name);
+	} else {
+		/* Server saw last flight before it answered */
+		syn = stand_in_server_get_syn_data (server);
+		g_print ("  %s: SYN data %s, %d round trips to bound, %.0f ms\n", name, syn ? "yes" : "no",
+				stand_in_server_get_bind_flights (server) + (syn ? 0 : 1),
+				g_timer_elapsed (timer, NULL) * 1000);
+		kfxmpp_session_disconnect (session, NULL);
+	}
+
+	g_timer_destroy (timer);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	KfxmppSession *session;
+
+	kfxmpp_init ();
+	server = stand_in_server_new (NULL, STAND_IN_XMPP | STAND_IN_STARTTLS | STAND_IN_FAST_OPEN);
+	stand_in_server_set_round_trip (server, RTT);
+
+	session = stand_in_session_new (server);
+
+	g_print ("Simulated round trip: %d ms\n", RTT);
+	run (session, "plain");
+	kfxmpp_session_set_fast_open (session, TRUE);
+	kfxmpp_session_set_bind_pipelining (session, TRUE);
+	run (session, "fast open 1");
+	run (session, "fast open 2");
+
+	kfxmpp_session_unref (session);
+	stand_in_server_free (server);
+	kfxmpp_deinit ();
+
+	return 0;
+}
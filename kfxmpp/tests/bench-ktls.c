@@ -0,0 +1,193 @@
+/*
+ * kfxmpp kernel TLS benchmark
+ * ---------------------------
+ *
+ * Connects sessions through STARTTLS to a stand-in server over loopback,
+ * once with records handled by gnutls and once with kernel TLS. Server
+ * pushes messages to every session, then sessions send messages to
+ * server, and megabytes per second of each direction are reported.
+ * Directions kernel took over are shown, none where kernel lacks TLS
+ * support, in which case both runs should perform alike.
+ *
+ * Stand-in server handles its records with gnutls on a single thread, so
+ * it may well be what limits both runs.
+ *
+ * output:
+Sessions: 4, <n> MB each way
+  gnutls: receive <n> MB/s, send <n> MB/s
+  kernel TLS (tx rx): receive <n> MB/s, send <n> MB/s
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <string.h>
+
+#include "stand-in-server.h"
+
+#define N_SESSIONS	4
+#define N_MESSAGES	20000	/* Each way, per session */
+#define BODY_SIZE	1000
+#define SEND_AHEAD	(256 * 1024)	/* Bytes a session may have queued */
+
+typedef struct {
+	KfxmppSession *session;
+	gint connected;		/* 1 connected, -1 failed */
+	gint received;		/* Messages */
+	gboolean done;		/* Whether server answered <iq/> sent after messages */
+} Client;
+
+static StandInServer *server;
+static gchar *message;		/* Message both sides send */
+static Client clients[N_SESSIONS];
+
+
+static gboolean got_message (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	Client *client = data;
+
+	client->received++;
+	return FALSE;
+}
+
+
+static gboolean got_result (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	Client *client = data;
+
+	client->done = TRUE;
+	return FALSE;
+}
+
+
+static gboolean all_received (void)
+{
+	gint i;
+
+	for (i = 0; i < N_SESSIONS; i++)
+		if (clients[i].connected == 1 && clients[i].received < N_MESSAGES)
+			return FALSE;
+	return TRUE;
+}
+
+
+static gboolean all_done (void)
+{
+	gint i;
+
+	for (i = 0; i < N_SESSIONS; i++)
+		if (clients[i].connected == 1 && ! clients[i].done)
+			return FALSE;
+	return TRUE;
+}
+
+
+static void run (gboolean ktls)
+{
+	KfxmppEventHandler *handler;
+	KfxmppKtlsDirection active;
+	KfxmppStanza *iq;
+	GString *burst;
+	GTimer *timer;
+	gdouble megabytes, receive, send;
+	gint i, j, connected;
+
+	for (i = 0; i < N_SESSIONS; i++) {
+		Client *client = &clients[i];
+
+		memset (client, 0, sizeof (Client));
+		client->session = stand_in_session_new (server);
+		kfxmpp_session_set_ktls (client->session, ktls);
+
+		handler = kfxmpp_event_handler_new (got_message, client, NULL);
+		kfxmpp_session_add_handler (client->session, KFXMPP_EVENT_TYPE_MESSAGE, handler,
+				KFXMPP_EVENT_HANDLER_PRIORITY_NORMAL);
+		kfxmpp_event_handler_unref (handler);
+
+		kfxmpp_session_connect (client->session, stand_in_connected, &client->connected, NULL);
+	}
+
+	connected = 0;
+	while (connected < N_SESSIONS) {
+		g_main_context_iteration (NULL, TRUE);
+		for (i = 0, connected = 0; i < N_SESSIONS; i++)
+			if (clients[i].connected != 0)
+				connected++;
+	}
+	megabytes = (gdouble) N_SESSIONS * N_MESSAGES * strlen (message) / (1024 * 1024);
+
+	/* Server to client, a hundred messages at a time */
+	burst = g_string_new (NULL);
+	for (j = 0; j < 100; j++)
+		g_string_append (burst, message);
+	timer = g_timer_new ();
+	stand_in_server_push (server, burst->str, N_MESSAGES / 100);
+	g_string_free (burst, TRUE);
+	while (! all_received ())
+		g_main_context_iteration (NULL, TRUE);
+	receive = megabytes / g_timer_elapsed (timer, NULL);
+
+	/* Client to server, <iq/> result tells everything before it got there */
+	g_timer_start (timer);
+	for (j = 0; j < N_MESSAGES; j++) {
+		for (i = 0; i < N_SESSIONS; i++) {
+			if (clients[i].connected != 1)
+				continue;
+			kfxmpp_session_send_raw (clients[i].session, message, -1, NULL);
+			while (kfxmpp_session_get_pending_bytes (clients[i].session) > SEND_AHEAD)
+				g_main_context_iteration (NULL, TRUE);
+		}
+	}
+	for (i = 0; i < N_SESSIONS; i++) {
+		if (clients[i].connected != 1)
+			continue;
+		iq = kfxmpp_stanza_new (NULL, KFXMPP_STANZA_KLASS_IQ);
+		handler = kfxmpp_event_handler_new (got_result, &clients[i], NULL);
+		kfxmpp_session_send_await_response (clients[i].session, iq, handler, NULL);
+		kfxmpp_event_handler_unref (handler);
+		kfxmpp_stanza_free (iq);
+	}
+	while (! all_done ())
+		g_main_context_iteration (NULL, TRUE);
+	send = megabytes / g_timer_elapsed (timer, NULL);
+
+	active = kfxmpp_session_get_ktls_active (clients[0].session);
+	if (ktls)
+		g_print ("  kernel TLS (%s%s%s):", active & KFXMPP_KTLS_TX ? "tx" : "",
+				active == (KFXMPP_KTLS_TX | KFXMPP_KTLS_RX) ? " " : "",
+				active & KFXMPP_KTLS_RX ? "rx" : (active ? "" : "none"));
+	else
+		g_print ("  gnutls:");
+	g_print (" receive %.0f MB/s, send %.0f MB/s\n", receive, send);
+
+	for (i = 0; i < N_SESSIONS; i++) {
+		kfxmpp_session_disconnect (clients[i].session, NULL);
+		kfxmpp_session_unref (clients[i].session);
+	}
+	g_timer_destroy (timer);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	gchar *body;
+
+	kfxmpp_init ();
+	server = stand_in_server_new (NULL, STAND_IN_STARTTLS);
+
+	body = g_strnfill (BODY_SIZE, 'x');
+	message = g_strdup_printf ("<message from='bot@localhost' to='user@localhost' type='chat'>"
+			"<body>%s</body></message>", body);
+	g_free (body);
+
+	g_print ("Sessions: %d, %.0f MB each way\n", N_SESSIONS,
+			(gdouble) N_SESSIONS * N_MESSAGES * strlen (message) / (1024 * 1024));
+	run (FALSE);
+	run (TRUE);
+
+	stand_in_server_free (server);
+	g_free (message);
+	kfxmpp_deinit ();
+
+	return 0;
+}
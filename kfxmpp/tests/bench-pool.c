@@ -0,0 +1,220 @@
+/*
+ * kfxmpp session pool benchmark
+ * -----------------------------
+ *
+ * Connects 1k, 10k and 50k sessions, all in one KfxmppSessionPool, to
+ * stand-in servers running in other threads. Servers speak just enough of
+ * legacy Jabber to let sessions authenticate. Measures CPU used by the
+ * whole process while sessions sit idle (keepalives included), then time
+ * needed to deliver a burst of messages to every session.
+ *
+ * Each session needs two descriptors, so larger runs are skipped when
+ * descriptor limit is too low.
+ *
+ * output:
+Sessions: 1000
+  connect: <n> ms
+  idle CPU: <n>% over 10 s
+  throughput: <n> messages/s
+Sessions: 10000
+  connect: <n> ms
+  idle CPU: <n>% over 10 s
+  throughput: <n> messages/s
+Sessions: 50000
+  connect: <n> ms
+  idle CPU: <n>% over 10 s
+  throughput: <n> messages/s
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <sys/resource.h>
+
+#include "stand-in-server.h"
+
+#define N_LISTENERS	4	/* Ports are per destination address, so spread connections */
+#define MAX_CONNECTING	500	/* Connect attempts in flight */
+#define IDLE_SECONDS	10
+#define BURST		20	/* Messages pushed to each session */
+
+#define SERVER_MESSAGE "<message from='bot@localhost' to='user@localhost' type='chat'>" \
+		"<body>Hello from stand-in server</body></message>"
+
+static const gint scales[] = { 1000, 10000, 50000 };
+
+static StandInServer *servers[N_LISTENERS];
+
+/* Client side */
+static KfxmppSession **sessions;
+static gint n_sessions;
+static gint started;
+static gint connected;
+static gint failed;
+static gint received;
+
+
+/***********************************************************************
+ *
+ * Client side
+ *
+ */
+
+static gboolean got_message (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	received++;
+	return FALSE;
+}
+
+
+static void start_next (KfxmppSessionPool *pool);
+
+static void got_connected (KfxmppSession *session, KfxmppError error, gpointer data)
+{
+	if (error == KFXMPP_ERROR_NONE)
+		connected++;
+	else
+		failed++;
+	start_next (data);
+}
+
+
+static void start_next (KfxmppSessionPool *pool)
+{
+	KfxmppSession *session;
+	KfxmppEventHandler *handler;
+	gint i;
+
+	if (started >= n_sessions)
+		return;
+	i = started++;
+
+	session = stand_in_session_new (servers[i % N_LISTENERS]);
+
+	handler = kfxmpp_event_handler_new (got_message, NULL, NULL);
+	kfxmpp_session_add_handler (session, KFXMPP_EVENT_TYPE_MESSAGE, handler,
+			KFXMPP_EVENT_HANDLER_PRIORITY_NORMAL);
+	kfxmpp_event_handler_unref (handler);
+
+	kfxmpp_session_pool_add (pool, session);
+	kfxmpp_session_connect (session, got_connected, pool, NULL);
+	sessions[i] = session;
+}
+
+
+static gdouble cpu_time (void)
+{
+	struct rusage usage;
+
+	getrusage (RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+
+static void run (gint n)
+{
+	KfxmppSessionPool *pool;
+	GSource *source;
+	GString *burst;
+	GTimer *timer;
+	gdouble cpu, elapsed;
+	gint i;
+
+	g_print ("Sessions: %d\n", n);
+
+	n_sessions = n;
+	started = connected = failed = received = 0;
+	sessions = g_new0 (KfxmppSession *, n);
+
+	pool = kfxmpp_session_pool_new ();
+	source = kfxmpp_session_pool_create_source (pool);
+	g_source_attach (source, NULL);
+
+	/* Connect */
+	timer = g_timer_new ();
+	for (i = 0; i < MIN (n, MAX_CONNECTING); i++)
+		start_next (pool);
+	while (connected + failed < n)
+		g_main_context_iteration (NULL, TRUE);
+	g_print ("  connect: %.0f ms", g_timer_elapsed (timer, NULL) * 1000);
+	if (failed)
+		g_print (" (%d failed)", failed);
+	g_print ("\n");
+
+	/* Idle */
+	cpu = cpu_time ();
+	g_timer_start (timer);
+	while (g_timer_elapsed (timer, NULL) < IDLE_SECONDS)
+		g_main_context_iteration (NULL, TRUE);
+	g_print ("  idle CPU: %.1f%% over %d s\n",
+			(cpu_time () - cpu) * 100 / g_timer_elapsed (timer, NULL), IDLE_SECONDS);
+
+	/* Burst */
+	burst = g_string_new (NULL);
+	for (i = 0; i < BURST; i++)
+		g_string_append (burst, SERVER_MESSAGE);
+	g_timer_start (timer);
+	for (i = 0; i < N_LISTENERS; i++)
+		stand_in_server_push (servers[i], burst->str, 1);
+	g_string_free (burst, TRUE);
+	while (received < connected * BURST)
+		g_main_context_iteration (NULL, TRUE);
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_print ("  throughput: %.0f messages/s\n", received / elapsed);
+
+	for (i = 0; i < n; i++) {
+		kfxmpp_session_disconnect (sessions[i], NULL);
+		kfxmpp_session_unref (sessions[i]);
+	}
+	g_free (sessions);
+
+	g_source_destroy (source);
+	g_source_unref (source);
+	kfxmpp_session_pool_unref (pool);
+	g_timer_destroy (timer);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	KfxmppSessionPool *pool;
+	struct rlimit limit;
+	gchar *address;
+	guint i;
+
+	kfxmpp_init ();
+
+	/* Two descriptors per session, one on each side */
+	getrlimit (RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit (RLIMIT_NOFILE, &limit);
+
+	pool = kfxmpp_session_pool_new ();
+	if (pool == NULL) {
+		g_print ("epoll is not available\n");
+		return 0;
+	}
+	kfxmpp_session_pool_unref (pool);
+
+	for (i = 0; i < N_LISTENERS; i++) {
+		address = g_strdup_printf ("127.0.0.%u", 1 + i);
+		servers[i] = stand_in_server_new (address, STAND_IN_LEGACY);
+		g_free (address);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (scales); i++) {
+		if ((rlim_t) scales[i] * 2 + 64 > limit.rlim_cur) {
+			g_print ("Sessions: %d\n  skipped, descriptor limit is %lu\n",
+					scales[i], (gulong) limit.rlim_cur);
+			continue;
+		}
+		run (scales[i]);
+	}
+
+	for (i = 0; i < N_LISTENERS; i++)
+		stand_in_server_free (servers[i]);
+	kfxmpp_deinit ();
+
+	return 0;
+}
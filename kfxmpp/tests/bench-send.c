@@ -0,0 +1,97 @@
+/*
+ * kfxmpp send queue benchmark
+ * ---------------------------
+ *
+ * Connects a session to a stand-in server, then 16 producer threads send
+ * messages with kfxmpp_session_send while the main loop writes them. A
+ * producer wakes up the main loop only when it finds session's send queue
+ * empty, so number of wakeups should be much lower than number of
+ * stanzas. Server counts messages it gets.
+ *
+ * output:
+Producers: 16 x 20000 stanzas
+Sent <n> stanzas in <n> wakeups (<n> stanzas per wakeup)
+Throughput: <n> stanzas/s
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include "stand-in-server.h"
+
+#define N_PRODUCERS	16
+#define N_STANZAS	20000
+
+static KfxmppSession *session;
+static gint failed = 0;
+
+
+static gpointer producer (gpointer data)
+{
+	KfxmppStanza *stanza;
+	gint i;
+
+	stanza = kfxmpp_stanza_new ("sink@localhost", KFXMPP_STANZA_KLASS_MESSAGE);
+	xmlNewTextChild (stanza->node, NULL, BAD_CAST "body", BAD_CAST "Hello");
+
+	for (i = 0; i < N_STANZAS; i++)
+		if (kfxmpp_session_send (session, stanza, NULL) < 0)
+			g_atomic_int_inc (&failed);
+
+	kfxmpp_stanza_free (stanza);
+	return NULL;
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	StandInServer *server;
+	GThread *threads[N_PRODUCERS];
+	GTimer *timer;
+	gdouble elapsed;
+	gint wakeups = 0;
+	gint sent;
+	gint i;
+
+	kfxmpp_init ();
+	server = stand_in_server_new (NULL, STAND_IN_LEGACY);
+	session = stand_in_session_new (server);
+	if (! stand_in_session_connect (session)) {
+		g_print ("Connect: FAILED\n");
+		return 1;
+	}
+
+	g_print ("Producers: %d x %d stanzas\n", N_PRODUCERS, N_STANZAS);
+
+	/* Main thread runs session's context all along, producers only queue */
+	g_main_context_acquire (NULL);
+	stand_in_server_reset (server);
+	timer = g_timer_new ();
+	for (i = 0; i < N_PRODUCERS; i++)
+		threads[i] = g_thread_create (producer, NULL, TRUE, NULL);
+
+	while (stand_in_server_get_messages (server) + g_atomic_int_get (&failed) < N_PRODUCERS * N_STANZAS) {
+		if (g_main_context_iteration (NULL, FALSE))
+			wakeups++;
+		else
+			g_usleep (100);
+	}
+	elapsed = g_timer_elapsed (timer, NULL);
+
+	for (i = 0; i < N_PRODUCERS; i++)
+		g_thread_join (threads[i]);
+	g_main_context_release (NULL);
+
+	sent = stand_in_server_get_messages (server);
+	g_print ("Sent %d stanzas in %d wakeups (%.1f stanzas per wakeup)\n",
+			sent, wakeups, (gdouble) sent / MAX (wakeups, 1));
+	g_print ("Throughput: %.0f stanzas/s\n", sent / elapsed);
+
+	g_timer_destroy (timer);
+	kfxmpp_session_disconnect (session, NULL);
+	kfxmpp_session_unref (session);
+	stand_in_server_free (server);
+	kfxmpp_deinit ();
+
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+/*
+ * kfxmpp shard manager benchmark
+ * ------------------------------
+ *
+ * Connects 2000 sessions through a KfxmppShardManager with 1, 2, 4...
+ * shards, up to the number of online processors, to a stand-in server
+ * running a thread per listening socket. Server speaks just enough of
+ * legacy Jabber to let sessions authenticate. Then every session gets
+ * bursts of messages, and messages handled per second are reported.
+ * Throughput should grow about linearly with shards, as long as server
+ * threads keep up.
+ *
+ * output:
+Sessions: 2000, 200 messages each
+  1 shard(s): <n> messages/s
+  2 shard(s): <n> messages/s
+  <n> shard(s): <n> messages/s
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "stand-in-server.h"
+
+#define N_LISTENERS	4	/* Server threads, each with its own address */
+#define N_SESSIONS	2000
+#define ROUNDS		10
+#define BURST		20	/* Messages pushed to each session per round */
+
+#define SERVER_MESSAGE "<message from='bot@localhost' to='user@localhost' type='chat'>" \
+		"<body>Hello from stand-in server</body></message>"
+
+static StandInServer *servers[N_LISTENERS];
+
+/* Client side, each session counts on its own so that shards share nothing */
+typedef struct {
+	KfxmppSession *session;
+	gint connected;		/* 1 connected, -1 failed (atomic) */
+	gint received;		/* Messages (atomic) */
+} Client;
+
+static Client clients[N_SESSIONS];
+
+
+/***********************************************************************
+ *
+ * Client side
+ *
+ */
+
+static gboolean got_message (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	Client *client = data;
+
+	g_atomic_int_inc (&client->received);
+	return FALSE;
+}
+
+
+/* Wait until every session got connected or every connected one got enough messages */
+static gint wait_for (gint messages)
+{
+	gint i, n;
+
+	for (;;) {
+		n = 0;
+		for (i = 0; i < N_SESSIONS; i++) {
+			gint state = g_atomic_int_get (&clients[i].connected);
+
+			if (messages == 0 ? state != 0 :
+					state != 1 || g_atomic_int_get (&clients[i].received) >= messages)
+				n++;
+		}
+		if (n == N_SESSIONS)
+			return n;
+		g_usleep (1000);
+	}
+}
+
+
+static void run (guint n_shards)
+{
+	KfxmppShardManager *manager;
+	KfxmppEventHandler *handler;
+	GString *burst;
+	GTimer *timer;
+	gint i, round, received;
+	gdouble elapsed;
+
+	manager = kfxmpp_shard_manager_new (n_shards);
+
+	for (i = 0; i < N_SESSIONS; i++) {
+		Client *client = &clients[i];
+
+		memset (client, 0, sizeof (Client));
+		client->session = stand_in_session_new (servers[i % N_LISTENERS]);
+
+		/* Session belongs to no thread until it is added */
+		handler = kfxmpp_event_handler_new (got_message, client, NULL);
+		kfxmpp_session_add_handler (client->session, KFXMPP_EVENT_TYPE_MESSAGE, handler,
+				KFXMPP_EVENT_HANDLER_PRIORITY_NORMAL);
+		kfxmpp_event_handler_unref (handler);
+
+		kfxmpp_shard_manager_add (manager, client->session, stand_in_connected, &client->connected);
+	}
+	wait_for (0);
+
+	burst = g_string_new (NULL);
+	for (i = 0; i < BURST; i++)
+		g_string_append (burst, SERVER_MESSAGE);
+
+	timer = g_timer_new ();
+	for (round = 1; round <= ROUNDS; round++) {
+		for (i = 0; i < N_LISTENERS; i++)
+			stand_in_server_push (servers[i], burst->str, 1);
+		wait_for (round * BURST);
+	}
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_string_free (burst, TRUE);
+
+	received = 0;
+	for (i = 0; i < N_SESSIONS; i++)
+		received += g_atomic_int_get (&clients[i].received);
+	g_print ("  %u shard(s): %.0f messages/s\n", n_shards, received / elapsed);
+
+	/* Disconnects remaining sessions */
+	kfxmpp_shard_manager_unref (manager);
+	for (i = 0; i < N_SESSIONS; i++)
+		kfxmpp_session_unref (clients[i].session);
+	g_timer_destroy (timer);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	struct rlimit limit;
+	gchar *address;
+	glong cpus;
+	guint n;
+	gint i;
+
+	kfxmpp_init ();
+
+	/* Two descriptors per session, one on each side */
+	getrlimit (RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit (RLIMIT_NOFILE, &limit);
+	if (limit.rlim_cur < N_SESSIONS * 2 + 64) {
+		g_print ("Descriptor limit is %lu, too low\n", (gulong) limit.rlim_cur);
+		return 0;
+	}
+
+	/* Ports are per destination address, so spread connections */
+	for (i = 0; i < N_LISTENERS; i++) {
+		address = g_strdup_printf ("127.0.0.%d", 1 + i);
+		servers[i] = stand_in_server_new (address, STAND_IN_LEGACY);
+		g_free (address);
+	}
+
+	g_print ("Sessions: %d, %d messages each\n", N_SESSIONS, ROUNDS * BURST);
+	cpus = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+	for (n = 1; n <= (guint) cpus; n *= 2)
+		run (n);
+	if (n / 2 < (guint) cpus)
+		run (cpus);
+
+	for (i = 0; i < N_LISTENERS; i++)
+		stand_in_server_free (servers[i]);
+	kfxmpp_deinit ();
+
+	return 0;
+}
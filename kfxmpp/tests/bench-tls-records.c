@@ -0,0 +1,118 @@
+/*
+ * kfxmpp TLS record batching benchmark
+ * ------------------------------------
+ *
+ * Connects a session through STARTTLS to a stand-in server over loopback
+ * and sends short messages, a few per main loop iteration, with each TLS
+ * batching setting: a record per send, records sealed at end of every
+ * iteration (latency profile), and partial records waiting a millisecond
+ * for more data (throughput profile). An <iq/> answered by server marks
+ * the end of each run. Bytes server received on the wire, records sealed
+ * and client CPU time are reported per message.
+ *
+ * output:
+Messages: 20000, <n> bytes each, 10 per iteration
+  record per send: <n> wire bytes, <n> records, <n> us CPU per message
+  latency: <n> wire bytes, <n> records, <n> us CPU per message
+  throughput: <n> wire bytes, <n> records, <n> us CPU per message
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <string.h>
+#include <time.h>
+
+#include "stand-in-server.h"
+
+#define N_MESSAGES	20000
+#define PER_ITERATION	10
+
+#define MESSAGE "<message to='bot@localhost' type='chat'><body>Hello, how are you?</body></message>"
+
+static StandInServer *server;
+static gboolean done;		/* Whether server answered <iq/> sent after messages */
+
+
+static gboolean got_result (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	done = TRUE;
+	return FALSE;
+}
+
+
+static gdouble cpu_time (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+static void run (const gchar *name, gsize record_size, guint delay)
+{
+	KfxmppSession *session;
+	KfxmppEventHandler *handler;
+	KfxmppStanza *iq;
+	gdouble cpu;
+	gint i;
+
+	session = stand_in_session_new (server);
+	kfxmpp_session_set_tls_batching (session, record_size, delay);
+
+	done = FALSE;
+	if (! stand_in_session_connect (session)) {
+		g_print ("  %s: connection FAILED\n", name);
+		kfxmpp_session_unref (session);
+		return;
+	}
+
+	/* Let stream restart settle before counting */
+	while (g_main_context_iteration (NULL, FALSE))
+		;
+	g_usleep (10000);
+	stand_in_server_reset (server);
+
+	cpu = cpu_time ();
+	for (i = 0; i < N_MESSAGES; i++) {
+		kfxmpp_session_send_raw (session, MESSAGE, -1, NULL);
+		if (i % PER_ITERATION == PER_ITERATION - 1)
+			g_main_context_iteration (NULL, FALSE);
+	}
+
+	iq = kfxmpp_stanza_new (NULL, KFXMPP_STANZA_KLASS_IQ);
+	handler = kfxmpp_event_handler_new (got_result, NULL, NULL);
+	kfxmpp_session_send_await_response (session, iq, handler, NULL);
+	kfxmpp_event_handler_unref (handler);
+	kfxmpp_stanza_free (iq);
+	while (! done)
+		g_main_context_iteration (NULL, TRUE);
+	cpu = cpu_time () - cpu;
+
+	g_print ("  %s: %.1f wire bytes, %.3f records, %.2f us CPU per message\n", name,
+			(gdouble) stand_in_server_get_wire_bytes (server) / N_MESSAGES,
+			(gdouble) kfxmpp_session_get_tls_records (session) / N_MESSAGES,
+			cpu / N_MESSAGES);
+
+	kfxmpp_session_disconnect (session, NULL);
+	kfxmpp_session_unref (session);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	kfxmpp_init ();
+	server = stand_in_server_new (NULL, STAND_IN_STARTTLS);
+
+	g_print ("Messages: %d, %d bytes each, %d per iteration\n", N_MESSAGES,
+			(gint) strlen (MESSAGE), PER_ITERATION);
+	run ("record per send", 0, 0);
+	run ("latency", 16 * 1024, 0);
+	run ("throughput", 16 * 1024, 1);
+
+	stand_in_server_free (server);
+	kfxmpp_deinit ();
+
+	return 0;
+}
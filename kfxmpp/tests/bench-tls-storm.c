@@ -0,0 +1,228 @@
+/*
+ * kfxmpp TLS connect storm benchmark
+ * ----------------------------------
+ *
+ * Keeps sessions open on one thread, pinging stand-in server all the time,
+ * while a storm of new sessions connects through STARTTLS on the same
+ * thread. Once with handshakes run in place, once with a crypto pool.
+ * Time until every new session is connected is reported, and 99th
+ * percentile of round trip times open sessions saw meanwhile. With a pool,
+ * handshakes should no longer stall open sessions, and storm should pass
+ * sooner on a machine with spare cores.
+ *
+ * Stand-in server offers STARTTLS with a self-signed certificate made at
+ * start, then speaks legacy Jabber to let sessions authenticate.
+ *
+ * output:
+Sessions: 100 open, 1000 connecting
+  no pool: all connected in <n> ms, p99 RTT <n> ms
+  pool of <n> threads: all connected in <n> ms, p99 RTT <n> ms
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <string.h>
+#include <sys/resource.h>
+
+#include "stand-in-server.h"
+
+#define N_LISTENERS	4	/* Server threads, each with its own address */
+#define N_OPEN		100
+#define N_STORM		1000
+#define PING_INTERVAL	10	/* Milliseconds */
+
+#define CLIENT_PING "<iq type='get' id='ping'/>"
+
+static StandInServer *servers[N_LISTENERS];
+
+/* Client side, all on main thread */
+typedef struct {
+	KfxmppSession *session;
+	gint connected;		/* 1 connected, -1 failed */
+	gdouble ping_sent;	/* Time of ping waiting for result, 0 if none */
+} Client;
+
+static Client open_clients[N_OPEN];
+static Client storm_clients[N_STORM];
+static GTimer *clock_timer;
+static GArray *rtts;		/* Round trip times during storm, in ms */
+static gboolean measuring;
+
+
+/***********************************************************************
+ *
+ * Client side
+ *
+ */
+
+static gboolean got_xml (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	Client *client = data;
+	gdouble rtt;
+
+	/* Once connected, every <iq/> is a result of a ping */
+	if (client->connected != 1 || client->ping_sent == 0)
+		return FALSE;
+
+	rtt = (g_timer_elapsed (clock_timer, NULL) - client->ping_sent) * 1000;
+	client->ping_sent = 0;
+	if (measuring)
+		g_array_append_val (rtts, rtt);
+	return FALSE;
+}
+
+
+static gboolean ping (gpointer data)
+{
+	gint i;
+
+	for (i = 0; i < N_OPEN; i++) {
+		Client *client = &open_clients[i];
+
+		if (client->connected != 1 || client->ping_sent != 0)
+			continue;
+		client->ping_sent = g_timer_elapsed (clock_timer, NULL);
+		kfxmpp_session_send_raw (client->session, CLIENT_PING, strlen (CLIENT_PING), NULL);
+	}
+	return TRUE;
+}
+
+
+static void start (Client *client, gint i, KfxmppCryptoPool *pool)
+{
+	KfxmppEventHandler *handler;
+
+	memset (client, 0, sizeof (Client));
+	client->session = stand_in_session_new (servers[i % N_LISTENERS]);
+	kfxmpp_session_set_crypto_pool (client->session, pool);
+
+	handler = kfxmpp_event_handler_new (got_xml, client, NULL);
+	kfxmpp_session_add_handler (client->session, KFXMPP_EVENT_TYPE_XML, handler,
+			KFXMPP_EVENT_HANDLER_PRIORITY_NORMAL);
+	kfxmpp_event_handler_unref (handler);
+
+	kfxmpp_session_connect (client->session, stand_in_connected, &client->connected, NULL);
+}
+
+
+static gint count_done (Client *clients, gint n)
+{
+	gint i, done = 0;
+
+	for (i = 0; i < n; i++)
+		if (clients[i].connected != 0)
+			done++;
+	return done;
+}
+
+
+static void stop (Client *clients, gint n)
+{
+	gint i;
+
+	for (i = 0; i < n; i++) {
+		kfxmpp_session_disconnect (clients[i].session, NULL);
+		kfxmpp_session_unref (clients[i].session);
+	}
+}
+
+
+static gint compare_rtt (gconstpointer a, gconstpointer b)
+{
+	gdouble x = *(const gdouble *) a, y = *(const gdouble *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static void run (KfxmppCryptoPool *pool)
+{
+	GTimer *timer;
+	guint source;
+	gdouble elapsed, p99;
+	gint i, failed;
+
+	rtts = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+	/* Open sessions are not part of the storm */
+	for (i = 0; i < N_OPEN; i++)
+		start (&open_clients[i], i, pool);
+	while (count_done (open_clients, N_OPEN) < N_OPEN)
+		g_main_context_iteration (NULL, TRUE);
+	source = g_timeout_add (PING_INTERVAL, ping, NULL);
+
+	measuring = TRUE;
+	timer = g_timer_new ();
+	for (i = 0; i < N_STORM; i++)
+		start (&storm_clients[i], i, pool);
+	while (count_done (storm_clients, N_STORM) < N_STORM)
+		g_main_context_iteration (NULL, TRUE);
+	elapsed = g_timer_elapsed (timer, NULL);
+	measuring = FALSE;
+	g_source_remove (source);
+
+	failed = 0;
+	for (i = 0; i < N_STORM; i++)
+		if (storm_clients[i].connected < 0)
+			failed++;
+
+	g_array_sort (rtts, compare_rtt);
+	p99 = rtts->len ? g_array_index (rtts, gdouble, rtts->len * 99 / 100) : 0;
+
+	if (pool)
+		g_print ("  pool of %u threads:", kfxmpp_crypto_pool_get_max_threads (pool));
+	else
+		g_print ("  no pool:");
+	g_print (" all connected in %.0f ms, p99 RTT %.1f ms", elapsed * 1000, p99);
+	if (failed)
+		g_print (" (%d failed)", failed);
+	g_print ("\n");
+
+	stop (storm_clients, N_STORM);
+	stop (open_clients, N_OPEN);
+	g_array_free (rtts, TRUE);
+	g_timer_destroy (timer);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	KfxmppCryptoPool *pool;
+	struct rlimit limit;
+	gchar *address;
+	gint i;
+
+	kfxmpp_init ();
+
+	/* Two descriptors per session, one on each side */
+	getrlimit (RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit (RLIMIT_NOFILE, &limit);
+	if (limit.rlim_cur < (N_OPEN + N_STORM) * 2 + 64) {
+		g_print ("Descriptor limit is %lu, too low\n", (gulong) limit.rlim_cur);
+		return 0;
+	}
+
+	/* Ports are per destination address, so spread connections */
+	for (i = 0; i < N_LISTENERS; i++) {
+		address = g_strdup_printf ("127.0.0.%d", 1 + i);
+		servers[i] = stand_in_server_new (address, STAND_IN_STARTTLS);
+		g_free (address);
+	}
+	clock_timer = g_timer_new ();
+
+	g_print ("Sessions: %d open, %d connecting\n", N_OPEN, N_STORM);
+	run (NULL);
+
+	pool = kfxmpp_crypto_pool_new (0);
+	run (pool);
+	kfxmpp_crypto_pool_unref (pool);
+
+	for (i = 0; i < N_LISTENERS; i++)
+		stand_in_server_free (servers[i]);
+	g_timer_destroy (clock_timer);
+	kfxmpp_deinit ();
+
+	return 0;
+}
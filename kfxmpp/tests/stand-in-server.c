@@ -0,0 +1,927 @@
+/*
+ * kfxmpp stand-in server
+ * ----------------------
+ *
+ * See stand-in-server.h. Connections are handled with epoll on server's
+ * own thread. Server writes block until socket takes everything, so
+ * bursts larger than socket buffer go out while client reads them.
+ */
+
+#include "stand-in-server.h"
+
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MAX_EVENTS	256
+
+#define SERVER_STREAM "<?xml version='1.0'?><stream:stream xmlns='jabber:client' " \
+		"xmlns:stream='http://etherx.jabber.org/streams' id='stand-in' from='localhost'>"
+#define SERVER_XMPP_STREAM "<?xml version='1.0'?><stream:stream xmlns='jabber:client' " \
+		"xmlns:stream='http://etherx.jabber.org/streams' id='stand-in' from='localhost' version='1.0'>"
+#define SERVER_STARTTLS "<starttls xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>"
+#define SERVER_PROCEED "<proceed xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>"
+#define SERVER_SASL "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><mechanism>PLAIN</mechanism></mechanisms>"
+#define SERVER_SUCCESS "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>"
+#define SERVER_COMPRESSION "<compression xmlns='http://jabber.org/features/compress'><method>zlib</method></compression>"
+#define SERVER_COMPRESSED "<compressed xmlns='http://jabber.org/protocol/compress'/>"
+#define SERVER_COMPRESS_FAILURE "<failure xmlns='http://jabber.org/protocol/compress'><setup-failed/></failure>"
+#define SERVER_BIND "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+
+typedef enum {
+	CONN_HEADER,		/* Waiting for stream header */
+	CONN_STARTTLS,		/* Waiting for <starttls/> */
+	CONN_HANDSHAKE,
+	CONN_AUTH,		/* Waiting for <auth/> */
+	CONN_OPEN		/* Answering <iq/>, counting messages */
+} ConnState;
+
+typedef struct {
+	StandInServer *server;
+	gint fd;
+	GString *in;		/* Data received and not scanned yet */
+	ConnState state;
+	gnutls_session_t tls;	/* NULL until TLS starts */
+	z_stream *inflater;	/* NULL until stream is compressed */
+	z_stream *deflater;
+	gboolean authenticated;	/* Whether SASL succeeded */
+	gboolean bound;		/* Whether first <iq/> after SASL was answered */
+	gint flights;		/* Flights of data received from client */
+	gboolean answered;	/* Whether server sent something since last flight */
+} Conn;
+
+typedef struct {
+	GString *data;		/* NULL to stop server */
+	guint count;		/* Times data is sent, each with a write of its own */
+	gboolean raw;		/* Whether data bypasses TLS and compression */
+} Command;
+
+struct _StandInServer {
+	StandInFlags flags;
+	gchar *address;
+	gint listener;
+	gint port;
+	gint control[2];	/* Wakes server up when a command is queued */
+	GAsyncQueue *commands;
+	GThread *thread;
+	gnutls_certificate_credentials_t cred;
+	guint round_trip;	/* Milliseconds each flight waits */
+
+	/* Reported by server thread */
+	GMutex *lock;		/* Protects alpn */
+	gchar alpn[32];
+	gint auth_flights;
+	gint bind_flights;
+	gint syn_data;
+	gint wire_bytes;	/* Received after stream was open (atomic) */
+	gint messages;		/* Received after stream was open (atomic) */
+	gint stream_ends;	/* Streams clients closed (atomic) */
+};
+
+
+/***********************************************************************
+ *
+ * Connections
+ *
+ */
+
+/**
+ * Write all of data, waiting for socket buffer to drain when needed
+ **/
+static gssize server_push (gnutls_transport_ptr_t p, const void *data, size_t size)
+{
+	Conn *conn = p;
+	gsize done = 0;
+	gssize ret;
+
+	conn->answered = TRUE;
+	while (done < size) {
+		ret = send (conn->fd, (const gchar *) data + done, size - done, MSG_NOSIGNAL);
+		if (ret > 0) {
+			done += ret;
+		} else if (ret < 0 && errno == EAGAIN) {
+			struct pollfd pfd;
+
+			pfd.fd = conn->fd;
+			pfd.events = POLLOUT;
+			poll (&pfd, 1, -1);
+		} else if (ret < 0 && errno != EINTR) {
+			return done > 0 ? (gssize) done : -1;
+		}
+	}
+	return done;
+}
+
+
+static gssize server_pull (gnutls_transport_ptr_t p, void *data, size_t size)
+{
+	Conn *conn = p;
+	gssize ret;
+
+	ret = recv (conn->fd, data, size, 0);
+	if (ret > 0 && conn->state == CONN_OPEN)
+		g_atomic_int_add (&conn->server->wire_bytes, ret);
+	return ret;
+}
+
+
+static void server_transmit (Conn *conn, const gchar *data, gsize size)
+{
+	gssize ret;
+
+	if (conn->tls == NULL) {
+		server_push (conn, data, size);
+		return;
+	}
+
+	/* A record at a time */
+	while (size > 0) {
+		ret = gnutls_record_send (conn->tls, data, size);
+		if (ret < 0 && gnutls_error_is_fatal (ret))
+			return;
+		if (ret > 0) {
+			data += ret;
+			size -= ret;
+		}
+	}
+}
+
+
+static void server_send (Conn *conn, const gchar *data, gsize size)
+{
+	gchar out[16384];
+
+	if (conn->deflater == NULL) {
+		server_transmit (conn, data, size);
+		return;
+	}
+
+	conn->deflater->next_in = (Bytef *) data;
+	conn->deflater->avail_in = size;
+	do {
+		conn->deflater->next_out = (Bytef *) out;
+		conn->deflater->avail_out = sizeof (out);
+		deflate (conn->deflater, Z_SYNC_FLUSH);
+		server_transmit (conn, out, sizeof (out) - conn->deflater->avail_out);
+	} while (conn->deflater->avail_out == 0);
+}
+
+
+static void server_reply (Conn *conn, const gchar *data)
+{
+	server_send (conn, data, strlen (data));
+}
+
+
+static void server_start_tls (Conn *conn)
+{
+	gnutls_datum_t protocol = { (guchar *) "xmpp-client", 11 };
+
+	/* Tickets would be one more flight to client */
+	gnutls_init (&conn->tls, GNUTLS_SERVER | GNUTLS_NONBLOCK | GNUTLS_NO_TICKETS);
+	gnutls_set_default_priority (conn->tls);
+	gnutls_credentials_set (conn->tls, GNUTLS_CRD_CERTIFICATE, conn->server->cred);
+	if (conn->server->flags & STAND_IN_DIRECT_TLS)
+		gnutls_alpn_set_protocols (conn->tls, &protocol, 1, 0);
+	gnutls_transport_set_ptr (conn->tls, conn);
+	gnutls_transport_set_push_function (conn->tls, server_push);
+	gnutls_transport_set_pull_function (conn->tls, server_pull);
+	conn->state = CONN_HANDSHAKE;
+}
+
+
+static void server_start_compression (Conn *conn)
+{
+	conn->inflater = g_new0 (z_stream, 1);
+	inflateInit (conn->inflater);
+	conn->deflater = g_new0 (z_stream, 1);
+	deflateInit (conn->deflater, Z_DEFAULT_COMPRESSION);
+}
+
+
+/**
+ * Answer stream header according to how far client got
+ **/
+static void server_open_stream (Conn *conn)
+{
+	StandInFlags flags = conn->server->flags;
+	GString *reply;
+
+	if (! (flags & STAND_IN_XMPP) && ! ((flags & STAND_IN_STARTTLS) && conn->tls == NULL)) {
+		server_reply (conn, SERVER_STREAM);
+		conn->state = CONN_OPEN;
+		return;
+	}
+
+	reply = g_string_new (SERVER_XMPP_STREAM "<stream:features>");
+	if ((flags & STAND_IN_STARTTLS) && conn->tls == NULL) {
+		g_string_append (reply, SERVER_STARTTLS);
+		conn->state = CONN_STARTTLS;
+	} else if (! conn->authenticated) {
+		g_string_append (reply, SERVER_SASL);
+		conn->state = CONN_AUTH;
+	} else {
+		if ((flags & (STAND_IN_COMPRESSION | STAND_IN_REFUSE_COMPRESSION)) && conn->deflater == NULL)
+			g_string_append (reply, SERVER_COMPRESSION);
+		g_string_append (reply, SERVER_BIND);
+		conn->state = CONN_OPEN;
+	}
+	g_string_append (reply, "</stream:features>");
+
+	server_send (conn, reply->str, reply->len);
+	g_string_free (reply, TRUE);
+}
+
+
+/**
+ * Answer every <iq/> with a result and count messages
+ **/
+static void server_scan_open (Conn *conn)
+{
+	StandInServer *server = conn->server;
+	GString *in = conn->in;
+	gchar *p, *id, *end = NULL, *partial = NULL;
+	gchar *reply;
+	gsize done = 0;
+	gint n = 0;
+
+	if ((server->flags & (STAND_IN_COMPRESSION | STAND_IN_REFUSE_COMPRESSION)) &&
+			conn->deflater == NULL && strstr (in->str, "<compress ") != NULL) {
+		g_string_truncate (in, 0);
+		if (server->flags & STAND_IN_REFUSE_COMPRESSION) {
+			server_reply (conn, SERVER_COMPRESS_FAILURE);
+			return;
+		}
+		/* Everything after this goes through zlib */
+		server_reply (conn, SERVER_COMPRESSED);
+		server_start_compression (conn);
+		conn->state = CONN_HEADER;
+		return;
+	}
+
+	for (p = strstr (in->str, "</message>"); p; p = strstr (p, "</message>")) {
+		p += 10;
+		done = p - in->str;
+		n++;
+	}
+	if (n > 0)
+		g_atomic_int_add (&server->messages, n);
+
+	/* Nothing is answered after client closed stream */
+	if (strstr (in->str, "</stream:stream>") != NULL) {
+		g_atomic_int_inc (&server->stream_ends);
+		g_string_truncate (in, 0);
+		return;
+	}
+
+	for (p = strstr (in->str, "<iq"); p; p = strstr (end, "<iq")) {
+		id = strstr (p, " id=");
+		if (id == NULL || id[4] == '\0' || (end = strchr (id + 5, id[4])) == NULL) {
+			partial = p;
+			break;
+		}
+		if (conn->authenticated && ! conn->bound) {
+			conn->bound = TRUE;
+			g_atomic_int_set (&server->bind_flights, conn->flights);
+		}
+		reply = g_strdup_printf ("<iq type='result' id='%.*s'/>", (gint) (end - id - 5), id + 5);
+		server_reply (conn, reply);
+		g_free (reply);
+		done = MAX (done, (gsize) (end - in->str));
+	}
+
+	if (partial) {
+		g_string_erase (in, 0, partial - in->str);
+		return;
+	}
+	/* Keep what may be start of next <iq or </message> */
+	g_string_erase (in, 0, done);
+	p = strrchr (in->str, '<');
+	g_string_erase (in, 0, p ? p - in->str : (gssize) in->len);
+}
+
+
+/**
+ * Take client as far as data received allows
+ **/
+static void server_scan (Conn *conn)
+{
+	StandInServer *server = conn->server;
+	gchar *str = conn->in->str;
+	gchar *p, *end;
+
+	switch (conn->state) {
+		case CONN_HEADER:
+			p = strstr (str, "<stream:stream");
+			if (p == NULL || (end = strchr (p, '>')) == NULL)
+				return;
+			g_string_erase (conn->in, 0, end + 1 - str);
+			server_open_stream (conn);
+			/* Requests may have come along, e.g. pipelined binding */
+			if (conn->in->len > 0)
+				server_scan (conn);
+			break;
+		case CONN_STARTTLS:
+			if (strstr (str, "<starttls") == NULL)
+				return;
+			g_string_truncate (conn->in, 0);
+			server_reply (conn, SERVER_PROCEED);
+			server_start_tls (conn);
+			break;
+		case CONN_AUTH:
+			if (strstr (str, "</auth>") == NULL)
+				return;
+			g_string_truncate (conn->in, 0);
+			g_atomic_int_set (&server->auth_flights, conn->flights);
+			server_reply (conn, SERVER_SUCCESS);
+			conn->authenticated = TRUE;
+			conn->state = CONN_HEADER;
+			break;
+		case CONN_OPEN:
+			server_scan_open (conn);
+			break;
+		default:
+			break;
+	}
+}
+
+
+/**
+ * Take data received, decompressing it if needed, FALSE if it is corrupt
+ **/
+static gboolean server_receive (Conn *conn, const gchar *data, gsize size)
+{
+	gchar out[65536];
+	gint ret;
+
+	if (conn->inflater == NULL) {
+		g_string_append_len (conn->in, data, size);
+		server_scan (conn);
+		return TRUE;
+	}
+
+	conn->inflater->next_in = (Bytef *) data;
+	conn->inflater->avail_in = size;
+	do {
+		conn->inflater->next_out = (Bytef *) out;
+		conn->inflater->avail_out = sizeof (out);
+		ret = inflate (conn->inflater, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			return FALSE;
+		g_string_append_len (conn->in, out, sizeof (out) - conn->inflater->avail_out);
+	} while (conn->inflater->avail_in > 0 || conn->inflater->avail_out == 0);
+	server_scan (conn);
+
+	return TRUE;
+}
+
+
+/**
+ * Read whatever connection has, FALSE when it is gone
+ **/
+static gboolean server_read (Conn *conn)
+{
+	StandInServer *server = conn->server;
+	gchar buffer[16384];
+	gssize size;
+	gint ret;
+
+	/* Each flight waits out its round trip */
+	if (conn->answered) {
+		conn->answered = FALSE;
+		conn->flights++;
+		if (server->round_trip > 0)
+			g_usleep (server->round_trip * 1000);
+	}
+
+	if (conn->state == CONN_HANDSHAKE) {
+		gnutls_datum_t protocol;
+
+		ret = gnutls_handshake (conn->tls);
+		if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+			return TRUE;
+		if (ret < 0)
+			return FALSE;
+		conn->state = CONN_HEADER;
+
+		if (gnutls_alpn_get_selected_protocol (conn->tls, &protocol) == 0) {
+			g_mutex_lock (server->lock);
+			g_snprintf (server->alpn, sizeof (server->alpn), "%.*s",
+					(gint) protocol.size, protocol.data);
+			g_mutex_unlock (server->lock);
+		}
+	}
+
+	for (;;) {
+		if (conn->tls == NULL) {
+			size = server_pull (conn, buffer, sizeof (buffer));
+			if (size < 0 && (errno == EAGAIN || errno == EINTR))
+				return TRUE;
+		} else {
+			size = gnutls_record_recv (conn->tls, buffer, sizeof (buffer));
+			if (size == GNUTLS_E_AGAIN || size == GNUTLS_E_INTERRUPTED)
+				return TRUE;
+		}
+		if (size <= 0)
+			return FALSE;
+
+		if (! server_receive (conn, buffer, size))
+			return FALSE;
+		/* Handshake data is for next wakeup */
+		if (conn->state == CONN_HANDSHAKE)
+			return TRUE;
+	}
+}
+
+
+static void server_accept (StandInServer *server, gint ep, GHashTable *conns)
+{
+	struct epoll_event event;
+	struct tcp_info info;
+	socklen_t len;
+	gint fd;
+
+	while ((fd = accept (server->listener, NULL, NULL)) >= 0) {
+		Conn *conn = g_new0 (Conn, 1);
+
+		conn->server = server;
+		conn->fd = fd;
+		conn->in = g_string_new (NULL);
+		/* Client speaks first */
+		conn->answered = TRUE;
+		fcntl (fd, F_SETFL, O_NONBLOCK);
+
+		/* Stream header may have come with SYN */
+		len = sizeof (info);
+		if ((server->flags & STAND_IN_FAST_OPEN) &&
+				getsockopt (fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+				(info.tcpi_options & TCPI_OPT_SYN_DATA))
+			g_atomic_int_set (&server->syn_data, 1);
+
+		if (server->flags & STAND_IN_DIRECT_TLS)
+			server_start_tls (conn);
+
+		event.events = EPOLLIN;
+		event.data.ptr = conn;
+		epoll_ctl (ep, EPOLL_CTL_ADD, fd, &event);
+		g_hash_table_insert (conns, conn, conn);
+	}
+}
+
+
+static void server_close (gpointer data)
+{
+	Conn *conn = data;
+
+	if (conn->tls)
+		gnutls_deinit (conn->tls);
+	if (conn->inflater) {
+		inflateEnd (conn->inflater);
+		deflateEnd (conn->deflater);
+		g_free (conn->inflater);
+		g_free (conn->deflater);
+	}
+	close (conn->fd);
+	g_string_free (conn->in, TRUE);
+	g_free (conn);
+}
+
+
+static void server_run_command (gpointer key, gpointer value, gpointer data)
+{
+	Conn *conn = value;
+	Command *command = data;
+	guint i;
+
+	if (conn->state != CONN_OPEN)
+		return;
+	for (i = 0; i < command->count; i++) {
+		if (command->raw)
+			server_push (conn, command->data->str, command->data->len);
+		else
+			server_send (conn, command->data->str, command->data->len);
+	}
+}
+
+
+static gpointer server_thread (gpointer data)
+{
+	StandInServer *server = data;
+	GHashTable *conns;
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event event;
+	gint ep, n, i;
+
+	ep = epoll_create (MAX_EVENTS);
+	conns = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, server_close);
+
+	event.events = EPOLLIN;
+	event.data.ptr = &server->listener;
+	epoll_ctl (ep, EPOLL_CTL_ADD, server->listener, &event);
+	event.events = EPOLLIN;
+	event.data.ptr = &server->control[0];
+	epoll_ctl (ep, EPOLL_CTL_ADD, server->control[0], &event);
+
+	for (;;) {
+		n = epoll_wait (ep, events, MAX_EVENTS, -1);
+		for (i = 0; i < n; i++) {
+			gpointer ptr = events[i].data.ptr;
+
+			if (ptr == &server->control[0]) {
+				Command *command;
+				gchar c;
+
+				if (read (server->control[0], &c, 1) != 1)
+					continue;
+				command = g_async_queue_pop (server->commands);
+				if (command->data == NULL) {
+					g_free (command);
+					goto done;
+				}
+				g_hash_table_foreach (conns, server_run_command, command);
+				g_string_free (command->data, TRUE);
+				g_free (command);
+			} else if (ptr == &server->listener) {
+				server_accept (server, ep, conns);
+			} else if (! server_read (ptr)) {
+				/* Closing descriptor removes it from epoll */
+				g_hash_table_remove (conns, ptr);
+			}
+		}
+	}
+
+done:
+	g_hash_table_destroy (conns);
+	close (ep);
+	return NULL;
+}
+
+
+/***********************************************************************
+ *
+ * Server
+ *
+ */
+
+static void make_credentials (StandInServer *server)
+{
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	guchar serial = 1;
+	time_t now = time (NULL);
+
+	gnutls_x509_privkey_init (&key);
+	gnutls_x509_privkey_generate (key, GNUTLS_PK_ECDSA,
+			GNUTLS_CURVE_TO_BITS (GNUTLS_ECC_CURVE_SECP256R1), 0);
+
+	gnutls_x509_crt_init (&crt);
+	gnutls_x509_crt_set_version (crt, 3);
+	gnutls_x509_crt_set_serial (crt, &serial, 1);
+	gnutls_x509_crt_set_activation_time (crt, now - 3600);
+	gnutls_x509_crt_set_expiration_time (crt, now + 3600);
+	gnutls_x509_crt_set_dn_by_oid (crt, GNUTLS_OID_X520_COMMON_NAME, 0, "localhost", 9);
+	gnutls_x509_crt_set_key (crt, key);
+	gnutls_x509_crt_sign2 (crt, crt, key, GNUTLS_DIG_SHA256, 0);
+
+	gnutls_certificate_allocate_credentials (&server->cred);
+	gnutls_certificate_set_x509_key (server->cred, &crt, 1, key);
+
+	gnutls_x509_crt_deinit (crt);
+	gnutls_x509_privkey_deinit (key);
+}
+
+
+static void server_command (StandInServer *server, Command *command)
+{
+	g_async_queue_push (server->commands, command);
+	if (write (server->control[1], "c", 1) != 1)
+		g_warning ("Cannot wake stand-in server up");
+}
+
+
+/**
+ * \brief Start a stand-in server
+ * \param address Loopback address to listen on, NULL for 127.0.0.1
+ * \param flags What server speaks
+ * \return A new server, NULL if it could not listen
+ **/
+StandInServer *stand_in_server_new (const gchar *address, StandInFlags flags)
+{
+	StandInServer *server;
+	struct sockaddr_in addr;
+	socklen_t len;
+	gint queue = 16;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	if (address == NULL)
+		address = "127.0.0.1";
+	if (inet_aton (address, &addr.sin_addr) == 0)
+		return NULL;
+
+	server = g_new0 (StandInServer, 1);
+	server->flags = flags;
+	server->address = g_strdup (address);
+
+	server->listener = socket (AF_INET, SOCK_STREAM, 0);
+	if (bind (server->listener, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+		close (server->listener);
+		g_free (server->address);
+		g_free (server);
+		return NULL;
+	}
+	if (flags & STAND_IN_FAST_OPEN)
+		setsockopt (server->listener, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof (queue));
+	listen (server->listener, 4096);
+	fcntl (server->listener, F_SETFL, O_NONBLOCK);
+
+	len = sizeof (addr);
+	getsockname (server->listener, (struct sockaddr *) &addr, &len);
+	server->port = ntohs (addr.sin_port);
+
+	if (flags & (STAND_IN_STARTTLS | STAND_IN_DIRECT_TLS))
+		make_credentials (server);
+
+	server->lock = g_mutex_new ();
+	server->commands = g_async_queue_new ();
+	if (pipe (server->control) < 0)
+		g_error ("Cannot create stand-in server's control pipe");
+	server->thread = g_thread_create (server_thread, server, TRUE, NULL);
+
+	return server;
+}
+
+
+/**
+ * \brief Stop a stand-in server, closing all its connections
+ **/
+void stand_in_server_free (StandInServer *server)
+{
+	g_return_if_fail (server);
+
+	server_command (server, g_new0 (Command, 1));
+	g_thread_join (server->thread);
+
+	close (server->listener);
+	close (server->control[0]);
+	close (server->control[1]);
+	if (server->cred)
+		gnutls_certificate_free_credentials (server->cred);
+	g_async_queue_unref (server->commands);
+	g_mutex_free (server->lock);
+	g_free (server->address);
+	g_free (server);
+}
+
+
+const gchar *stand_in_server_get_address (StandInServer *server)
+{
+	g_return_val_if_fail (server, NULL);
+
+	return server->address;
+}
+
+
+gint stand_in_server_get_port (StandInServer *server)
+{
+	g_return_val_if_fail (server, -1);
+
+	return server->port;
+}
+
+
+/**
+ * \brief Delay each flight of data server receives by a simulated round trip
+ * \param server A server with no connections yet
+ * \param ms Round trip, in milliseconds; 0 for none (default)
+ **/
+void stand_in_server_set_round_trip (StandInServer *server, guint ms)
+{
+	g_return_if_fail (server);
+
+	server->round_trip = ms;
+}
+
+
+/**
+ * \brief Send data to every client with an open stream
+ * \param server A server
+ * \param data Stanzas
+ * \param count Times data is sent, each time with a write of its own,
+ * 	which is a TLS record of its own too when it fits in one
+ *
+ * Data is sent by server thread, after this returns.
+ **/
+void stand_in_server_push (StandInServer *server, const gchar *data, guint count)
+{
+	Command *command;
+
+	g_return_if_fail (server);
+	g_return_if_fail (data);
+
+	command = g_new0 (Command, 1);
+	command->data = g_string_new (data);
+	command->count = count;
+	server_command (server, command);
+}
+
+
+/**
+ * \brief Send bytes to every client with an open stream, bypassing TLS and
+ * compression
+ **/
+void stand_in_server_push_raw (StandInServer *server, const gchar *data)
+{
+	Command *command;
+
+	g_return_if_fail (server);
+	g_return_if_fail (data);
+
+	command = g_new0 (Command, 1);
+	command->data = g_string_new (data);
+	command->count = 1;
+	command->raw = TRUE;
+	server_command (server, command);
+}
+
+
+/**
+ * \brief Reset everything server reports
+ **/
+void stand_in_server_reset (StandInServer *server)
+{
+	g_return_if_fail (server);
+
+	g_mutex_lock (server->lock);
+	server->alpn[0] = '\0';
+	g_mutex_unlock (server->lock);
+	g_atomic_int_set (&server->auth_flights, 0);
+	g_atomic_int_set (&server->bind_flights, 0);
+	g_atomic_int_set (&server->syn_data, 0);
+	g_atomic_int_set (&server->wire_bytes, 0);
+	g_atomic_int_set (&server->messages, 0);
+	g_atomic_int_set (&server->stream_ends, 0);
+}
+
+
+/**
+ * \brief Get flights of data server received from last client before it
+ * sent SASL <success/>
+ **/
+gint stand_in_server_get_auth_flights (StandInServer *server)
+{
+	g_return_val_if_fail (server, 0);
+
+	return g_atomic_int_get (&server->auth_flights);
+}
+
+
+/**
+ * \brief Get flights of data server received from last client before it
+ * answered resource binding
+ **/
+gint stand_in_server_get_bind_flights (StandInServer *server)
+{
+	g_return_val_if_fail (server, 0);
+
+	return g_atomic_int_get (&server->bind_flights);
+}
+
+
+/**
+ * \brief Get whether a client sent data along with SYN
+ **/
+gboolean stand_in_server_get_syn_data (StandInServer *server)
+{
+	g_return_val_if_fail (server, FALSE);
+
+	return g_atomic_int_get (&server->syn_data) != 0;
+}
+
+
+/**
+ * \brief Get ALPN protocol last direct TLS client selected
+ * \return Newly allocated protocol name, NULL if there was none
+ **/
+gchar *stand_in_server_get_alpn (StandInServer *server)
+{
+	gchar *alpn;
+
+	g_return_val_if_fail (server, NULL);
+
+	g_mutex_lock (server->lock);
+	alpn = server->alpn[0] ? g_strdup (server->alpn) : NULL;
+	g_mutex_unlock (server->lock);
+
+	return alpn;
+}
+
+
+/**
+ * \brief Get bytes server received on the wire from clients with an open
+ * stream
+ **/
+gint stand_in_server_get_wire_bytes (StandInServer *server)
+{
+	g_return_val_if_fail (server, 0);
+
+	return g_atomic_int_get (&server->wire_bytes);
+}
+
+
+/**
+ * \brief Get messages server received from clients
+ **/
+gint stand_in_server_get_messages (StandInServer *server)
+{
+	g_return_val_if_fail (server, 0);
+
+	return g_atomic_int_get (&server->messages);
+}
+
+
+/**
+ * \brief Get number of streams clients closed with </stream:stream>
+ **/
+gint stand_in_server_get_stream_ends (StandInServer *server)
+{
+	g_return_val_if_fail (server, 0);
+
+	return g_atomic_int_get (&server->stream_ends);
+}
+
+
+/***********************************************************************
+ *
+ * Client side
+ *
+ */
+
+/**
+ * \brief Create a session set up for a stand-in server
+ **/
+KfxmppSession *stand_in_session_new (StandInServer *server)
+{
+	KfxmppSession *session;
+
+	g_return_val_if_fail (server, NULL);
+
+	session = kfxmpp_session_new ("localhost");
+	kfxmpp_session_set_host_address (session, server->address);
+	kfxmpp_session_set_port (session, server->port);
+	kfxmpp_session_set_username (session, "user");
+	kfxmpp_session_set_password (session, "secret");
+	kfxmpp_session_set_resource (session, "stand-in");
+
+	if (server->flags & STAND_IN_DIRECT_TLS)
+		kfxmpp_session_set_use_tls (session, KFXMPP_TLS_POLICY_DIRECT);
+	else if (server->flags & STAND_IN_STARTTLS)
+		kfxmpp_session_set_use_tls (session, KFXMPP_TLS_POLICY_ALWAYS);
+	else
+		kfxmpp_session_set_use_tls (session, KFXMPP_TLS_POLICY_NEVER);
+	/* Stand-in certificate is self-signed */
+	kfxmpp_session_set_verify_certificate (session, FALSE);
+
+	return session;
+}
+
+
+/**
+ * \brief Connect callback storing outcome in a gint given as its data,
+ * 1 when connected, -1 when connecting failed
+ **/
+void stand_in_connected (KfxmppSession *session, KfxmppError error, gpointer data)
+{
+	g_atomic_int_set ((gint *) data, error == KFXMPP_ERROR_NONE ? 1 : -1);
+}
+
+
+/**
+ * \brief Connect a session, iterating its main context until done
+ * \return TRUE when session is connected
+ **/
+gboolean stand_in_session_connect (KfxmppSession *session)
+{
+	GMainContext *context = kfxmpp_session_get_context (session);
+	gint connected = 0;
+
+	if (! kfxmpp_session_connect (session, stand_in_connected, &connected, NULL))
+		return FALSE;
+	while (g_atomic_int_get (&connected) == 0)
+		g_main_context_iteration (context, TRUE);
+
+	return connected > 0;
+}
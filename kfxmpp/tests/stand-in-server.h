@@ -0,0 +1,52 @@
+/*
+ * kfxmpp stand-in server
+ * ----------------------
+ *
+ * Server tests and benchmarks connect their sessions to. Each one listens
+ * on a loopback port and runs in a thread of its own, speaking just
+ * enough of legacy Jabber or XMPP to let sessions authenticate and bind,
+ * then answering every <iq/> with an empty result and counting messages.
+ * Flags choose STARTTLS, direct TLS, stream compression and TCP Fast Open.
+ */
+
+#ifndef __STAND_IN_SERVER_H__
+#define __STAND_IN_SERVER_H__
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+typedef enum {
+	STAND_IN_LEGACY			= 0,		/**< Legacy Jabber, sessions use iq-auth */
+	STAND_IN_XMPP			= 1 << 0,	/**< XMPP 1.0, SASL PLAIN and resource binding */
+	STAND_IN_STARTTLS		= 1 << 1,	/**< Offer STARTTLS, before legacy stream too */
+	STAND_IN_DIRECT_TLS		= 1 << 2,	/**< Start TLS right after accepting, with ALPN */
+	STAND_IN_COMPRESSION		= 1 << 3,	/**< Offer zlib compression after SASL */
+	STAND_IN_REFUSE_COMPRESSION	= 1 << 4,	/**< Offer it, then answer <failure/> */
+	STAND_IN_FAST_OPEN		= 1 << 5	/**< Accept data along with SYN */
+} StandInFlags;
+
+typedef struct _StandInServer StandInServer;
+
+StandInServer *stand_in_server_new (const gchar *address, StandInFlags flags);
+void stand_in_server_free (StandInServer *server);
+const gchar *stand_in_server_get_address (StandInServer *server);
+gint stand_in_server_get_port (StandInServer *server);
+void stand_in_server_set_round_trip (StandInServer *server, guint ms);
+
+void stand_in_server_push (StandInServer *server, const gchar *data, guint count);
+void stand_in_server_push_raw (StandInServer *server, const gchar *data);
+
+void stand_in_server_reset (StandInServer *server);
+gint stand_in_server_get_auth_flights (StandInServer *server);
+gint stand_in_server_get_bind_flights (StandInServer *server);
+gboolean stand_in_server_get_syn_data (StandInServer *server);
+gchar *stand_in_server_get_alpn (StandInServer *server);
+gint stand_in_server_get_wire_bytes (StandInServer *server);
+gint stand_in_server_get_messages (StandInServer *server);
+gint stand_in_server_get_stream_ends (StandInServer *server);
+
+KfxmppSession *stand_in_session_new (StandInServer *server);
+void stand_in_connected (KfxmppSession *session, KfxmppError error, gpointer data);
+gboolean stand_in_session_connect (KfxmppSession *session);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * kfxmpp presence coalescer test
+ * ------------------------------
+ *
+ * output:
+Delivered <presence from='a@example.com/home'> (away)
+Message from a@example.com/home passed through
+Subscription from c@example.com passed through
+Delivered <presence from='b@example.com/work'> (unavailable)
+Pending: 0, collapsed: 4, delivered: 2
+Delivered <presence from='d@example.com'> (dnd)
+Window moved to another context, pending: 0
+ */
+
+#include <glib.h>
+#include <libxml/tree.h>
+#include <kfxmpp/kfxmpp.h>
+#include <kfxmpp/coalescer.h>
+
+static void delivered (KfxmppPresenceCoalescer *c, xmlNodePtr node, gpointer data);
+
+static xmlNodePtr presence (const gchar *from, const gchar *type, const gchar *show)
+{
+	xmlNodePtr node;
+
+	node = xmlNewNode (NULL, BAD_CAST "presence");
+	xmlSetProp (node, BAD_CAST "from", BAD_CAST from);
+	if (type)
+		xmlSetProp (node, BAD_CAST "type", BAD_CAST type);
+	if (show)
+		xmlNewTextChild (node, NULL, BAD_CAST "show", BAD_CAST show);
+	return node;
+}
+
+
+static void push (KfxmppPresenceCoalescer *c, xmlNodePtr node, const gchar *what)
+{
+	if (! kfxmpp_presence_coalescer_push (c, node))
+		g_print ("%s passed through\n", what);
+	xmlFreeNode (node);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	KfxmppPresenceCoalescer *c;
+	GMainContext *context;
+	xmlNodePtr msg;
+	gint i;
+
+	c = kfxmpp_presence_coalescer_new (delivered, NULL);
+
+	push (c, presence ("a@example.com/home", NULL, "chat"), "Presence");
+	push (c, presence ("b@example.com/work", NULL, "dnd"), "Presence");
+	push (c, presence ("a@example.com/home", NULL, "xa"), "Presence");
+	push (c, presence ("b@example.com/work", NULL, "xa"), "Presence");
+	push (c, presence ("a@example.com/home", NULL, "away"), "Presence");
+
+	/* Message from a@example.com/home flushes its presence first */
+	msg = xmlNewNode (NULL, BAD_CAST "message");
+	xmlSetProp (msg, BAD_CAST "from", BAD_CAST "a@example.com/home");
+	push (c, msg, "Message from a@example.com/home");
+
+	push (c, presence ("b@example.com/work", "unavailable", NULL), "Presence");
+	push (c, presence ("c@example.com", "subscribe", NULL), "Subscription from c@example.com");
+
+	kfxmpp_presence_coalescer_flush (c);
+
+	g_print ("Pending: %u, collapsed: %u, delivered: %u\n",
+			kfxmpp_presence_coalescer_get_pending (c),
+			kfxmpp_presence_coalescer_get_collapsed (c),
+			kfxmpp_presence_coalescer_get_delivered (c));
+
+	/* Held presence follows window to a new context */
+	context = g_main_context_new ();
+	kfxmpp_presence_coalescer_set_window (c, 10, NULL);
+	push (c, presence ("d@example.com", NULL, "dnd"), "Presence");
+	kfxmpp_presence_coalescer_set_window (c, 10, context);
+	for (i = 0; i < 1000 && kfxmpp_presence_coalescer_get_pending (c) > 0; i++)
+		if (! g_main_context_iteration (context, FALSE))
+			g_usleep (1000);
+	g_print ("Window moved to another context, pending: %u\n",
+			kfxmpp_presence_coalescer_get_pending (c));
+
+	kfxmpp_presence_coalescer_free (c);
+	g_main_context_unref (context);
+	return 0;
+}
+
+
+static void delivered (KfxmppPresenceCoalescer *c, xmlNodePtr node, gpointer data)
+{
+	xmlChar *from = xmlGetProp (node, BAD_CAST "from");
+	xmlChar *type = xmlGetProp (node, BAD_CAST "type");
+	xmlChar *show = node->children ? xmlNodeGetContent (node->children) : NULL;
+
+	g_print ("Delivered <presence from='%s'> (%s)\n", from, type ? type : show);
+
+	xmlFree (from);
+	xmlFree (type);
+	xmlFree (show);
+}
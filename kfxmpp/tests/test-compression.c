@@ -0,0 +1,167 @@
+/*
+ * kfxmpp stream compression test
+ * ------------------------------
+ *
+ * Connects a session to a stand-in server offering zlib compression after
+ * authentication, once for each of a few level and window settings. Each
+ * time, session has to negotiate compression and bind on the compressed
+ * stream, then messages go both ways through compressor and decompressor:
+ * server must count every message session sent, session must get the one
+ * server sent, and both directions have to take fewer bytes than they
+ * carry. Then server sends bytes no decompressor accepts, and session
+ * must drop connection.
+ *
+ * Last, a server that answers <failure/> to compression request lets
+ * session bind on the uncompressed stream.
+ *
+ * output:
+level 1, window 9: compressed: yes, sent 10 message(s) in fewer bytes: yes, received 1 message(s) in fewer bytes: yes, corrupt input: disconnected
+level 6, window 12: compressed: yes, sent 10 message(s) in fewer bytes: yes, received 1 message(s) in fewer bytes: yes, corrupt input: disconnected
+level 9, window 15: compressed: yes, sent 10 message(s) in fewer bytes: yes, received 1 message(s) in fewer bytes: yes, corrupt input: disconnected
+refused: connect: OK, compressed: no, bound: yes
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <string.h>
+
+#include "stand-in-server.h"
+
+#define N_MESSAGES	10
+#define BODY_SIZE	2000
+
+/* No valid deflate block starts with these */
+#define CORRUPT	"\xff\xff\xff\xff"
+
+static gint received = 0;
+static gint disconnected = 0;
+
+
+static gboolean got_message (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	received++;
+	return FALSE;
+}
+
+
+static void lost (KfxmppSession *session, KfxmppSessionDisconnectStatus status, gpointer data)
+{
+	disconnected++;
+}
+
+
+static void iterate (gint times)
+{
+	while (times-- > 0)
+		if (! g_main_context_iteration (NULL, FALSE))
+			g_usleep (1000);
+}
+
+
+static gboolean run (StandInServer *server, gint level, gint window, const gchar *message)
+{
+	KfxmppSession *session;
+	KfxmppEventHandler *handler;
+	gsize sent, sent_compressed, got, got_compressed;
+	gint i;
+
+	session = stand_in_session_new (server);
+	kfxmpp_session_set_compression (session, level, window);
+	kfxmpp_session_set_disconnect_callback (session, lost, NULL);
+	handler = kfxmpp_event_handler_new (got_message, NULL, NULL);
+	kfxmpp_session_add_handler (session, KFXMPP_EVENT_TYPE_MESSAGE, handler,
+			KFXMPP_EVENT_HANDLER_PRIORITY_NORMAL);
+	kfxmpp_event_handler_unref (handler);
+
+	stand_in_server_reset (server);
+	received = disconnected = 0;
+	if (! stand_in_session_connect (session)) {
+		g_print ("level %d, window %d: connection FAILED\n", level, window);
+		kfxmpp_session_unref (session);
+		return FALSE;
+	}
+	g_print ("level %d, window %d: compressed: %s", level, window,
+			kfxmpp_session_get_compressed (session) ? "yes" : "no");
+
+	/* Client to server */
+	for (i = 0; i < N_MESSAGES; i++)
+		kfxmpp_session_send_raw (session, message, strlen (message), NULL);
+	for (i = 0; i < 1000 && stand_in_server_get_messages (server) < N_MESSAGES; i++)
+		iterate (1);
+	kfxmpp_session_get_compression_stats (session, &sent, &sent_compressed, NULL, NULL);
+	g_print (", sent %d message(s) in fewer bytes: %s", stand_in_server_get_messages (server),
+			sent_compressed > 0 && sent_compressed < sent ? "yes" : "no");
+
+	/* Server to client */
+	stand_in_server_push (server, message, 1);
+	for (i = 0; i < 1000 && received < 1; i++)
+		iterate (1);
+	kfxmpp_session_get_compression_stats (session, NULL, NULL, &got, &got_compressed);
+	g_print (", received %d message(s) in fewer bytes: %s", received,
+			got_compressed > 0 && got_compressed < got ? "yes" : "no");
+
+	/* Garbage where compressed stream should go on */
+	stand_in_server_push_raw (server, CORRUPT);
+	for (i = 0; i < 1000 && disconnected == 0; i++)
+		iterate (1);
+	g_print (", corrupt input: %s\n", disconnected > 0 &&
+			! kfxmpp_session_get_compressed (session) ? "disconnected" : "ignored");
+
+	kfxmpp_session_unref (session);
+
+	return stand_in_server_get_messages (server) == N_MESSAGES && received == 1 && disconnected > 0;
+}
+
+
+static gboolean run_refused (StandInServer *server)
+{
+	KfxmppSession *session;
+	gboolean connected;
+
+	session = stand_in_session_new (server);
+	kfxmpp_session_set_compression (session, 6, 15);
+
+	stand_in_server_reset (server);
+	connected = stand_in_session_connect (session);
+	g_print ("refused: connect: %s, compressed: %s, bound: %s\n",
+			connected ? "OK" : "FAILED",
+			kfxmpp_session_get_compressed (session) ? "yes" : "no",
+			stand_in_server_get_bind_flights (server) > 0 ? "yes" : "no");
+
+	if (connected)
+		kfxmpp_session_disconnect (session, NULL);
+	kfxmpp_session_unref (session);
+
+	return connected && stand_in_server_get_bind_flights (server) > 0;
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	StandInServer *server;
+	gchar *body, *message;
+	gboolean ok;
+
+	kfxmpp_init ();
+
+	/* Repetitive enough to compress well at any setting */
+	body = g_strnfill (BODY_SIZE, 'z');
+	message = g_strdup_printf ("<message from='bot@localhost' to='user@localhost'><body>%s</body></message>", body);
+	g_free (body);
+
+	server = stand_in_server_new (NULL, STAND_IN_XMPP | STAND_IN_COMPRESSION);
+	ok = run (server, 1, 9, message);
+	ok = run (server, 6, 12, message) && ok;
+	ok = run (server, 9, 15, message) && ok;
+	stand_in_server_free (server);
+
+	server = stand_in_server_new (NULL, STAND_IN_XMPP | STAND_IN_REFUSE_COMPRESSION);
+	ok = run_refused (server) && ok;
+	stand_in_server_free (server);
+
+	g_free (message);
+	kfxmpp_deinit ();
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,117 @@
+/*
+ * kfxmpp deferred handler test
+ * ----------------------------
+ *
+ * First handler defers its decision and resolves it from another thread,
+ * which reads event data from the copy token keeps pinned. Event is first
+ * resolved as unhandled, so dispatch continues with lower priority
+ * handlers; second trigger is resolved as handled and stops.
+ *
+ * output:
+Trigger "first": returned 1, 1 pending
+Lookup "first"
+Lookup "first" resolved, handled = 0
+Fallback "first"
+Trigger "second": returned 1, 1 pending
+Lookup "second"
+Lookup "second" resolved, handled = 1
+Pinned data released 2 time(s), 0 pending
+ */
+
+#include <glib.h>
+#include <kfxmpp/event.h>
+
+static GMainLoop *loop;
+static gint released = 0;
+
+
+static gpointer lookup_thread (gpointer data)
+{
+	KfxmppEventToken *token = data;
+	const gchar *name;
+	gboolean handled;
+
+	/* Waits for handler to return, trigger's copy is gone by then */
+	name = kfxmpp_event_token_get_data (token);
+
+	/* Pretend to do something slow */
+	g_usleep (10000);
+	g_print ("Lookup \"%s\"\n", name);
+
+	handled = (g_str_equal (name, "second"));
+	g_print ("Lookup \"%s\" resolved, handled = %d\n", name, handled);
+	kfxmpp_event_token_resolve (token, handled);
+
+	return NULL;
+}
+
+
+static gboolean lookup_handler (KfxmppEventHandler *h, gpointer source, gpointer event, gpointer data)
+{
+	g_thread_create (lookup_thread, kfxmpp_event_defer (), FALSE, NULL);
+
+	return KFXMPP_EVENT_PENDING;
+}
+
+
+static gboolean fallback_handler (KfxmppEventHandler *h, gpointer source, gpointer event, gpointer data)
+{
+	g_print ("Fallback \"%s\"\n", (gchar *) event);
+	return TRUE;
+}
+
+
+static gpointer pin (gpointer source, gpointer data)
+{
+	return g_strdup (data);
+}
+
+
+static void unpin (gpointer source, gpointer data)
+{
+	released++;
+	g_free (data);
+	g_main_loop_quit (loop);
+}
+
+
+static void trigger (KfxmppEvent *e, const gchar *name)
+{
+	gchar *data = g_strdup (name);
+	gboolean ret;
+
+	ret = kfxmpp_event_trigger_full (e, data, pin, unpin, NULL);
+	g_print ("Trigger \"%s\": returned %d, %d pending\n", name, ret, kfxmpp_event_get_pending (e));
+
+	/* Caller's copy may go away, handlers see the pinned one */
+	g_free (data);
+	g_main_loop_run (loop);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	KfxmppEvent *e;
+	KfxmppEventHandler *h1, *h2;
+
+	g_thread_init (NULL);
+	loop = g_main_loop_new (NULL, FALSE);
+
+	e = kfxmpp_event_new (NULL);
+	h1 = kfxmpp_event_handler_new (lookup_handler, NULL, NULL);
+	h2 = kfxmpp_event_handler_new (fallback_handler, NULL, NULL);
+	kfxmpp_event_add_handler (e, h1, 50);
+	kfxmpp_event_add_handler (e, h2, 10);
+
+	trigger (e, "first");
+	trigger (e, "second");
+
+	g_print ("Pinned data released %d time(s), %d pending\n", released, kfxmpp_event_get_pending (e));
+
+	kfxmpp_event_handler_unref (h1);
+	kfxmpp_event_handler_unref (h2);
+	kfxmpp_event_unref (e);
+	g_main_loop_unref (loop);
+
+	return released == 2 ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+/*
+ * kfxmpp external backend wakeup test
+ * -----------------------------------
+ *
+ * Drives a session with an external backend from a plain poll() loop
+ * that never iterates a GLib main context once session is connected. The
+ * loop polls session's socket and backend's wakeup descriptor, and
+ * processes session when either is ready or its deadline has passed.
+ *
+ * Another thread sends a few messages: they have to reach the server.
+ * A handler defers a message and another thread resolves it: the next
+ * handler has to be called. A presence held for a coalescing window has
+ * to be delivered when the window ends.
+ *
+ * output:
+Connect: OK
+Sent from another thread: 5 message(s) arrived
+Resolved from another thread: next handler called
+Coalesced presence: delivered
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <poll.h>
+#include <string.h>
+
+#include "stand-in-server.h"
+
+#define N_MESSAGES	5
+
+#define MESSAGE		"<message to='bot@localhost'><body>From a worker</body></message>"
+#define INCOMING	"<message from='bot@localhost' to='user@localhost'><body>Wait</body></message>"
+#define PRESENCE	"<presence from='bot@localhost/x'/>"
+
+static KfxmppEventToken *token = NULL;
+static gint later = 0;
+static gint presences = 0;
+
+
+static gboolean defer_message (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	token = kfxmpp_event_defer ();
+	return KFXMPP_EVENT_PENDING;
+}
+
+
+static gboolean count_message (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	later++;
+	return TRUE;
+}
+
+
+static gboolean count_presence (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	KfxmppStanza *stanza = event;
+
+	if (stanza->klass == KFXMPP_STANZA_KLASS_PRESENCE)
+		presences++;
+	return FALSE;
+}
+
+
+static void update (KfxmppIoBackend *backend, gpointer data)
+{
+}
+
+
+/* Poll what session and its backend ask for, the way application's own loop would */
+static void host_iterate (KfxmppSession *session, gint timeout)
+{
+	KfxmppIoBackend *backend = kfxmpp_session_get_io_backend (session);
+	GIOCondition interest = kfxmpp_session_get_interest (session);
+	GIOCondition revents = 0;
+	struct pollfd pfd[2];
+	gint64 deadline;
+	gboolean woken = FALSE;
+
+	pfd[0].fd = kfxmpp_session_get_fd (session);
+	pfd[0].events = (interest & G_IO_IN ? POLLIN : 0) | (interest & G_IO_OUT ? POLLOUT : 0);
+	pfd[0].revents = 0;
+	pfd[1].fd = kfxmpp_io_backend_get_wakeup_fd (backend);
+	pfd[1].events = POLLIN;
+	pfd[1].revents = 0;
+
+	deadline = kfxmpp_session_get_deadline (session);
+	if (deadline >= 0)
+		timeout = CLAMP (deadline - kfxmpp_io_get_time (), 0, timeout);
+
+	if (poll (pfd, 2, timeout) > 0) {
+		if (pfd[0].revents & POLLIN)
+			revents |= G_IO_IN;
+		if (pfd[0].revents & POLLOUT)
+			revents |= G_IO_OUT;
+		if (pfd[0].revents & POLLHUP)
+			revents |= G_IO_HUP;
+		if (pfd[0].revents & POLLERR)
+			revents |= G_IO_ERR;
+		woken = (pfd[1].revents & POLLIN) != 0;
+	}
+
+	deadline = kfxmpp_session_get_deadline (session);
+	if (revents || woken || (deadline >= 0 && deadline <= kfxmpp_io_get_time ()))
+		kfxmpp_session_process (session, revents, kfxmpp_io_get_time ());
+}
+
+
+static gpointer send_messages (gpointer data)
+{
+	KfxmppSession *session = data;
+	gint i;
+
+	for (i = 0; i < N_MESSAGES; i++)
+		kfxmpp_session_send_raw (session, MESSAGE, strlen (MESSAGE), NULL);
+	return NULL;
+}
+
+
+static gpointer resolve (gpointer data)
+{
+	kfxmpp_event_token_resolve (data, FALSE);
+	return NULL;
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	StandInServer *server;
+	KfxmppSession *session;
+	KfxmppIoBackend *backend;
+	KfxmppEventHandler *handler;
+	GThread *thread;
+	gint connected = 0;
+	gboolean ok;
+	gint i;
+
+	kfxmpp_init ();
+	server = stand_in_server_new (NULL, STAND_IN_LEGACY);
+
+	session = stand_in_session_new (server);
+	backend = kfxmpp_io_backend_new_external (update, NULL);
+	kfxmpp_session_set_io_backend (session, backend);
+	kfxmpp_session_set_presence_coalescing (session, 50);
+
+	handler = kfxmpp_event_handler_new (defer_message, NULL, NULL);
+	kfxmpp_session_add_handler (session, KFXMPP_EVENT_TYPE_MESSAGE, handler,
+			KFXMPP_EVENT_HANDLER_PRIORITY_HIGH);
+	kfxmpp_event_handler_unref (handler);
+	handler = kfxmpp_event_handler_new (count_message, NULL, NULL);
+	kfxmpp_session_add_handler (session, KFXMPP_EVENT_TYPE_MESSAGE, handler,
+			KFXMPP_EVENT_HANDLER_PRIORITY_NORMAL);
+	kfxmpp_event_handler_unref (handler);
+	handler = kfxmpp_event_handler_new (count_presence, NULL, NULL);
+	kfxmpp_session_add_handler (session, KFXMPP_EVENT_TYPE_XML, handler,
+			KFXMPP_EVENT_HANDLER_PRIORITY_NORMAL);
+	kfxmpp_event_handler_unref (handler);
+
+	/* Connecting goes through main context, the rest through host */
+	kfxmpp_session_connect (session, stand_in_connected, &connected, NULL);
+	while (connected == 0) {
+		g_main_context_iteration (NULL, FALSE);
+		host_iterate (session, 1);
+	}
+	if (connected < 0) {
+		g_print ("Connect: FAILED\n");
+		return 1;
+	}
+	g_print ("Connect: OK\n");
+
+	/* Data sent from another thread */
+	stand_in_server_reset (server);
+	thread = g_thread_create (send_messages, session, TRUE, NULL);
+	g_thread_join (thread);
+	for (i = 0; i < 1000 && stand_in_server_get_messages (server) < N_MESSAGES; i++)
+		host_iterate (session, 10);
+	g_print ("Sent from another thread: %d message(s) arrived\n",
+			stand_in_server_get_messages (server));
+	ok = stand_in_server_get_messages (server) == N_MESSAGES;
+
+	/* Deferred handler resolved from another thread */
+	stand_in_server_push (server, INCOMING, 1);
+	for (i = 0; i < 1000 && token == NULL; i++)
+		host_iterate (session, 10);
+	if (token) {
+		thread = g_thread_create (resolve, token, TRUE, NULL);
+		g_thread_join (thread);
+	}
+	for (i = 0; i < 1000 && later == 0; i++)
+		host_iterate (session, 10);
+	g_print ("Resolved from another thread: next handler %s\n", later > 0 ? "called" : "not called");
+	ok = ok && later > 0;
+
+	/* Coalescing window ends on backend's timer */
+	stand_in_server_push (server, PRESENCE, 1);
+	for (i = 0; i < 1000 && presences == 0; i++)
+		host_iterate (session, 10);
+	g_print ("Coalesced presence: %s\n", presences > 0 ? "delivered" : "held");
+	ok = ok && presences > 0;
+
+	kfxmpp_session_disconnect (session, NULL);
+	kfxmpp_session_unref (session);
+	kfxmpp_io_backend_unref (backend);
+	stand_in_server_free (server);
+	kfxmpp_deinit ();
+
+	return ok ? 0 : 1;
+}
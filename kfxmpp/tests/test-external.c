@@ -0,0 +1,187 @@
+/*
+ * kfxmpp external backend test
+ * ----------------------------
+ *
+ * Drives an external backend with a plain poll() loop, the way an
+ * application with its own event loop would: it registers what backend
+ * asks for, sleeps until backend's deadline and passes readiness to
+ * kfxmpp_io_backend_process. Scenario is the one of readiness backend
+ * test, then a timer runs with no watch left. Writing is tried as soon as
+ * callback becomes interested in it, so host never has to poll for it.
+ *
+ * output:
+host: told to update
+host: polling for reading
+external: readable, got 'ping'
+external: writable, sent 'pong'
+external: hangup, removing watch
+host: nothing to poll
+external: 0 watch(es), peer got 'pong'
+host: told to update
+external: timer fired 3 times
+ */
+
+#include <glib.h>
+#include <kfxmpp/iobackend.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+typedef struct {
+	KfxmppIoWatch *watch;	/* Watch registered with host, NULL if none */
+	gint fd;
+	GIOCondition interest;	/* What host polls for */
+} Host;
+
+typedef struct {
+	Host *host;
+	gint peer;
+	gboolean done;
+} Scenario;
+
+
+static void update (KfxmppIoBackend *backend, gpointer data)
+{
+	g_print ("host: told to update\n");
+}
+
+
+/* Bring host's registration in line with watch */
+static void host_sync (Host *host)
+{
+	GIOCondition interest = host->watch ? kfxmpp_io_watch_get_interest (host->watch) : 0;
+
+	if (interest == host->interest)
+		return;
+	host->interest = interest;
+
+	if (interest == G_IO_IN)
+		g_print ("host: polling for reading\n");
+	else if (interest == (G_IO_IN | G_IO_OUT))
+		g_print ("host: polling for reading and writing\n");
+	else if (interest == 0)
+		g_print ("host: nothing to poll\n");
+}
+
+
+static void host_iterate (KfxmppIoBackend *backend, Host *host)
+{
+	struct pollfd pfd;
+	GIOCondition revents = 0;
+	gint64 deadline;
+	gint timeout = -1;
+
+	host_sync (host);
+
+	pfd.fd = host->watch ? host->fd : -1;
+	pfd.events = 0;
+	pfd.revents = 0;
+	if (host->interest & G_IO_IN)
+		pfd.events |= POLLIN;
+	if (host->interest & G_IO_OUT)
+		pfd.events |= POLLOUT;
+
+	deadline = kfxmpp_io_backend_get_deadline (backend);
+	if (deadline >= 0)
+		timeout = MAX (deadline - kfxmpp_io_get_time (), 0);
+
+	if (poll (&pfd, 1, timeout) > 0) {
+		if (pfd.revents & POLLIN)
+			revents |= G_IO_IN;
+		if (pfd.revents & POLLOUT)
+			revents |= G_IO_OUT;
+		if (pfd.revents & POLLHUP)
+			revents |= G_IO_HUP;
+		if (pfd.revents & POLLERR)
+			revents |= G_IO_ERR;
+	}
+
+	kfxmpp_io_backend_process (backend, host->watch, revents, kfxmpp_io_get_time ());
+}
+
+
+static gboolean ready (KfxmppIoWatch *watch, GIOCondition condition, gpointer data)
+{
+	Scenario *s = data;
+	gint fd = kfxmpp_io_watch_get_fd (watch);
+	gchar buffer[16];
+	gssize n;
+
+	if (condition & G_IO_OUT) {
+		write (fd, "pong", 4);
+		g_print ("external: writable, sent 'pong'\n");
+		kfxmpp_io_watch_set_interest (watch, G_IO_IN);
+		shutdown (s->peer, SHUT_WR);
+		return TRUE;
+	}
+
+	if (condition & G_IO_IN) {
+		n = read (fd, buffer, sizeof (buffer) - 1);
+		if (n > 0) {
+			buffer[n] = '\0';
+			g_print ("external: readable, got '%s'\n", buffer);
+			kfxmpp_io_watch_set_interest (watch, G_IO_IN | G_IO_OUT);
+			return TRUE;
+		}
+	}
+
+	/* End of stream or hangup */
+	g_print ("external: hangup, removing watch\n");
+	s->host->watch = NULL;
+	s->done = TRUE;
+	return FALSE;
+}
+
+
+static gboolean count (gpointer data)
+{
+	gint *fired = data;
+
+	return ++(*fired) < 3;
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	KfxmppIoBackend *backend;
+	Host host;
+	Scenario s;
+	gint fds[2];
+	gchar buffer[16];
+	gssize n;
+	gint fired = 0;
+
+	backend = kfxmpp_io_backend_new_external (update, NULL);
+
+	socketpair (AF_UNIX, SOCK_STREAM, 0, fds);
+	memset (&host, 0, sizeof (host));
+	s.host = &host;
+	s.peer = fds[1];
+	s.done = FALSE;
+
+	host.fd = fds[0];
+	host.watch = kfxmpp_io_backend_add_watch (backend, fds[0], G_IO_IN, ready, &s);
+
+	write (fds[1], "ping", 4);
+	while (! s.done)
+		host_iterate (backend, &host);
+	host_sync (&host);
+
+	n = read (fds[1], buffer, sizeof (buffer) - 1);
+	buffer[MAX (n, 0)] = '\0';
+	g_print ("external: %u watch(es), peer got '%s'\n",
+			kfxmpp_io_backend_get_n_watches (backend), buffer);
+	close (fds[0]);
+	close (fds[1]);
+
+	kfxmpp_io_backend_add_timer (backend, 20, count, &fired);
+	while (fired < 3)
+		host_iterate (backend, &host);
+	g_print ("external: timer fired %d times\n", fired);
+
+	kfxmpp_io_backend_unref (backend);
+
+	return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * kfxmpp read fairness test
+ * -------------------------
+ *
+ * Connects two sessions to a stand-in server, both on one epoll backend,
+ * and lets server send each of them a burst many times larger than the
+ * read budget before backend is dispatched at all. A session out of
+ * budget yields to the other one, so messages of both must come in
+ * turns instead of one session's burst after the other's. Each turn a
+ * session waited for is recorded in its scheduling delay histogram.
+ *
+ * Systems without epoll print "epoll: not available" only.
+ *
+ * output:
+Connect: OK
+Received: 400 + 400 message(s)
+Alternated: yes, at least 8 turns
+Scheduling delays recorded: yes + yes
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+#include <kfxmpp/iobackend.h>
+
+#include <poll.h>
+
+#include "stand-in-server.h"
+
+#define N_MESSAGES	400
+#define READ_BUDGET	1
+
+#define MESSAGE "<message from='bot@localhost' to='user@localhost'><body>Take turns</body></message>"
+
+static GString *order;
+
+
+static gboolean got_message (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	g_string_append_c (order, GPOINTER_TO_INT (data));
+	return FALSE;
+}
+
+
+static void step (KfxmppIoBackend *backend)
+{
+	gboolean busy;
+
+	busy = g_main_context_iteration (NULL, FALSE);
+	if (kfxmpp_io_backend_dispatch (backend, 0) > 0)
+		busy = TRUE;
+	if (! busy)
+		g_usleep (1000);
+}
+
+
+static KfxmppSession *new_session (StandInServer *server, KfxmppIoBackend *backend, gchar name)
+{
+	KfxmppSession *session;
+	KfxmppEventHandler *handler;
+
+	session = stand_in_session_new (server);
+	kfxmpp_session_set_io_backend (session, backend);
+	handler = kfxmpp_event_handler_new (got_message, GINT_TO_POINTER (name), NULL);
+	kfxmpp_session_add_handler (session, KFXMPP_EVENT_TYPE_MESSAGE, handler,
+			KFXMPP_EVENT_HANDLER_PRIORITY_NORMAL);
+	kfxmpp_event_handler_unref (handler);
+
+	return session;
+}
+
+
+static gboolean delays_recorded (KfxmppSession *session)
+{
+	const guint *delays = kfxmpp_session_get_scheduling_delays (session);
+	guint total = 0;
+	gint i;
+
+	for (i = 0; i < KFXMPP_SESSION_DELAY_BUCKETS; i++)
+		total += delays[i];
+	return total > 0;
+}
+
+
+static void wait_readable (KfxmppSession *session)
+{
+	struct pollfd pfd;
+
+	pfd.fd = kfxmpp_session_get_fd (session);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	poll (&pfd, 1, 1000);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	StandInServer *server;
+	KfxmppIoBackend *backend;
+	KfxmppSession *a, *b;
+	gint connected_a = 0, connected_b = 0;
+	gint count_a = 0, count_b = 0, turns = 1;
+	gchar *burst;
+	GString *str;
+	gsize i;
+
+	kfxmpp_init ();
+	server = stand_in_server_new (NULL, STAND_IN_LEGACY);
+	backend = kfxmpp_io_backend_new_epoll ();
+	if (backend == NULL) {
+		g_print ("epoll: not available\n");
+		return 0;
+	}
+	order = g_string_new (NULL);
+
+	a = new_session (server, backend, 'a');
+	b = new_session (server, backend, 'b');
+	kfxmpp_session_connect (a, stand_in_connected, &connected_a, NULL);
+	kfxmpp_session_connect (b, stand_in_connected, &connected_b, NULL);
+	while (connected_a == 0 || connected_b == 0)
+		step (backend);
+	if (connected_a < 0 || connected_b < 0) {
+		g_print ("Connect: FAILED\n");
+		return 1;
+	}
+	g_print ("Connect: OK\n");
+
+	/* A single receive buffer per turn */
+	kfxmpp_session_set_read_budget (a, READ_BUDGET, 1000);
+	kfxmpp_session_set_read_budget (b, READ_BUDGET, 1000);
+	kfxmpp_session_reset_scheduling_delays (a);
+	kfxmpp_session_reset_scheduling_delays (b);
+
+	/* Whole bursts wait in both sockets before either session reads */
+	str = g_string_new (NULL);
+	for (i = 0; i < N_MESSAGES; i++)
+		g_string_append (str, MESSAGE);
+	burst = g_string_free (str, FALSE);
+	stand_in_server_push (server, burst, 1);
+	g_free (burst);
+	wait_readable (a);
+	wait_readable (b);
+	g_usleep (50000);
+
+	for (i = 0; i < 5000 && order->len < 2 * N_MESSAGES; i++)
+		step (backend);
+
+	for (i = 0; i < order->len; i++) {
+		if (order->str[i] == 'a')
+			count_a++;
+		else
+			count_b++;
+		if (i > 0 && order->str[i] != order->str[i - 1])
+			turns++;
+	}
+	g_print ("Received: %d + %d message(s)\n", count_a, count_b);
+	g_print ("Alternated: %s, at least 8 turns\n", turns >= 8 ? "yes" : "no");
+	g_print ("Scheduling delays recorded: %s + %s\n",
+			delays_recorded (a) ? "yes" : "no", delays_recorded (b) ? "yes" : "no");
+
+	kfxmpp_session_disconnect (a, NULL);
+	kfxmpp_session_disconnect (b, NULL);
+	kfxmpp_session_unref (a);
+	kfxmpp_session_unref (b);
+	kfxmpp_io_backend_unref (backend);
+	stand_in_server_free (server);
+	g_string_free (order, TRUE);
+	kfxmpp_deinit ();
+
+	return turns >= 8 && count_a == N_MESSAGES && count_b == N_MESSAGES ? 0 : 1;
+}
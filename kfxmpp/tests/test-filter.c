@@ -0,0 +1,97 @@
+/*
+ * kfxmpp stream filter test
+ * -------------------------
+ *
+ * output:
+Got <message> from alice@example.com/home
+Got <presence> from bob@example.com/work
+Got <iq> from example.com
+message[{http://jabber.org/protocol/chatstates}*]: 3 matches, 4 elements skipped
+presence[domain(@from)='spam.example.com']: 1 matches, 3 elements skipped
+message/{http://jabber.org/protocol/pubsub#event}event: 1 matches, 3 elements skipped
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+static const gchar *stream =
+	"<?xml version='1.0'?>"
+	"<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' id='1' version='1.0'>"
+	"<message from='alice@example.com/home' type='chat'>"
+		"<body>Hello</body>"
+	"</message>"
+	"<message from='alice@example.com/home' type='chat'>"
+		"<active xmlns='http://jabber.org/protocol/chatstates'/>"
+		"<body>Hello again</body>"
+	"</message>"
+	"<message from='alice@example.com/home' type='chat'>"
+		"<composing xmlns='http://jabber.org/protocol/chatstates'/>"
+	"</message>"
+	"<presence from='eve@spam.example.com/bot'><show>chat</show><status>Buy!</status></presence>"
+	"<presence from='bob@example.com/work'><show>dnd</show></presence>"
+	"<message from='pubsub.example.com'>"
+		"<event xmlns='http://jabber.org/protocol/pubsub#event'>"
+			"<items node='x'><item id='1'/></items>"
+		"</event>"
+	"</message>"
+	"<message from='alice@example.com/home' type='chat'>"
+		"<body>Bye</body>"
+		"<gone xmlns='http://jabber.org/protocol/chatstates'/>"
+	"</message>"
+	"<iq from='example.com' type='result' id='1'/>";
+
+static const gchar *expressions[] = {
+	"message[{http://jabber.org/protocol/chatstates}*]",
+	"presence[domain(@from)='spam.example.com']",
+	"message/{http://jabber.org/protocol/pubsub#event}event",
+	NULL
+};
+
+static void onXml (KfxmppStreamParser *p, xmlNodePtr node, gpointer data);
+
+gint main (gint argc, gchar *argv[])
+{
+	KfxmppStreamParser *p;
+	KfxmppFilter *filters[3];
+	GError *error = NULL;
+	gsize i;
+
+	p = kfxmpp_stream_parser_new (onXml, NULL);
+
+	for (i = 0; expressions[i]; i++) {
+		filters[i] = kfxmpp_filter_new (expressions[i], &error);
+		if (filters[i] == NULL) {
+			g_print ("%s\n", error->message);
+			return 1;
+		}
+		kfxmpp_stream_parser_add_filter (p, filters[i]);
+	}
+
+	/* Feed in small chunks, so that stanzas are split between calls */
+	for (i = 0; i < strlen (stream); i += 7)
+		kfxmpp_stream_parser_feed (p, stream + i, MIN (7, strlen (stream) - i));
+
+	for (i = 0; expressions[i]; i++) {
+		g_print ("%s: %u matches, %u elements skipped\n", expressions[i],
+				kfxmpp_filter_get_matches (filters[i]),
+				kfxmpp_filter_get_skipped (filters[i]));
+		kfxmpp_filter_unref (filters[i]);
+	}
+
+	/* Expression with a syntax error */
+	if (kfxmpp_filter_new ("message[@type='chat'", &error) != NULL)
+		return 1;
+	g_error_free (error);
+
+	kfxmpp_stream_parser_unref (p);
+	return 0;
+}
+
+
+static void onXml (KfxmppStreamParser *p, xmlNodePtr node, gpointer data)
+{
+	xmlChar *from = xmlGetProp (node, BAD_CAST "from");
+
+	g_print ("Got <%s> from %s\n", node->name, from);
+	xmlFree (from);
+}
@@ -0,0 +1,228 @@
+/*
+ * kfxmpp inbound backlog test
+ * ---------------------------
+ *
+ * Connects a session to a stand-in server with a limit of 8 pending
+ * stanzas, and a handler that defers every ordinary message. Server sends
+ * 8 messages followed by headlines and presences in one burst: reading
+ * pauses at the 8th message and, under drop policy, the rest of the
+ * burst is dropped. What server sends next must stay in socket while
+ * reading is paused, also when backend does I/O itself. Reading resumes
+ * once half of pending stanzas are resolved, and later stanzas are
+ * dispatched again.
+ *
+ * Runs the same scenario on GLib and io_uring backends. Kernels without
+ * io_uring print "uring: not available" instead of its lines.
+ *
+ * output:
+glib: paused at 8 pending: yes, dropped 8, dispatched 0 headline(s) and 0 presence(s)
+glib: while paused, left in socket: yes, pending 8
+glib: at 5 pending: paused
+glib: at 4 pending: resumed, then got 2 message(s) and 1 headline(s)
+glib: 1 pause(s), 1 resume(s)
+uring: paused at 8 pending: yes, dropped 8, dispatched 0 headline(s) and 0 presence(s)
+uring: while paused, left in socket: yes, pending 8
+uring: at 5 pending: paused
+uring: at 4 pending: resumed, then got 2 message(s) and 1 headline(s)
+uring: 1 pause(s), 1 resume(s)
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <poll.h>
+
+#include "stand-in-server.h"
+
+#define LIMIT	8
+
+#define MESSAGE		"<message from='bot@localhost' to='user@localhost'><body>m</body></message>"
+#define HEADLINE	"<message from='bot@localhost' to='user@localhost' type='headline'><body>h</body></message>"
+#define PRESENCE	"<presence from='bot@localhost/x'/>"
+
+static GQueue *tokens = NULL;
+static gint headlines = 0;
+static gint presences = 0;
+
+
+static gboolean got_xml (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	KfxmppStanza *stanza = event;
+	xmlChar *type;
+
+	if (stanza->klass == KFXMPP_STANZA_KLASS_PRESENCE) {
+		presences++;
+		return FALSE;
+	}
+	if (stanza->klass != KFXMPP_STANZA_KLASS_MESSAGE)
+		return FALSE;
+
+	type = xmlGetProp (stanza->node, BAD_CAST "type");
+	if (type && xmlStrcmp (type, BAD_CAST "headline") == 0) {
+		headlines++;
+		xmlFree (type);
+		return FALSE;
+	}
+	xmlFree (type);
+
+	/* Ordinary messages wait for the test to decide */
+	g_queue_push_tail (tokens, kfxmpp_event_defer ());
+	return KFXMPP_EVENT_PENDING;
+}
+
+
+/* One round of main loop, and of backend when session has its own */
+static void step (KfxmppIoBackend *backend)
+{
+	gboolean busy;
+
+	busy = g_main_context_iteration (NULL, FALSE);
+	if (backend && kfxmpp_io_backend_dispatch (backend, 0) > 0)
+		busy = TRUE;
+	if (! busy)
+		g_usleep (1000);
+}
+
+
+static void resolve (KfxmppIoBackend *backend, gint n)
+{
+	gint i;
+
+	while (n-- > 0 && ! g_queue_is_empty (tokens))
+		kfxmpp_event_token_resolve (g_queue_pop_head (tokens), TRUE);
+	for (i = 0; i < 10; i++)
+		step (backend);
+}
+
+
+static gboolean socket_readable (KfxmppSession *session, gint timeout)
+{
+	struct pollfd pfd;
+
+	pfd.fd = kfxmpp_session_get_fd (session);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll (&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN);
+}
+
+
+static gchar *repeat (const gchar *stanza, gint n)
+{
+	GString *str = g_string_new (NULL);
+
+	while (n-- > 0)
+		g_string_append (str, stanza);
+	return g_string_free (str, FALSE);
+}
+
+
+static gboolean run (StandInServer *server, const gchar *name, KfxmppIoBackend *backend)
+{
+	KfxmppSession *session;
+	KfxmppEventHandler *handler;
+	gchar *messages, *heads, *pres, *burst;
+	gint connected = 0;
+	gint i;
+
+	session = stand_in_session_new (server);
+	if (backend)
+		kfxmpp_session_set_io_backend (session, backend);
+	handler = kfxmpp_event_handler_new (got_xml, NULL, NULL);
+	kfxmpp_session_add_handler (session, KFXMPP_EVENT_TYPE_XML, handler,
+			KFXMPP_EVENT_HANDLER_PRIORITY_NORMAL);
+	kfxmpp_event_handler_unref (handler);
+
+	kfxmpp_session_connect (session, stand_in_connected, &connected, NULL);
+	while (connected == 0)
+		step (backend);
+	if (connected < 0) {
+		g_print ("%s: connection FAILED\n", name);
+		kfxmpp_session_unref (session);
+		return FALSE;
+	}
+
+	tokens = g_queue_new ();
+	headlines = presences = 0;
+	kfxmpp_session_set_inbound_limits (session, LIMIT, 0);
+	kfxmpp_session_set_inbound_drop_policy (session,
+			KFXMPP_INBOUND_DROP_HEADLINES | KFXMPP_INBOUND_DROP_PRESENCES);
+
+	/* One write, small enough to be read at once */
+	messages = repeat (MESSAGE, LIMIT);
+	heads = repeat (HEADLINE, 4);
+	pres = repeat (PRESENCE, 4);
+	burst = g_strconcat (messages, heads, pres, NULL);
+	stand_in_server_push (server, burst, 1);
+	g_free (burst);
+	g_free (pres);
+	g_free (heads);
+	g_free (messages);
+
+	for (i = 0; i < 1000 && kfxmpp_session_get_inbound_dropped (session) < 8; i++)
+		step (backend);
+	g_print ("%s: paused at %d pending: %s, dropped %u, dispatched %d headline(s) and %d presence(s)\n",
+			name, g_queue_get_length (tokens),
+			kfxmpp_session_get_reading_paused (session) ? "yes" : "no",
+			kfxmpp_session_get_inbound_dropped (session), headlines, presences);
+
+	/* Nothing may be taken off the socket now */
+	burst = g_strconcat (MESSAGE, MESSAGE, HEADLINE, NULL);
+	stand_in_server_push (server, burst, 1);
+	g_free (burst);
+	socket_readable (session, 1000);
+	for (i = 0; i < 20; i++)
+		step (backend);
+	g_print ("%s: while paused, left in socket: %s, pending %d\n", name,
+			socket_readable (session, 0) ? "yes" : "no", g_queue_get_length (tokens));
+
+	/* Low watermark is half of the limit */
+	resolve (backend, 3);
+	g_print ("%s: at %d pending: %s\n", name, g_queue_get_length (tokens),
+			kfxmpp_session_get_reading_paused (session) ? "paused" : "resumed");
+	resolve (backend, 1);
+	g_print ("%s: at %d pending: %s", name, g_queue_get_length (tokens),
+			kfxmpp_session_get_reading_paused (session) ? "paused" : "resumed");
+
+	for (i = 0; i < 1000 && (g_queue_get_length (tokens) < LIMIT / 2 + 2 || headlines < 1); i++)
+		step (backend);
+	g_print (", then got %d message(s) and %d headline(s)\n",
+			g_queue_get_length (tokens) - LIMIT / 2, headlines);
+	g_print ("%s: %u pause(s), %u resume(s)\n", name,
+			kfxmpp_session_get_inbound_pauses (session),
+			kfxmpp_session_get_inbound_resumes (session));
+
+	resolve (backend, g_queue_get_length (tokens));
+	g_queue_free (tokens);
+	tokens = NULL;
+
+	kfxmpp_session_disconnect (session, NULL);
+	kfxmpp_session_unref (session);
+
+	return TRUE;
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	StandInServer *server;
+	KfxmppIoBackend *uring;
+	gboolean ok;
+
+	kfxmpp_init ();
+	server = stand_in_server_new (NULL, STAND_IN_LEGACY);
+
+	ok = run (server, "glib", NULL);
+
+	uring = kfxmpp_io_backend_new_uring ();
+	if (uring) {
+		ok = run (server, "uring", uring) && ok;
+		kfxmpp_io_backend_unref (uring);
+	} else {
+		g_print ("uring: not available\n");
+	}
+
+	stand_in_server_free (server);
+	kfxmpp_deinit ();
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,311 @@
+/*
+ * kfxmpp readiness backend test
+ * -----------------------------
+ *
+ * Runs the same scenario on GLib, epoll, edge-triggered epoll and io_uring
+ * backends:
+ * one watch per socket, interested in reading, becomes interested in
+ * writing for a while and is removed from within its own callback once
+ * the peer shuts down. Then a callback reads a byte at a time and defers
+ * the rest, which edge-triggered backend would never report otherwise,
+ * and a repeating timer runs next to a cancelled one. Last, a watch is
+ * switched to completion I/O, which only io_uring backend supports.
+ *
+ * Kernels without io_uring print "uring: not available" instead of its
+ * part.
+ *
+ * output:
+glib: 1 watch(es)
+glib: readable, got 'ping'
+glib: writable, sent 'pong'
+glib: hangup, removing watch
+glib: 0 watch(es), peer got 'pong'
+glib: deferred reads got 'abcd'
+glib: timer fired 3 times, cancelled timer 0 times
+glib: completion I/O not supported
+epoll: 1 watch(es)
+epoll: readable, got 'ping'
+epoll: writable, sent 'pong'
+epoll: hangup, removing watch
+epoll: 0 watch(es), peer got 'pong'
+epoll: deferred reads got 'abcd'
+epoll: timer fired 3 times, cancelled timer 0 times
+epoll: completion I/O not supported
+edge: 1 watch(es)
+edge: readable, got 'ping'
+edge: writable, sent 'pong'
+edge: hangup, removing watch
+edge: 0 watch(es), peer got 'pong'
+edge: deferred reads got 'abcd'
+edge: timer fired 3 times, cancelled timer 0 times
+edge: completion I/O not supported
+uring: 1 watch(es)
+uring: readable, got 'ping'
+uring: writable, sent 'pong'
+uring: hangup, removing watch
+uring: 0 watch(es), peer got 'pong'
+uring: deferred reads got 'abcd'
+uring: timer fired 3 times, cancelled timer 0 times
+uring: received 'hello'
+uring: sent 'world', peer got 'world'
+uring: end of stream, removing watch
+ */
+
+#include <glib.h>
+#include <kfxmpp/iobackend.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+typedef struct {
+	const gchar *name;
+	gint peer;
+	gboolean done;
+} Scenario;
+
+typedef struct {
+	gchar got[8];
+	gint length;
+} Sip;
+
+typedef struct {
+	const gchar *name;
+	GString *got;
+	gboolean written;
+	gboolean done;
+} Pushed;
+
+
+static gboolean ready (KfxmppIoWatch *watch, GIOCondition condition, gpointer data)
+{
+	Scenario *s = data;
+	gint fd = kfxmpp_io_watch_get_fd (watch);
+	gchar buffer[16];
+	gssize n;
+
+	if (condition & G_IO_OUT) {
+		write (fd, "pong", 4);
+		g_print ("%s: writable, sent 'pong'\n", s->name);
+		kfxmpp_io_watch_set_interest (watch, G_IO_IN);
+		shutdown (s->peer, SHUT_WR);
+		return TRUE;
+	}
+
+	if (condition & G_IO_IN) {
+		n = read (fd, buffer, sizeof (buffer) - 1);
+		if (n > 0) {
+			buffer[n] = '\0';
+			g_print ("%s: readable, got '%s'\n", s->name, buffer);
+			kfxmpp_io_watch_set_interest (watch, G_IO_IN | G_IO_OUT);
+			return TRUE;
+		}
+	}
+
+	/* End of stream or hangup */
+	g_print ("%s: hangup, removing watch\n", s->name);
+	s->done = TRUE;
+	return FALSE;
+}
+
+
+static gboolean sip (KfxmppIoWatch *watch, GIOCondition condition, gpointer data)
+{
+	Sip *s = data;
+
+	if (read (kfxmpp_io_watch_get_fd (watch), s->got + s->length, 1) == 1)
+		s->length++;
+	/* Leave the rest for later */
+	kfxmpp_io_watch_defer (watch, G_IO_IN);
+	return TRUE;
+}
+
+
+static void pushed_recv (KfxmppIoWatch *watch, const gchar *buffer, gssize size, gpointer data)
+{
+	Pushed *p = data;
+
+	if (size > 0) {
+		g_string_append_len (p->got, buffer, size);
+		return;
+	}
+
+	g_print ("%s: end of stream, removing watch\n", p->name);
+	kfxmpp_io_watch_remove (watch);
+	p->done = TRUE;
+}
+
+
+static gboolean pushed_ready (KfxmppIoWatch *watch, GIOCondition condition, gpointer data)
+{
+	Pushed *p = data;
+
+	if (condition & G_IO_OUT) {
+		p->written = TRUE;
+		kfxmpp_io_watch_set_interest (watch, G_IO_IN);
+	}
+	return TRUE;
+}
+
+
+static gboolean count (gpointer data)
+{
+	gint *fired = data;
+
+	return ++(*fired) < 3;
+}
+
+
+static void iterate (KfxmppIoBackend *backend)
+{
+	if (kfxmpp_io_backend_get_fd (backend) >= 0)
+		kfxmpp_io_backend_dispatch (backend, 1000);
+	else
+		g_main_context_iteration (NULL, TRUE);
+}
+
+
+static void run_deferred (KfxmppIoBackend *backend, const gchar *name)
+{
+	KfxmppIoWatch *watch;
+	Sip s;
+	gint fds[2];
+
+	socketpair (AF_UNIX, SOCK_STREAM, 0, fds);
+	memset (&s, 0, sizeof (s));
+
+	watch = kfxmpp_io_backend_add_watch (backend, fds[0], G_IO_IN, sip, &s);
+	write (fds[1], "abcd", 4);
+	while (s.length < 4)
+		iterate (backend);
+	g_print ("%s: deferred reads got '%s'\n", name, s.got);
+
+	kfxmpp_io_watch_remove (watch);
+	close (fds[0]);
+	close (fds[1]);
+}
+
+
+static void run_timers (KfxmppIoBackend *backend, const gchar *name)
+{
+	KfxmppIoTimer *timer;
+	gint fired = 0;
+	gint cancelled = 0;
+
+	kfxmpp_io_backend_add_timer (backend, 20, count, &fired);
+	timer = kfxmpp_io_backend_add_timer (backend, 10, count, &cancelled);
+	kfxmpp_io_timer_remove (timer);
+
+	while (fired < 3)
+		iterate (backend);
+	g_print ("%s: timer fired %d times, cancelled timer %d times\n", name, fired, cancelled);
+}
+
+
+static void run_completion (KfxmppIoBackend *backend, const gchar *name)
+{
+	KfxmppIoWatch *watch;
+	Pushed p;
+	gint fds[2];
+	gchar buffer[16];
+	gssize n;
+
+	socketpair (AF_UNIX, SOCK_STREAM, 0, fds);
+	memset (&p, 0, sizeof (p));
+	p.name = name;
+	p.got = g_string_new (NULL);
+
+	watch = kfxmpp_io_backend_add_watch (backend, fds[0], G_IO_IN, pushed_ready, &p);
+	if (! kfxmpp_io_watch_set_recv_func (watch, pushed_recv)) {
+		g_print ("%s: completion I/O not supported\n", name);
+		kfxmpp_io_watch_remove (watch);
+		goto out;
+	}
+
+	write (fds[1], "hello", 5);
+	while (p.got->len < 5)
+		iterate (backend);
+	g_print ("%s: received '%s'\n", name, p.got->str);
+
+	kfxmpp_io_watch_send (watch, g_string_new ("world"));
+	kfxmpp_io_watch_set_interest (watch, G_IO_IN | G_IO_OUT);
+	while (! p.written)
+		iterate (backend);
+	n = read (fds[1], buffer, sizeof (buffer) - 1);
+	buffer[MAX (n, 0)] = '\0';
+	g_print ("%s: sent 'world', peer got '%s'\n", name, buffer);
+
+	shutdown (fds[1], SHUT_WR);
+	while (! p.done)
+		iterate (backend);
+
+out:
+	close (fds[0]);
+	close (fds[1]);
+	g_string_free (p.got, TRUE);
+}
+
+
+static void run (KfxmppIoBackend *backend, const gchar *name)
+{
+	Scenario s;
+	gint fds[2];
+	gchar buffer[16];
+	gssize n;
+
+	socketpair (AF_UNIX, SOCK_STREAM, 0, fds);
+	s.name = name;
+	s.peer = fds[1];
+	s.done = FALSE;
+
+	kfxmpp_io_backend_add_watch (backend, fds[0], G_IO_IN, ready, &s);
+	g_print ("%s: %u watch(es)\n", name, kfxmpp_io_backend_get_n_watches (backend));
+
+	write (fds[1], "ping", 4);
+	while (! s.done)
+		iterate (backend);
+
+	n = read (fds[1], buffer, sizeof (buffer) - 1);
+	buffer[MAX (n, 0)] = '\0';
+	g_print ("%s: %u watch(es), peer got '%s'\n", name,
+			kfxmpp_io_backend_get_n_watches (backend), buffer);
+
+	close (fds[0]);
+	close (fds[1]);
+
+	run_deferred (backend, name);
+	run_timers (backend, name);
+	run_completion (backend, name);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	KfxmppIoBackend *backend;
+
+	backend = kfxmpp_io_backend_new_glib (NULL);
+	run (backend, "glib");
+	kfxmpp_io_backend_unref (backend);
+
+	backend = kfxmpp_io_backend_new_epoll ();
+	if (backend == NULL) {
+		g_print ("epoll: not available\n");
+		return 0;
+	}
+	run (backend, "epoll");
+	kfxmpp_io_backend_unref (backend);
+
+	backend = kfxmpp_io_backend_new_epoll_full (TRUE);
+	run (backend, "edge");
+	kfxmpp_io_backend_unref (backend);
+
+	backend = kfxmpp_io_backend_new_uring ();
+	if (backend == NULL) {
+		g_print ("uring: not available\n");
+		return 0;
+	}
+	run (backend, "uring");
+	kfxmpp_io_backend_unref (backend);
+
+	return 0;
+}
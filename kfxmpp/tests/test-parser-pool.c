@@ -0,0 +1,95 @@
+/*
+ * kfxmpp parser pool test
+ * -----------------------
+ *
+ * Three streams are parsed one after another by parsers taking their
+ * contexts from a pool. Second parser is released from its own callback,
+ * the way a session restarts stream after authentication, and a new one
+ * takes over right away. Freeing more parsers than pool keeps frees the
+ * extra context.
+ *
+ * output:
+stream 'one': got <message> 'first'
+stream 'one': got <iq>
+stream 'two': got <success>, restarting
+stream 'three': got <message> 'after restart'
+reused 1, idle 1
+two parsers freed, idle 1
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <string.h>
+
+static const gchar *streams[] = {
+	"<?xml version='1.0'?>"
+	"<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' id='one' version='1.0'>"
+	"<message><body>first</body></message>"
+	"<iq type='result' id='1'/>",
+
+	"<?xml version='1.0'?>"
+	"<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' id='two' version='1.0'>"
+	"<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>",
+
+	"<?xml version='1.0'?>"
+	"<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' id='three' version='1.0'>"
+	"<message><body>after restart</body></message>"
+};
+
+static KfxmppStreamParserPool *pool;
+static KfxmppStreamParser *current;
+
+
+static void got_xml (KfxmppStreamParser *parser, xmlNodePtr node, gpointer data)
+{
+	const gchar *id = kfxmpp_stream_parser_get_id (parser);
+
+	if (xmlStrcmp (node->name, (const xmlChar *) "success") == 0) {
+		g_print ("stream '%s': got <success>, restarting\n", id);
+		/* Parser being fed stays alive until feeding is done */
+		kfxmpp_stream_parser_unref (current);
+		current = kfxmpp_stream_parser_new_from_pool (pool, got_xml, NULL);
+		return;
+	}
+
+	if (node->children) {
+		xmlChar *text = xmlNodeGetContent (node);
+
+		g_print ("stream '%s': got <%s> '%s'\n", id, node->name, text);
+		xmlFree (text);
+	} else {
+		g_print ("stream '%s': got <%s>\n", id, node->name);
+	}
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	KfxmppStreamParser *a, *b;
+
+	g_thread_init (NULL);
+	pool = kfxmpp_stream_parser_pool_new (1);
+
+	current = kfxmpp_stream_parser_new_from_pool (pool, got_xml, NULL);
+	kfxmpp_stream_parser_feed (current, streams[0], strlen (streams[0]));
+	kfxmpp_stream_parser_unref (current);
+
+	current = kfxmpp_stream_parser_new_from_pool (pool, got_xml, NULL);
+	kfxmpp_stream_parser_feed (current, streams[1], strlen (streams[1]));
+	kfxmpp_stream_parser_feed (current, streams[2], strlen (streams[2]));
+	kfxmpp_stream_parser_unref (current);
+
+	g_print ("reused %u, idle %u\n", kfxmpp_stream_parser_pool_get_reused (pool),
+			kfxmpp_stream_parser_pool_get_n_idle (pool));
+
+	a = kfxmpp_stream_parser_new_from_pool (pool, got_xml, NULL);
+	b = kfxmpp_stream_parser_new_from_pool (pool, got_xml, NULL);
+	kfxmpp_stream_parser_unref (a);
+	kfxmpp_stream_parser_unref (b);
+	g_print ("two parsers freed, idle %u\n", kfxmpp_stream_parser_pool_get_n_idle (pool));
+
+	kfxmpp_stream_parser_pool_unref (pool);
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * kfxmpp pool disconnect test
+ * ---------------------------
+ *
+ * Connects a session in a pool driven by io_uring, where backend writes
+ * session's output itself. Session then sends a few messages and
+ * disconnects within one iteration, so that none of it is written before
+ * socket is closed. Server still has to get every message, followed by
+ * end of stream.
+ *
+ * Kernels without io_uring print "uring: not available" only.
+ *
+ * output:
+Connect: OK
+Messages before end of stream: 5
+End of stream: received
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+#include <kfxmpp/sessionpool.h>
+
+#include <string.h>
+
+#include "stand-in-server.h"
+
+#define N_MESSAGES	5
+
+#define MESSAGE "<message to='bot@localhost'><body>Last words</body></message>"
+
+
+static void step (KfxmppSessionPool *pool)
+{
+	gboolean busy;
+
+	busy = g_main_context_iteration (NULL, FALSE);
+	if (kfxmpp_session_pool_dispatch (pool, 0) > 0)
+		busy = TRUE;
+	if (! busy)
+		g_usleep (1000);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	StandInServer *server;
+	KfxmppIoBackend *uring;
+	KfxmppSessionPool *pool;
+	KfxmppSession *session;
+	gint connected = 0;
+	gboolean ok;
+	gint i;
+
+	kfxmpp_init ();
+
+	uring = kfxmpp_io_backend_new_uring ();
+	if (uring == NULL) {
+		g_print ("uring: not available\n");
+		return 0;
+	}
+	pool = kfxmpp_session_pool_new_with_backend (uring);
+	kfxmpp_io_backend_unref (uring);
+	server = stand_in_server_new (NULL, STAND_IN_LEGACY);
+
+	session = stand_in_session_new (server);
+	kfxmpp_session_pool_add (pool, session);
+	kfxmpp_session_connect (session, stand_in_connected, &connected, NULL);
+	while (connected == 0)
+		step (pool);
+	if (connected < 0) {
+		g_print ("Connect: FAILED\n");
+		return 1;
+	}
+	g_print ("Connect: OK\n");
+
+	/* Everything is still queued when socket goes */
+	stand_in_server_reset (server);
+	for (i = 0; i < N_MESSAGES; i++)
+		kfxmpp_session_send_raw (session, MESSAGE, strlen (MESSAGE), NULL);
+	kfxmpp_session_disconnect (session, NULL);
+
+	for (i = 0; i < 1000 && stand_in_server_get_stream_ends (server) == 0; i++)
+		step (pool);
+	g_print ("Messages before end of stream: %d\n", stand_in_server_get_messages (server));
+	ok = stand_in_server_get_messages (server) == N_MESSAGES &&
+		stand_in_server_get_stream_ends (server) > 0;
+	g_print ("End of stream: %s\n",
+			stand_in_server_get_stream_ends (server) > 0 ? "received" : "lost");
+
+	kfxmpp_session_pool_remove (pool, session);
+	kfxmpp_session_unref (session);
+	kfxmpp_session_pool_unref (pool);
+	stand_in_server_free (server);
+	kfxmpp_deinit ();
+
+	return ok ? 0 : 1;
+}
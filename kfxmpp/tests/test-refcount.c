@@ -0,0 +1,143 @@
+/*
+ * kfxmpp reference counting test
+ * ------------------------------
+ *
+ * Takes and drops references to shared objects from many threads at once
+ * and checks that every object is freed exactly once afterwards. Then it
+ * measures single-threaded cost of ref/unref pair against plain integer
+ * increment/decrement.
+ *
+ * output:
+Stress: 16 threads x 100000 ref/unref pairs
+Handler freed 1 time(s)
+Stress: OK
+Benchmark: <n> ns per ref/unref pair (plain: <n> ns)
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+#include <kfxmpp/message.h>
+
+#define N_THREADS	16
+#define ITERATIONS	100000
+#define BENCH_ITERATIONS 10000000
+
+typedef struct {
+	KfxmppSession *session;
+	KfxmppEvent *event;
+	KfxmppEventHandler *handler;
+	KfxmppMessage *message;
+	KfxmppStreamParser *parser;
+} SharedObjects;
+
+static gint handler_freed = 0;
+
+static gboolean handler (KfxmppEventHandler *h, gpointer source, gpointer event, gpointer data)
+{
+	return FALSE;
+}
+
+
+static void handler_notify (gpointer data)
+{
+	g_atomic_int_inc (&handler_freed);
+}
+
+
+static gpointer worker (gpointer data)
+{
+	SharedObjects *obj = data;
+	gint i;
+
+	for (i = 0; i < ITERATIONS; i++) {
+		kfxmpp_session_ref (obj->session);
+		kfxmpp_event_ref (obj->event);
+		kfxmpp_event_handler_ref (obj->handler);
+		kfxmpp_message_ref (obj->message);
+		kfxmpp_stream_parser_ref (obj->parser);
+
+		kfxmpp_stream_parser_unref (obj->parser);
+		kfxmpp_message_unref (obj->message);
+		kfxmpp_event_handler_unref (obj->handler);
+		kfxmpp_event_unref (obj->event);
+		kfxmpp_session_unref (obj->session);
+	}
+	return NULL;
+}
+
+
+static void benchmark (void)
+{
+	KfxmppMessage *msg;
+	volatile gint plain = 1;
+	GTimer *timer;
+	gdouble atomic_time, plain_time;
+	gint i;
+
+	msg = kfxmpp_message_new (NULL);
+	timer = g_timer_new ();
+
+	g_timer_start (timer);
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		kfxmpp_message_ref (msg);
+		kfxmpp_message_unref (msg);
+	}
+	atomic_time = g_timer_elapsed (timer, NULL);
+
+	g_timer_start (timer);
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		plain++;
+		plain--;
+	}
+	plain_time = g_timer_elapsed (timer, NULL);
+
+	g_print ("Benchmark: %.2f ns per ref/unref pair (plain: %.2f ns)\n",
+			atomic_time * 1e9 / BENCH_ITERATIONS,
+			plain_time * 1e9 / BENCH_ITERATIONS);
+
+	g_timer_destroy (timer);
+	kfxmpp_message_unref (msg);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	SharedObjects obj;
+	GThread *threads[N_THREADS];
+	gint i;
+
+	g_thread_init (NULL);
+
+	obj.session = kfxmpp_session_new ("example.com");
+	obj.event = kfxmpp_event_new (NULL);
+	obj.handler = kfxmpp_event_handler_new (handler, NULL, handler_notify);
+	obj.message = kfxmpp_message_new ("someone@example.com");
+	obj.parser = kfxmpp_stream_parser_new (NULL, NULL);
+
+	/* Event holds its own reference to handler */
+	kfxmpp_event_add_handler (obj.event, obj.handler, 10);
+
+	g_print ("Stress: %d threads x %d ref/unref pairs\n", N_THREADS, ITERATIONS);
+	for (i = 0; i < N_THREADS; i++)
+		threads[i] = g_thread_create (worker, &obj, TRUE, NULL);
+	for (i = 0; i < N_THREADS; i++)
+		g_thread_join (threads[i]);
+
+	/* Drop initial references, handler should go away with event */
+	kfxmpp_event_handler_unref (obj.handler);
+	kfxmpp_event_unref (obj.event);
+	kfxmpp_message_unref (obj.message);
+	kfxmpp_stream_parser_unref (obj.parser);
+	kfxmpp_session_unref (obj.session);
+
+	g_print ("Handler freed %d time(s)\n", handler_freed);
+	if (handler_freed != 1) {
+		g_print ("Stress: FAILED\n");
+		return 1;
+	}
+	g_print ("Stress: OK\n");
+
+	benchmark ();
+
+	return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * kfxmpp TLS pending records test
+ * -------------------------------
+ *
+ * Connects a session through STARTTLS to a stand-in server, with an
+ * external backend so that the test decides which readiness events
+ * session sees. Server then sends one message in a single record, larger
+ * than session's receive buffer. With a read budget of a single byte,
+ * first read takes part of the record and leaves the rest decrypted
+ * inside gnutls, where no socket readiness event announces it. Session
+ * must still hand the whole message to the parser within the one event
+ * it was given.
+ *
+ * output:
+Connect: OK
+One readiness event: 1 message(s), socket readable afterwards: no
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <poll.h>
+
+#include "stand-in-server.h"
+
+#define BODY_SIZE	4000
+
+static gint received = 0;
+
+
+static gboolean got_message (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	received++;
+	return FALSE;
+}
+
+
+static void update (KfxmppIoBackend *backend, gpointer data)
+{
+}
+
+
+/* Poll session's socket for what it asks, the way application's own loop would */
+static void host_iterate (KfxmppSession *session, gint timeout)
+{
+	GIOCondition interest = kfxmpp_session_get_interest (session);
+	GIOCondition revents = 0;
+	struct pollfd pfd;
+	gint64 deadline;
+
+	pfd.fd = kfxmpp_session_get_fd (session);
+	pfd.events = (interest & G_IO_IN ? POLLIN : 0) | (interest & G_IO_OUT ? POLLOUT : 0);
+	pfd.revents = 0;
+	if (poll (&pfd, 1, timeout) > 0) {
+		if (pfd.revents & POLLIN)
+			revents |= G_IO_IN;
+		if (pfd.revents & POLLOUT)
+			revents |= G_IO_OUT;
+		if (pfd.revents & POLLHUP)
+			revents |= G_IO_HUP;
+		if (pfd.revents & POLLERR)
+			revents |= G_IO_ERR;
+	}
+
+	deadline = kfxmpp_session_get_deadline (session);
+	if (revents || (deadline >= 0 && deadline <= kfxmpp_io_get_time ()))
+		kfxmpp_session_process (session, revents, kfxmpp_io_get_time ());
+}
+
+
+static gboolean socket_readable (KfxmppSession *session, gint timeout)
+{
+	struct pollfd pfd;
+
+	pfd.fd = kfxmpp_session_get_fd (session);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll (&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	StandInServer *server;
+	KfxmppSession *session;
+	KfxmppIoBackend *backend;
+	KfxmppEventHandler *handler;
+	gchar *body, *message;
+	gint connected = 0;
+
+	kfxmpp_init ();
+	server = stand_in_server_new (NULL, STAND_IN_STARTTLS);
+
+	session = stand_in_session_new (server);
+	backend = kfxmpp_io_backend_new_external (update, NULL);
+	kfxmpp_session_set_io_backend (session, backend);
+	handler = kfxmpp_event_handler_new (got_message, NULL, NULL);
+	kfxmpp_session_add_handler (session, KFXMPP_EVENT_TYPE_MESSAGE, handler,
+			KFXMPP_EVENT_HANDLER_PRIORITY_NORMAL);
+	kfxmpp_event_handler_unref (handler);
+
+	/* Connecting goes through main context, socket through host */
+	kfxmpp_session_connect (session, stand_in_connected, &connected, NULL);
+	while (connected == 0) {
+		g_main_context_iteration (NULL, FALSE);
+		host_iterate (session, 1);
+	}
+	if (connected < 0) {
+		g_print ("Connect: FAILED\n");
+		return 1;
+	}
+	g_print ("Connect: OK\n");
+
+	/* A single byte per wakeup, a record is read once at most */
+	kfxmpp_session_set_read_budget (session, 1, 1000);
+
+	body = g_strnfill (BODY_SIZE, 'x');
+	message = g_strdup_printf ("<message from='bot@localhost' to='user@localhost'><body>%s</body></message>", body);
+	stand_in_server_push (server, message, 1);
+	g_free (message);
+	g_free (body);
+
+	/* Let the whole record arrive, then report it once */
+	socket_readable (session, 1000);
+	g_usleep (20000);
+	kfxmpp_session_process (session, G_IO_IN, kfxmpp_io_get_time ());
+
+	g_print ("One readiness event: %d message(s), socket readable afterwards: %s\n",
+			received, socket_readable (session, 0) ? "yes" : "no");
+
+	kfxmpp_session_disconnect (session, NULL);
+	kfxmpp_session_unref (session);
+	kfxmpp_io_backend_unref (backend);
+	stand_in_server_free (server);
+	kfxmpp_deinit ();
+
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * kfxmpp TLS resumption cache test
+ * --------------------------------
+ *
+ * Connects two gnutls sessions over a local socket pair twice, the way
+ * sessions do: offering what TLS cache holds for the server before
+ * handshake, and storing it after. Server sends a record after handshake,
+ * which carries TLS 1.3 ticket along. Second handshake resumes the first
+ * session, so server does not send its certificate again.
+ *
+ * output:
+Handshake 1: resumed no
+Handshake 2: resumed yes
+Cache: 1 entries, 1 hits, 1 misses
+ */
+
+#include <glib.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define SERVER_NAME	"localhost"
+
+static gnutls_certificate_credentials_t server_cred;
+static gnutls_datum_t ticket_key;
+static gint sockets[2];
+
+
+static void make_credentials (void)
+{
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	guchar serial = 1;
+	time_t now = time (NULL);
+
+	gnutls_x509_privkey_init (&key);
+	gnutls_x509_privkey_generate (key, GNUTLS_PK_ECDSA,
+			GNUTLS_CURVE_TO_BITS (GNUTLS_ECC_CURVE_SECP256R1), 0);
+
+	gnutls_x509_crt_init (&crt);
+	gnutls_x509_crt_set_version (crt, 3);
+	gnutls_x509_crt_set_serial (crt, &serial, 1);
+	gnutls_x509_crt_set_activation_time (crt, now - 3600);
+	gnutls_x509_crt_set_expiration_time (crt, now + 3600);
+	gnutls_x509_crt_set_dn_by_oid (crt, GNUTLS_OID_X520_COMMON_NAME, 0, SERVER_NAME, strlen (SERVER_NAME));
+	gnutls_x509_crt_set_key (crt, key);
+	gnutls_x509_crt_sign2 (crt, crt, key, GNUTLS_DIG_SHA256, 0);
+
+	gnutls_certificate_allocate_credentials (&server_cred);
+	gnutls_certificate_set_x509_key (server_cred, &crt, 1, key);
+
+	gnutls_x509_crt_deinit (crt);
+	gnutls_x509_privkey_deinit (key);
+
+	gnutls_session_ticket_key_generate (&ticket_key);
+}
+
+
+static gpointer server (gpointer data)
+{
+	gnutls_session_t session;
+	gchar ack;
+
+	gnutls_init (&session, GNUTLS_SERVER);
+	gnutls_set_default_priority (session);
+	gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, server_cred);
+	gnutls_session_ticket_enable_server (session, &ticket_key);
+	gnutls_transport_set_int (session, sockets[1]);
+
+	if (gnutls_handshake (session) < 0)
+		return NULL;
+	gnutls_record_send (session, "!", 1);
+
+	/* Stay until client is done */
+	gnutls_record_recv (session, &ack, 1);
+	gnutls_bye (session, GNUTLS_SHUT_WR);
+	gnutls_deinit (session);
+
+	return NULL;
+}
+
+
+static gboolean connect_once (gint n)
+{
+	gnutls_session_t session;
+	gnutls_certificate_credentials_t cred;
+	GThread *thread;
+	gchar byte;
+	gboolean resumed;
+
+	socketpair (AF_UNIX, SOCK_STREAM, 0, sockets);
+	thread = g_thread_create (server, NULL, TRUE, NULL);
+
+	gnutls_certificate_allocate_credentials (&cred);
+	gnutls_init (&session, GNUTLS_CLIENT);
+	gnutls_set_default_priority (session);
+	gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, cred);
+	gnutls_transport_set_int (session, sockets[0]);
+	kfxmpp_tls_cache_offer (session, SERVER_NAME);
+
+	if (gnutls_handshake (session) < 0) {
+		g_print ("Handshake %d: FAILED\n", n);
+		return FALSE;
+	}
+	kfxmpp_tls_cache_handshake_done (session, SERVER_NAME);
+
+	resumed = gnutls_session_is_resumed (session);
+	g_print ("Handshake %d: resumed %s\n", n, resumed ? "yes" : "no");
+
+	/* What session does when it closes */
+	gnutls_record_recv (session, &byte, 1);
+	kfxmpp_tls_cache_store (session, SERVER_NAME);
+
+	gnutls_record_send (session, "!", 1);
+	g_thread_join (thread);
+	gnutls_deinit (session);
+	gnutls_certificate_free_credentials (cred);
+	close (sockets[0]);
+	close (sockets[1]);
+
+	return resumed == (n > 1);
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	gboolean ok;
+
+	kfxmpp_init ();
+	make_credentials ();
+
+	ok = connect_once (1);
+	ok = connect_once (2) && ok;
+	g_print ("Cache: %u entries, %u hits, %u misses\n", kfxmpp_tls_cache_get_size (),
+			kfxmpp_tls_cache_get_hits (), kfxmpp_tls_cache_get_misses ());
+
+	gnutls_certificate_free_credentials (server_cred);
+	gnutls_free (ticket_key.data);
+	kfxmpp_deinit ();
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+/*
+ * kfxmpp certificate verification cache test
+ * ------------------------------------------
+ *
+ * Connects gnutls sessions using credentials shared by kfxmpp sessions
+ * over a local socket pair, and verifies server's chain the way sessions
+ * do. Server certificate is self-signed, and added to shared trust store
+ * for the test. Second connection to the same server finds its chain
+ * verified already. Third one expects another server name, which has
+ * to be verified and fails.
+ *
+ * output:
+Handshake 1 (localhost): verified yes
+Handshake 2 (localhost): verified yes
+Handshake 3 (otherhost): verified no
+Verify: 1 hits, 2 misses
+ */
+
+#include <glib.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include <kfxmpp/kfxmpp.h>
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+static gnutls_certificate_credentials_t server_cred;
+static gint sockets[2];
+
+
+static void make_credentials (void)
+{
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	guchar serial = 1;
+	time_t now = time (NULL);
+
+	gnutls_x509_privkey_init (&key);
+	gnutls_x509_privkey_generate (key, GNUTLS_PK_ECDSA,
+			GNUTLS_CURVE_TO_BITS (GNUTLS_ECC_CURVE_SECP256R1), 0);
+
+	gnutls_x509_crt_init (&crt);
+	gnutls_x509_crt_set_version (crt, 3);
+	gnutls_x509_crt_set_serial (crt, &serial, 1);
+	gnutls_x509_crt_set_activation_time (crt, now - 3600);
+	gnutls_x509_crt_set_expiration_time (crt, now + 3600);
+	gnutls_x509_crt_set_dn_by_oid (crt, GNUTLS_OID_X520_COMMON_NAME, 0, "localhost", 9);
+	gnutls_x509_crt_set_subject_alt_name (crt, GNUTLS_SAN_DNSNAME, "localhost", 9, GNUTLS_FSAN_SET);
+	gnutls_x509_crt_set_basic_constraints (crt, 1, -1);
+	gnutls_x509_crt_set_key_usage (crt, GNUTLS_KEY_DIGITAL_SIGNATURE | GNUTLS_KEY_KEY_CERT_SIGN);
+	gnutls_x509_crt_set_key (crt, key);
+	gnutls_x509_crt_sign2 (crt, crt, key, GNUTLS_DIG_SHA256, 0);
+
+	gnutls_certificate_allocate_credentials (&server_cred);
+	gnutls_certificate_set_x509_key (server_cred, &crt, 1, key);
+
+	/* Trust server the way system trust store would */
+	gnutls_certificate_set_x509_trust (kfxmpp_tls_cache_get_credentials (), &crt, 1);
+
+	gnutls_x509_crt_deinit (crt);
+	gnutls_x509_privkey_deinit (key);
+}
+
+
+static gpointer server (gpointer data)
+{
+	gnutls_session_t session;
+	gchar ack;
+
+	gnutls_init (&session, GNUTLS_SERVER);
+	gnutls_set_default_priority (session);
+	gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, server_cred);
+	gnutls_transport_set_int (session, sockets[1]);
+
+	if (gnutls_handshake (session) == 0)
+		gnutls_record_recv (session, &ack, 1);
+	gnutls_deinit (session);
+
+	return NULL;
+}
+
+
+static gboolean connect_once (gint n, const gchar *name)
+{
+	gnutls_session_t session;
+	GThread *thread;
+	gboolean ok;
+
+	socketpair (AF_UNIX, SOCK_STREAM, 0, sockets);
+	thread = g_thread_create (server, NULL, TRUE, NULL);
+
+	gnutls_init (&session, GNUTLS_CLIENT);
+	gnutls_set_default_priority (session);
+	gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, kfxmpp_tls_cache_get_credentials ());
+	gnutls_transport_set_int (session, sockets[0]);
+
+	if (gnutls_handshake (session) < 0) {
+		g_print ("Handshake %d: FAILED\n", n);
+		return FALSE;
+	}
+	ok = kfxmpp_tls_cache_verify (session, name);
+	g_print ("Handshake %d (%s): verified %s\n", n, name, ok ? "yes" : "no");
+
+	gnutls_record_send (session, "!", 1);
+	g_thread_join (thread);
+	gnutls_deinit (session);
+	close (sockets[0]);
+	close (sockets[1]);
+
+	return ok;
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	gboolean ok;
+
+	kfxmpp_init ();
+	make_credentials ();
+
+	ok = connect_once (1, "localhost");
+	ok = connect_once (2, "localhost") && ok;
+	ok = ! connect_once (3, "otherhost") && ok;
+	g_print ("Verify: %u hits, %u misses\n", kfxmpp_tls_cache_get_verify_hits (),
+			kfxmpp_tls_cache_get_verify_misses ());
+	ok = kfxmpp_tls_cache_get_verify_hits () == 1 && ok;
+
+	gnutls_certificate_free_credentials (server_cred);
+	kfxmpp_deinit ();
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+/*
+ * kfxmpp send watermarks test
+ * ---------------------------
+ *
+ * Connects a session to a stand-in server and sends messages without
+ * letting main loop run, until send queue goes past its high watermark
+ * and sends are refused. A request refused this way must not leave its
+ * response handler behind. Once main loop drains the queue below low
+ * watermark, writable callback fires and requests go through again.
+ *
+ * output:
+Connect: OK
+Filled: WOULD_BLOCK with <n> messages sent, pending above high watermark: yes
+Request while full: -1, WOULD_BLOCK, handler released: yes
+Drained: writable callback called 1 time(s), pending below low watermark: yes
+Request after drain: answered
+ */
+
+#include <glib.h>
+#include <kfxmpp/kfxmpp.h>
+#include <kfxmpp/message.h>
+
+#include "stand-in-server.h"
+
+#define LOW_WATERMARK	(4 * 1024)
+#define HIGH_WATERMARK	(16 * 1024)
+#define MAX_MESSAGES	100000
+
+#define BODY "Watermarks keep a slow peer from growing send queue without bound"
+
+static gint writable = 0;
+static gboolean released = FALSE;
+static gboolean answered = FALSE;
+
+
+static void got_writable (KfxmppSession *session, gpointer data)
+{
+	writable++;
+}
+
+
+static gboolean got_result (KfxmppEventHandler *handler, gpointer source, gpointer event, gpointer data)
+{
+	answered = TRUE;
+	return TRUE;
+}
+
+
+static void handler_released (gpointer data)
+{
+	released = TRUE;
+}
+
+
+static gint request (KfxmppSession *session, GError **error)
+{
+	KfxmppEventHandler *handler;
+	KfxmppStanza *iq;
+	gint id;
+
+	iq = kfxmpp_stanza_new (NULL, KFXMPP_STANZA_KLASS_IQ);
+	handler = kfxmpp_event_handler_new (got_result, NULL, handler_released);
+	id = kfxmpp_session_send_await_response (session, iq, handler, error);
+	kfxmpp_event_handler_unref (handler);
+	kfxmpp_stanza_free (iq);
+
+	return id;
+}
+
+
+gint main (gint argc, gchar *argv[])
+{
+	StandInServer *server;
+	KfxmppSession *session;
+	GError *error = NULL;
+	gint sent = 0;
+	gint id;
+
+	kfxmpp_init ();
+	server = stand_in_server_new (NULL, STAND_IN_LEGACY);
+	session = stand_in_session_new (server);
+
+	if (! stand_in_session_connect (session)) {
+		g_print ("Connect: FAILED\n");
+		return 1;
+	}
+	g_print ("Connect: OK\n");
+
+	kfxmpp_session_set_send_watermarks (session, LOW_WATERMARK, HIGH_WATERMARK);
+	kfxmpp_session_set_writable_callback (session, got_writable, NULL);
+
+	/* Nothing is written while main loop does not run */
+	while (sent < MAX_MESSAGES &&
+			kfxmpp_message_send_simple (session, "sink@localhost", BODY, &error) >= 0)
+		sent++;
+	g_print ("Filled: %s with %d messages sent, pending above high watermark: %s\n",
+			error && error->code == KFXMPP_ERROR_WOULD_BLOCK ? "WOULD_BLOCK" : "no error", sent,
+			kfxmpp_session_get_pending_bytes (session) >= HIGH_WATERMARK ? "yes" : "no");
+	g_clear_error (&error);
+
+	id = request (session, &error);
+	g_print ("Request while full: %d, %s, handler released: %s\n", id,
+			error && error->code == KFXMPP_ERROR_WOULD_BLOCK ? "WOULD_BLOCK" : "no error",
+			released ? "yes" : "no");
+	g_clear_error (&error);
+
+	while (writable == 0)
+		g_main_context_iteration (NULL, TRUE);
+	g_print ("Drained: writable callback called %d time(s), pending below low watermark: %s\n",
+			writable, kfxmpp_session_get_pending_bytes (session) <= LOW_WATERMARK ? "yes" : "no");
+
+	if (request (session, NULL) < 0) {
+		g_print ("Request after drain: refused\n");
+	} else {
+		while (! answered)
+			g_main_context_iteration (NULL, TRUE);
+		g_print ("Request after drain: answered\n");
+	}
+
+	kfxmpp_session_disconnect (session, NULL);
+	kfxmpp_session_unref (session);
+	stand_in_server_free (server);
+	kfxmpp_deinit ();
+
+	return 0;
+}
@@ -172,7 +172,10 @@ void connected (KfxmppSession *session, KfxmppError error, gpointer data)
 		if (config->chat)
 			kfxmpp_message_set_type (msg, KFXMPP_MESSAGE_TYPE_CHAT);
 
-		kfxmpp_message_send (msg, session);
+		if (kfxmpp_message_send (msg, session, NULL) < 0) {
+			g_print ("kfxmpp-send: Cannot send message\n");
+			config->errorcode = EXIT_FAILURE;
+		}
 		kfxmpp_message_unref (msg);
 		
 		kfxmpp_session_disconnect (session, NULL);		